@@ -0,0 +1,142 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "allocator.h"
+
+#include "frame_cache.h"
+#include "macros.h"
+#include "module.h"
+#include "netpbm_allocator.h"
+#include "object_pool.h"
+#include "scratch_buffer.h"
+
+
+static void *STDMETHODCALLTYPE CrtAllocateMemory([[maybe_unused]] void *context, const size_t size)
+{
+    return malloc(size);
+}
+
+static void STDMETHODCALLTYPE CrtFreeMemory([[maybe_unused]] void *context, void *memory)
+{
+    free(memory);
+}
+
+static void *STDMETHODCALLTYPE CrtAllocateAlignedMemory([[maybe_unused]] void *context, const size_t size,
+                                                        const size_t alignment)
+{
+    return _aligned_malloc(size, alignment);
+}
+
+static void STDMETHODCALLTYPE CrtFreeAlignedMemory([[maybe_unused]] void *context, void *memory)
+{
+    _aligned_free(memory);
+}
+
+static void STDMETHODCALLTYPE LeakMemory([[maybe_unused]] void *context, [[maybe_unused]] void *memory)
+{
+}
+
+static const NetpbmAllocator g_crtAllocator = {NULL, CrtAllocateMemory, CrtFreeMemory, CrtAllocateAlignedMemory,
+                                               CrtFreeAlignedMemory};
+static NetpbmAllocator g_allocator = {NULL, CrtAllocateMemory, CrtFreeMemory, CrtAllocateAlignedMemory,
+                                      CrtFreeAlignedMemory};
+
+// Number of allocations of the current allocator that have not been freed.
+static volatile LONG64 g_allocationCount;
+
+
+void *AllocateMemory(const size_t size)
+{
+    void *memory = g_allocator.allocateMemory(g_allocator.context, size);
+    if (memory)
+    {
+        InterlockedIncrement64(&g_allocationCount);
+    }
+
+    return memory;
+}
+
+void *AllocateZeroedMemory(const size_t count, const size_t size)
+{
+    if (size != 0 && count > SIZE_MAX / size)
+        return NULL;
+
+    void *memory = AllocateMemory(count * size);
+    if (memory)
+    {
+        memset(memory, 0, count * size);
+    }
+
+    return memory;
+}
+
+_Use_decl_annotations_ void FreeMemory(void *memory)
+{
+    if (!memory)
+        return;
+
+    InterlockedDecrement64(&g_allocationCount);
+    g_allocator.freeMemory(g_allocator.context, memory);
+}
+
+void *AllocateAlignedMemory(const size_t size, const size_t alignment)
+{
+    void *memory = g_allocator.allocateAlignedMemory(g_allocator.context, size, alignment);
+    if (memory)
+    {
+        InterlockedIncrement64(&g_allocationCount);
+    }
+
+    return memory;
+}
+
+_Use_decl_annotations_ void FreeAlignedMemory(void *memory)
+{
+    if (!memory)
+        return;
+
+    InterlockedDecrement64(&g_allocationCount);
+    g_allocator.freeAlignedMemory(g_allocator.context, memory);
+}
+
+void *AllocatePixelBuffer(const size_t size)
+{
+    return AllocateAlignedMemory(size, PixelBufferAlignment);
+}
+
+_Use_decl_annotations_ void FreePixelBuffer(void *buffer)
+{
+    FreeAlignedMemory(buffer);
+}
+
+void PrepareAllocatorForUnload(void)
+{
+    if (g_allocator.allocateMemory == CrtAllocateMemory)
+        return;
+
+    g_allocator.freeMemory = LeakMemory;
+    g_allocator.freeAlignedMemory = LeakMemory;
+}
+
+HRESULT STDMETHODCALLTYPE NetpbmSetAllocator(const NetpbmAllocator *allocator)
+{
+    TRACE("netpbm-wic-codec-c::NetpbmSetAllocator\n");
+
+    if (allocator && (!allocator->allocateMemory || !allocator->freeMemory || !allocator->allocateAlignedMemory ||
+                      !allocator->freeAlignedMemory))
+        return E_INVALIDARG;
+
+    if (ModuleIsLocked())
+        return WINCODEC_ERR_WRONGSTATE;
+
+    EmptyObjectPools();
+    EmptyScratchBuffers();
+    RemoveAllCachedPixels();
+    if (g_allocationCount != 0)
+        return WINCODEC_ERR_WRONGSTATE;
+
+    g_allocator = allocator ? *allocator : g_crtAllocator;
+    return S_OK;
+}
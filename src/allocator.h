@@ -0,0 +1,26 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+// Alignment of the large pixel buffers: every buffer starts at a cache line.
+enum
+{
+    PixelBufferAlignment = 64
+};
+
+// Allocate with the allocator set by NetpbmSetAllocator, return NULL when out of memory.
+void *AllocateMemory(size_t size);
+void *AllocateZeroedMemory(size_t count, size_t size);
+void FreeMemory(_In_opt_ void *memory);
+
+// The alignment is a power of 2.
+void *AllocateAlignedMemory(size_t size, size_t alignment);
+void FreeAlignedMemory(_In_opt_ void *memory);
+
+void *AllocatePixelBuffer(size_t size);
+void FreePixelBuffer(_In_opt_ void *buffer);
+
+// Called when the DLL is unloaded, before the kept memory is freed under the loader lock: the free functions of an
+// allocator of the host may take locks or may already be unloaded, the memory of such an allocator is leaked instead.
+void PrepareAllocatorForUnload(void);
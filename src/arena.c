@@ -0,0 +1,69 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "arena.h"
+
+#include "allocator.h"
+
+
+typedef struct ArenaChunk
+{
+    ArenaChunk *next;
+} ArenaChunk;
+
+// The allocations of a chunk start after its header.
+static const size_t ChunkHeaderSize = (sizeof(ArenaChunk) + ArenaAlignment - 1) & ~(size_t)(ArenaAlignment - 1);
+
+
+_Use_decl_annotations_ void InitializeArena(Arena *arena, void *firstChunk, const size_t size,
+                                            const ReleaseArenaOwner releaseOwner)
+{
+    arena->refCount = 1;
+    arena->releaseOwner = releaseOwner;
+    arena->position = firstChunk;
+    arena->end = (BYTE *)firstChunk + size;
+    arena->chunks = NULL;
+}
+
+_Use_decl_annotations_ void *ArenaAllocate(Arena *arena, size_t size)
+{
+    size = (size + ArenaAlignment - 1) & ~(size_t)(ArenaAlignment - 1);
+    if ((size_t)(arena->end - arena->position) < size)
+    {
+        const size_t chunkSize = size > ArenaChunkSize - ChunkHeaderSize ? ChunkHeaderSize + size : ArenaChunkSize;
+        ArenaChunk *chunk = AllocateMemory(chunkSize);
+        if (!chunk)
+            return NULL;
+
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->position = (BYTE *)chunk + ChunkHeaderSize;
+        arena->end = (BYTE *)chunk + chunkSize;
+    }
+
+    void *memory = arena->position;
+    arena->position += size;
+    return memory;
+}
+
+_Use_decl_annotations_ void AddRefArena(Arena *arena)
+{
+    InterlockedIncrement(&arena->refCount);
+}
+
+_Use_decl_annotations_ void ReleaseArena(Arena *arena)
+{
+    if (InterlockedDecrement(&arena->refCount) != 0)
+        return;
+
+    while (arena->chunks)
+    {
+        ArenaChunk *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        FreeMemory(chunk);
+    }
+
+    arena->releaseOwner(arena);
+}
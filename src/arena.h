@@ -0,0 +1,38 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+enum
+{
+    ArenaAlignment = 16,       // Of every allocation, MEMORY_ALLOCATION_ALIGNMENT of x64.
+    ArenaChunkSize = 16 * 1024 // Minimum size of the chunks that are allocated when the arena grows.
+};
+
+typedef struct ArenaChunk ArenaChunk;
+typedef struct Arena Arena;
+
+// Called by the last ReleaseArena, after the chunks have been freed: frees the object that embeds the arena.
+typedef void (*ReleaseArenaOwner)(_In_ Arena *arena);
+
+// Bump allocator for the memory of a decoder session, which is released in one operation. The first chunk is
+// provided by the owner (embedded in its object), the arena grows with chunks that are allocated with AllocateMemory.
+// The arena is reference counted: objects that are allocated from it (the frame) keep it alive.
+typedef struct Arena
+{
+    volatile LONG refCount;
+    ReleaseArenaOwner releaseOwner;
+    BYTE *position;
+    BYTE *end;
+    ArenaChunk *chunks; // Allocated chunks, most recent first.
+} Arena;
+
+// The arena starts with a reference count of 1. The first chunk must be aligned to ArenaAlignment.
+void InitializeArena(_Out_ Arena *arena, _In_reads_bytes_(size) void *firstChunk, size_t size,
+                     _In_ ReleaseArenaOwner releaseOwner);
+
+// Returns NULL when out of memory. Allocations must be serialized by the owner.
+void *ArenaAllocate(_Inout_ Arena *arena, size_t size);
+
+void AddRefArena(_Inout_ Arena *arena);
+void ReleaseArena(_Inout_ Arena *arena);
@@ -0,0 +1,375 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "content_hash.h"
+
+#include "macros.h"
+#include "row_decoder.h"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define USE_SSE4_2
+#elif defined(_M_ARM64)
+#include <arm64intr.h>
+#define USE_ARM64_CRC32
+#endif
+
+
+enum
+{
+    Crc32cPolynomial = 0x82F63B78, // Reflected Castagnoli polynomial.
+    Crc32cLaneSize = 4096
+};
+
+static const ULONGLONG Prime64_1 = 0x9E3779B185EBCA87ULL;
+static const ULONGLONG Prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const ULONGLONG Prime64_3 = 0x165667B19E3779F9ULL;
+static const ULONGLONG Prime64_4 = 0x85EBCA77C2B2AE63ULL;
+static const ULONGLONG Prime64_5 = 0x27D4EB2F165667C5ULL;
+
+static ULONGLONG Read64(_In_reads_bytes_(8) const BYTE *data)
+{
+    ULONGLONG value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static UINT Read32(_In_reads_bytes_(4) const BYTE *data)
+{
+    UINT value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static ULONGLONG XxHashRound(ULONGLONG accumulator, const ULONGLONG input)
+{
+    accumulator += input * Prime64_2;
+    accumulator = _rotl64(accumulator, 31);
+    return accumulator * Prime64_1;
+}
+
+static ULONGLONG XxHashMergeRound(ULONGLONG accumulator, const ULONGLONG value)
+{
+    accumulator ^= XxHashRound(0, value);
+    return accumulator * Prime64_1 + Prime64_4;
+}
+
+// Consumes complete stripes of 32 bytes, returns the number of bytes consumed.
+static size_t XxHashStripes(_Inout_updates_(4) ULONGLONG *accumulators, _In_reads_bytes_(size) const BYTE *data,
+                            const size_t size)
+{
+    ULONGLONG v1 = accumulators[0];
+    ULONGLONG v2 = accumulators[1];
+    ULONGLONG v3 = accumulators[2];
+    ULONGLONG v4 = accumulators[3];
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        v1 = XxHashRound(v1, Read64(data + i));
+        v2 = XxHashRound(v2, Read64(data + i + 8));
+        v3 = XxHashRound(v3, Read64(data + i + 16));
+        v4 = XxHashRound(v4, Read64(data + i + 24));
+    }
+
+    accumulators[0] = v1;
+    accumulators[1] = v2;
+    accumulators[2] = v3;
+    accumulators[3] = v4;
+    return i;
+}
+
+#ifdef USE_SSE4_2
+// SSE4.2 is not part of the x64 baseline.
+static bool IsSse42Supported(void)
+{
+    static volatile LONG supported = -1;
+    if (supported < 0)
+    {
+        int info[4];
+        __cpuid(info, 1);
+        supported = (info[2] & (1 << 20)) != 0;
+    }
+
+    return supported != 0;
+}
+#endif
+
+// A CRC operator is a 32x32 GF(2) matrix (a column per bit) that appends a number of zero bits to a CRC register.
+static UINT ApplyCrc32cOperator(_In_reads_(32) const UINT *crcOperator, UINT crc)
+{
+    UINT result = 0;
+    for (UINT bit = 0; crc != 0; ++bit, crc >>= 1)
+    {
+        result ^= crcOperator[bit] & (0U - (crc & 1));
+    }
+
+    return result;
+}
+
+// Creates the operator for a lane of Crc32cLaneSize zero bytes by squaring the operator for a single zero bit.
+static void InitializeCrc32cLaneOperator(_Out_writes_(32) UINT *crcOperator)
+{
+    crcOperator[0] = Crc32cPolynomial;
+    for (UINT bit = 1; bit < 32; ++bit)
+    {
+        crcOperator[bit] = 1U << (bit - 1);
+    }
+
+    for (UINT bitCount = 1; bitCount < Crc32cLaneSize * 8; bitCount *= 2)
+    {
+        UINT square[32];
+        for (UINT bit = 0; bit < 32; ++bit)
+        {
+            square[bit] = ApplyCrc32cOperator(crcOperator, crcOperator[bit]);
+        }
+
+        memcpy(crcOperator, square, sizeof(square));
+    }
+}
+
+static UINT UpdateCrc32c(UINT crc, _In_reads_(32) const UINT *laneOperator, _In_reads_bytes_(size) const BYTE *data,
+                         const size_t size)
+{
+    size_t i = 0;
+
+#if defined(USE_SSE4_2) && defined(_M_X64)
+    if (IsSse42Supported())
+    {
+        // The crc32 instruction has a latency of 3 cycles and a throughput of 1: 3 lanes are computed in parallel
+        // and combined, crc(A + B) is crc(A) followed by the zero bytes of B, xor crc(B) from a zero register.
+        for (; size - i >= 3 * Crc32cLaneSize; i += 3 * Crc32cLaneSize)
+        {
+            ULONGLONG crc0 = crc;
+            ULONGLONG crc1 = 0;
+            ULONGLONG crc2 = 0;
+            const BYTE *lanes = data + i;
+            for (size_t j = 0; j < Crc32cLaneSize; j += 8)
+            {
+                crc0 = _mm_crc32_u64(crc0, Read64(lanes + j));
+                crc1 = _mm_crc32_u64(crc1, Read64(lanes + Crc32cLaneSize + j));
+                crc2 = _mm_crc32_u64(crc2, Read64(lanes + 2 * Crc32cLaneSize + j));
+            }
+
+            crc = ApplyCrc32cOperator(laneOperator, ApplyCrc32cOperator(laneOperator, (UINT)crc0) ^ (UINT)crc1) ^
+                  (UINT)crc2;
+        }
+
+        ULONGLONG crc64 = crc;
+        for (; i + 8 <= size; i += 8)
+        {
+            crc64 = _mm_crc32_u64(crc64, Read64(data + i));
+        }
+
+        crc = (UINT)crc64;
+        for (; i < size; ++i)
+        {
+            crc = _mm_crc32_u8(crc, data[i]);
+        }
+    }
+#elif defined(USE_SSE4_2)
+    if (IsSse42Supported())
+    {
+        for (; i + 4 <= size; i += 4)
+        {
+            crc = _mm_crc32_u32(crc, Read32(data + i));
+        }
+
+        for (; i < size; ++i)
+        {
+            crc = _mm_crc32_u8(crc, data[i]);
+        }
+    }
+#elif defined(USE_ARM64_CRC32)
+    for (; i + 8 <= size; i += 8)
+    {
+        crc = __crc32cd(crc, Read64(data + i));
+    }
+
+    for (; i < size; ++i)
+    {
+        crc = __crc32cb(crc, data[i]);
+    }
+#endif
+
+    for (; i < size; ++i)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; ++bit)
+        {
+            crc = crc >> 1 ^ (Crc32cPolynomial & (0U - (crc & 1)));
+        }
+    }
+
+    return crc;
+}
+
+_Use_decl_annotations_ void InitializeContentHasher(ContentHasher *hasher, const NetpbmHashAlgorithm algorithm)
+{
+    hasher->algorithm = algorithm;
+    hasher->totalSize = 0;
+    hasher->accumulators[0] = Prime64_1 + Prime64_2;
+    hasher->accumulators[1] = Prime64_2;
+    hasher->accumulators[2] = 0;
+    hasher->accumulators[3] = 0 - Prime64_1;
+    hasher->bufferSize = 0;
+    hasher->crc = UINT_MAX;
+    if (algorithm == NetpbmHashAlgorithmCrc32c)
+    {
+        InitializeCrc32cLaneOperator(hasher->crcLaneOperator);
+    }
+}
+
+_Use_decl_annotations_ void UpdateContentHash(ContentHasher *hasher, const void *data, size_t size)
+{
+    const BYTE *bytes = data;
+    hasher->totalSize += size;
+    if (hasher->algorithm == NetpbmHashAlgorithmCrc32c)
+    {
+        hasher->crc = UpdateCrc32c(hasher->crc, hasher->crcLaneOperator, bytes, size);
+        return;
+    }
+
+    if (hasher->bufferSize != 0)
+    {
+        const size_t copySize = size < sizeof(hasher->buffer) - hasher->bufferSize
+                                    ? size
+                                    : sizeof(hasher->buffer) - hasher->bufferSize;
+        memcpy(hasher->buffer + hasher->bufferSize, bytes, copySize);
+        hasher->bufferSize += (UINT)copySize;
+        bytes += copySize;
+        size -= copySize;
+        if (hasher->bufferSize < sizeof(hasher->buffer))
+            return;
+
+        XxHashStripes(hasher->accumulators, hasher->buffer, sizeof(hasher->buffer));
+        hasher->bufferSize = 0;
+    }
+
+    const size_t consumed = XxHashStripes(hasher->accumulators, bytes, size);
+    memcpy(hasher->buffer, bytes + consumed, size - consumed);
+    hasher->bufferSize = (UINT)(size - consumed);
+}
+
+_Use_decl_annotations_ ULONGLONG GetContentHash(const ContentHasher *hasher)
+{
+    if (hasher->algorithm == NetpbmHashAlgorithmCrc32c)
+        return ~hasher->crc;
+
+    const ULONGLONG *v = hasher->accumulators;
+    ULONGLONG hash;
+    if (hasher->totalSize >= 32)
+    {
+        hash = _rotl64(v[0], 1) + _rotl64(v[1], 7) + _rotl64(v[2], 12) + _rotl64(v[3], 18);
+        for (int i = 0; i < 4; ++i)
+        {
+            hash = XxHashMergeRound(hash, v[i]);
+        }
+    }
+    else
+    {
+        hash = Prime64_5;
+    }
+
+    hash += hasher->totalSize;
+
+    const BYTE *tail = hasher->buffer;
+    UINT remaining = hasher->bufferSize;
+    for (; remaining >= 8; tail += 8, remaining -= 8)
+    {
+        hash ^= XxHashRound(0, Read64(tail));
+        hash = _rotl64(hash, 27) * Prime64_1 + Prime64_4;
+    }
+
+    if (remaining >= 4)
+    {
+        hash ^= Read32(tail) * Prime64_1;
+        hash = _rotl64(hash, 23) * Prime64_2 + Prime64_3;
+        tail += 4;
+        remaining -= 4;
+    }
+
+    for (; remaining != 0; ++tail, --remaining)
+    {
+        hash ^= *tail * Prime64_5;
+        hash = _rotl64(hash, 11) * Prime64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= Prime64_2;
+    hash ^= hash >> 29;
+    hash *= Prime64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+
+typedef struct HashingSink
+{
+    ContentHasher hasher;
+    NetpbmRowSink sink;
+    void *context;
+    UINT nextRow;
+} HashingSink;
+
+// Hashes a band while it is still in the CPU cache, before it is passed to the sink of the caller.
+static HRESULT STDMETHODCALLTYPE HashRows(void *context, const NetpbmRows *rows)
+{
+    HashingSink *hashingSink = context;
+    if (rows->firstRow != hashingSink->nextRow)
+        return WINCODEC_ERR_UNSUPPORTEDOPERATION; // Bottom-up rows of a PFM file in a non-seekable stream.
+
+    ContentHasher *hasher = &hashingSink->hasher;
+    if (rows->firstRow == 0)
+    {
+        // Images with the same pixel bytes but another pixel format or size have a different hash.
+        const UINT size[] = {rows->width, rows->height};
+        UpdateContentHash(hasher, &rows->pixelFormat, sizeof(rows->pixelFormat));
+        UpdateContentHash(hasher, size, sizeof(size));
+    }
+
+    // The padding bits of 1 bit rows are not part of the image (binary files may have any value).
+    const UINT paddingBits = IsEqualGUID(&rows->pixelFormat, &GUID_WICPixelFormatBlackWhite) ? (8 - rows->width % 8) % 8
+                                                                                             : 0;
+    if (paddingBits == 0)
+    {
+        UpdateContentHash(hasher, rows->pixels, (size_t)rows->rowCount * rows->stride);
+    }
+    else
+    {
+        const BYTE mask = (BYTE)(0xFF << paddingBits);
+        for (UINT row = 0; row < rows->rowCount; ++row)
+        {
+            const BYTE *pixels = rows->pixels + (size_t)row * rows->stride;
+            const BYTE last = pixels[rows->stride - 1] & mask;
+            UpdateContentHash(hasher, pixels, rows->stride - 1);
+            UpdateContentHash(hasher, &last, 1);
+        }
+    }
+
+    hashingSink->nextRow += rows->rowCount;
+    return hashingSink->sink ? hashingSink->sink(hashingSink->context, rows) : S_OK;
+}
+
+_Use_decl_annotations_ HRESULT STDMETHODCALLTYPE NetpbmDecodeRowsWithHash(IStream *stream,
+                                                                          const WICPixelFormatGUID *pixelFormat,
+                                                                          const NetpbmHashAlgorithm algorithm,
+                                                                          const UINT bandHeight,
+                                                                          const NetpbmRowSink sink, void *context,
+                                                                          ULONGLONG *hash)
+{
+    TRACE("netpbm-wic-codec-c::NetpbmDecodeRowsWithHash\n");
+
+    if (!stream || !hash ||
+        (algorithm != NetpbmHashAlgorithmXxHash64 && algorithm != NetpbmHashAlgorithmCrc32c))
+        return E_INVALIDARG;
+
+    HashingSink hashingSink = {.sink = sink, .context = context, .nextRow = 0};
+    InitializeContentHasher(&hashingSink.hasher, algorithm);
+
+    const HRESULT result = DecodeStreamRows(stream, pixelFormat, 0, NULL, NULL, bandHeight, HashRows, &hashingSink);
+    *hash = SUCCEEDED(result) ? GetContentHash(&hashingSink.hasher) : 0;
+    return result;
+}
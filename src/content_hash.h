@@ -0,0 +1,22 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "netpbm_content_hash.h"
+
+// Streaming state of XXH64 or CRC-32C.
+typedef struct ContentHasher
+{
+    NetpbmHashAlgorithm algorithm;
+    ULONGLONG totalSize;
+    ULONGLONG accumulators[4]; // XXH64 lanes.
+    BYTE buffer[32];           // XXH64 input that doesn't fill a stripe yet.
+    UINT bufferSize;
+    UINT crc;
+    UINT crcLaneOperator[32];  // Appends a lane of zero bytes to a CRC, combines the interleaved CRC lanes.
+} ContentHasher;
+
+void InitializeContentHasher(_Out_ ContentHasher *hasher, NetpbmHashAlgorithm algorithm);
+void UpdateContentHash(_Inout_ ContentHasher *hasher, _In_reads_bytes_(size) const void *data, size_t size);
+ULONGLONG GetContentHash(_In_ const ContentHasher *hasher);
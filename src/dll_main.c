@@ -4,15 +4,17 @@
 #include "pch.h"
 
 #include "module.h"
+#include "allocator.h"
+#include "frame_cache.h"
 #include "macros.h"
 #include "guids.h"
 #include "property_store.h"
 #include "netpbm_bitmap_decoder.h"
+#include "object_pool.h"
+#include "scratch_buffer.h"
 
 BOOL __stdcall DllMain(const HMODULE module, const DWORD reasonForCall, const void *reserved)
 {
-    UNREFERENCED_PARAMETER(reserved);
-
     switch (reasonForCall)
     {
     case DLL_PROCESS_ATTACH:
@@ -26,6 +28,17 @@ BOOL __stdcall DllMain(const HMODULE module, const DWORD reasonForCall, const vo
 
     case DLL_PROCESS_DETACH:
         TRACE("netpbm-wic-codec::DllMain DLL_PROCESS_DETACH \n");
+
+        // The kept memory is only freed when the DLL is unloaded by FreeLibrary, not when the process terminates.
+        // Freeing the fiber local storage indexes is required: their callbacks would otherwise run at the next thread
+        // exit after the code of the DLL is unmapped.
+        if (!reserved)
+        {
+            PrepareAllocatorForUnload();
+            ReleaseObjectPools();
+            ReleaseScratchBuffers();
+            RemoveAllCachedPixels();
+        }
         break;
 
     default:
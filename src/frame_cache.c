@@ -0,0 +1,245 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "frame_cache.h"
+
+#include "allocator.h"
+#include "macros.h"
+#include "netpbm_frame_cache.h"
+
+
+// The entries are spread over shards by the hash of their key: lookups of different files take different locks, and
+// they only take the lock of their shard shared. The entries are only added and removed while g_updateLock is held,
+// which lets the eviction scan all shards without their locks.
+// A lookup only writes the cache line of its shard: the clock of the uses and the counters are kept per shard. The
+// clocks of different shards are made comparable by g_additionClock, which is only advanced when an entry is added:
+// the least recently used entry is the one with the oldest addition clock and, in the same shard, the oldest use.
+enum
+{
+    ShardCount = 16,
+    EntriesPerShard = 8
+};
+
+typedef struct CacheEntry
+{
+    FrameCacheKey key;
+    SharedPixels *pixels;
+    volatile LONG64 lastAddition; // Value of g_additionClock at the last use of the entry.
+    volatile LONG64 lastUse;      // Value of the use clock of the shard at the last use of the entry.
+} CacheEntry;
+
+typedef struct CacheShard
+{
+    alignas(64) SRWLOCK lock; // Every shard in its own cache line.
+    UINT count;
+    volatile LONG64 useClock;
+    volatile LONG64 hits;
+    volatile LONG64 misses;
+    CacheEntry entries[EntriesPerShard];
+} CacheShard;
+
+static CacheShard g_shards[ShardCount];
+static SRWLOCK g_updateLock = SRWLOCK_INIT;
+static volatile LONG64 g_budget;
+static volatile LONG64 g_cachedSize;
+static volatile LONG64 g_additionClock;
+
+
+_Use_decl_annotations_ SharedPixels *CreateSharedPixels(const size_t size)
+{
+    SharedPixels *pixels = AllocatePixelBuffer(offsetof(SharedPixels, pixels) + size);
+    if (!pixels)
+        return NULL;
+
+    pixels->refCount = 1;
+    pixels->size = size;
+    return pixels;
+}
+
+_Use_decl_annotations_ void AddRefSharedPixels(SharedPixels *pixels)
+{
+    InterlockedIncrement(&pixels->refCount);
+}
+
+_Use_decl_annotations_ void ReleaseSharedPixels(SharedPixels *pixels)
+{
+    if (InterlockedDecrement(&pixels->refCount) == 0)
+    {
+        FreePixelBuffer(pixels);
+    }
+}
+
+ULONGLONG GetFrameCacheBudget(void)
+{
+    return (ULONGLONG)g_budget;
+}
+
+static bool IsEqualFrameCacheKey(_In_ const FrameCacheKey *a, _In_ const FrameCacheKey *b)
+{
+    return IsEqualGUID(&a->pixelFormat, &b->pixelFormat) && a->channelCount == b->channelCount &&
+           memcmp(a->channels, b->channels, a->channelCount * sizeof(UINT)) == 0 &&
+           IsEqualHeaderCacheKey(&a->file, &b->file);
+}
+
+// FNV-1a of the name, the size and the last byte of the pixel format (which distinguishes the WIC pixel formats).
+static CacheShard *GetShard(_In_ const FrameCacheKey *key)
+{
+    UINT hash = 2166136261U;
+    for (const WCHAR *character = key->file.name; *character; ++character)
+    {
+        hash = (hash ^ *character) * 16777619U;
+    }
+    hash = (hash ^ (UINT)key->file.size) * 16777619U;
+    hash = (hash ^ key->pixelFormat.Data4[7]) * 16777619U;
+    return &g_shards[hash % ShardCount];
+}
+
+_Use_decl_annotations_ SharedPixels *FindCachedPixels(const FrameCacheKey *key)
+{
+    CacheShard *shard = GetShard(key);
+    SharedPixels *pixels = NULL;
+    AcquireSRWLockShared(&shard->lock);
+    for (UINT i = 0; i < shard->count; ++i)
+    {
+        CacheEntry *entry = &shard->entries[i];
+        if (IsEqualFrameCacheKey(&entry->key, key))
+        {
+            pixels = entry->pixels;
+            AddRefSharedPixels(pixels);
+            InterlockedExchange64(&entry->lastAddition, g_additionClock);
+            InterlockedExchange64(&entry->lastUse, InterlockedIncrement64(&shard->useClock));
+            break;
+        }
+    }
+    ReleaseSRWLockShared(&shard->lock);
+
+    InterlockedIncrement64(pixels ? &shard->hits : &shard->misses);
+    return pixels;
+}
+
+// The use clocks of entries of different shards are not comparable, their order is arbitrary.
+static bool IsUsedBefore(_In_ const CacheEntry *a, _In_ const CacheEntry *b)
+{
+    return a->lastAddition != b->lastAddition ? a->lastAddition < b->lastAddition : a->lastUse < b->lastUse;
+}
+
+// Called while g_updateLock is held.
+static void RemoveEntry(_Inout_ CacheShard *shard, const UINT index)
+{
+    AcquireSRWLockExclusive(&shard->lock);
+    SharedPixels *pixels = shard->entries[index].pixels;
+    shard->entries[index] = shard->entries[--shard->count];
+    ReleaseSRWLockExclusive(&shard->lock);
+
+    InterlockedExchangeAdd64(&g_cachedSize, -(LONG64)pixels->size);
+    ReleaseSharedPixels(pixels); // The frames that use the pixels keep them alive.
+}
+
+// Called while g_updateLock is held.
+static void RemoveLeastRecentlyUsedEntries(const ULONGLONG maxSize)
+{
+    while ((ULONGLONG)g_cachedSize > maxSize)
+    {
+        CacheShard *oldestShard = NULL;
+        UINT oldestIndex = 0;
+        for (UINT i = 0; i < ShardCount; ++i)
+        {
+            for (UINT j = 0; j < g_shards[i].count; ++j)
+            {
+                if (!oldestShard || IsUsedBefore(&g_shards[i].entries[j], &oldestShard->entries[oldestIndex]))
+                {
+                    oldestShard = &g_shards[i];
+                    oldestIndex = j;
+                }
+            }
+        }
+
+        RemoveEntry(oldestShard, oldestIndex);
+    }
+}
+
+void RemoveAllCachedPixels(void)
+{
+    AcquireSRWLockExclusive(&g_updateLock);
+    for (UINT i = 0; i < ShardCount; ++i)
+    {
+        while (g_shards[i].count != 0)
+        {
+            RemoveEntry(&g_shards[i], g_shards[i].count - 1);
+        }
+    }
+    ReleaseSRWLockExclusive(&g_updateLock);
+}
+
+_Use_decl_annotations_ void AddCachedPixels(const FrameCacheKey *key, SharedPixels *pixels)
+{
+    AcquireSRWLockExclusive(&g_updateLock);
+    const ULONGLONG budget = (ULONGLONG)g_budget;
+    CacheShard *shard = GetShard(key);
+    bool present = false;
+    for (UINT i = 0; i < shard->count && !present; ++i)
+    {
+        present = IsEqualFrameCacheKey(&shard->entries[i].key, key); // Added by a concurrent miss.
+    }
+
+    if (!present && pixels->size <= budget)
+    {
+        RemoveLeastRecentlyUsedEntries(budget - pixels->size);
+        if (shard->count == EntriesPerShard)
+        {
+            UINT oldestIndex = 0;
+            for (UINT i = 1; i < shard->count; ++i)
+            {
+                if (IsUsedBefore(&shard->entries[i], &shard->entries[oldestIndex]))
+                {
+                    oldestIndex = i;
+                }
+            }
+            RemoveEntry(shard, oldestIndex);
+        }
+
+        AddRefSharedPixels(pixels);
+        AcquireSRWLockExclusive(&shard->lock);
+        CacheEntry *entry = &shard->entries[shard->count++];
+        entry->key = *key;
+        entry->pixels = pixels;
+        entry->lastAddition = InterlockedIncrement64(&g_additionClock);
+        entry->lastUse = InterlockedIncrement64(&shard->useClock);
+        ReleaseSRWLockExclusive(&shard->lock);
+        InterlockedExchangeAdd64(&g_cachedSize, (LONG64)pixels->size);
+    }
+
+    ReleaseSRWLockExclusive(&g_updateLock);
+}
+
+HRESULT STDMETHODCALLTYPE NetpbmSetFrameCacheBudget(const ULONGLONG byteBudget)
+{
+    TRACE("netpbm-wic-codec-c::NetpbmSetFrameCacheBudget\n");
+
+    if (byteBudget > LLONG_MAX)
+        return E_INVALIDARG;
+
+    AcquireSRWLockExclusive(&g_updateLock);
+    InterlockedExchange64(&g_budget, (LONG64)byteBudget);
+    RemoveLeastRecentlyUsedEntries(byteBudget);
+    ReleaseSRWLockExclusive(&g_updateLock);
+    return S_OK;
+}
+
+_Use_decl_annotations_ HRESULT STDMETHODCALLTYPE NetpbmGetFrameCacheCounters(ULONGLONG *hits, ULONGLONG *misses)
+{
+    if (!hits || !misses)
+        return E_INVALIDARG;
+
+    *hits = 0;
+    *misses = 0;
+    for (UINT i = 0; i < ShardCount; ++i)
+    {
+        *hits += (ULONGLONG)g_shards[i].hits;
+        *misses += (ULONGLONG)g_shards[i].misses;
+    }
+
+    return S_OK;
+}
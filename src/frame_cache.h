@@ -0,0 +1,45 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "allocator.h"
+#include "header_cache.h"
+
+#include <stdalign.h>
+
+// Identity of decoded pixels: the file and the transform of its samples to the pixels.
+typedef struct FrameCacheKey
+{
+    HeaderCacheKey file;
+    GUID pixelFormat;
+    UINT channelCount; // Number of selected channels, 0 when all channels are decoded.
+    UINT channels[3];
+} FrameCacheKey;
+
+// Immutable decoded pixels, shared by the cache and the frames that decode the same file. A pixel buffer that starts
+// with its reference count, the pixels start at the next alignment boundary.
+typedef struct SharedPixels
+{
+    volatile LONG refCount;
+    size_t size;
+    alignas(PixelBufferAlignment) BYTE pixels[];
+} SharedPixels;
+
+// Returns a buffer with a reference count of 1, or NULL when out of memory.
+SharedPixels *CreateSharedPixels(size_t size);
+void AddRefSharedPixels(_Inout_ SharedPixels *pixels);
+void ReleaseSharedPixels(_Inout_ SharedPixels *pixels);
+
+// Returns 0 when the cache is disabled.
+ULONGLONG GetFrameCacheBudget(void);
+
+// Returns a new reference to the cached pixels, or NULL when they are not in the cache.
+SharedPixels *FindCachedPixels(_In_ const FrameCacheKey *key);
+
+// Removes all pixels from the cache, the frames that use them keep them alive.
+void RemoveAllCachedPixels(void);
+
+// Adds a reference to the pixels to the cache, when they fit in the budget. The least recently used pixels are
+// removed to make room.
+void AddCachedPixels(_In_ const FrameCacheKey *key, _Inout_ SharedPixels *pixels);
@@ -4,6 +4,7 @@
 #pragma once
 
 #include <guiddef.h>
+#include <propkeydef.h>
 
 // {4CD8A8CD-C269-446B-A0B9-54179B293A1F}
 DEFINE_GUID(CLSID_WICBitmapDecoder, 0x4cd8a8cd, 0xc269, 0x446b, 0xa0, 0xb9, 0x54, 0x17, 0x9b, 0x29, 0x3a, 0x1f);
@@ -13,3 +14,20 @@ DEFINE_GUID(CLSID_PropertyStore, 0x6f2df117, 0xab14, 0x4728, 0x86, 0x1e, 0x80, 0
 
 // {70ab66f5-cd48-43a1-aa29-10131b7f4ff1}
 DEFINE_GUID(CLSID_ContainerFormatNetpbm, 0x70ab66f5, 0xcd48, 0x43a1, 0xaa, 0x29, 0x10, 0x13, 0x1b, 0x7f, 0x4f, 0xf1);
+
+// {0E4F3C2B-8A41-4E7D-9C1E-6B2D5A7F3E91}
+DEFINE_GUID(IID_INetpbmChannelSelection, 0x0e4f3c2b, 0x8a41, 0x4e7d, 0x9c, 0x1e, 0x6b, 0x2d, 0x5a, 0x7f, 0x3e, 0x91);
+
+// {5B8E2D71-3C6A-4F09-B7D4-1E9A6C2F8B30}
+DEFINE_GUID(IID_INetpbmPlanarOutput, 0x5b8e2d71, 0x3c6a, 0x4f09, 0xb7, 0xd4, 0x1e, 0x9a, 0x6c, 0x2f, 0x8b, 0x30);
+
+// {A3C71F52-6E0B-4D28-8F4A-2B95D1E7C064}
+DEFINE_GUID(IID_INetpbmValidation, 0xa3c71f52, 0x6e0b, 0x4d28, 0x8f, 0x4a, 0x2b, 0x95, 0xd1, 0xe7, 0xc0, 0x64);
+
+// {D64B1E93-2F07-4C85-A1E6-7C39B08F5D2A}
+DEFINE_GUID(IID_INetpbmStatistics, 0xd64b1e93, 0x2f07, 0x4c85, 0xa1, 0xe6, 0x7c, 0x39, 0xb0, 0x8f, 0x5d, 0x2a);
+
+// Netpbm specific properties of the property store: the magic number ("P1" to "P7", "Pf", "PF") and the maximum value.
+// {8B1F5E3A-4C27-4D9B-9E61-2A7C0D3F5B84}
+DEFINE_PROPERTYKEY(PKEY_Netpbm_Format, 0x8b1f5e3a, 0x4c27, 0x4d9b, 0x9e, 0x61, 0x2a, 0x7c, 0x0d, 0x3f, 0x5b, 0x84, 2);
+DEFINE_PROPERTYKEY(PKEY_Netpbm_MaxValue, 0x8b1f5e3a, 0x4c27, 0x4d9b, 0x9e, 0x61, 0x2a, 0x7c, 0x0d, 0x3f, 0x5b, 0x84, 3);
@@ -0,0 +1,130 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "header_cache.h"
+
+#include "netpbm_header_cache.h"
+
+
+// The entries are read without a lock: a reader copies an entry and then checks that its sequence number didn't
+// change. The sequence number is odd while the entry is written, the writers are serialized by a lock.
+typedef struct CacheEntry
+{
+    volatile LONG sequence;
+    volatile LONG64 lastUse; // Value of g_useClock at the last lookup that found the entry, 0 when the entry is empty.
+    HeaderCacheKey key;
+    PnmHeader header;
+    CommentRanges comments;
+} CacheEntry;
+
+static CacheEntry g_entries[NetpbmHeaderCacheCapacity];
+static SRWLOCK g_writeLock = SRWLOCK_INIT;
+static volatile LONG64 g_useClock;
+static volatile LONG64 g_hits;
+static volatile LONG64 g_misses;
+
+
+_Use_decl_annotations_ bool IsEqualHeaderCacheKey(const HeaderCacheKey *a, const HeaderCacheKey *b)
+{
+    return a->size == b->size && a->position == b->position &&
+           a->lastWriteTime.dwLowDateTime == b->lastWriteTime.dwLowDateTime &&
+           a->lastWriteTime.dwHighDateTime == b->lastWriteTime.dwHighDateTime &&
+           wcsncmp(a->name, b->name, MAX_PATH) == 0;
+}
+
+_Use_decl_annotations_ bool GetHeaderCacheKey(IStream *stream, const ULONGLONG position, HeaderCacheKey *key)
+{
+    STATSTG statstg;
+    if (FAILED(stream->lpVtbl->Stat(stream, &statstg, STATFLAG_DEFAULT)))
+        return false;
+
+    bool identified = false;
+    if (statstg.pwcsName)
+    {
+        const size_t length = wcslen(statstg.pwcsName);
+        if (length != 0 && length < MAX_PATH)
+        {
+            memcpy(key->name, statstg.pwcsName, (length + 1) * sizeof(WCHAR));
+            key->size = statstg.cbSize.QuadPart;
+            key->lastWriteTime = statstg.mtime;
+            key->position = position;
+            identified = true;
+        }
+
+        CoTaskMemFree(statstg.pwcsName);
+    }
+
+    return identified;
+}
+
+_Use_decl_annotations_ bool FindCachedHeader(const HeaderCacheKey *key, PnmHeader *header, CommentRanges *comments)
+{
+    for (size_t i = 0; i < ARRAYSIZE(g_entries); ++i)
+    {
+        CacheEntry *entry = &g_entries[i];
+        const LONG sequence = entry->sequence;
+        MemoryBarrier();
+        if (sequence & 1 || entry->lastUse == 0 || !IsEqualHeaderCacheKey(&entry->key, key))
+            continue;
+
+        *header = entry->header;
+        if (comments)
+        {
+            *comments = entry->comments;
+        }
+
+        MemoryBarrier();
+        if (entry->sequence != sequence)
+            continue; // Replaced while it was copied.
+
+        InterlockedExchange64(&entry->lastUse, InterlockedIncrement64(&g_useClock));
+        InterlockedIncrement64(&g_hits);
+        return true;
+    }
+
+    InterlockedIncrement64(&g_misses);
+    return false;
+}
+
+_Use_decl_annotations_ void AddCachedHeader(const HeaderCacheKey *key, const PnmHeader *header,
+                                            const CommentRanges *comments)
+{
+    AcquireSRWLockExclusive(&g_writeLock);
+
+    // Replace the entry of the file (added by a concurrent miss) or the least recently used entry.
+    CacheEntry *entry = &g_entries[0];
+    for (size_t i = 0; i < ARRAYSIZE(g_entries); ++i)
+    {
+        if (g_entries[i].lastUse != 0 && IsEqualHeaderCacheKey(&g_entries[i].key, key))
+        {
+            entry = &g_entries[i];
+            break;
+        }
+
+        if (g_entries[i].lastUse < entry->lastUse)
+        {
+            entry = &g_entries[i];
+        }
+    }
+
+    InterlockedIncrement(&entry->sequence);
+    entry->key = *key;
+    entry->header = *header;
+    entry->comments = *comments;
+    InterlockedExchange64(&entry->lastUse, InterlockedIncrement64(&g_useClock));
+    InterlockedIncrement(&entry->sequence);
+
+    ReleaseSRWLockExclusive(&g_writeLock);
+}
+
+_Use_decl_annotations_ HRESULT STDMETHODCALLTYPE NetpbmGetHeaderCacheCounters(ULONGLONG *hits, ULONGLONG *misses)
+{
+    if (!hits || !misses)
+        return E_INVALIDARG;
+
+    *hits = (ULONGLONG)g_hits;
+    *misses = (ULONGLONG)g_misses;
+    return S_OK;
+}
@@ -0,0 +1,29 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "pnm_header.h"
+
+// Identity of the file of a stream: the name, size and last write time returned by IStream::Stat and the position of
+// the header in the stream.
+typedef struct HeaderCacheKey
+{
+    ULONGLONG size;
+    FILETIME lastWriteTime;
+    ULONGLONG position;
+    WCHAR name[MAX_PATH];
+} HeaderCacheKey;
+
+// Returns false when the stream cannot be identified (it has no name or a name longer than MAX_PATH - 1): the header
+// of the stream is then not cached.
+bool GetHeaderCacheKey(_In_ IStream *stream, ULONGLONG position, _Out_ HeaderCacheKey *key);
+
+bool IsEqualHeaderCacheKey(_In_ const HeaderCacheKey *a, _In_ const HeaderCacheKey *b);
+
+// Looks up the header of a file in the process-wide cache, doesn't take a lock.
+// comments (optional) receives the ranges of the comments of the header.
+bool FindCachedHeader(_In_ const HeaderCacheKey *key, _Out_ PnmHeader *header, _Out_opt_ CommentRanges *comments);
+
+// Adds (or replaces) the header of a file, the least recently used header is removed when the cache is full.
+void AddCachedHeader(_In_ const HeaderCacheKey *key, _In_ const PnmHeader *header, _In_ const CommentRanges *comments);
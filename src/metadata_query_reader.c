@@ -0,0 +1,339 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "metadata_query_reader.h"
+
+#include "allocator.h"
+#include "guids.h"
+#include "macros.h"
+#include "module.h"
+
+#include <Shlwapi.h>
+
+
+typedef struct MetadataQueryReader
+{
+    IWICMetadataQueryReader wicMetadataQueryReader;
+    LONG refCount;
+    IUnknown *source; // Creates the values of a lazy reader, NULL when the values are fixed.
+    MetadataValueSource getValue;
+    SRWLOCK lock;     // Serializes the creation of the values of a lazy reader.
+    UINT itemCount;
+    MetadataItem items[];
+} MetadataQueryReader;
+
+typedef struct MetadataNameEnumerator
+{
+    IEnumString enumString;
+    LONG refCount;
+    MetadataQueryReader *queryReader;
+    UINT index;
+} MetadataNameEnumerator;
+
+
+static ULONG STDMETHODCALLTYPE AddRef(_In_ IWICMetadataQueryReader *this)
+{
+    MetadataQueryReader *queryReader = (MetadataQueryReader *)this;
+    return InterlockedIncrement(&queryReader->refCount);
+}
+
+static void DestroyMetadataItems(_Inout_updates_(itemCount) MetadataItem *items, const UINT itemCount)
+{
+    for (UINT i = 0; i < itemCount; ++i)
+    {
+        VERIFY(SUCCEEDED(PropVariantClear(&items[i].value)));
+    }
+}
+
+static ULONG STDMETHODCALLTYPE Release(_In_ IWICMetadataQueryReader *this)
+{
+    MetadataQueryReader *queryReader = (MetadataQueryReader *)this;
+    const ULONG refCount = InterlockedDecrement(&queryReader->refCount);
+    if (refCount == 0)
+    {
+        DestroyMetadataItems(queryReader->items, queryReader->itemCount);
+        if (queryReader->source)
+        {
+            queryReader->source->lpVtbl->Release(queryReader->source);
+        }
+        FreeMemory(queryReader);
+        ModuleRelease();
+    }
+
+    return refCount;
+}
+
+static HRESULT STDMETHODCALLTYPE QueryInterface(_In_ IWICMetadataQueryReader *this, _In_ REFIID riid,
+                                                _COM_Outptr_ void **ppv)
+{
+    static const QITAB qiTable[] = {QITABENT(MetadataQueryReader, IWICMetadataQueryReader), {NULL, 0}};
+
+    return QISearch(this, qiTable, riid, ppv);
+}
+
+static HRESULT STDMETHODCALLTYPE GetContainerFormat([[maybe_unused]] IWICMetadataQueryReader *this,
+                                                    GUID *pguidContainerFormat)
+{
+    if (!pguidContainerFormat)
+        return E_POINTER;
+
+    *pguidContainerFormat = CLSID_ContainerFormatNetpbm;
+    return S_OK;
+}
+
+// The reader is the root of the metadata of the frame.
+static HRESULT STDMETHODCALLTYPE GetLocation([[maybe_unused]] IWICMetadataQueryReader *this, const UINT cchMaxLength,
+                                             WCHAR *wzNamespace, UINT *pcchActualLength)
+{
+    if (!pcchActualLength)
+        return E_POINTER;
+
+    *pcchActualLength = 2;
+    if (!wzNamespace)
+        return S_OK;
+
+    if (cchMaxLength < 2)
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+
+    wzNamespace[0] = L'/';
+    wzNamespace[1] = L'\0';
+    return S_OK;
+}
+
+static HRESULT CopyItemValue(_Inout_ MetadataQueryReader *queryReader, const UINT index, _Out_ PROPVARIANT *value)
+{
+    if (!queryReader->source)
+        return PropVariantCopy(value, &queryReader->items[index].value);
+
+    AcquireSRWLockExclusive(&queryReader->lock);
+    MetadataItem *item = &queryReader->items[index];
+    HRESULT result = S_OK;
+    if (item->value.vt == VT_EMPTY)
+    {
+        result = queryReader->getValue(queryReader->source, index, &item->value);
+    }
+
+    if (SUCCEEDED(result))
+    {
+        result = PropVariantCopy(value, &item->value);
+    }
+    ReleaseSRWLockExclusive(&queryReader->lock);
+    return result;
+}
+
+static HRESULT STDMETHODCALLTYPE GetMetadataByName(_In_ IWICMetadataQueryReader *this, LPCWSTR wzName,
+                                                   PROPVARIANT *pvarValue)
+{
+    TRACE("netpbm-wic-codec-c::MetadataQueryReader::GetMetadataByName\n");
+
+    if (!wzName)
+        return E_INVALIDARG;
+
+    MetadataQueryReader *queryReader = (MetadataQueryReader *)this;
+    for (UINT i = 0; i < queryReader->itemCount; ++i)
+    {
+        if (_wcsicmp(queryReader->items[i].name, wzName) != 0)
+            continue;
+
+        // A NULL value only checks whether the metadata item exists.
+        return pvarValue ? CopyItemValue(queryReader, i, pvarValue) : S_OK;
+    }
+
+    return WINCODEC_ERR_PROPERTYNOTFOUND;
+}
+
+static HRESULT CreateMetadataNameEnumerator(_In_ MetadataQueryReader *queryReader, UINT index,
+                                            _Outptr_ IEnumString **enumString);
+
+static HRESULT STDMETHODCALLTYPE GetEnumerator(_In_ IWICMetadataQueryReader *this, IEnumString **ppIEnumString)
+{
+    if (!ppIEnumString)
+        return E_POINTER;
+
+    return CreateMetadataNameEnumerator((MetadataQueryReader *)this, 0, ppIEnumString);
+}
+
+static ULONG STDMETHODCALLTYPE Enumerator_AddRef(_In_ IEnumString *this)
+{
+    MetadataNameEnumerator *enumerator = (MetadataNameEnumerator *)this;
+    return InterlockedIncrement(&enumerator->refCount);
+}
+
+static ULONG STDMETHODCALLTYPE Enumerator_Release(_In_ IEnumString *this)
+{
+    MetadataNameEnumerator *enumerator = (MetadataNameEnumerator *)this;
+    const ULONG refCount = InterlockedDecrement(&enumerator->refCount);
+    if (refCount == 0)
+    {
+        Release(&enumerator->queryReader->wicMetadataQueryReader);
+        FreeMemory(enumerator);
+        ModuleRelease();
+    }
+
+    return refCount;
+}
+
+static HRESULT STDMETHODCALLTYPE Enumerator_QueryInterface(_In_ IEnumString *this, _In_ REFIID riid,
+                                                           _COM_Outptr_ void **ppv)
+{
+    static const QITAB qiTable[] = {QITABENT(MetadataNameEnumerator, IEnumString), {NULL, 0}};
+
+    return QISearch(this, qiTable, riid, ppv);
+}
+
+// The names are returned as CoTaskMemAlloc strings, owned by the caller.
+static HRESULT STDMETHODCALLTYPE Enumerator_Next(_In_ IEnumString *this, const ULONG celt, LPOLESTR *rgelt,
+                                                 ULONG *pceltFetched)
+{
+    if (!rgelt || (celt > 1 && !pceltFetched))
+        return E_INVALIDARG;
+
+    MetadataNameEnumerator *enumerator = (MetadataNameEnumerator *)this;
+    const MetadataQueryReader *queryReader = enumerator->queryReader;
+    ULONG fetched = 0;
+    while (fetched < celt && enumerator->index < queryReader->itemCount)
+    {
+        const HRESULT result = SHStrDupW(queryReader->items[enumerator->index].name, &rgelt[fetched]);
+        if (FAILED(result))
+        {
+            for (ULONG i = 0; i < fetched; ++i)
+            {
+                CoTaskMemFree(rgelt[i]);
+                rgelt[i] = NULL;
+            }
+
+            return result;
+        }
+
+        ++fetched;
+        ++enumerator->index;
+    }
+
+    if (pceltFetched)
+    {
+        *pceltFetched = fetched;
+    }
+
+    return fetched == celt ? S_OK : S_FALSE;
+}
+
+static HRESULT STDMETHODCALLTYPE Enumerator_Skip(_In_ IEnumString *this, const ULONG celt)
+{
+    MetadataNameEnumerator *enumerator = (MetadataNameEnumerator *)this;
+    const UINT remaining = enumerator->queryReader->itemCount - enumerator->index;
+    if (celt > remaining)
+    {
+        enumerator->index = enumerator->queryReader->itemCount;
+        return S_FALSE;
+    }
+
+    enumerator->index += celt;
+    return S_OK;
+}
+
+static HRESULT STDMETHODCALLTYPE Enumerator_Reset(_In_ IEnumString *this)
+{
+    ((MetadataNameEnumerator *)this)->index = 0;
+    return S_OK;
+}
+
+static HRESULT STDMETHODCALLTYPE Enumerator_Clone(_In_ IEnumString *this, IEnumString **ppenum)
+{
+    if (!ppenum)
+        return E_POINTER;
+
+    const MetadataNameEnumerator *enumerator = (MetadataNameEnumerator *)this;
+    return CreateMetadataNameEnumerator(enumerator->queryReader, enumerator->index, ppenum);
+}
+
+static HRESULT CreateMetadataNameEnumerator(MetadataQueryReader *queryReader, const UINT index, IEnumString **enumString)
+{
+    *enumString = NULL;
+
+    MetadataNameEnumerator *enumerator = AllocateMemory(sizeof(MetadataNameEnumerator));
+    if (!enumerator)
+        return E_OUTOFMEMORY;
+
+    static const IEnumStringVtbl enumStringVtbl = {Enumerator_QueryInterface, Enumerator_AddRef, Enumerator_Release,
+                                                   Enumerator_Next,           Enumerator_Skip,   Enumerator_Reset,
+                                                   Enumerator_Clone};
+
+    enumerator->enumString.lpVtbl = &enumStringVtbl;
+    enumerator->refCount = 1;
+    enumerator->index = index;
+    AddRef(&queryReader->wicMetadataQueryReader);
+    enumerator->queryReader = queryReader;
+
+    ModuleAddRef();
+    *enumString = &enumerator->enumString;
+    return S_OK;
+}
+
+static MetadataQueryReader *AllocateMetadataQueryReader(const UINT itemCount)
+{
+    MetadataQueryReader *metadataQueryReader =
+        AllocateMemory(sizeof(MetadataQueryReader) + (size_t)itemCount * sizeof(MetadataItem));
+    if (!metadataQueryReader)
+        return NULL;
+
+    static const IWICMetadataQueryReaderVtbl wicMetadataQueryReaderVtbl = {
+        QueryInterface,    AddRef,        Release, GetContainerFormat, GetLocation,
+        GetMetadataByName, GetEnumerator};
+
+    metadataQueryReader->wicMetadataQueryReader.lpVtbl = &wicMetadataQueryReaderVtbl;
+    metadataQueryReader->refCount = 1;
+    metadataQueryReader->source = NULL;
+    metadataQueryReader->getValue = NULL;
+    InitializeSRWLock(&metadataQueryReader->lock);
+    metadataQueryReader->itemCount = itemCount;
+    return metadataQueryReader;
+}
+
+_Use_decl_annotations_ HRESULT CreateMetadataQueryReader(MetadataItem *items, const UINT itemCount,
+                                                         IWICMetadataQueryReader **queryReader)
+{
+    *queryReader = NULL;
+
+    MetadataQueryReader *metadataQueryReader = AllocateMetadataQueryReader(itemCount);
+    if (!metadataQueryReader)
+    {
+        DestroyMetadataItems(items, itemCount);
+        return E_OUTOFMEMORY;
+    }
+
+    if (itemCount != 0)
+    {
+        memcpy(metadataQueryReader->items, items, itemCount * sizeof(MetadataItem));
+    }
+
+    ModuleAddRef();
+    *queryReader = &metadataQueryReader->wicMetadataQueryReader;
+    return S_OK;
+}
+
+_Use_decl_annotations_ HRESULT CreateLazyMetadataQueryReader(const WCHAR *const *names, const UINT itemCount,
+                                                             IUnknown *source, const MetadataValueSource getValue,
+                                                             IWICMetadataQueryReader **queryReader)
+{
+    *queryReader = NULL;
+
+    MetadataQueryReader *metadataQueryReader = AllocateMetadataQueryReader(itemCount);
+    if (!metadataQueryReader)
+        return E_OUTOFMEMORY;
+
+    for (UINT i = 0; i < itemCount; ++i)
+    {
+        metadataQueryReader->items[i].name = names[i];
+        PropVariantInit(&metadataQueryReader->items[i].value);
+    }
+
+    source->lpVtbl->AddRef(source);
+    metadataQueryReader->source = source;
+    metadataQueryReader->getValue = getValue;
+
+    ModuleAddRef();
+    *queryReader = &metadataQueryReader->wicMetadataQueryReader;
+    return S_OK;
+}
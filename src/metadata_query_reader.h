@@ -0,0 +1,28 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Windows.h>
+#include <wincodec.h>
+
+typedef struct MetadataItem
+{
+    const WCHAR *name; // Full query name, for example /statistics/mean. Must stay valid (a string literal).
+    PROPVARIANT value;
+} MetadataItem;
+
+// Creates a read-only metadata query reader of the Netpbm container for a fixed set of items.
+// The reader takes ownership of the values of the items, also when the creation fails.
+HRESULT CreateMetadataQueryReader(_Inout_updates_(itemCount) MetadataItem *items, UINT itemCount,
+                                  _Outptr_ IWICMetadataQueryReader **queryReader);
+
+// Creates the value of the item with the index, called on the first query of the item. The value must stay VT_EMPTY
+// when the call fails.
+typedef HRESULT (*MetadataValueSource)(_In_ IUnknown *source, UINT index, _Out_ PROPVARIANT *value);
+
+// Creates a read-only metadata query reader of which the values are created by the source on their first query and
+// then cached. The names must stay valid (string literals), the reader keeps a reference to the source.
+HRESULT CreateLazyMetadataQueryReader(_In_reads_(itemCount) const WCHAR *const *names, UINT itemCount,
+                                      _In_ IUnknown *source, MetadataValueSource getValue,
+                                      _Outptr_ IWICMetadataQueryReader **queryReader);
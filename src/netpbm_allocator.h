@@ -0,0 +1,28 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Unknwnbase.h>
+
+// Functions that allocate the memory of the codec, the context is passed to every call. The large pixel buffers
+// (decoded images and bands of rows) and the decoders and property stores that are kept for reuse are allocated with
+// allocateAlignedMemory and freed with freeAlignedMemory, the alignment is a power of 2. allocateMemory needs no
+// alignment beyond that of the C types. The allocation functions return NULL when out of memory. Memory that is
+// returned to the caller by a COM contract (strings of PROPVARIANT values) is allocated with CoTaskMemAlloc.
+typedef struct NetpbmAllocator
+{
+    void *context;
+    void *(STDMETHODCALLTYPE *allocateMemory)(void *context, size_t size);
+    void(STDMETHODCALLTYPE *freeMemory)(void *context, void *memory);
+    void *(STDMETHODCALLTYPE *allocateAlignedMemory)(void *context, size_t size, size_t alignment);
+    void(STDMETHODCALLTYPE *freeAlignedMemory)(void *context, void *memory);
+} NetpbmAllocator;
+
+// Exported function that routes the allocations of the codec through the functions of the allocator, which is copied.
+// NULL restores the allocator of the C runtime. WINCODEC_ERR_WRONGSTATE is returned, and nothing is freed, when
+// objects of the codec or locks of the module exist. Otherwise the memory that is kept for reuse (released objects,
+// scratch buffers and cached pixels) is freed first, the allocator can only be replaced when no other memory of the
+// current allocator is in use. It must not be called concurrently with other calls of the codec. The kept memory of
+// a host allocator is leaked when the DLL is unloaded, its free functions are not called under the loader lock.
+HRESULT STDMETHODCALLTYPE NetpbmSetAllocator(const NetpbmAllocator *allocator);
@@ -5,21 +5,40 @@
 
 #include "netpbm_bitmap_decoder.h"
 
+#include "arena.h"
 #include "class_factory.h"
 #include "guids.h"
+#include "header_cache.h"
 #include "macros.h"
 #include "module.h"
+#include "netpbm_bitmap_frame_decode.h"
+#include "netpbm_validation.h"
+#include "object_pool.h"
 #include "pnm_header.h"
+#include "subsampled_bitmap_source.h"
+
+#include <stdalign.h>
 
 
 typedef struct NetpbmBitmapDecoder
 {
     IWICBitmapDecoder wicBitmapDecoder;
+    INetpbmValidation validation;
     volatile bool initialized;
     LONG refCount;
+    IWICBitmapFrameDecode *frame; // Netpbm files have 1 frame, it is created by Initialize.
+    Arena arena; // Memory of the session, released when the decoder and its frame are released.
+    alignas(ArenaAlignment) BYTE firstArenaChunk[FrameDecodeArenaSize];
 } NetpbmBitmapDecoder;
 
 
+// The frame is allocated from the arena: the memory of the decoder is released when both are released.
+static void ReleaseDecoderMemory(_In_ Arena *arena)
+{
+    FreePooledObject(ObjectPoolBitmapDecoder, (BYTE *)arena - offsetof(NetpbmBitmapDecoder, arena));
+}
+
+
 static ULONG __stdcall AddRef(_In_ IWICBitmapDecoder *this)
 {
     NetpbmBitmapDecoder *netpbmBitmapDecoder = (NetpbmBitmapDecoder *)this;
@@ -32,7 +51,12 @@ static ULONG __stdcall Release(_In_ IWICBitmapDecoder *this)
     const ULONG refCount = InterlockedDecrement(&netpbmBitmapDecoder->refCount);
     if (refCount == 0)
     {
-        free(netpbmBitmapDecoder);
+        if (netpbmBitmapDecoder->frame)
+        {
+            netpbmBitmapDecoder->frame->lpVtbl->Release(netpbmBitmapDecoder->frame);
+        }
+
+        ReleaseArena(&netpbmBitmapDecoder->arena);
         ModuleRelease();
     }
 
@@ -41,7 +65,10 @@ static ULONG __stdcall Release(_In_ IWICBitmapDecoder *this)
 
 static HRESULT __stdcall QueryInterface(_In_ IWICBitmapDecoder *this, _In_ REFIID riid, _COM_Outptr_ void **ppv)
 {
-    static const QITAB qiTable[] = {QITABENT(NetpbmBitmapDecoder, IWICBitmapDecoder), {NULL, 0}};
+    static const QITAB qiTable[] = {
+        QITABENT(NetpbmBitmapDecoder, IWICBitmapDecoder),
+        {&IID_INetpbmValidation, (int)offsetof(NetpbmBitmapDecoder, validation)},
+        {NULL, 0}};
 
     return QISearch(this, qiTable, riid, ppv);
 }
@@ -60,6 +87,7 @@ static HRESULT __stdcall QueryCapability([[maybe_unused]] IWICBitmapDecoder *thi
     // Custom decoder implementations should save the current position of the specified IStream,
     // read whatever information is necessary in order to determine which capabilities
     // it can provide for the supplied stream, and restore the stream position.
+    // Non-seekable streams fail before any byte is read: the stream can still be passed to Initialize.
     LARGE_INTEGER move = {};
     ULARGE_INTEGER original_position;
     HRESULT result = stream->lpVtbl->Seek(stream, move, STREAM_SEEK_CUR, &original_position);
@@ -68,20 +96,80 @@ static HRESULT __stdcall QueryCapability([[maybe_unused]] IWICBitmapDecoder *thi
 
     if (IsPnmFile(stream))
     {
-        *capability = WICBitmapDecoderCapabilityCanDecodeAllImages;
+        *capability = WICBitmapDecoderCapabilityCanDecodeAllImages | WICBitmapDecoderCapabilityCanDecodeThumbnail;
     }
 
-    result = stream->lpVtbl->Seek(stream, *(LARGE_INTEGER *)&original_position, STREAM_SEEK_CUR, NULL);
+    result = stream->lpVtbl->Seek(stream, *(LARGE_INTEGER *)&original_position, STREAM_SEEK_SET, NULL);
     if (FAILED(result))
         return result;
 
     return S_OK;
 }
 
-static HRESULT __stdcall Initialize([[maybe_unused]] IWICBitmapDecoder *this, [[maybe_unused]] IStream *pIStream,
+static HRESULT __stdcall Initialize(IWICBitmapDecoder *this, IStream *pIStream,
                                     [[maybe_unused]] WICDecodeOptions cacheOptions)
 {
-    return E_NOTIMPL;
+    TRACE("netpbm_bitmap_decoder-c::Initialize\n");
+
+    if (!pIStream)
+        return E_INVALIDARG;
+
+    NetpbmBitmapDecoder *netpbmBitmapDecoder = (NetpbmBitmapDecoder *)this;
+    if (netpbmBitmapDecoder->initialized)
+        return WINCODEC_ERR_WRONGSTATE;
+
+    PnmHeader header;
+    HRESULT result;
+    if (IsSeekableStream(pIStream))
+    {
+        const LARGE_INTEGER move = {};
+        ULARGE_INTEGER position;
+        result = pIStream->lpVtbl->Seek(pIStream, move, STREAM_SEEK_CUR, &position);
+        if (FAILED(result))
+            return result;
+
+        // Only the ranges of the comments are recorded, their text is read when it is requested as metadata.
+        // The header of a file that was opened before (for example by the property store) is taken from the cache.
+        CommentRanges comments;
+        HeaderCacheKey key;
+        const bool cacheable = GetHeaderCacheKey(pIStream, position.QuadPart, &key);
+        if (!cacheable || !FindCachedHeader(&key, &header, &comments))
+        {
+            result = ReadPnmHeaderAndComments(pIStream, &header, &comments);
+            if (FAILED(result))
+                return result;
+
+            if (cacheable)
+            {
+                AddCachedHeader(&key, &header, &comments);
+            }
+        }
+
+        result = CreateNetpbmBitmapFrameDecode(pIStream, NULL, &header, &comments, &netpbmBitmapDecoder->arena,
+                                               &netpbmBitmapDecoder->frame);
+    }
+    else
+    {
+        // Non-seekable streams (pipes) are decoded in a single pass: the frame continues with the reader that has
+        // read (and buffered) the first samples.
+        StreamReader *reader = ArenaAllocate(&netpbmBitmapDecoder->arena, sizeof(StreamReader));
+        if (!reader)
+            return E_OUTOFMEMORY;
+
+        StreamReaderInitialize(reader, pIStream, 0);
+        result = ReadPnmHeaderFromReader(reader, &header);
+        if (FAILED(result))
+            return result;
+
+        result = CreateNetpbmBitmapFrameDecode(pIStream, reader, &header, NULL, &netpbmBitmapDecoder->arena,
+                                               &netpbmBitmapDecoder->frame);
+    }
+
+    if (FAILED(result))
+        return result;
+
+    netpbmBitmapDecoder->initialized = true;
+    return S_OK;
 }
 
 static HRESULT __stdcall GetContainerFormat([[maybe_unused]] IWICBitmapDecoder *this, GUID *guidContainerFormat)
@@ -109,23 +197,39 @@ static HRESULT __stdcall CopyPalette([[maybe_unused]] IWICBitmapDecoder *this, [
     return WINCODEC_ERR_PALETTEUNAVAILABLE;
 }
 
-static HRESULT __stdcall GetMetadataQueryReader([[maybe_unused]] IWICBitmapDecoder *this,
-                                                [[maybe_unused]] IWICMetadataQueryReader **ppIMetadataQueryReader)
+// The comments of the header are the metadata of the container.
+static HRESULT __stdcall GetMetadataQueryReader(IWICBitmapDecoder *this,
+                                                IWICMetadataQueryReader **ppIMetadataQueryReader)
 {
-    TRACE("netpbm_bitmap_decoder-c::GetMetadataQueryReader (not supported)\n");
+    TRACE("netpbm_bitmap_decoder-c::GetMetadataQueryReader\n");
 
-    // Keep the initial design simple: no support for container-level metadata.
-    // Note: Conceptual, comments from the NetPbm file could converted into metadata.
-    return WINCODEC_ERR_UNSUPPORTEDOPERATION;
+    if (!ppIMetadataQueryReader)
+        return E_POINTER;
+
+    const NetpbmBitmapDecoder *netpbmBitmapDecoder = (NetpbmBitmapDecoder *)this;
+    if (!netpbmBitmapDecoder->initialized)
+    {
+        *ppIMetadataQueryReader = NULL;
+        return WINCODEC_ERR_NOTINITIALIZED;
+    }
+
+    return CreateFrameCommentMetadataQueryReader(netpbmBitmapDecoder->frame, ppIMetadataQueryReader);
 }
 
-static HRESULT __stdcall GetPreview([[maybe_unused]] IWICBitmapDecoder *this,
-                                    [[maybe_unused]] IWICBitmapSource **ppIBitmapSource)
+static HRESULT __stdcall GetPreview(IWICBitmapDecoder *this, IWICBitmapSource **ppIBitmapSource)
 {
-    TRACE("netpbm_bitmap_decoder::GetPreview (not supported)\n");
+    TRACE("netpbm_bitmap_decoder-c::GetPreview\n");
+
+    if (!ppIBitmapSource)
+        return E_POINTER;
 
-    // The Netpbm format doesn't support storing previews in the file format.
-    return WINCODEC_ERR_UNSUPPORTEDOPERATION;
+    *ppIBitmapSource = NULL;
+    const NetpbmBitmapDecoder *netpbmBitmapDecoder = (NetpbmBitmapDecoder *)this;
+    if (!netpbmBitmapDecoder->initialized)
+        return WINCODEC_ERR_NOTINITIALIZED;
+
+    // The Netpbm format doesn't support storing previews in the file format, create one by sampling the image.
+    return CreateFrameSubsampledBitmapSource(netpbmBitmapDecoder->frame, PreviewMaxSize, ppIBitmapSource);
 }
 
 static HRESULT __stdcall GetColorContexts([[maybe_unused]] IWICBitmapDecoder *this, [[maybe_unused]] UINT cCount,
@@ -141,13 +245,21 @@ static HRESULT __stdcall GetColorContexts([[maybe_unused]] IWICBitmapDecoder *th
     return S_OK;
 }
 
-static HRESULT __stdcall GetThumbnail([[maybe_unused]] IWICBitmapDecoder *this,
-                                      [[maybe_unused]] IWICBitmapSource **ppIThumbnail)
+static HRESULT __stdcall GetThumbnail(IWICBitmapDecoder *this, IWICBitmapSource **ppIThumbnail)
 {
-    TRACE("netpbm_bitmap_decoder-c::GetThumbnail (not supported)\n");
+    TRACE("netpbm_bitmap_decoder-c::GetThumbnail\n");
+
+    if (!ppIThumbnail)
+        return E_POINTER;
+
+    *ppIThumbnail = NULL;
+    const NetpbmBitmapDecoder *netpbmBitmapDecoder = (NetpbmBitmapDecoder *)this;
+    if (!netpbmBitmapDecoder->initialized)
+        return WINCODEC_ERR_NOTINITIALIZED;
 
     // The Netpbm format doesn't support storing thumbnails in the file format.
-    return WINCODEC_ERR_CODECNOTHUMBNAIL;
+    // Sampling the rows of the image is much cheaper than a full decode followed by a downscale.
+    return CreateFrameSubsampledBitmapSource(netpbmBitmapDecoder->frame, ThumbnailMaxSize, ppIThumbnail);
 }
 
 static HRESULT __stdcall GetFrameCount([[maybe_unused]] IWICBitmapDecoder *this, [[maybe_unused]] UINT *pCount)
@@ -162,10 +274,53 @@ static HRESULT __stdcall GetFrameCount([[maybe_unused]] IWICBitmapDecoder *this,
     return S_OK;
 }
 
-static HRESULT __stdcall GetFrame([[maybe_unused]] IWICBitmapDecoder *this, [[maybe_unused]] UINT index,
-                                  [[maybe_unused]] IWICBitmapFrameDecode **ppIBitmapFrame)
+static HRESULT __stdcall GetFrame(IWICBitmapDecoder *this, const UINT index, IWICBitmapFrameDecode **ppIBitmapFrame)
 {
-    return E_NOTIMPL;
+    TRACE("netpbm_bitmap_decoder-c::GetFrame\n");
+
+    if (!ppIBitmapFrame)
+        return E_POINTER;
+
+    *ppIBitmapFrame = NULL;
+    const NetpbmBitmapDecoder *netpbmBitmapDecoder = (NetpbmBitmapDecoder *)this;
+    if (!netpbmBitmapDecoder->initialized)
+        return WINCODEC_ERR_NOTINITIALIZED;
+
+    if (index != 0)
+        return WINCODEC_ERR_FRAMEMISSING;
+
+    netpbmBitmapDecoder->frame->lpVtbl->AddRef(netpbmBitmapDecoder->frame);
+    *ppIBitmapFrame = netpbmBitmapDecoder->frame;
+    return S_OK;
+}
+
+static NetpbmBitmapDecoder *FromValidation(_In_ INetpbmValidation *validation)
+{
+    return (NetpbmBitmapDecoder *)((BYTE *)validation - offsetof(NetpbmBitmapDecoder, validation));
+}
+
+static HRESULT STDMETHODCALLTYPE Validation_QueryInterface(_In_ INetpbmValidation *this, _In_ REFIID riid,
+                                                           _COM_Outptr_ void **ppv)
+{
+    return QueryInterface(&FromValidation(this)->wicBitmapDecoder, riid, ppv);
+}
+
+static ULONG STDMETHODCALLTYPE Validation_AddRef(_In_ INetpbmValidation *this)
+{
+    return AddRef(&FromValidation(this)->wicBitmapDecoder);
+}
+
+static ULONG STDMETHODCALLTYPE Validation_Release(_In_ INetpbmValidation *this)
+{
+    return Release(&FromValidation(this)->wicBitmapDecoder);
+}
+
+static HRESULT STDMETHODCALLTYPE Validation_Validate([[maybe_unused]] INetpbmValidation *this, IStream *stream,
+                                                     ULONGLONG *badOffset)
+{
+    TRACE("netpbm_bitmap_decoder-c::Validate\n");
+
+    return NetpbmValidate(stream, badOffset);
 }
 
 static HRESULT __stdcall IClassFactory_CreateInstance([[maybe_unused]] IClassFactory *this, IUnknown *punkOuter,
@@ -177,7 +332,7 @@ static HRESULT __stdcall IClassFactory_CreateInstance([[maybe_unused]] IClassFac
         return CLASS_E_NOAGGREGATION;
     }
 
-    NetpbmBitmapDecoder *netpbmBitmapDecoder = malloc(sizeof(NetpbmBitmapDecoder));
+    NetpbmBitmapDecoder *netpbmBitmapDecoder = AllocatePooledObject(ObjectPoolBitmapDecoder, sizeof(NetpbmBitmapDecoder));
     if (!netpbmBitmapDecoder)
     {
         *ppv = NULL;
@@ -191,9 +346,16 @@ static HRESULT __stdcall IClassFactory_CreateInstance([[maybe_unused]] IClassFac
                                                                GetPreview,      GetColorContexts, GetThumbnail,
                                                                GetFrameCount,   GetFrame};
 
+    static const INetpbmValidationVtbl validationVtbl = {Validation_QueryInterface, Validation_AddRef,
+                                                         Validation_Release, Validation_Validate};
+
     netpbmBitmapDecoder->wicBitmapDecoder.lpVtbl = &wicBitmapDecoderVtbl;
+    netpbmBitmapDecoder->validation.lpVtbl = &validationVtbl;
     netpbmBitmapDecoder->refCount = 0;
     netpbmBitmapDecoder->initialized = false;
+    netpbmBitmapDecoder->frame = NULL;
+    InitializeArena(&netpbmBitmapDecoder->arena, netpbmBitmapDecoder->firstArenaChunk,
+                    sizeof(netpbmBitmapDecoder->firstArenaChunk), ReleaseDecoderMemory);
 
     const HRESULT hr = QueryInterface(&netpbmBitmapDecoder->wicBitmapDecoder, vTableGuid, ppv);
     if (SUCCEEDED(hr))
@@ -202,7 +364,7 @@ static HRESULT __stdcall IClassFactory_CreateInstance([[maybe_unused]] IClassFac
     }
     else
     {
-        free(netpbmBitmapDecoder);
+        FreePooledObject(ObjectPoolBitmapDecoder, netpbmBitmapDecoder);
     }
 
     return hr;
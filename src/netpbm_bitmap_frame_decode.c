@@ -0,0 +1,1409 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "netpbm_bitmap_frame_decode.h"
+
+#include "allocator.h"
+#include "arena.h"
+#include "frame_cache.h"
+#include "guids.h"
+#include "macros.h"
+#include "metadata_query_reader.h"
+#include "module.h"
+#include "netpbm_channel_selection.h"
+#include "netpbm_planar_output.h"
+#include "netpbm_statistics.h"
+#include "pixel_converter.h"
+#include "row_decoder.h"
+#include "scratch_buffer.h"
+#include "statistics.h"
+#include "stream_reader.h"
+#include "subsampled_bitmap_source.h"
+
+
+typedef struct NetpbmBitmapFrameDecode
+{
+    IWICBitmapFrameDecode wicBitmapFrameDecode;
+    IWICBitmapSourceTransform bitmapSourceTransform;
+    INetpbmChannelSelection channelSelection;
+    INetpbmPlanarOutput planarOutput;
+    INetpbmStatistics statisticsInterface;
+    LONG refCount;
+    IStream *stream;
+    PnmHeader header;
+    const GUID *pixelFormat;
+    UINT bitsPerPixel;    // Of the WIC pixel format.
+    SRWLOCK lock;         // Guards the channel selection, the statistics and the creation of the decoded pixels.
+    SRWLOCK streamLock;   // Serializes the seeks and reads of the stream, acquired after lock.
+    BYTE *decodedPixels;  // Pixels of a plain (ASCII) file or a non-seekable stream, created by the first CopyPixels.
+    SharedPixels *sharedPixels; // Pixels of the frame cache, used by CopyPixels when the cache is enabled.
+    bool notCacheable;    // The stream has no name, its pixels cannot be shared.
+    bool singlePass;      // The stream cannot seek, the samples can only be read once in file order.
+    StreamReader *singlePassReader; // Positioned after the header, cleared after the samples have been decoded.
+    Arena *arena;         // Of the decoder, holds the memory of the frame and of the single pass reader.
+    UINT channelCount;    // Number of selected channels, 0 when all channels are decoded.
+    UINT channels[3];
+    StatisticsAccumulator *statistics; // Enabled by INetpbmStatistics, accumulated by CopyPixels.
+    UINT statisticsRow;   // Next row that is accumulated, the statistics are complete when it equals the height.
+    CommentRanges comments; // Of the header, the text is read on request.
+    BYTE scaleTable[256]; // Maps 8-bit samples in the range [0, maxValue] to [0, 255].
+} NetpbmBitmapFrameDecode;
+
+
+static ULONG __stdcall AddRef(_In_ IWICBitmapFrameDecode *this)
+{
+    NetpbmBitmapFrameDecode *frameDecode = (NetpbmBitmapFrameDecode *)this;
+    return InterlockedIncrement(&frameDecode->refCount);
+}
+
+static ULONG __stdcall Release(_In_ IWICBitmapFrameDecode *this)
+{
+    NetpbmBitmapFrameDecode *frameDecode = (NetpbmBitmapFrameDecode *)this;
+    const ULONG refCount = InterlockedDecrement(&frameDecode->refCount);
+    if (refCount == 0)
+    {
+        frameDecode->stream->lpVtbl->Release(frameDecode->stream);
+        FreePixelBuffer(frameDecode->decodedPixels);
+        if (frameDecode->sharedPixels)
+        {
+            ReleaseSharedPixels(frameDecode->sharedPixels);
+        }
+        if (frameDecode->statistics)
+        {
+            ReleaseStatisticsAccumulator(frameDecode->statistics);
+            FreeMemory(frameDecode->statistics);
+        }
+        ReleaseArena(frameDecode->arena);
+        ModuleRelease();
+    }
+
+    return refCount;
+}
+
+static HRESULT __stdcall QueryInterface(_In_ IWICBitmapFrameDecode *this, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+{
+    static const QITAB qiTable[] = {
+        QITABENT(NetpbmBitmapFrameDecode, IWICBitmapFrameDecode),
+        QITABENT(NetpbmBitmapFrameDecode, IWICBitmapSource),
+        {&IID_IWICBitmapSourceTransform, (int)offsetof(NetpbmBitmapFrameDecode, bitmapSourceTransform)},
+        {&IID_INetpbmChannelSelection, (int)offsetof(NetpbmBitmapFrameDecode, channelSelection)},
+        {&IID_INetpbmPlanarOutput, (int)offsetof(NetpbmBitmapFrameDecode, planarOutput)},
+        {&IID_INetpbmStatistics, (int)offsetof(NetpbmBitmapFrameDecode, statisticsInterface)},
+        {NULL, 0}};
+
+    return QISearch(this, qiTable, riid, ppv);
+}
+
+static HRESULT __stdcall GetSize(_In_ IWICBitmapFrameDecode *this, UINT *puiWidth, UINT *puiHeight)
+{
+    TRACE("netpbm_bitmap_frame_decode-c::GetSize\n");
+
+    if (!puiWidth || !puiHeight)
+        return E_POINTER;
+
+    const NetpbmBitmapFrameDecode *frameDecode = (NetpbmBitmapFrameDecode *)this;
+    *puiWidth = frameDecode->header.width;
+    *puiHeight = frameDecode->header.height;
+    return S_OK;
+}
+
+static HRESULT __stdcall GetPixelFormat(_In_ IWICBitmapFrameDecode *this, WICPixelFormatGUID *pPixelFormat)
+{
+    TRACE("netpbm_bitmap_frame_decode-c::GetPixelFormat\n");
+
+    if (!pPixelFormat)
+        return E_POINTER;
+
+    NetpbmBitmapFrameDecode *frameDecode = (NetpbmBitmapFrameDecode *)this;
+    AcquireSRWLockShared(&frameDecode->lock);
+    memcpy(pPixelFormat, frameDecode->pixelFormat, sizeof(GUID));
+    ReleaseSRWLockShared(&frameDecode->lock);
+    return S_OK;
+}
+
+static HRESULT __stdcall GetResolution([[maybe_unused]] IWICBitmapFrameDecode *this, double *pDpiX, double *pDpiY)
+{
+    TRACE("netpbm_bitmap_frame_decode-c::GetResolution\n");
+
+    if (!pDpiX || !pDpiY)
+        return E_POINTER;
+
+    // The Netpbm format has no resolution information, use the default of 96 DPI.
+    *pDpiX = 96.0;
+    *pDpiY = 96.0;
+    return S_OK;
+}
+
+// Returns the indexed pixel format of which the gray palette of CopyPalette maps the pixels to the gray levels of the
+// samples, or NULL when there is none. The samples are copied as is, the palette encodes the scaling of maxValue.
+static const GUID *GetIndexedPixelFormat(_In_ const NetpbmBitmapFrameDecode *frameDecode)
+{
+    if (IsEqualGUID(frameDecode->pixelFormat, &GUID_WICPixelFormatBlackWhite))
+        return &GUID_WICPixelFormat1bppIndexed;
+
+    if (IsEqualGUID(frameDecode->pixelFormat, &GUID_WICPixelFormat8bppGray) && frameDecode->channelCount == 0)
+        return &GUID_WICPixelFormat8bppIndexed;
+
+    return NULL;
+}
+
+// Returns the number of colors of the gray palette, 0 when the frame has no indexed pixel format.
+static UINT GetGrayPalette(_In_ const NetpbmBitmapFrameDecode *frameDecode, _Out_writes_(256) WICColor *colors)
+{
+    const GUID *indexedPixelFormat = GetIndexedPixelFormat(frameDecode);
+    if (!indexedPixelFormat)
+        return 0;
+
+    // Plain samples and the samples of non-seekable streams are decoded once, they are already converted.
+    const PnmHeader *header = &frameDecode->header;
+    const bool converted = IsPlainPnmFormat(header->format) || frameDecode->singlePass;
+    const WICColor black = 0xFF000000;
+    const WICColor white = 0xFFFFFFFF;
+    if (IsEqualGUID(indexedPixelFormat, &GUID_WICPixelFormat1bppIndexed))
+    {
+        // A set bit is black in a PBM file and white after the conversion.
+        colors[0] = converted ? black : white;
+        colors[1] = converted ? white : black;
+        return 2;
+    }
+
+    // All byte values have a color, samples larger than maxValue are white like in the converted pixels.
+    for (UINT i = 0; i < 256; ++i)
+    {
+        const UINT gray = converted ? i : frameDecode->scaleTable[i];
+        colors[i] = black | gray << 16 | gray << 8 | gray;
+    }
+
+    return 256;
+}
+
+// Netpbm images don't have palettes. Bitmaps and graymaps with 8-bit samples have a generated gray palette for
+// consumers that require indexed pixels, which they can decode with IWICBitmapSourceTransform::CopyPixels.
+static HRESULT __stdcall CopyPalette(_In_ IWICBitmapFrameDecode *this, IWICPalette *pIPalette)
+{
+    TRACE("netpbm_bitmap_frame_decode-c::CopyPalette\n");
+
+    if (!pIPalette)
+        return E_INVALIDARG;
+
+    NetpbmBitmapFrameDecode *frameDecode = (NetpbmBitmapFrameDecode *)this;
+    WICColor colors[256];
+    AcquireSRWLockShared(&frameDecode->lock);
+    const UINT colorCount = GetGrayPalette(frameDecode, colors);
+    ReleaseSRWLockShared(&frameDecode->lock);
+    if (colorCount == 0)
+        return WINCODEC_ERR_PALETTEUNAVAILABLE;
+
+    return pIPalette->lpVtbl->InitializeCustom(pIPalette, colors, colorCount);
+}
+
+// The stream has a single position: every read seeks and reads while the stream lock is held, which lets copies of
+// disjoint rectangles convert their samples in parallel.
+static HRESULT ReadAt(_Inout_ NetpbmBitmapFrameDecode *frameDecode, const ULONGLONG position,
+                      _Out_writes_bytes_all_(size) void *buffer, const ULONG size)
+{
+    AcquireSRWLockExclusive(&frameDecode->streamLock);
+    HRESULT result = SeekTo(frameDecode->stream, position);
+    if (SUCCEEDED(result))
+    {
+        result = ReadExactly(frameDecode->stream, buffer, size);
+    }
+    ReleaseSRWLockExclusive(&frameDecode->streamLock);
+    return result;
+}
+
+static HRESULT CopyBitmapPixels(_Inout_ NetpbmBitmapFrameDecode *frameDecode, _In_ const WICRect *rect,
+                                const bool indexed, const UINT stride, _Out_ BYTE *buffer)
+{
+    const PnmHeader *header = &frameDecode->header;
+    const UINT fileRowSize = GetPnmRowSize(header);
+    const UINT rowSize = ((UINT)rect->Width + 7) / 8;
+    const UINT shift = (UINT)rect->X % 8;
+    const UINT firstByte = (UINT)rect->X / 8;
+    const UINT readSize = ((UINT)rect->X + (UINT)rect->Width - 1) / 8 - firstByte + 1;
+
+    // Rows that don't start at a byte boundary are read into a scratch buffer and shifted into place.
+    BYTE *scratch = NULL;
+    if (shift != 0)
+    {
+        scratch = AcquireScratchBuffer(readSize);
+        if (!scratch)
+            return E_OUTOFMEMORY;
+    }
+
+    HRESULT result = S_OK;
+    for (INT row = 0; row < rect->Height; ++row)
+    {
+        BYTE *destination = buffer + (size_t)row * stride;
+        result = ReadAt(frameDecode, header->dataOffset + (ULONGLONG)(rect->Y + row) * fileRowSize + firstByte,
+                        scratch ? scratch : destination, readSize);
+        if (FAILED(result))
+            break;
+
+        if (scratch)
+        {
+            ShiftBitsLeft(scratch, readSize, shift, destination, rowSize);
+        }
+
+        if (!indexed)
+        {
+            InvertBits(destination, rowSize);
+        }
+    }
+
+    ReleaseScratchBuffer(scratch);
+    return result;
+}
+
+// Only the span between the first and last selected channel of a row is read, the selected samples are gathered
+// from a scratch buffer.
+static HRESULT CopySelectedChannels(_Inout_ NetpbmBitmapFrameDecode *frameDecode, _In_ const WICRect *rect,
+                                    const UINT stride, _Out_ BYTE *buffer)
+{
+    const PnmHeader *header = &frameDecode->header;
+    const UINT bytesPerSample = GetPnmBitsPerSample(header) / 8;
+    const UINT filePixelSize = header->samplesPerPixel * bytesPerSample;
+
+    UINT firstChannel = frameDecode->channels[0];
+    UINT lastChannel = frameDecode->channels[0];
+    for (UINT i = 1; i < frameDecode->channelCount; ++i)
+    {
+        firstChannel = frameDecode->channels[i] < firstChannel ? frameDecode->channels[i] : firstChannel;
+        lastChannel = frameDecode->channels[i] > lastChannel ? frameDecode->channels[i] : lastChannel;
+    }
+
+    UINT channels[ARRAYSIZE(frameDecode->channels)];
+    for (UINT i = 0; i < frameDecode->channelCount; ++i)
+    {
+        channels[i] = frameDecode->channels[i] - firstChannel;
+    }
+
+    const UINT readSize = ((UINT)rect->Width - 1) * filePixelSize + (lastChannel - firstChannel + 1) * bytesPerSample;
+    BYTE *scratch = AcquireScratchBuffer(readSize);
+    if (!scratch)
+        return E_OUTOFMEMORY;
+
+    const size_t sampleCount = (size_t)rect->Width * frameDecode->channelCount;
+    HRESULT result = S_OK;
+    for (INT row = 0; row < rect->Height; ++row)
+    {
+        result = ReadAt(frameDecode,
+                        header->dataOffset + (ULONGLONG)(rect->Y + row) * GetPnmRowSize(header) +
+                            (ULONGLONG)rect->X * filePixelSize + firstChannel * bytesPerSample,
+                        scratch, readSize);
+        if (FAILED(result))
+            break;
+
+        BYTE *destination = buffer + (size_t)row * stride;
+        if (bytesPerSample == 1)
+        {
+            GatherChannels8(scratch, header->samplesPerPixel, channels, frameDecode->channelCount, destination,
+                            (UINT)rect->Width);
+            if (header->maxValue != UCHAR_MAX)
+            {
+                ScaleSamples8(destination, sampleCount, frameDecode->scaleTable);
+            }
+        }
+        else
+        {
+            GatherBigEndianChannels16(scratch, header->samplesPerPixel, channels, frameDecode->channelCount,
+                                      (USHORT *)destination, (UINT)rect->Width);
+            if (header->maxValue != USHRT_MAX)
+            {
+                ScaleSamples16((USHORT *)destination, sampleCount, header->maxValue);
+            }
+        }
+    }
+
+    ReleaseScratchBuffer(scratch);
+    return result;
+}
+
+// Binary samples are read directly into the buffer of the caller and converted in place, indexed pixels are the samples.
+static HRESULT CopyBinaryPixels(_Inout_ NetpbmBitmapFrameDecode *frameDecode, _In_ const WICRect *rect,
+                                const bool indexed, const UINT stride, _Out_ BYTE *buffer)
+{
+    const PnmHeader *header = &frameDecode->header;
+    if (header->format == PnmFormatBitmap)
+        return CopyBitmapPixels(frameDecode, rect, indexed, stride, buffer);
+
+    if (frameDecode->channelCount != 0)
+        return CopySelectedChannels(frameDecode, rect, stride, buffer);
+
+    const UINT fileRowSize = GetPnmRowSize(header);
+    const UINT filePixelSize = header->samplesPerPixel * (GetPnmBitsPerSample(header) / 8);
+    const UINT sourceRowSize = (UINT)rect->Width * filePixelSize;
+    const UINT rowSize = (UINT)rect->Width * (frameDecode->bitsPerPixel / 8);
+
+    // Gray-alpha pixels are read into the back of the row and expanded in place to RGBA.
+    const UINT readOffset = rowSize - sourceRowSize;
+
+    // Full rows are adjacent in the stream. When they are also adjacent in the buffer, multiple rows
+    // are read with a single call. The bottom-up rows of PFM files are located by seeking to every row.
+    const bool bottomUp = IsFloatPnmFormat(header->format);
+    const bool fullRows = (UINT)rect->Width == header->width && !bottomUp;
+    const UINT maxReadSize = 1U << 26;
+    const UINT rowsPerRead =
+        fullRows && readOffset == 0 && stride == rowSize && sourceRowSize <= maxReadSize ? maxReadSize / sourceRowSize : 1;
+
+    // The statistics are accumulated while the samples are converted, when the rows continue the previous rows.
+    StatisticsAccumulator *statistics = frameDecode->statistics;
+    if (statistics && (indexed || !fullRows || (UINT)rect->Y != frameDecode->statisticsRow))
+    {
+        statistics = NULL;
+    }
+
+    for (UINT row = 0; row < (UINT)rect->Height;)
+    {
+        const UINT fileRow = bottomUp ? header->height - 1 - ((UINT)rect->Y + row) : (UINT)rect->Y + row;
+        const UINT rowCount = (UINT)rect->Height - row < rowsPerRead ? (UINT)rect->Height - row : rowsPerRead;
+        BYTE *destination = buffer + (size_t)row * stride;
+        const HRESULT result =
+            ReadAt(frameDecode, header->dataOffset + (ULONGLONG)fileRow * fileRowSize + (ULONGLONG)rect->X * filePixelSize,
+                   destination + readOffset, rowCount * sourceRowSize);
+        if (FAILED(result))
+        {
+            if (statistics)
+            {
+                ResetStatisticsAccumulator(statistics);
+                frameDecode->statisticsRow = 0;
+            }
+
+            return result;
+        }
+
+        if (statistics)
+        {
+            ConvertGraySamplesWithStatistics(statistics, frameDecode->scaleTable, destination, destination,
+                                             (size_t)rowCount * (UINT)rect->Width);
+            frameDecode->statisticsRow += rowCount;
+        }
+        else if (!indexed)
+        {
+            ConvertPnmPixels(header, frameDecode->scaleTable, destination, (size_t)rowCount * (UINT)rect->Width);
+        }
+
+        row += rowCount;
+    }
+
+    return S_OK;
+}
+
+static HRESULT STDMETHODCALLTYPE StoreDecodedRows(void *context, const NetpbmRows *rows)
+{
+    memcpy((BYTE *)context + (size_t)rows->firstRow * rows->stride, rows->pixels, (size_t)rows->rowCount * rows->stride);
+    return S_OK;
+}
+
+static HRESULT DecodePlainPixels(_Inout_ NetpbmBitmapFrameDecode *frameDecode, const size_t rowSize,
+                                 _Out_ BYTE *pixels)
+{
+    const PnmHeader *header = &frameDecode->header;
+    AcquireSRWLockExclusive(&frameDecode->streamLock);
+    HRESULT result = SeekTo(frameDecode->stream, header->dataOffset);
+    if (SUCCEEDED(result))
+    {
+        StreamReader reader;
+        StreamReaderInitialize(&reader, frameDecode->stream, header->dataOffset);
+        for (UINT y = 0; y < header->height && SUCCEEDED(result); ++y)
+        {
+            result = DecodePlainPnmRow(&reader, header, frameDecode->scaleTable, pixels + y * rowSize);
+        }
+    }
+    ReleaseSRWLockExclusive(&frameDecode->streamLock);
+
+    return result;
+}
+
+// Plain (ASCII) samples have no fixed size and cannot be located without scanning the stream, the samples of a
+// non-seekable stream can only be read once. The complete image is decoded once, which makes the following
+// CopyPixels calls cheap.
+static HRESULT DecodePixels(_Inout_ NetpbmBitmapFrameDecode *frameDecode)
+{
+    const PnmHeader *header = &frameDecode->header;
+    const size_t rowSize = ((size_t)header->width * frameDecode->bitsPerPixel + 7) / 8;
+    if (frameDecode->singlePass && !frameDecode->singlePassReader)
+        return WINCODEC_ERR_WRONGSTATE; // A previous decode has failed after consuming the stream.
+
+    BYTE *pixels = AllocatePixelBuffer(rowSize * header->height);
+    if (!pixels)
+        return E_OUTOFMEMORY;
+
+    memset(pixels, 0, rowSize * header->height);
+
+    HRESULT result;
+    if (frameDecode->singlePass)
+    {
+        // All rows are decoded at once, the statistics (when enabled) are complete afterwards.
+        StatisticsAccumulator *statistics = frameDecode->statisticsRow == 0 ? frameDecode->statistics : NULL;
+        result = DecodePnmRows(frameDecode->stream, frameDecode->singlePassReader, header, NULL, statistics, 0,
+                               StoreDecodedRows, pixels);
+        frameDecode->singlePassReader = NULL;
+        if (statistics && SUCCEEDED(result))
+        {
+            frameDecode->statisticsRow = header->height;
+        }
+    }
+    else
+    {
+        result = DecodePlainPixels(frameDecode, rowSize, pixels);
+    }
+
+    if (FAILED(result))
+    {
+        FreePixelBuffer(pixels);
+        return result;
+    }
+
+    frameDecode->decodedPixels = pixels;
+    return S_OK;
+}
+
+// Copies a rectangle of the complete image of decoded pixels.
+static void CopyImageRectangle(_In_ const NetpbmBitmapFrameDecode *frameDecode, const UINT bitsPerPixel,
+                               _In_ const BYTE *pixels, _In_ const WICRect *rect, const UINT stride, _Out_ BYTE *buffer)
+{
+    const size_t sourceStride = ((size_t)frameDecode->header.width * bitsPerPixel + 7) / 8;
+    const size_t firstBit = (size_t)rect->X * bitsPerPixel;
+    const UINT rowSize = (UINT)(((size_t)rect->Width * bitsPerPixel + 7) / 8);
+    const size_t sourceSize = (firstBit + (size_t)rect->Width * bitsPerPixel + 7) / 8 - firstBit / 8;
+
+    const BYTE *source = pixels + (size_t)rect->Y * sourceStride + firstBit / 8;
+    for (INT row = 0; row < rect->Height; ++row)
+    {
+        ShiftBitsLeft(source, sourceSize, (UINT)(firstBit % 8), buffer, rowSize);
+        source += sourceStride;
+        buffer += stride;
+    }
+}
+
+static HRESULT CopyDecodedPixels(_Inout_ NetpbmBitmapFrameDecode *frameDecode, _In_ const WICRect *rect,
+                                 const UINT stride, _Out_ BYTE *buffer)
+{
+    if (!frameDecode->decodedPixels)
+    {
+        const HRESULT result = DecodePixels(frameDecode);
+        if (FAILED(result))
+            return result;
+    }
+
+    CopyImageRectangle(frameDecode, frameDecode->bitsPerPixel, frameDecode->decodedPixels, rect, stride, buffer);
+    return S_OK;
+}
+
+// Decodes the complete image of a seekable stream, called while the lock is held exclusively.
+static HRESULT DecodeSharedPixels(_Inout_ NetpbmBitmapFrameDecode *frameDecode, _Outptr_ SharedPixels **pixels)
+{
+    const PnmHeader *header = &frameDecode->header;
+    const size_t rowSize = ((size_t)header->width * frameDecode->bitsPerPixel + 7) / 8;
+    *pixels = CreateSharedPixels(rowSize * header->height);
+    if (!*pixels)
+        return E_OUTOFMEMORY;
+
+    HRESULT result;
+    if (IsPlainPnmFormat(header->format))
+    {
+        result = DecodePlainPixels(frameDecode, rowSize, (*pixels)->pixels);
+    }
+    else
+    {
+        const WICRect rect = {0, 0, (INT)header->width, (INT)header->height};
+        result = CopyBinaryPixels(frameDecode, &rect, false, (UINT)rowSize, (*pixels)->pixels);
+    }
+
+    if (FAILED(result))
+    {
+        ReleaseSharedPixels(*pixels);
+        *pixels = NULL;
+    }
+
+    return result;
+}
+
+// Returns a reference to the decoded pixels of the frame cache and their bits per pixel, or S_FALSE when the frame
+// doesn't use the cache: it is disabled, the stream has no name, the image doesn't fit in the budget or statistics are
+// accumulated. The lock is only taken exclusively to find or decode the pixels, which happens once.
+static HRESULT GetSharedPixels(_Inout_ NetpbmBitmapFrameDecode *frameDecode,
+                               _Outptr_result_maybenull_ SharedPixels **pixels, _Out_ UINT *bitsPerPixel)
+{
+    const PnmHeader *header = &frameDecode->header;
+    AcquireSRWLockShared(&frameDecode->lock);
+    const ULONGLONG size = ((ULONGLONG)header->width * frameDecode->bitsPerPixel + 7) / 8 * header->height;
+    const bool cached = !frameDecode->statistics && !frameDecode->notCacheable && size <= GetFrameCacheBudget();
+    *pixels = cached ? frameDecode->sharedPixels : NULL;
+    *bitsPerPixel = frameDecode->bitsPerPixel;
+    if (*pixels)
+    {
+        AddRefSharedPixels(*pixels);
+    }
+    ReleaseSRWLockShared(&frameDecode->lock);
+    if (*pixels)
+        return S_OK;
+
+    if (!cached)
+        return S_FALSE;
+
+    // The state is checked again, the channels or the statistics may have changed without the lock.
+    HRESULT result = S_FALSE;
+    AcquireSRWLockExclusive(&frameDecode->lock);
+    const ULONGLONG exclusiveSize = ((ULONGLONG)header->width * frameDecode->bitsPerPixel + 7) / 8 * header->height;
+    if (!frameDecode->sharedPixels && !frameDecode->statistics && !frameDecode->notCacheable &&
+        exclusiveSize <= GetFrameCacheBudget())
+    {
+        FrameCacheKey key;
+        if (GetHeaderCacheKey(frameDecode->stream, header->dataOffset, &key.file))
+        {
+            key.pixelFormat = *frameDecode->pixelFormat;
+            key.channelCount = frameDecode->channelCount;
+            memcpy(key.channels, frameDecode->channels, sizeof(key.channels));
+            frameDecode->sharedPixels = FindCachedPixels(&key);
+            if (!frameDecode->sharedPixels)
+            {
+                result = DecodeSharedPixels(frameDecode, &frameDecode->sharedPixels);
+                if (SUCCEEDED(result))
+                {
+                    AddCachedPixels(&key, frameDecode->sharedPixels);
+                }
+            }
+        }
+        else
+        {
+            frameDecode->notCacheable = true;
+        }
+    }
+
+    if (frameDecode->sharedPixels && !frameDecode->statistics)
+    {
+        *pixels = frameDecode->sharedPixels;
+        *bitsPerPixel = frameDecode->bitsPerPixel;
+        AddRefSharedPixels(*pixels);
+        result = S_OK;
+    }
+    ReleaseSRWLockExclusive(&frameDecode->lock);
+    return result;
+}
+
+// Returns the half float pixel format that can be decoded directly from the samples, or NULL when there is none.
+static const GUID *GetHalfPixelFormat(_In_ const NetpbmBitmapFrameDecode *frameDecode)
+{
+    return frameDecode->channelCount == 0 && !frameDecode->singlePass ? GetPnmHalfPixelFormat(&frameDecode->header)
+                                                                      : NULL;
+}
+
+// Every row is read, converted to float and then to half float while it is in the CPU cache.
+static HRESULT CopyHalfPixels(_Inout_ NetpbmBitmapFrameDecode *frameDecode, _In_ const WICRect *rect,
+                              const UINT stride, _Out_ BYTE *buffer)
+{
+    const PnmHeader *header = &frameDecode->header;
+    const UINT fileRowSize = GetPnmRowSize(header);
+    const UINT filePixelSize = header->samplesPerPixel * (GetPnmBitsPerSample(header) / 8);
+    const UINT sourceRowSize = (UINT)rect->Width * filePixelSize;
+    const size_t floatOffset = ((size_t)sourceRowSize + 15) & ~(size_t)15;
+    const size_t sampleCount = (size_t)rect->Width * (header->samplesPerPixel == 1 ? 1 : 4);
+    BYTE *scratch = AcquireScratchBuffer(floatOffset + sampleCount * sizeof(float));
+    if (!scratch)
+        return E_OUTOFMEMORY;
+
+    float *floatSamples = (float *)(scratch + floatOffset);
+    const bool bottomUp = IsFloatPnmFormat(header->format);
+    HRESULT result = S_OK;
+    for (UINT row = 0; row < (UINT)rect->Height; ++row)
+    {
+        const UINT fileRow = bottomUp ? header->height - 1 - ((UINT)rect->Y + row) : (UINT)rect->Y + row;
+        result = ReadAt(frameDecode,
+                        header->dataOffset + (ULONGLONG)fileRow * fileRowSize + (ULONGLONG)rect->X * filePixelSize,
+                        scratch, sourceRowSize);
+        if (FAILED(result))
+            break;
+
+        ConvertPnmSamplesToFloat(header, scratch, floatSamples, (UINT)rect->Width);
+        ConvertFloatToHalf(floatSamples, (USHORT *)(buffer + (size_t)row * stride), sampleCount);
+    }
+
+    ReleaseScratchBuffer(scratch);
+    return result;
+}
+
+typedef enum PixelOutput
+{
+    PixelOutputFrame,     // The pixel format of the frame.
+    PixelOutputHalfFloat, // The pixel format of GetHalfPixelFormat.
+    PixelOutputIndexed    // The pixel format of GetIndexedPixelFormat.
+} PixelOutput;
+
+// Returns S_FALSE when the rectangle is empty and there is nothing to copy.
+static HRESULT CheckCopyBuffer(_In_ const WICRect *rect, const UINT bitsPerPixel, const UINT stride,
+                               const UINT bufferSize)
+{
+    const UINT rowSize = (UINT)(((ULONGLONG)rect->Width * bitsPerPixel + 7) / 8);
+    if (stride < rowSize)
+        return E_INVALIDARG;
+
+    if (rect->Width == 0 || rect->Height == 0)
+        return S_FALSE;
+
+    if (bufferSize < (ULONGLONG)stride * (rect->Height - 1) + rowSize)
+        return WINCODEC_ERR_INSUFFICIENTBUFFER;
+
+    return S_OK;
+}
+
+static HRESULT CopyPixelsWithFormat(_Inout_ NetpbmBitmapFrameDecode *frameDecode, _In_opt_ const WICRect *prc,
+                                    const PixelOutput output, const UINT stride, const UINT bufferSize,
+                                    _Out_writes_bytes_(bufferSize) BYTE *buffer)
+{
+    if (!buffer)
+        return E_INVALIDARG;
+
+    const PnmHeader *header = &frameDecode->header;
+    WICRect rect = {0, 0, (INT)header->width, (INT)header->height};
+    if (prc)
+    {
+        if (prc->X < 0 || prc->Y < 0 || prc->Width < 0 || prc->Height < 0 ||
+            (UINT)prc->X + (UINT)prc->Width > header->width || (UINT)prc->Y + (UINT)prc->Height > header->height)
+            return E_INVALIDARG;
+
+        rect = *prc;
+    }
+
+    // The pixel format changes with the channel selection: the buffer is checked against the pixel format of the
+    // pixels that are copied, while the lock that keeps it is held.
+    HRESULT result;
+    if (output == PixelOutputFrame && !frameDecode->singlePass && rect.Width != 0 && rect.Height != 0 &&
+        GetFrameCacheBudget() != 0)
+    {
+        // The shared pixels are immutable, they are copied without holding the lock.
+        SharedPixels *pixels;
+        UINT bitsPerPixel;
+        result = GetSharedPixels(frameDecode, &pixels, &bitsPerPixel);
+        if (FAILED(result))
+            return result;
+
+        if (result == S_OK)
+        {
+            result = CheckCopyBuffer(&rect, bitsPerPixel, stride, bufferSize);
+            if (result == S_OK)
+            {
+                CopyImageRectangle(frameDecode, bitsPerPixel, pixels->pixels, &rect, stride, buffer);
+            }
+
+            ReleaseSharedPixels(pixels);
+            return FAILED(result) ? result : S_OK;
+        }
+    }
+
+    // Copies only read the state of the frame and hold the lock shared, concurrent copies only wait for each other's
+    // reads of the stream. Accumulating the statistics and decoding the complete image modify the frame.
+    const bool decoded =
+        output != PixelOutputHalfFloat && (IsPlainPnmFormat(header->format) || frameDecode->singlePass);
+    AcquireSRWLockShared(&frameDecode->lock);
+    const bool exclusive = frameDecode->statistics || (decoded && !frameDecode->decodedPixels);
+    if (exclusive)
+    {
+        ReleaseSRWLockShared(&frameDecode->lock);
+        AcquireSRWLockExclusive(&frameDecode->lock);
+    }
+
+    const UINT bitsPerPixel =
+        output == PixelOutputHalfFloat ? (header->samplesPerPixel == 1 ? 16 : 64) : frameDecode->bitsPerPixel;
+    result = CheckCopyBuffer(&rect, bitsPerPixel, stride, bufferSize);
+    if (result == S_OK)
+    {
+        if (output == PixelOutputHalfFloat)
+        {
+            result = CopyHalfPixels(frameDecode, &rect, stride, buffer);
+        }
+        else
+        {
+            // The decoded pixels are converted, the gray palette of these frames maps them to themselves.
+            result = decoded ? CopyDecodedPixels(frameDecode, &rect, stride, buffer)
+                             : CopyBinaryPixels(frameDecode, &rect, output == PixelOutputIndexed, stride, buffer);
+        }
+    }
+
+    if (exclusive)
+    {
+        ReleaseSRWLockExclusive(&frameDecode->lock);
+    }
+    else
+    {
+        ReleaseSRWLockShared(&frameDecode->lock);
+    }
+    return FAILED(result) ? result : S_OK;
+}
+
+static HRESULT __stdcall CopyPixels(_In_ IWICBitmapFrameDecode *this, const WICRect *prc, const UINT cbStride,
+                                    const UINT cbBufferSize, BYTE *pbBuffer)
+{
+    TRACE("netpbm_bitmap_frame_decode-c::CopyPixels\n");
+
+    return CopyPixelsWithFormat((NetpbmBitmapFrameDecode *)this, prc, PixelOutputFrame, cbStride, cbBufferSize,
+                                pbBuffer);
+}
+
+// Returns true when all rows have been accumulated.
+static bool GetCompleteStatistics(_In_ const NetpbmBitmapFrameDecode *frameDecode, _Out_ NetpbmStatistics *statistics)
+{
+    if (!frameDecode->statistics || frameDecode->statisticsRow != frameDecode->header.height)
+        return false;
+
+    GetAccumulatedStatistics(frameDecode->statistics, statistics);
+    return true;
+}
+
+// The comments of the header are the metadata of the container, the reader of the frame is only available for the
+// statistics that are computed by CopyPixels.
+// It is a snapshot: the items are present when the statistics were complete at the time of the call.
+static HRESULT __stdcall GetMetadataQueryReader(_In_ IWICBitmapFrameDecode *this,
+                                                IWICMetadataQueryReader **ppIMetadataQueryReader)
+{
+    TRACE("netpbm_bitmap_frame_decode-c::GetMetadataQueryReader\n");
+
+    if (!ppIMetadataQueryReader)
+        return E_POINTER;
+
+    *ppIMetadataQueryReader = NULL;
+    NetpbmBitmapFrameDecode *frameDecode = (NetpbmBitmapFrameDecode *)this;
+    AcquireSRWLockShared(&frameDecode->lock);
+    const bool enabled = frameDecode->statistics != NULL;
+    ReleaseSRWLockShared(&frameDecode->lock);
+    if (!enabled)
+        return WINCODEC_ERR_UNSUPPORTEDOPERATION;
+
+    // Enabled statistics stay enabled, the snapshot is taken after the allocation.
+    NetpbmStatistics *statistics = AllocateMemory(sizeof(NetpbmStatistics));
+    if (!statistics)
+        return E_OUTOFMEMORY;
+
+    AcquireSRWLockShared(&frameDecode->lock);
+    const bool complete = GetCompleteStatistics(frameDecode, statistics);
+    ReleaseSRWLockShared(&frameDecode->lock);
+
+    MetadataItem items[4];
+    UINT itemCount = 0;
+    HRESULT result = S_OK;
+    if (complete)
+    {
+        items[0].name = L"/statistics/minimum";
+        items[1].name = L"/statistics/maximum";
+        items[2].name = L"/statistics/mean";
+        items[3].name = L"/statistics/histogram";
+        VERIFY(SUCCEEDED(InitPropVariantFromUInt32(statistics->minimum, &items[0].value)));
+        VERIFY(SUCCEEDED(InitPropVariantFromUInt32(statistics->maximum, &items[1].value)));
+        VERIFY(SUCCEEDED(InitPropVariantFromDouble(statistics->mean, &items[2].value)));
+        result = InitPropVariantFromUInt64Vector(statistics->histogram, statistics->binCount, &items[3].value);
+        itemCount = SUCCEEDED(result) ? 4 : 3;
+    }
+
+    FreeMemory(statistics);
+    if (FAILED(result))
+    {
+        for (UINT i = 0; i < itemCount; ++i)
+        {
+            VERIFY(SUCCEEDED(PropVariantClear(&items[i].value)));
+        }
+
+        return result;
+    }
+
+    return CreateMetadataQueryReader(items, itemCount, ppIMetadataQueryReader);
+}
+
+static HRESULT __stdcall GetColorContexts([[maybe_unused]] IWICBitmapFrameDecode *this, [[maybe_unused]] UINT cCount,
+                                          [[maybe_unused]] IWICColorContext **ppIColorContexts, UINT *pcActualCount)
+{
+    TRACE("netpbm_bitmap_frame_decode-c::GetColorContexts (always 0)\n");
+
+    if (!pcActualCount)
+        return E_POINTER;
+
+    // The Netpbm format doesn't support storing color contexts (ICC profiles) in the file format.
+    *pcActualCount = 0;
+    return S_OK;
+}
+
+static HRESULT __stdcall GetThumbnail(_In_ IWICBitmapFrameDecode *this, IWICBitmapSource **ppIThumbnail)
+{
+    TRACE("netpbm_bitmap_frame_decode-c::GetThumbnail\n");
+
+    if (!ppIThumbnail)
+        return E_POINTER;
+
+    return CreateFrameSubsampledBitmapSource(this, ThumbnailMaxSize, ppIThumbnail);
+}
+
+static void SelectPixelFormat(_Inout_ NetpbmBitmapFrameDecode *frameDecode)
+{
+    if (frameDecode->channelCount == 0)
+    {
+        SelectPnmPixelFormat(&frameDecode->header, &frameDecode->pixelFormat, &frameDecode->bitsPerPixel);
+        return;
+    }
+
+    const bool samples16 = GetPnmBitsPerSample(&frameDecode->header) == 16;
+    const bool gray = frameDecode->channelCount == 1;
+    frameDecode->pixelFormat = gray ? samples16 ? &GUID_WICPixelFormat16bppGray : &GUID_WICPixelFormat8bppGray
+                                    : samples16 ? &GUID_WICPixelFormat48bppRGB : &GUID_WICPixelFormat24bppRGB;
+    frameDecode->bitsPerPixel = frameDecode->channelCount * (samples16 ? 16 : 8);
+}
+
+static NetpbmBitmapFrameDecode *FromChannelSelection(_In_ INetpbmChannelSelection *channelSelection)
+{
+    return (NetpbmBitmapFrameDecode *)((BYTE *)channelSelection - offsetof(NetpbmBitmapFrameDecode, channelSelection));
+}
+
+static HRESULT STDMETHODCALLTYPE ChannelSelection_QueryInterface(_In_ INetpbmChannelSelection *this, _In_ REFIID riid,
+                                                                 _COM_Outptr_ void **ppv)
+{
+    return QueryInterface(&FromChannelSelection(this)->wicBitmapFrameDecode, riid, ppv);
+}
+
+static ULONG STDMETHODCALLTYPE ChannelSelection_AddRef(_In_ INetpbmChannelSelection *this)
+{
+    return AddRef(&FromChannelSelection(this)->wicBitmapFrameDecode);
+}
+
+static ULONG STDMETHODCALLTYPE ChannelSelection_Release(_In_ INetpbmChannelSelection *this)
+{
+    return Release(&FromChannelSelection(this)->wicBitmapFrameDecode);
+}
+
+static HRESULT STDMETHODCALLTYPE ChannelSelection_GetChannelCount(_In_ INetpbmChannelSelection *this,
+                                                                  UINT *channelCount)
+{
+    if (!channelCount)
+        return E_POINTER;
+
+    *channelCount = FromChannelSelection(this)->header.samplesPerPixel;
+    return S_OK;
+}
+
+static HRESULT STDMETHODCALLTYPE ChannelSelection_SelectChannels(_In_ INetpbmChannelSelection *this,
+                                                                 const UINT channelCount, const UINT *channels)
+{
+    TRACE("netpbm_bitmap_frame_decode-c::SelectChannels\n");
+
+    if (!channels)
+        return E_POINTER;
+
+    NetpbmBitmapFrameDecode *frameDecode = FromChannelSelection(this);
+    const PnmHeader *header = &frameDecode->header;
+    if (IsPlainPnmFormat(header->format) || IsFloatPnmFormat(header->format) || header->format == PnmFormatBitmap ||
+        frameDecode->singlePass)
+        return WINCODEC_ERR_UNSUPPORTEDOPERATION;
+
+    if (channelCount != 1 && channelCount != ARRAYSIZE(frameDecode->channels))
+        return E_INVALIDARG;
+
+    for (UINT i = 0; i < channelCount; ++i)
+    {
+        if (channels[i] >= header->samplesPerPixel)
+            return E_INVALIDARG;
+    }
+
+    // The statistics are accumulated from the samples of all channels.
+    AcquireSRWLockExclusive(&frameDecode->lock);
+    if (frameDecode->statistics)
+    {
+        ReleaseSRWLockExclusive(&frameDecode->lock);
+        return WINCODEC_ERR_UNSUPPORTEDOPERATION;
+    }
+
+    memcpy(frameDecode->channels, channels, channelCount * sizeof(UINT));
+    frameDecode->channelCount = channelCount;
+    SelectPixelFormat(frameDecode);
+    if (frameDecode->sharedPixels)
+    {
+        ReleaseSharedPixels(frameDecode->sharedPixels);
+        frameDecode->sharedPixels = NULL;
+    }
+    ReleaseSRWLockExclusive(&frameDecode->lock);
+    return S_OK;
+}
+
+static NetpbmBitmapFrameDecode *FromBitmapSourceTransform(_In_ IWICBitmapSourceTransform *bitmapSourceTransform)
+{
+    return (NetpbmBitmapFrameDecode *)((BYTE *)bitmapSourceTransform -
+                                       offsetof(NetpbmBitmapFrameDecode, bitmapSourceTransform));
+}
+
+static HRESULT STDMETHODCALLTYPE BitmapSourceTransform_QueryInterface(_In_ IWICBitmapSourceTransform *this,
+                                                                      _In_ REFIID riid, _COM_Outptr_ void **ppv)
+{
+    return QueryInterface(&FromBitmapSourceTransform(this)->wicBitmapFrameDecode, riid, ppv);
+}
+
+static ULONG STDMETHODCALLTYPE BitmapSourceTransform_AddRef(_In_ IWICBitmapSourceTransform *this)
+{
+    return AddRef(&FromBitmapSourceTransform(this)->wicBitmapFrameDecode);
+}
+
+static ULONG STDMETHODCALLTYPE BitmapSourceTransform_Release(_In_ IWICBitmapSourceTransform *this)
+{
+    return Release(&FromBitmapSourceTransform(this)->wicBitmapFrameDecode);
+}
+
+// Scaling and rotation are not supported, the transform is only used to decode into another pixel format.
+static HRESULT STDMETHODCALLTYPE BitmapSourceTransform_CopyPixels(_In_ IWICBitmapSourceTransform *this,
+                                                                  const WICRect *prc, const UINT uiWidth,
+                                                                  const UINT uiHeight, WICPixelFormatGUID *pguidDstFormat,
+                                                                  const WICBitmapTransformOptions dstTransform,
+                                                                  const UINT nStride, const UINT cbBufferSize,
+                                                                  BYTE *pbBuffer)
+{
+    TRACE("netpbm_bitmap_frame_decode-c::BitmapSourceTransform_CopyPixels\n");
+
+    NetpbmBitmapFrameDecode *frameDecode = FromBitmapSourceTransform(this);
+    const UINT width = prc ? (UINT)prc->Width : frameDecode->header.width;
+    const UINT height = prc ? (UINT)prc->Height : frameDecode->header.height;
+    if (uiWidth != width || uiHeight != height || dstTransform != WICBitmapTransformRotate0)
+        return E_INVALIDARG;
+
+    // The size of the buffer is checked again by CopyPixelsWithFormat, the channel selection may change in between.
+    PixelOutput output = PixelOutputFrame;
+    AcquireSRWLockShared(&frameDecode->lock);
+    if (pguidDstFormat && !IsEqualGUID(pguidDstFormat, frameDecode->pixelFormat))
+    {
+        const GUID *halfPixelFormat = GetHalfPixelFormat(frameDecode);
+        const GUID *indexedPixelFormat = GetIndexedPixelFormat(frameDecode);
+        if (halfPixelFormat && IsEqualGUID(pguidDstFormat, halfPixelFormat))
+        {
+            output = PixelOutputHalfFloat;
+        }
+        else if (indexedPixelFormat && IsEqualGUID(pguidDstFormat, indexedPixelFormat))
+        {
+            output = PixelOutputIndexed;
+        }
+        else
+        {
+            ReleaseSRWLockShared(&frameDecode->lock);
+            return WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT;
+        }
+    }
+    ReleaseSRWLockShared(&frameDecode->lock);
+
+    return CopyPixelsWithFormat(frameDecode, prc, output, nStride, cbBufferSize, pbBuffer);
+}
+
+static HRESULT STDMETHODCALLTYPE BitmapSourceTransform_GetClosestSize(_In_ IWICBitmapSourceTransform *this,
+                                                                      UINT *puiWidth, UINT *puiHeight)
+{
+    if (!puiWidth || !puiHeight)
+        return E_POINTER;
+
+    const NetpbmBitmapFrameDecode *frameDecode = FromBitmapSourceTransform(this);
+    *puiWidth = frameDecode->header.width;
+    *puiHeight = frameDecode->header.height;
+    return S_OK;
+}
+
+// 16-bit and float sources can be decoded directly to half float, bitmaps and 8-bit graymaps to indexed pixels with the
+// gray palette of CopyPalette. Other formats are only offered as is.
+static HRESULT STDMETHODCALLTYPE BitmapSourceTransform_GetClosestPixelFormat(_In_ IWICBitmapSourceTransform *this,
+                                                                             WICPixelFormatGUID *pguidDstFormat)
+{
+    TRACE("netpbm_bitmap_frame_decode-c::GetClosestPixelFormat\n");
+
+    if (!pguidDstFormat)
+        return E_POINTER;
+
+    const NetpbmBitmapFrameDecode *frameDecode = FromBitmapSourceTransform(this);
+    const GUID *halfPixelFormat = GetHalfPixelFormat(frameDecode);
+    if (halfPixelFormat && IsEqualGUID(pguidDstFormat, halfPixelFormat))
+        return S_OK;
+
+    const GUID *indexedPixelFormat = GetIndexedPixelFormat(frameDecode);
+    if (indexedPixelFormat && IsEqualGUID(pguidDstFormat, indexedPixelFormat))
+        return S_OK;
+
+    memcpy(pguidDstFormat, frameDecode->pixelFormat, sizeof(GUID));
+    return S_OK;
+}
+
+static HRESULT STDMETHODCALLTYPE BitmapSourceTransform_DoesSupportTransform(
+    [[maybe_unused]] IWICBitmapSourceTransform *this, const WICBitmapTransformOptions dstTransform, BOOL *pfIsSupported)
+{
+    if (!pfIsSupported)
+        return E_POINTER;
+
+    *pfIsSupported = dstTransform == WICBitmapTransformRotate0;
+    return S_OK;
+}
+
+static NetpbmBitmapFrameDecode *FromPlanarOutput(_In_ INetpbmPlanarOutput *planarOutput)
+{
+    return (NetpbmBitmapFrameDecode *)((BYTE *)planarOutput - offsetof(NetpbmBitmapFrameDecode, planarOutput));
+}
+
+static HRESULT STDMETHODCALLTYPE PlanarOutput_QueryInterface(_In_ INetpbmPlanarOutput *this, _In_ REFIID riid,
+                                                             _COM_Outptr_ void **ppv)
+{
+    return QueryInterface(&FromPlanarOutput(this)->wicBitmapFrameDecode, riid, ppv);
+}
+
+static ULONG STDMETHODCALLTYPE PlanarOutput_AddRef(_In_ INetpbmPlanarOutput *this)
+{
+    return AddRef(&FromPlanarOutput(this)->wicBitmapFrameDecode);
+}
+
+static ULONG STDMETHODCALLTYPE PlanarOutput_Release(_In_ INetpbmPlanarOutput *this)
+{
+    return Release(&FromPlanarOutput(this)->wicBitmapFrameDecode);
+}
+
+// Writes the samples of a row of pixels to the rows of the planes.
+static void DeinterleaveRow(_In_ const NetpbmBitmapFrameDecode *frameDecode, _In_ const BYTE *source,
+                            _In_reads_(planeCount) BYTE *const *planeRows, const UINT planeCount, const bool floatPlanes,
+                            const UINT pixelCount)
+{
+    const PnmHeader *header = &frameDecode->header;
+    const UINT bitsPerSample = GetPnmBitsPerSample(header);
+    if (bitsPerSample == 8 && planeCount == 3)
+    {
+        if (floatPlanes)
+        {
+            DeinterleaveRgb8ToFloat(source, (float *)planeRows[0], (float *)planeRows[1], (float *)planeRows[2],
+                                    pixelCount, (float)header->maxValue);
+            return;
+        }
+
+        DeinterleaveRgb8(source, planeRows[0], planeRows[1], planeRows[2], pixelCount);
+        if (header->maxValue != UCHAR_MAX)
+        {
+            for (UINT plane = 0; plane < planeCount; ++plane)
+            {
+                ScaleSamples8(planeRows[plane], pixelCount, frameDecode->scaleTable);
+            }
+        }
+
+        return;
+    }
+
+    const float maxValue = (float)header->maxValue;
+    for (UINT plane = 0; plane < planeCount; ++plane)
+    {
+        BYTE *destination = planeRows[plane];
+        for (UINT x = 0; x < pixelCount; ++x)
+        {
+            const size_t index = (size_t)x * planeCount + plane;
+            if (bitsPerSample == 32)
+            {
+                UINT bits;
+                memcpy(&bits, source + index * 4, sizeof(bits));
+                bits = header->littleEndian ? bits : _byteswap_ulong(bits);
+                memcpy(destination + (size_t)x * 4, &bits, sizeof(bits));
+                continue;
+            }
+
+            const UINT value = bitsPerSample == 8 ? source[index] : (UINT)source[index * 2] << 8 | source[index * 2 + 1];
+            if (floatPlanes)
+            {
+                ((float *)destination)[x] = (float)value / maxValue;
+            }
+            else if (bitsPerSample == 8)
+            {
+                destination[x] = frameDecode->scaleTable[value];
+            }
+            else
+            {
+                ((USHORT *)destination)[x] = (USHORT)value;
+            }
+        }
+
+        if (bitsPerSample == 16 && !floatPlanes && header->maxValue != USHRT_MAX)
+        {
+            ScaleSamples16((USHORT *)destination, pixelCount, header->maxValue);
+        }
+    }
+}
+
+static HRESULT STDMETHODCALLTYPE PlanarOutput_CopyPlanes(_In_ INetpbmPlanarOutput *this, const WICRect *prc,
+                                                         const WICBitmapPlane *planes, const UINT planeCount)
+{
+    TRACE("netpbm_bitmap_frame_decode-c::CopyPlanes\n");
+
+    if (!planes)
+        return E_INVALIDARG;
+
+    NetpbmBitmapFrameDecode *frameDecode = FromPlanarOutput(this);
+    const PnmHeader *header = &frameDecode->header;
+    if (IsPlainPnmFormat(header->format) || header->format == PnmFormatBitmap || frameDecode->singlePass)
+        return WINCODEC_ERR_UNSUPPORTEDOPERATION;
+
+    if (planeCount != header->samplesPerPixel)
+        return E_INVALIDARG;
+
+    WICRect rect = {0, 0, (INT)header->width, (INT)header->height};
+    if (prc)
+    {
+        if (prc->X < 0 || prc->Y < 0 || prc->Width < 0 || prc->Height < 0 ||
+            (UINT)prc->X + (UINT)prc->Width > header->width || (UINT)prc->Y + (UINT)prc->Height > header->height)
+            return E_INVALIDARG;
+
+        rect = *prc;
+    }
+
+    const UINT bitsPerSample = GetPnmBitsPerSample(header);
+    const bool floatPlanes = IsEqualGUID(&planes[0].Format, &GUID_WICPixelFormat32bppGrayFloat);
+    const GUID *sampleFormat = bitsPerSample == 8 ? &GUID_WICPixelFormat8bppGray : &GUID_WICPixelFormat16bppGray;
+    if (!floatPlanes && (bitsPerSample == 32 || !IsEqualGUID(&planes[0].Format, sampleFormat)))
+        return WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT;
+
+    const UINT rowSize = (UINT)rect.Width * (floatPlanes ? 4 : bitsPerSample / 8);
+    for (UINT i = 0; i < planeCount; ++i)
+    {
+        if (!IsEqualGUID(&planes[i].Format, &planes[0].Format))
+            return WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT;
+
+        if (!planes[i].pbBuffer || planes[i].cbStride < rowSize)
+            return E_INVALIDARG;
+
+        if (rect.Height != 0 && planes[i].cbBufferSize < (ULONGLONG)planes[i].cbStride * (rect.Height - 1) + rowSize)
+            return WINCODEC_ERR_INSUFFICIENTBUFFER;
+    }
+
+    if (rect.Width == 0 || rect.Height == 0)
+        return S_OK;
+
+    const UINT filePixelSize = header->samplesPerPixel * (bitsPerSample / 8);
+    const UINT sourceRowSize = (UINT)rect.Width * filePixelSize;
+    const size_t planeRowsOffset = (sourceRowSize + sizeof(BYTE *) - 1) & ~(sizeof(BYTE *) - 1);
+    BYTE *scratch = AcquireScratchBuffer(planeRowsOffset + planeCount * sizeof(BYTE *));
+    if (!scratch)
+        return E_OUTOFMEMORY;
+
+    BYTE **planeRows = (BYTE **)(scratch + planeRowsOffset);
+    const bool bottomUp = IsFloatPnmFormat(header->format);
+    HRESULT result = S_OK;
+
+    for (UINT row = 0; row < (UINT)rect.Height; ++row)
+    {
+        const UINT fileRow = bottomUp ? header->height - 1 - ((UINT)rect.Y + row) : (UINT)rect.Y + row;
+        result = ReadAt(frameDecode,
+                        header->dataOffset + (ULONGLONG)fileRow * GetPnmRowSize(header) + (ULONGLONG)rect.X * filePixelSize,
+                        scratch, sourceRowSize);
+        if (FAILED(result))
+            break;
+
+        for (UINT i = 0; i < planeCount; ++i)
+        {
+            planeRows[i] = planes[i].pbBuffer + (size_t)row * planes[i].cbStride;
+        }
+
+        DeinterleaveRow(frameDecode, scratch, planeRows, planeCount, floatPlanes, (UINT)rect.Width);
+    }
+
+    ReleaseScratchBuffer(scratch);
+    return result;
+}
+
+static NetpbmBitmapFrameDecode *FromStatistics(_In_ INetpbmStatistics *statistics)
+{
+    return (NetpbmBitmapFrameDecode *)((BYTE *)statistics - offsetof(NetpbmBitmapFrameDecode, statisticsInterface));
+}
+
+static HRESULT STDMETHODCALLTYPE Statistics_QueryInterface(_In_ INetpbmStatistics *this, _In_ REFIID riid,
+                                                           _COM_Outptr_ void **ppv)
+{
+    return QueryInterface(&FromStatistics(this)->wicBitmapFrameDecode, riid, ppv);
+}
+
+static ULONG STDMETHODCALLTYPE Statistics_AddRef(_In_ INetpbmStatistics *this)
+{
+    return AddRef(&FromStatistics(this)->wicBitmapFrameDecode);
+}
+
+static ULONG STDMETHODCALLTYPE Statistics_Release(_In_ INetpbmStatistics *this)
+{
+    return Release(&FromStatistics(this)->wicBitmapFrameDecode);
+}
+
+static HRESULT STDMETHODCALLTYPE Statistics_EnableStatistics(_In_ INetpbmStatistics *this, const UINT binCount)
+{
+    TRACE("netpbm_bitmap_frame_decode-c::EnableStatistics\n");
+
+    NetpbmBitmapFrameDecode *frameDecode = FromStatistics(this);
+    StatisticsAccumulator *statistics = AllocateMemory(sizeof(StatisticsAccumulator));
+    if (!statistics)
+        return E_OUTOFMEMORY;
+
+    const HRESULT result = InitializeStatisticsAccumulator(statistics, &frameDecode->header, binCount, NULL);
+    if (FAILED(result))
+    {
+        ReleaseStatisticsAccumulator(statistics);
+        FreeMemory(statistics);
+        return result;
+    }
+
+    // Enabling the statistics again restarts the accumulation. Selected channels are copied without accumulating.
+    AcquireSRWLockExclusive(&frameDecode->lock);
+    const bool channelsSelected = frameDecode->channelCount != 0;
+    StatisticsAccumulator *unused = channelsSelected ? statistics : frameDecode->statistics;
+    if (!channelsSelected)
+    {
+        frameDecode->statistics = statistics;
+        frameDecode->statisticsRow = 0;
+    }
+    ReleaseSRWLockExclusive(&frameDecode->lock);
+
+    if (unused)
+    {
+        ReleaseStatisticsAccumulator(unused);
+        FreeMemory(unused);
+    }
+
+    return channelsSelected ? WINCODEC_ERR_UNSUPPORTEDOPERATION : S_OK;
+}
+
+static HRESULT STDMETHODCALLTYPE Statistics_GetStatistics(_In_ INetpbmStatistics *this, NetpbmStatistics *statistics)
+{
+    if (!statistics)
+        return E_POINTER;
+
+    NetpbmBitmapFrameDecode *frameDecode = FromStatistics(this);
+    AcquireSRWLockShared(&frameDecode->lock);
+    const bool complete = GetCompleteStatistics(frameDecode, statistics);
+    ReleaseSRWLockShared(&frameDecode->lock);
+    return complete ? S_OK : WINCODEC_ERR_WRONGSTATE;
+}
+
+static_assert(sizeof(NetpbmBitmapFrameDecode) <= FrameDecodeArenaSize);
+
+_Use_decl_annotations_ HRESULT CreateNetpbmBitmapFrameDecode(IStream *stream, StreamReader *singlePassReader,
+                                                             const PnmHeader *header, const CommentRanges *comments,
+                                                             Arena *arena, IWICBitmapFrameDecode **frameDecode)
+{
+    *frameDecode = NULL;
+
+    NetpbmBitmapFrameDecode *netpbmBitmapFrameDecode = ArenaAllocate(arena, sizeof(NetpbmBitmapFrameDecode));
+    if (!netpbmBitmapFrameDecode)
+        return E_OUTOFMEMORY;
+
+    AddRefArena(arena);
+    netpbmBitmapFrameDecode->arena = arena;
+
+    netpbmBitmapFrameDecode->header = *header;
+
+    // Layouts without a matching WIC pixel format (multispectral PAM files) are decoded as the gray image of channel 0.
+    netpbmBitmapFrameDecode->channelCount = header->tupleType == PamTupleTypeUnknown ? 1 : 0;
+    netpbmBitmapFrameDecode->channels[0] = 0;
+    SelectPixelFormat(netpbmBitmapFrameDecode);
+
+    static const IWICBitmapFrameDecodeVtbl wicBitmapFrameDecodeVtbl = {
+        QueryInterface,  AddRef,        Release,     GetSize,
+        GetPixelFormat,  GetResolution, CopyPalette, CopyPixels,
+        GetMetadataQueryReader, GetColorContexts, GetThumbnail};
+
+    static const INetpbmChannelSelectionVtbl channelSelectionVtbl = {
+        ChannelSelection_QueryInterface, ChannelSelection_AddRef, ChannelSelection_Release,
+        ChannelSelection_GetChannelCount, ChannelSelection_SelectChannels};
+
+    static const INetpbmPlanarOutputVtbl planarOutputVtbl = {PlanarOutput_QueryInterface, PlanarOutput_AddRef,
+                                                             PlanarOutput_Release, PlanarOutput_CopyPlanes};
+
+    static const INetpbmStatisticsVtbl statisticsVtbl = {Statistics_QueryInterface, Statistics_AddRef,
+                                                         Statistics_Release, Statistics_EnableStatistics,
+                                                         Statistics_GetStatistics};
+
+    static const IWICBitmapSourceTransformVtbl bitmapSourceTransformVtbl = {
+        BitmapSourceTransform_QueryInterface,        BitmapSourceTransform_AddRef,
+        BitmapSourceTransform_Release,               BitmapSourceTransform_CopyPixels,
+        BitmapSourceTransform_GetClosestSize,        BitmapSourceTransform_GetClosestPixelFormat,
+        BitmapSourceTransform_DoesSupportTransform};
+
+    netpbmBitmapFrameDecode->wicBitmapFrameDecode.lpVtbl = &wicBitmapFrameDecodeVtbl;
+    netpbmBitmapFrameDecode->bitmapSourceTransform.lpVtbl = &bitmapSourceTransformVtbl;
+    netpbmBitmapFrameDecode->channelSelection.lpVtbl = &channelSelectionVtbl;
+    netpbmBitmapFrameDecode->planarOutput.lpVtbl = &planarOutputVtbl;
+    netpbmBitmapFrameDecode->statisticsInterface.lpVtbl = &statisticsVtbl;
+    netpbmBitmapFrameDecode->refCount = 1;
+    netpbmBitmapFrameDecode->decodedPixels = NULL;
+    netpbmBitmapFrameDecode->sharedPixels = NULL;
+    netpbmBitmapFrameDecode->notCacheable = false;
+    netpbmBitmapFrameDecode->singlePass = singlePassReader != NULL;
+    netpbmBitmapFrameDecode->singlePassReader = singlePassReader;
+    netpbmBitmapFrameDecode->statistics = NULL;
+    netpbmBitmapFrameDecode->statisticsRow = 0;
+    if (comments)
+    {
+        netpbmBitmapFrameDecode->comments = *comments;
+    }
+    else
+    {
+        netpbmBitmapFrameDecode->comments.count = 0;
+        netpbmBitmapFrameDecode->comments.textSize = 0;
+    }
+    InitializeSRWLock(&netpbmBitmapFrameDecode->lock);
+    InitializeSRWLock(&netpbmBitmapFrameDecode->streamLock);
+    if (GetPnmBitsPerSample(header) == 8)
+    {
+        InitializeScaleTable8(netpbmBitmapFrameDecode->scaleTable, header->maxValue);
+    }
+
+    stream->lpVtbl->AddRef(stream);
+    netpbmBitmapFrameDecode->stream = stream;
+
+    ModuleAddRef();
+    *frameDecode = &netpbmBitmapFrameDecode->wicBitmapFrameDecode;
+    return S_OK;
+}
+
+_Use_decl_annotations_ HRESULT CreateFrameSubsampledBitmapSource(IWICBitmapFrameDecode *frameDecode, const UINT maxSize,
+                                                                 IWICBitmapSource **bitmapSource)
+{
+    NetpbmBitmapFrameDecode *netpbmBitmapFrameDecode = (NetpbmBitmapFrameDecode *)frameDecode;
+    if (netpbmBitmapFrameDecode->singlePass)
+    {
+        *bitmapSource = NULL;
+        return WINCODEC_ERR_UNSUPPORTEDOPERATION;
+    }
+
+    AcquireSRWLockExclusive(&netpbmBitmapFrameDecode->streamLock);
+    const HRESULT result = CreateSubsampledBitmapSource(netpbmBitmapFrameDecode->stream,
+                                                        &netpbmBitmapFrameDecode->header, maxSize, bitmapSource);
+    ReleaseSRWLockExclusive(&netpbmBitmapFrameDecode->streamLock);
+    return result;
+}
+
+static HRESULT ReadComment(_In_ IUnknown *source, const UINT index, _Out_ PROPVARIANT *value)
+{
+    PropVariantInit(value);
+    NetpbmBitmapFrameDecode *frameDecode = (NetpbmBitmapFrameDecode *)source;
+    const CommentRange *range = &frameDecode->comments.ranges[index];
+    char *text = CoTaskMemAlloc((size_t)range->size + 1);
+    if (!text)
+        return E_OUTOFMEMORY;
+
+    const HRESULT result = range->size != 0 ? ReadAt(frameDecode, range->position, text, range->size) : S_OK;
+    if (FAILED(result))
+    {
+        CoTaskMemFree(text);
+        return result;
+    }
+
+    text[range->size] = '\0';
+    value->vt = VT_LPSTR;
+    value->pszVal = text;
+    return S_OK;
+}
+
+_Use_decl_annotations_ HRESULT CreateFrameCommentMetadataQueryReader(IWICBitmapFrameDecode *frameDecode,
+                                                                     IWICMetadataQueryReader **queryReader)
+{
+    NetpbmBitmapFrameDecode *netpbmBitmapFrameDecode = (NetpbmBitmapFrameDecode *)frameDecode;
+    if (netpbmBitmapFrameDecode->singlePass)
+    {
+        *queryReader = NULL;
+        return WINCODEC_ERR_UNSUPPORTEDOPERATION;
+    }
+
+    static const WCHAR *const names[MaxCommentCount] = {
+        L"/comments/0",  L"/comments/1",  L"/comments/2",  L"/comments/3",  L"/comments/4",  L"/comments/5",
+        L"/comments/6",  L"/comments/7",  L"/comments/8",  L"/comments/9",  L"/comments/10", L"/comments/11",
+        L"/comments/12", L"/comments/13", L"/comments/14", L"/comments/15"};
+
+    return CreateLazyMetadataQueryReader(names, netpbmBitmapFrameDecode->comments.count, (IUnknown *)frameDecode,
+                                         ReadComment, queryReader);
+}
@@ -0,0 +1,35 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "arena.h"
+#include "pnm_header.h"
+
+// Minimum size of the first arena chunk of the decoder, which holds the frame.
+enum
+{
+    FrameDecodeArenaSize = 1024
+};
+
+// Creates the frame that decodes the samples of the stream, the frame keeps a reference to the stream.
+// The frame implements INetpbmChannelSelection to decode a subset of the channels of a PAM file.
+// singlePassReader is the reader that has read the header of a non-seekable stream: the image is then decoded once in
+// file order, without channel selection, half float and planar output.
+// comments are the ranges of the comments of the header (NULL when they were not recorded).
+// The frame is allocated from the arena of the decoder (as is the reader) and keeps a reference to the arena.
+HRESULT CreateNetpbmBitmapFrameDecode(_In_ IStream *stream, _In_opt_ StreamReader *singlePassReader,
+                                      _In_ const PnmHeader *header, _In_opt_ const CommentRanges *comments,
+                                      _Inout_ Arena *arena, _COM_Outptr_ IWICBitmapFrameDecode **frameDecode);
+
+// Creates a subsampled copy of the frame (used for thumbnails and previews).
+// Access to the shared stream is serialized with the other calls of the frame.
+// Returns WINCODEC_ERR_UNSUPPORTEDOPERATION for non-seekable streams.
+HRESULT CreateFrameSubsampledBitmapSource(_In_ IWICBitmapFrameDecode *frameDecode, UINT maxSize,
+                                          _COM_Outptr_ IWICBitmapSource **bitmapSource);
+
+// Creates the metadata query reader with the comments of the header as the items /comments/0, /comments/1, ...
+// (VT_LPSTR values). The text of a comment is read from the stream on its first query.
+// Returns WINCODEC_ERR_UNSUPPORTEDOPERATION for non-seekable streams.
+HRESULT CreateFrameCommentMetadataQueryReader(_In_ IWICBitmapFrameDecode *frameDecode,
+                                              _COM_Outptr_ IWICMetadataQueryReader **queryReader);
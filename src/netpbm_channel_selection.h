@@ -0,0 +1,31 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Unknwnbase.h>
+
+// Private interface of the frame decoder (IID_INetpbmChannelSelection) to decode a subset of the channels of a
+// PAM file, for example 3 bands of a multispectral image.
+// A PAM file with an unknown tuple type and a DEPTH larger than 4 is decoded by default as the gray image of channel 0.
+typedef struct INetpbmChannelSelection INetpbmChannelSelection;
+
+typedef struct INetpbmChannelSelectionVtbl
+{
+    HRESULT(STDMETHODCALLTYPE *QueryInterface)(INetpbmChannelSelection *this, REFIID riid, void **ppv);
+    ULONG(STDMETHODCALLTYPE *AddRef)(INetpbmChannelSelection *this);
+    ULONG(STDMETHODCALLTYPE *Release)(INetpbmChannelSelection *this);
+
+    // Returns the number of channels (samples per pixel) of the image.
+    HRESULT(STDMETHODCALLTYPE *GetChannelCount)(INetpbmChannelSelection *this, UINT *channelCount);
+
+    // Selects 1 (8bppGray, 16bppGray) or 3 (24bppRGB, 48bppRGB) channels, which changes the pixel format of the frame.
+    // Only supported for binary graymap, pixmap and PAM files, and not after the statistics have been enabled.
+    HRESULT(STDMETHODCALLTYPE *SelectChannels)(INetpbmChannelSelection *this, UINT channelCount,
+                                               const UINT *channels);
+} INetpbmChannelSelectionVtbl;
+
+struct INetpbmChannelSelection
+{
+    CONST_VTBL INetpbmChannelSelectionVtbl *lpVtbl;
+};
@@ -0,0 +1,24 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Unknwnbase.h>
+#include <wincodec.h>
+
+#include "netpbm_row_decoder.h"
+
+typedef enum NetpbmHashAlgorithm
+{
+    NetpbmHashAlgorithmXxHash64 = 1, // XXH64 with seed 0.
+    NetpbmHashAlgorithmCrc32c = 2    // CRC-32C (Castagnoli) in the low 32 bits, uses SSE4.2 when available.
+} NetpbmHashAlgorithm;
+
+// Exported function that decodes like NetpbmDecodeRows and hashes the decoded pixels of every band before it is
+// passed to the sink (which may be NULL to only compute the hash). The hash covers the pixel format, the size and the
+// pixels in top-down order without row padding: it doesn't depend on the file variant (plain or binary, PNM or PAM)
+// or on the band height, equal images have equal hashes.
+// Returns WINCODEC_ERR_UNSUPPORTEDOPERATION for PFM files in non-seekable streams, their rows are bottom-up.
+HRESULT STDMETHODCALLTYPE NetpbmDecodeRowsWithHash(IStream *stream, const WICPixelFormatGUID *pixelFormat,
+                                                   NetpbmHashAlgorithm algorithm, UINT bandHeight, NetpbmRowSink sink,
+                                                   void *context, ULONGLONG *hash);
@@ -0,0 +1,17 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Unknwnbase.h>
+
+// Exported function that configures the process-wide cache of decoded pixels. The cache is disabled (budget 0) until
+// it is enabled with a budget: the maximum number of bytes of the cached pixels, the least recently used pixels are
+// removed to stay within the budget. Setting the budget to 0 disables the cache and removes all pixels.
+// When enabled, CopyPixels of a frame of a file (a stream with a name) decodes the complete frame once into a buffer
+// that is shared with the other frames that decode the same file to the same pixel format and channels.
+HRESULT STDMETHODCALLTYPE NetpbmSetFrameCacheBudget(ULONGLONG byteBudget);
+
+// Exported function that returns the number of frames that found their pixels in the cache (hits) and that decoded
+// them (misses).
+HRESULT STDMETHODCALLTYPE NetpbmGetFrameCacheCounters(ULONGLONG *hits, ULONGLONG *misses);
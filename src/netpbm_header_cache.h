@@ -0,0 +1,17 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Unknwnbase.h>
+
+// Number of headers that the process-wide header cache keeps, the least recently used header is replaced.
+enum
+{
+    NetpbmHeaderCacheCapacity = 16
+};
+
+// Exported function that returns the number of lookups in the process-wide header cache that found the header of the
+// file (hits) and that had to read the header from the stream (misses). Streams without a name (memory streams) are
+// not cached and not counted.
+HRESULT STDMETHODCALLTYPE NetpbmGetHeaderCacheCounters(ULONGLONG *hits, ULONGLONG *misses);
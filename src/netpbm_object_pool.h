@@ -0,0 +1,21 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Unknwnbase.h>
+
+// Default number of released decoders and property stores (each) that the process keeps for reuse.
+enum
+{
+    NetpbmDefaultObjectPoolCapacity = 64
+};
+
+// Exported function that sets the number of released objects of each class that are kept for reuse by the following
+// CreateInstance calls, in addition to the few objects that every thread keeps. Setting the capacity to 0 disables
+// the reuse and releases the objects of the process and of the calling thread only: the objects that other threads
+// keep are freed when these threads exit, or by NetpbmSetAllocator.
+// NetpbmSetAllocator also empties the caches of all threads by replacing their fiber local storage index, which the
+// other threads read without synchronization. No thread may create or release decoders or property stores during
+// that call, or an object could be freed while a thread still holds it.
+HRESULT STDMETHODCALLTYPE NetpbmSetObjectPoolCapacity(UINT capacity);
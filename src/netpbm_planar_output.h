@@ -0,0 +1,30 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Unknwnbase.h>
+#include <wincodec.h>
+
+// Private interface of the frame decoder (IID_INetpbmPlanarOutput) to decode the channels of an image into separate
+// planes, for example the R, G and B planes of a pixmap as normalized floats.
+typedef struct INetpbmPlanarOutput INetpbmPlanarOutput;
+
+typedef struct INetpbmPlanarOutputVtbl
+{
+    HRESULT(STDMETHODCALLTYPE *QueryInterface)(INetpbmPlanarOutput *this, REFIID riid, void **ppv);
+    ULONG(STDMETHODCALLTYPE *AddRef)(INetpbmPlanarOutput *this);
+    ULONG(STDMETHODCALLTYPE *Release)(INetpbmPlanarOutput *this);
+
+    // Writes channel i of the rectangle into planes[i], planeCount must match the number of channels of the image.
+    // All planes must have the same format: 8bppGray or 16bppGray (matching the sample size) for samples scaled as
+    // by CopyPixels, or 32bppGrayFloat for samples normalized to [0, 1] (PFM samples are copied as is).
+    // Only supported for binary graymap, pixmap, PAM and PFM files.
+    HRESULT(STDMETHODCALLTYPE *CopyPlanes)(INetpbmPlanarOutput *this, const WICRect *prc, const WICBitmapPlane *planes,
+                                           UINT planeCount);
+} INetpbmPlanarOutputVtbl;
+
+struct INetpbmPlanarOutput
+{
+    CONST_VTBL INetpbmPlanarOutputVtbl *lpVtbl;
+};
@@ -0,0 +1,29 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "netpbm_row_decoder.h"
+
+// Exported functions to decode a Netpbm image from data that arrives in chunks (for example from a network
+// connection), without a seekable stream and without buffering the complete file.
+// The decoder is a state machine: the header, comments and plain (ASCII) samples may be split at any position.
+typedef struct NetpbmPushDecoder NetpbmPushDecoder;
+
+// Completed rows are passed to the sink in bands of at most bandHeight rows (0 selects a band of about 256 KiB),
+// pixelFormat has the same meaning as for NetpbmDecodeRows.
+// PFM files store the rows bottom-up: their rows are passed one by one, in the order of the file.
+HRESULT STDMETHODCALLTYPE NetpbmCreatePushDecoder(const WICPixelFormatGUID *pixelFormat, UINT bandHeight,
+                                                  NetpbmRowSink sink, void *context, NetpbmPushDecoder **decoder);
+
+// Decodes the next chunk of the file. rowCount receives the number of rows that have been completed by this call, all
+// completed rows have been passed to the sink when the call returns. Data after the image is ignored.
+// After a failure, the decoder keeps returning the same error.
+HRESULT STDMETHODCALLTYPE NetpbmPushDecoderFeed(NetpbmPushDecoder *decoder, const BYTE *data, UINT size,
+                                                UINT *rowCount);
+
+// Signals the end of the data, which completes a plain sample at the end of the file.
+// Returns WINCODEC_ERR_BADIMAGE when the image is incomplete.
+HRESULT STDMETHODCALLTYPE NetpbmPushDecoderFinish(NetpbmPushDecoder *decoder, UINT *rowCount);
+
+void STDMETHODCALLTYPE NetpbmDestroyPushDecoder(NetpbmPushDecoder *decoder);
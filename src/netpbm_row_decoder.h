@@ -0,0 +1,30 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <wincodec.h>
+
+// Band of decoded rows that is passed to a NetpbmRowSink. The pixels are only valid during the call.
+typedef struct NetpbmRows
+{
+    UINT width; // Of the image.
+    UINT height;
+    WICPixelFormatGUID pixelFormat;
+    UINT firstRow; // Index of the first row of the band, bands are passed in top-down order.
+    UINT rowCount;
+    UINT stride;
+    const BYTE *pixels;
+} NetpbmRows;
+
+// A failure HRESULT stops the decoding, it is returned by NetpbmDecodeRows.
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmRowSink)(void *context, const NetpbmRows *rows);
+
+// Exported function that decodes the Netpbm image at the current position of the stream without a frame buffer:
+// the rows are decoded into a band of bandHeight rows (0 selects a band of about 256 KiB) and passed to the sink as
+// soon as the band is complete. pixelFormat is NULL (or GUID_WICPixelFormatDontCare) for the pixel format of
+// IWICBitmapFrameDecode::GetPixelFormat, or a half float format offered by IWICBitmapSourceTransform.
+// Non-seekable streams (pipes) are decoded in a single pass: the file is read once in order and the bottom-up rows of
+// PFM files are then passed one by one, in the order of the file.
+HRESULT STDMETHODCALLTYPE NetpbmDecodeRows(IStream *stream, const WICPixelFormatGUID *pixelFormat, UINT bandHeight,
+                                           NetpbmRowSink sink, void *context);
@@ -0,0 +1,63 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Unknwnbase.h>
+#include <wincodec.h>
+
+#include "netpbm_row_decoder.h"
+
+// Statistics of the samples of a graymap (binary P5 files and PAM files with 1 channel of 8 or 16 bits), computed
+// while the samples are converted. The values are the samples of the file, in the range [0, maxValue].
+typedef struct NetpbmStatistics
+{
+    UINT minimum;
+    UINT maximum;
+    double mean;
+    UINT maxValue;
+    UINT binCount;             // 256 or 4096.
+    ULONGLONG histogram[4096]; // Bin i counts the samples s for which s * binCount / (maxValue + 1) == i.
+} NetpbmStatistics;
+
+// Maps the samples in the window [center - width / 2, center + width / 2] linearly to [0, 255], samples outside the
+// window are clamped. Used for the automatic window/level of 16-bit medical and astronomical images.
+typedef struct NetpbmWindowLevel
+{
+    UINT center;
+    UINT width; // At least 1.
+} NetpbmWindowLevel;
+
+// Exported function that decodes like NetpbmDecodeRows (in the pixel format of IWICBitmapFrameDecode::GetPixelFormat)
+// and computes the statistics with binCount histogram bins in the same pass. With a windowLevel the rows are passed
+// as 8bppGray pixels. Returns WINCODEC_ERR_UNSUPPORTEDOPERATION for images that are not graymaps.
+HRESULT STDMETHODCALLTYPE NetpbmDecodeRowsWithStatistics(IStream *stream, UINT binCount,
+                                                         const NetpbmWindowLevel *windowLevel, UINT bandHeight,
+                                                         NetpbmRowSink sink, void *context,
+                                                         NetpbmStatistics *statistics);
+
+// Private interface of the frame decoder (IID_INetpbmStatistics) to compute the statistics while CopyPixels decodes
+// the image, which makes a second pass over the pixels unnecessary.
+typedef struct INetpbmStatistics INetpbmStatistics;
+
+typedef struct INetpbmStatisticsVtbl
+{
+    HRESULT(STDMETHODCALLTYPE *QueryInterface)(INetpbmStatistics *this, REFIID riid, void **ppv);
+    ULONG(STDMETHODCALLTYPE *AddRef)(INetpbmStatistics *this);
+    ULONG(STDMETHODCALLTYPE *Release)(INetpbmStatistics *this);
+
+    // Starts collecting the statistics (binCount is 256 or 4096). They are complete when all rows have been copied
+    // with full width rectangles in top-down order (a single CopyPixels call or a sequence of strips).
+    // The statistics are also available from the metadata query reader of the frame:
+    // /statistics/minimum, /statistics/maximum, /statistics/mean and /statistics/histogram.
+    // Returns WINCODEC_ERR_UNSUPPORTEDOPERATION when channels have been selected.
+    HRESULT(STDMETHODCALLTYPE *EnableStatistics)(INetpbmStatistics *this, UINT binCount);
+
+    // Returns WINCODEC_ERR_WRONGSTATE when the statistics are not enabled or not yet complete.
+    HRESULT(STDMETHODCALLTYPE *GetStatistics)(INetpbmStatistics *this, NetpbmStatistics *statistics);
+} INetpbmStatisticsVtbl;
+
+struct INetpbmStatistics
+{
+    CONST_VTBL INetpbmStatisticsVtbl *lpVtbl;
+};
@@ -0,0 +1,34 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Unknwnbase.h>
+#include <wincodec.h>
+
+// Exported function that checks a Netpbm file without decoding it: the header, samples above maxval and truncated
+// data are detected while the file is read once in order (non-seekable streams are supported), without a pixel
+// buffer. Returns S_OK for a valid file, or the decoder error: WINCODEC_ERR_UNKNOWNIMAGEFORMAT,
+// WINCODEC_ERR_BADHEADER, or WINCODEC_ERR_BADIMAGE for an invalid sample or truncated data.
+// badOffset receives the offset (relative to the stream position at the call) of the first invalid sample, the end of
+// the data of a truncated file or the position at which the header was rejected. It receives the size of the image
+// (header and samples) when the file is valid.
+HRESULT STDMETHODCALLTYPE NetpbmValidate(IStream *stream, ULONGLONG *badOffset);
+
+// Private interface of the decoder (IID_INetpbmValidation) that makes NetpbmValidate available to the users of the
+// COM class, the decoder doesn't need to be initialized.
+typedef struct INetpbmValidation INetpbmValidation;
+
+typedef struct INetpbmValidationVtbl
+{
+    HRESULT(STDMETHODCALLTYPE *QueryInterface)(INetpbmValidation *this, REFIID riid, void **ppv);
+    ULONG(STDMETHODCALLTYPE *AddRef)(INetpbmValidation *this);
+    ULONG(STDMETHODCALLTYPE *Release)(INetpbmValidation *this);
+
+    HRESULT(STDMETHODCALLTYPE *Validate)(INetpbmValidation *this, IStream *stream, ULONGLONG *badOffset);
+} INetpbmValidationVtbl;
+
+struct INetpbmValidation
+{
+    CONST_VTBL INetpbmValidationVtbl *lpVtbl;
+};
@@ -0,0 +1,207 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "object_pool.h"
+
+#include "allocator.h"
+#include "macros.h"
+#include "netpbm_object_pool.h"
+
+
+// A released object is first kept in the cache of its thread, which recycles it without atomic operations. When the
+// thread cache is full the object is pushed on the lock-free list of its pool (an SLIST, which is safe against ABA),
+// which is shared by all threads and bounded by g_capacity. The objects of a thread cache are moved to the lists when
+// the thread exits, by the callback of the fiber local storage.
+enum
+{
+    ThreadCacheCapacity = 4
+};
+
+typedef struct ObjectPool
+{
+    SLIST_HEADER freeList;
+    volatile LONG freeCount;
+} ObjectPool;
+
+typedef struct ThreadCache
+{
+    UINT counts[ObjectPoolCount];
+    void *objects[ObjectPoolCount][ThreadCacheCapacity];
+} ThreadCache;
+
+static ObjectPool g_pools[ObjectPoolCount];
+static INIT_ONCE g_initOnce = INIT_ONCE_STATIC_INIT;
+static DWORD g_threadCacheIndex = FLS_OUT_OF_INDEXES;
+static volatile LONG g_capacity = NetpbmDefaultObjectPoolCapacity;
+
+
+static void PushFreeObject(_Inout_ ObjectPool *pool, _In_ void *object)
+{
+    if (InterlockedIncrement(&pool->freeCount) > g_capacity)
+    {
+        InterlockedDecrement(&pool->freeCount);
+        FreeAlignedMemory(object);
+        return;
+    }
+
+    InterlockedPushEntrySList(&pool->freeList, object);
+}
+
+static void NTAPI ReleaseThreadCache(void *data)
+{
+    ThreadCache *cache = data;
+    if (!cache)
+        return;
+
+    for (size_t i = 0; i < ObjectPoolCount; ++i)
+    {
+        for (UINT j = 0; j < cache->counts[i]; ++j)
+        {
+            PushFreeObject(&g_pools[i], cache->objects[i][j]);
+        }
+    }
+
+    FreeMemory(cache);
+}
+
+static BOOL CALLBACK InitializeObjectPools([[maybe_unused]] INIT_ONCE *initOnce, [[maybe_unused]] void *parameter,
+                                           [[maybe_unused]] void **context)
+{
+    for (size_t i = 0; i < ObjectPoolCount; ++i)
+    {
+        InitializeSListHead(&g_pools[i].freeList);
+    }
+
+    // Without an index the objects are only kept in the lists.
+    g_threadCacheIndex = FlsAlloc(ReleaseThreadCache);
+    return TRUE;
+}
+
+static ThreadCache *GetThreadCache(const bool create)
+{
+    if (g_threadCacheIndex == FLS_OUT_OF_INDEXES)
+        return NULL;
+
+    ThreadCache *cache = FlsGetValue(g_threadCacheIndex);
+    if (!cache && create)
+    {
+        cache = AllocateZeroedMemory(1, sizeof(ThreadCache));
+        if (cache && !FlsSetValue(g_threadCacheIndex, cache))
+        {
+            FreeMemory(cache);
+            cache = NULL;
+        }
+    }
+
+    return cache;
+}
+
+// Frees the objects of the list beyond the capacity.
+static void TrimFreeList(_Inout_ ObjectPool *pool, const LONG capacity)
+{
+    while (pool->freeCount > capacity)
+    {
+        void *object = InterlockedPopEntrySList(&pool->freeList);
+        if (!object)
+            break;
+
+        InterlockedDecrement(&pool->freeCount);
+        FreeAlignedMemory(object);
+    }
+}
+
+_Use_decl_annotations_ void *AllocatePooledObject(const ObjectPoolId pool, const size_t size)
+{
+    InitOnceExecuteOnce(&g_initOnce, InitializeObjectPools, NULL, NULL);
+
+    ThreadCache *cache = GetThreadCache(false);
+    if (cache && cache->counts[pool] != 0)
+        return cache->objects[pool][--cache->counts[pool]];
+
+    void *object = InterlockedPopEntrySList(&g_pools[pool].freeList);
+    if (object)
+    {
+        InterlockedDecrement(&g_pools[pool].freeCount);
+        return object;
+    }
+
+    // The entries of an SLIST must be aligned to MEMORY_ALLOCATION_ALIGNMENT, which the allocator doesn't promise for
+    // unaligned allocations.
+    return AllocateAlignedMemory(size < sizeof(SLIST_ENTRY) ? sizeof(SLIST_ENTRY) : size, MEMORY_ALLOCATION_ALIGNMENT);
+}
+
+_Use_decl_annotations_ void FreePooledObject(const ObjectPoolId pool, void *object)
+{
+    if (g_capacity == 0)
+    {
+        FreeAlignedMemory(object);
+        return;
+    }
+
+    ThreadCache *cache = GetThreadCache(true);
+    if (cache && cache->counts[pool] < ThreadCacheCapacity)
+    {
+        cache->objects[pool][cache->counts[pool]++] = object;
+        return;
+    }
+
+    PushFreeObject(&g_pools[pool], object);
+}
+
+// Freeing the index calls ReleaseThreadCache for the caches of all threads, which moves their objects to the lists.
+static void FreeKeptObjects(const bool keepThreadCaches)
+{
+    if (g_threadCacheIndex != FLS_OUT_OF_INDEXES)
+    {
+        FlsFree(g_threadCacheIndex);
+        g_threadCacheIndex = keepThreadCaches ? FlsAlloc(ReleaseThreadCache) : FLS_OUT_OF_INDEXES;
+    }
+
+    for (size_t i = 0; i < ObjectPoolCount; ++i)
+    {
+        TrimFreeList(&g_pools[i], 0);
+    }
+}
+
+void EmptyObjectPools(void)
+{
+    InitOnceExecuteOnce(&g_initOnce, InitializeObjectPools, NULL, NULL);
+    FreeKeptObjects(true);
+}
+
+void ReleaseObjectPools(void)
+{
+    FreeKeptObjects(false);
+}
+
+HRESULT STDMETHODCALLTYPE NetpbmSetObjectPoolCapacity(const UINT capacity)
+{
+    TRACE("netpbm-wic-codec-c::NetpbmSetObjectPoolCapacity\n");
+
+    if (capacity > LONG_MAX)
+        return E_INVALIDARG;
+
+    InitOnceExecuteOnce(&g_initOnce, InitializeObjectPools, NULL, NULL);
+    InterlockedExchange(&g_capacity, (LONG)capacity);
+    for (size_t i = 0; i < ObjectPoolCount; ++i)
+    {
+        TrimFreeList(&g_pools[i], (LONG)capacity);
+    }
+
+    ThreadCache *cache = GetThreadCache(false);
+    if (capacity == 0 && cache)
+    {
+        for (size_t i = 0; i < ObjectPoolCount; ++i)
+        {
+            for (UINT j = 0; j < cache->counts[i]; ++j)
+            {
+                FreeAlignedMemory(cache->objects[i][j]);
+            }
+            cache->counts[i] = 0;
+        }
+    }
+
+    return S_OK;
+}
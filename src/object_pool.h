@@ -0,0 +1,26 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+typedef enum ObjectPoolId
+{
+    ObjectPoolBitmapDecoder,
+    ObjectPoolPropertyStore,
+    ObjectPoolCount
+} ObjectPoolId;
+
+// Returns the memory of a released object of the pool, or new memory of the size aligned to
+// MEMORY_ALLOCATION_ALIGNMENT. The size must be the same for all objects of a pool. Returns NULL when out of memory.
+void *AllocatePooledObject(ObjectPoolId pool, size_t size);
+
+// Keeps the memory of an object for reuse, or frees it when the pool is full.
+void FreePooledObject(ObjectPoolId pool, _In_ void *object);
+
+// Frees all kept objects, the objects of the thread caches of all threads included. The fiber local storage index of
+// the caches is freed and allocated again, which other threads read without a lock: it must not be called
+// concurrently with the other functions on any thread.
+void EmptyObjectPools(void);
+
+// Frees all kept objects, called when the DLL is unloaded.
+void ReleaseObjectPools(void);
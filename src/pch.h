@@ -3,8 +3,11 @@
 
 #pragma once
 
+#include <limits.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <Windows.h>
 #include <propsys.h>
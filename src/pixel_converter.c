@@ -0,0 +1,458 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "pixel_converter.h"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#include <immintrin.h>
+#define USE_SSE2
+#endif
+
+
+_Use_decl_annotations_ void InvertBits(BYTE *buffer, const size_t size)
+{
+    size_t i = 0;
+
+#ifdef USE_SSE2
+    const __m128i allBits = _mm_set1_epi8(-1);
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m128i value = _mm_loadu_si128((const __m128i *)(buffer + i));
+        _mm_storeu_si128((__m128i *)(buffer + i), _mm_xor_si128(value, allBits));
+    }
+#endif
+
+    for (; i < size; ++i)
+    {
+        buffer[i] = (BYTE)~buffer[i];
+    }
+}
+
+_Use_decl_annotations_ void ByteSwapSamples16(USHORT *samples, const size_t count)
+{
+    size_t i = 0;
+
+#ifdef USE_SSE2
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128i value = _mm_loadu_si128((const __m128i *)(samples + i));
+        _mm_storeu_si128((__m128i *)(samples + i), _mm_or_si128(_mm_slli_epi16(value, 8), _mm_srli_epi16(value, 8)));
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        samples[i] = _byteswap_ushort(samples[i]);
+    }
+}
+
+_Use_decl_annotations_ void InitializeScaleTable8(BYTE *table, const UINT maxValue)
+{
+    for (UINT i = 0; i < 256; ++i)
+    {
+        // Samples larger than maxValue are invalid, clamp them to white.
+        table[i] = i >= maxValue ? 255 : (BYTE)((i * 255 + maxValue / 2) / maxValue);
+    }
+}
+
+_Use_decl_annotations_ void ScaleSamples8(BYTE *samples, const size_t count, const BYTE *table)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        samples[i] = table[samples[i]];
+    }
+}
+
+_Use_decl_annotations_ void ScaleSamples16(USHORT *samples, const size_t count, const UINT maxValue)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        const UINT sample = samples[i];
+        samples[i] = sample >= maxValue ? USHRT_MAX : (USHORT)((sample * USHRT_MAX + maxValue / 2) / maxValue);
+    }
+}
+
+_Use_decl_annotations_ void ExpandGrayAlphaToRgba8(const BYTE *source, BYTE *destination, const size_t pixelCount)
+{
+    size_t i = 0;
+
+#ifdef USE_SSE2
+    // Every 16-bit lane holds a gray-alpha pair: duplicating the gray byte and interleaving it with the
+    // original pair gives gray, gray, gray, alpha. A block of 8 pixels is loaded before it is stored,
+    // which keeps the in-place expansion correct.
+    const __m128i grayMask = _mm_set1_epi16(0x00FF);
+    for (; i + 8 <= pixelCount; i += 8)
+    {
+        const __m128i grayAlpha = _mm_loadu_si128((const __m128i *)(source + i * 2));
+        const __m128i gray = _mm_and_si128(grayAlpha, grayMask);
+        const __m128i grayGray = _mm_or_si128(gray, _mm_slli_epi16(gray, 8));
+        _mm_storeu_si128((__m128i *)(destination + i * 4), _mm_unpacklo_epi16(grayGray, grayAlpha));
+        _mm_storeu_si128((__m128i *)(destination + i * 4 + 16), _mm_unpackhi_epi16(grayGray, grayAlpha));
+    }
+#endif
+
+    for (; i < pixelCount; ++i)
+    {
+        const BYTE gray = source[i * 2];
+        const BYTE alpha = source[i * 2 + 1];
+        destination[i * 4] = gray;
+        destination[i * 4 + 1] = gray;
+        destination[i * 4 + 2] = gray;
+        destination[i * 4 + 3] = alpha;
+    }
+}
+
+_Use_decl_annotations_ void ExpandBigEndianGrayAlphaToRgba16(const USHORT *source, USHORT *destination,
+                                                             const size_t pixelCount)
+{
+    size_t i = 0;
+
+#ifdef USE_SSE2
+    const __m128i grayMask = _mm_set1_epi32(0x0000FFFF);
+    for (; i + 4 <= pixelCount; i += 4)
+    {
+        __m128i grayAlpha = _mm_loadu_si128((const __m128i *)(source + i * 2));
+        grayAlpha = _mm_or_si128(_mm_slli_epi16(grayAlpha, 8), _mm_srli_epi16(grayAlpha, 8));
+        const __m128i gray = _mm_and_si128(grayAlpha, grayMask);
+        const __m128i grayGray = _mm_or_si128(gray, _mm_slli_epi32(gray, 16));
+        _mm_storeu_si128((__m128i *)(destination + i * 4), _mm_unpacklo_epi32(grayGray, grayAlpha));
+        _mm_storeu_si128((__m128i *)(destination + i * 4 + 8), _mm_unpackhi_epi32(grayGray, grayAlpha));
+    }
+#endif
+
+    for (; i < pixelCount; ++i)
+    {
+        const USHORT gray = _byteswap_ushort(source[i * 2]);
+        const USHORT alpha = _byteswap_ushort(source[i * 2 + 1]);
+        destination[i * 4] = gray;
+        destination[i * 4 + 1] = gray;
+        destination[i * 4 + 2] = gray;
+        destination[i * 4 + 3] = alpha;
+    }
+}
+
+_Use_decl_annotations_ void ShiftBitsLeft(const BYTE *source, const size_t sourceSize, const UINT shift,
+                                          BYTE *destination, const size_t destinationSize)
+{
+    if (shift == 0)
+    {
+        memcpy(destination, source, destinationSize);
+        return;
+    }
+
+    for (size_t i = 0; i < destinationSize; ++i)
+    {
+        const UINT next = i + 1 < sourceSize ? source[i + 1] : 0;
+        destination[i] = (BYTE)((source[i] << shift) | (next >> (8 - shift)));
+    }
+}
+
+_Use_decl_annotations_ void GatherChannels8(const BYTE *source, const size_t sourcePixelSize, const UINT *channels,
+                                            const UINT channelCount, BYTE *destination, const size_t pixelCount)
+{
+    // The common gray and RGB selections use fixed offsets, which allows the compiler to unroll the loop.
+    if (channelCount == 1)
+    {
+        const BYTE *sample = source + channels[0];
+        for (size_t i = 0; i < pixelCount; ++i, sample += sourcePixelSize)
+        {
+            destination[i] = *sample;
+        }
+
+        return;
+    }
+
+    if (channelCount == 3)
+    {
+        const UINT red = channels[0];
+        const UINT green = channels[1];
+        const UINT blue = channels[2];
+        for (size_t i = 0; i < pixelCount; ++i, source += sourcePixelSize)
+        {
+            destination[i * 3] = source[red];
+            destination[i * 3 + 1] = source[green];
+            destination[i * 3 + 2] = source[blue];
+        }
+
+        return;
+    }
+
+    for (size_t i = 0; i < pixelCount; ++i, source += sourcePixelSize)
+    {
+        for (UINT channel = 0; channel < channelCount; ++channel)
+        {
+            *destination++ = source[channels[channel]];
+        }
+    }
+}
+
+_Use_decl_annotations_ void GatherBigEndianChannels16(const BYTE *source, const size_t sourcePixelSize,
+                                                      const UINT *channels, const UINT channelCount,
+                                                      USHORT *destination, const size_t pixelCount)
+{
+    for (size_t i = 0; i < pixelCount; ++i, source += sourcePixelSize * 2)
+    {
+        for (UINT channel = 0; channel < channelCount; ++channel)
+        {
+            const BYTE *sample = source + channels[channel] * 2;
+            *destination++ = (USHORT)(sample[0] << 8 | sample[1]);
+        }
+    }
+}
+
+_Use_decl_annotations_ void ByteSwapSamples32(UINT *samples, const size_t count)
+{
+    size_t i = 0;
+
+#ifdef USE_SSE2
+    // SSE2 has no byte shuffle: swap the bytes of the 16-bit halves and then swap the halves.
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i value = _mm_loadu_si128((const __m128i *)(samples + i));
+        value = _mm_or_si128(_mm_slli_epi16(value, 8), _mm_srli_epi16(value, 8));
+        value = _mm_shufflelo_epi16(value, _MM_SHUFFLE(2, 3, 0, 1));
+        value = _mm_shufflehi_epi16(value, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i *)(samples + i), value);
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        samples[i] = _byteswap_ulong(samples[i]);
+    }
+}
+
+#ifdef USE_SSE2
+// F16C is not part of the x64 baseline: check the CPU and whether the OS saves the AVX (VEX) register state.
+static bool IsF16CSupported(void)
+{
+    static volatile LONG supported = -1;
+    if (supported < 0)
+    {
+        int info[4];
+        __cpuid(info, 1);
+        const bool osXSave = (info[2] & (1 << 27)) != 0;
+        const bool f16c = (info[2] & (1 << 29)) != 0;
+        supported = osXSave && f16c && (_xgetbv(0) & 6) == 6;
+    }
+
+    return supported != 0;
+}
+#endif
+
+_Use_decl_annotations_ USHORT FloatToHalf(const float value)
+{
+    UINT bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const UINT sign = (bits >> 16) & 0x8000;
+    const UINT exponent = (bits >> 23) & 0xFF;
+    UINT mantissa = bits & 0x7FFFFF;
+
+    // Inf and NaN, NaNs are made quiet and keep the upper bits of their payload (same as F16C).
+    if (exponent == 0xFF)
+        return (USHORT)(sign | 0x7C00 | (mantissa ? 0x200 | mantissa >> 13 : 0));
+
+    const int halfExponent = (int)exponent - 127 + 15;
+    if (halfExponent >= 31)
+        return (USHORT)(sign | 0x7C00);
+
+    UINT shift = 13;
+    UINT half;
+    if (halfExponent <= 0)
+    {
+        // Values smaller than half of the smallest denormal half round to zero.
+        if (halfExponent < -10)
+            return (USHORT)sign;
+
+        mantissa |= 0x800000;
+        shift = (UINT)(14 - halfExponent);
+        half = mantissa >> shift;
+    }
+    else
+    {
+        half = (UINT)halfExponent << 10 | mantissa >> 13;
+    }
+
+    // Round to nearest even, a carry into the exponent gives the correct result (including Inf).
+    const UINT remainder = mantissa & ((1U << shift) - 1);
+    const UINT halfway = 1U << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (half & 1)))
+    {
+        ++half;
+    }
+
+    return (USHORT)(sign | half);
+}
+
+_Use_decl_annotations_ void ConvertFloatToHalf(const float *source, USHORT *destination, const size_t count)
+{
+    size_t i = 0;
+
+#ifdef USE_SSE2
+    if (IsF16CSupported())
+    {
+        for (; i + 4 <= count; i += 4)
+        {
+            const __m128i half = _mm_cvtps_ph(_mm_loadu_ps(source + i), _MM_FROUND_TO_NEAREST_INT);
+            _mm_storel_epi64((__m128i *)(destination + i), half);
+        }
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        destination[i] = FloatToHalf(source[i]);
+    }
+}
+
+#ifdef USE_SSE2
+// De-interleaves 16 RGB pixels with the SSE2 unpack instructions (SSE2 has no byte shuffle).
+// Every round interleaves the low and high halves of the 3 registers, after 4 rounds the samples are sorted by channel.
+static void Deinterleave3x16(_In_reads_(48) const BYTE *source, _Out_ __m128i *red, _Out_ __m128i *green,
+                             _Out_ __m128i *blue)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *)source);
+    __m128i b = _mm_loadu_si128((const __m128i *)(source + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(source + 32));
+
+    for (int round = 0; round < 4; ++round)
+    {
+        const __m128i nextA = _mm_unpacklo_epi8(a, _mm_unpackhi_epi64(b, b));
+        const __m128i nextB = _mm_unpacklo_epi8(_mm_unpackhi_epi64(a, a), c);
+        const __m128i nextC = _mm_unpacklo_epi8(b, _mm_unpackhi_epi64(c, c));
+        a = nextA;
+        b = nextB;
+        c = nextC;
+    }
+
+    *red = a;
+    *green = b;
+    *blue = c;
+}
+
+static void StoreBytesAsFloat(const __m128i bytes, _Out_writes_(16) float *destination, const __m128 maxValue)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low = _mm_unpacklo_epi8(bytes, zero);
+    const __m128i high = _mm_unpackhi_epi8(bytes, zero);
+    _mm_storeu_ps(destination, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(low, zero)), maxValue));
+    _mm_storeu_ps(destination + 4, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(low, zero)), maxValue));
+    _mm_storeu_ps(destination + 8, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(high, zero)), maxValue));
+    _mm_storeu_ps(destination + 12, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(high, zero)), maxValue));
+}
+#endif
+
+_Use_decl_annotations_ void DeinterleaveRgb8(const BYTE *source, BYTE *red, BYTE *green, BYTE *blue,
+                                             const size_t pixelCount)
+{
+    size_t i = 0;
+
+#ifdef USE_SSE2
+    for (; i + 16 <= pixelCount; i += 16)
+    {
+        __m128i r;
+        __m128i g;
+        __m128i b;
+        Deinterleave3x16(source + i * 3, &r, &g, &b);
+        _mm_storeu_si128((__m128i *)(red + i), r);
+        _mm_storeu_si128((__m128i *)(green + i), g);
+        _mm_storeu_si128((__m128i *)(blue + i), b);
+    }
+#endif
+
+    for (; i < pixelCount; ++i)
+    {
+        red[i] = source[i * 3];
+        green[i] = source[i * 3 + 1];
+        blue[i] = source[i * 3 + 2];
+    }
+}
+
+_Use_decl_annotations_ void DeinterleaveRgb8ToFloat(const BYTE *source, float *red, float *green, float *blue,
+                                                    const size_t pixelCount, const float maxValue)
+{
+    size_t i = 0;
+
+#ifdef USE_SSE2
+    const __m128 divisor = _mm_set1_ps(maxValue);
+    for (; i + 16 <= pixelCount; i += 16)
+    {
+        __m128i r;
+        __m128i g;
+        __m128i b;
+        Deinterleave3x16(source + i * 3, &r, &g, &b);
+        StoreBytesAsFloat(r, red + i, divisor);
+        StoreBytesAsFloat(g, green + i, divisor);
+        StoreBytesAsFloat(b, blue + i, divisor);
+    }
+#endif
+
+    for (; i < pixelCount; ++i)
+    {
+        red[i] = (float)source[i * 3] / maxValue;
+        green[i] = (float)source[i * 3 + 1] / maxValue;
+        blue[i] = (float)source[i * 3 + 2] / maxValue;
+    }
+}
+
+_Use_decl_annotations_ size_t FindSampleAboveMax8(const BYTE *samples, const size_t count, const BYTE maxValue)
+{
+    size_t i = 0;
+
+#ifdef USE_SSE2
+    // The saturated difference with maxValue is only non-zero for samples above maxValue. Blocks of 64 samples are
+    // tested with a single branch, the scalar loop locates the sample in the failing block.
+    const __m128i max = _mm_set1_epi8((char)maxValue);
+    for (; i + 64 <= count; i += 64)
+    {
+        const __m128i *block = (const __m128i *)(samples + i);
+        const __m128i above = _mm_or_si128(
+            _mm_or_si128(_mm_subs_epu8(_mm_loadu_si128(block), max), _mm_subs_epu8(_mm_loadu_si128(block + 1), max)),
+            _mm_or_si128(_mm_subs_epu8(_mm_loadu_si128(block + 2), max), _mm_subs_epu8(_mm_loadu_si128(block + 3), max)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(above, _mm_setzero_si128())) != 0xFFFF)
+            break;
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        if (samples[i] > maxValue)
+            return i;
+    }
+
+    return count;
+}
+
+_Use_decl_annotations_ size_t FindBigEndianSampleAboveMax16(const BYTE *samples, const size_t count,
+                                                            const USHORT maxValue)
+{
+    size_t i = 0;
+
+#ifdef USE_SSE2
+    const __m128i max = _mm_set1_epi16((short)maxValue);
+    for (; i + 32 <= count; i += 32)
+    {
+        __m128i above = _mm_setzero_si128();
+        for (size_t j = 0; j < 4; ++j)
+        {
+            __m128i value = _mm_loadu_si128((const __m128i *)(samples + (i + j * 8) * 2));
+            value = _mm_or_si128(_mm_slli_epi16(value, 8), _mm_srli_epi16(value, 8));
+            above = _mm_or_si128(above, _mm_subs_epu16(value, max));
+        }
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(above, _mm_setzero_si128())) != 0xFFFF)
+            break;
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        if ((UINT)(samples[i * 2] << 8 | samples[i * 2 + 1]) > maxValue)
+            return i;
+    }
+
+    return count;
+}
@@ -0,0 +1,68 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+// Conversion functions that transform Netpbm samples in place into the layout of the WIC pixel formats.
+// The functions are used directly on the buffer that is passed to CopyPixels, which avoids intermediate copies.
+
+// Inverts all bits: Netpbm bitmaps use 1 for black, WIC BlackWhite uses 0 for black.
+void InvertBits(_Inout_updates_bytes_(size) BYTE *buffer, size_t size);
+
+// Converts big endian 16-bit samples (Netpbm) to little endian (WIC).
+void ByteSwapSamples16(_Inout_updates_(count) USHORT *samples, size_t count);
+
+// Creates the lookup table that maps samples in the range [0, maxValue] to [0, 255].
+void InitializeScaleTable8(_Out_writes_all_(256) BYTE *table, UINT maxValue);
+
+void ScaleSamples8(_Inout_updates_(count) BYTE *samples, size_t count, _In_reads_(256) const BYTE *table);
+
+// Maps samples in the range [0, maxValue] to [0, 65535].
+void ScaleSamples16(_Inout_updates_(count) USHORT *samples, size_t count, UINT maxValue);
+
+// Expands gray-alpha pixels to RGBA pixels.
+// The source may be located in the second half of the destination, which allows an in-place expansion.
+void ExpandGrayAlphaToRgba8(_In_reads_(pixelCount * 2) const BYTE *source,
+                            _Out_writes_(pixelCount * 4) BYTE *destination, size_t pixelCount);
+
+// Same as ExpandGrayAlphaToRgba8 for 16-bit samples, the big endian to little endian conversion is done in the same pass.
+void ExpandBigEndianGrayAlphaToRgba16(_In_reads_(pixelCount * 2) const USHORT *source,
+                                      _Out_writes_(pixelCount * 4) USHORT *destination, size_t pixelCount);
+
+// Copies destinationSize bytes of bits that start at bit offset shift (0 - 7) of the source.
+// Used for bitmap rectangles that don't start at a byte boundary.
+void ShiftBitsLeft(_In_reads_(sourceSize) const BYTE *source, size_t sourceSize, UINT shift,
+                   _Out_writes_(destinationSize) BYTE *destination, size_t destinationSize);
+
+// Copies the selected channels of interleaved pixels of sourcePixelSize samples to packed destination pixels.
+void GatherChannels8(_In_ const BYTE *source, size_t sourcePixelSize, _In_reads_(channelCount) const UINT *channels,
+                     UINT channelCount, _Out_writes_(pixelCount * channelCount) BYTE *destination, size_t pixelCount);
+
+// Same as GatherChannels8 for big endian 16-bit samples, the destination samples are little endian.
+void GatherBigEndianChannels16(_In_ const BYTE *source, size_t sourcePixelSize,
+                               _In_reads_(channelCount) const UINT *channels, UINT channelCount,
+                               _Out_writes_(pixelCount * channelCount) USHORT *destination, size_t pixelCount);
+
+// Converts big endian 32-bit samples (PFM files with a positive scale factor) to little endian.
+void ByteSwapSamples32(_Inout_updates_(count) UINT *samples, size_t count);
+
+// Converts a float to a IEEE 754 half float, rounded to nearest even.
+USHORT FloatToHalf(float value);
+
+// Converts floats to half floats, uses F16C when the CPU supports it (bit-exact with FloatToHalf).
+void ConvertFloatToHalf(_In_reads_(count) const float *source, _Out_writes_(count) USHORT *destination, size_t count);
+
+// Splits RGB pixels into separate R, G and B rows.
+void DeinterleaveRgb8(_In_reads_(pixelCount * 3) const BYTE *source, _Out_writes_(pixelCount) BYTE *red,
+                      _Out_writes_(pixelCount) BYTE *green, _Out_writes_(pixelCount) BYTE *blue, size_t pixelCount);
+
+// Splits RGB pixels into separate R, G and B rows of floats, the samples are divided by maxValue.
+void DeinterleaveRgb8ToFloat(_In_reads_(pixelCount * 3) const BYTE *source, _Out_writes_(pixelCount) float *red,
+                             _Out_writes_(pixelCount) float *green, _Out_writes_(pixelCount) float *blue,
+                             size_t pixelCount, float maxValue);
+
+// Returns the index of the first sample above maxValue, or count when all samples are valid.
+size_t FindSampleAboveMax8(_In_reads_(count) const BYTE *samples, size_t count, BYTE maxValue);
+
+// Same as FindSampleAboveMax8 for big endian 16-bit samples (count is the number of samples).
+size_t FindBigEndianSampleAboveMax16(_In_reads_bytes_(count * 2) const BYTE *samples, size_t count, USHORT maxValue);
@@ -5,6 +5,8 @@
 
 #include "pnm_header.h"
 
+#include "stream_reader.h"
+
 _Use_decl_annotations_ bool IsPnmFile(IStream *stream)
 {
     // Read the first two bytes to determine if the file is a PNM file.
@@ -17,6 +19,320 @@ _Use_decl_annotations_ bool IsPnmFile(IStream *stream)
     if (bytesRead != sizeof(buffer))
         return false;
 
-    return buffer[0] == 'P' && (buffer[1] == '1' || buffer[1] == '2' || buffer[1] == '3' || buffer[1] == '4' ||
-                                buffer[1] == '5' || buffer[1] == '6');
+    return buffer[0] == 'P' && ((buffer[1] >= '1' && buffer[1] <= '7') || buffer[1] == 'f' || buffer[1] == 'F');
+}
+
+static HRESULT ReadHeaderValue(_Inout_ StreamReader *reader, _Out_ UINT *value)
+{
+    const HRESULT result = StreamReaderReadUnsigned(reader, value);
+    if (FAILED(result))
+        return result;
+
+    return result == S_OK ? S_OK : WINCODEC_ERR_BADHEADER;
+}
+
+static HRESULT ReadPnmHeaderValues(_Inout_ StreamReader *reader, _Inout_ PnmHeader *header)
+{
+    const bool bitmap = header->format == PnmFormatPlainBitmap || header->format == PnmFormatBitmap;
+    const bool pixmap = header->format == PnmFormatPlainPixmap || header->format == PnmFormatPixmap;
+    header->tupleType = bitmap ? PamTupleTypeBlackAndWhite : pixmap ? PamTupleTypeRgb : PamTupleTypeGrayscale;
+    header->samplesPerPixel = pixmap ? 3 : 1;
+
+    HRESULT result = ReadHeaderValue(reader, &header->width);
+    if (FAILED(result))
+        return result;
+
+    result = ReadHeaderValue(reader, &header->height);
+    if (FAILED(result))
+        return result;
+
+    if (bitmap)
+    {
+        header->maxValue = 1;
+        return S_OK;
+    }
+
+    return ReadHeaderValue(reader, &header->maxValue);
+}
+
+static PamTupleType GetTupleType(_In_z_ const char *name)
+{
+    static const struct
+    {
+        const char *name;
+        PamTupleType tupleType;
+    } tupleTypes[] = {{"BLACKANDWHITE", PamTupleTypeBlackAndWhite},
+                      {"GRAYSCALE", PamTupleTypeGrayscale},
+                      {"RGB", PamTupleTypeRgb},
+                      {"BLACKANDWHITE_ALPHA", PamTupleTypeBlackAndWhiteAlpha},
+                      {"GRAYSCALE_ALPHA", PamTupleTypeGrayscaleAlpha},
+                      {"RGB_ALPHA", PamTupleTypeRgbAlpha}};
+
+    for (size_t i = 0; i < ARRAYSIZE(tupleTypes); ++i)
+    {
+        if (strcmp(name, tupleTypes[i].name) == 0)
+            return tupleTypes[i].tupleType;
+    }
+
+    return PamTupleTypeUnknown;
+}
+
+static UINT GetTupleTypeDepth(const PamTupleType tupleType)
+{
+    switch (tupleType)
+    {
+    case PamTupleTypeBlackAndWhite:
+    case PamTupleTypeGrayscale:
+        return 1;
+
+    case PamTupleTypeBlackAndWhiteAlpha:
+    case PamTupleTypeGrayscaleAlpha:
+        return 2;
+
+    case PamTupleTypeRgb:
+        return 3;
+
+    case PamTupleTypeRgbAlpha:
+        return 4;
+
+    default:
+        return 0;
+    }
+}
+
+// A PFM header has the same layout as a P5/P6 header, but it has a scale factor in place of the maximum value.
+static HRESULT ReadPfmHeaderValues(_Inout_ StreamReader *reader, _Inout_ PnmHeader *header)
+{
+    const bool pixmap = header->format == PnmFormatFloatPixmap;
+    header->tupleType = pixmap ? PamTupleTypeRgb : PamTupleTypeGrayscale;
+    header->samplesPerPixel = pixmap ? 3 : 1;
+
+    HRESULT result = ReadHeaderValue(reader, &header->width);
+    if (FAILED(result))
+        return result;
+
+    result = ReadHeaderValue(reader, &header->height);
+    if (FAILED(result))
+        return result;
+
+    char token[32];
+    result = StreamReaderReadToken(reader, token, sizeof(token));
+    if (FAILED(result))
+        return result;
+
+    if (result == S_FALSE)
+        return WINCODEC_ERR_BADHEADER;
+
+    char *end;
+    const float scale = strtof(token, &end);
+    if (*end != '\0' || scale == 0 || !isfinite(scale))
+        return WINCODEC_ERR_BADHEADER;
+
+    header->scale = fabsf(scale);
+    header->littleEndian = scale < 0;
+    return S_OK;
+}
+
+// A PAM header is a list of "KEYWORD value" lines, terminated by a ENDHDR line.
+static HRESULT ReadPamHeaderValues(_Inout_ StreamReader *reader, _Inout_ PnmHeader *header)
+{
+    for (;;)
+    {
+        char keyword[16];
+        HRESULT result = StreamReaderReadToken(reader, keyword, sizeof(keyword));
+        if (FAILED(result))
+            return result;
+
+        if (result == S_FALSE)
+            return WINCODEC_ERR_BADHEADER;
+
+        if (strcmp(keyword, "ENDHDR") == 0)
+            break;
+
+        if (strcmp(keyword, "WIDTH") == 0)
+        {
+            result = ReadHeaderValue(reader, &header->width);
+        }
+        else if (strcmp(keyword, "HEIGHT") == 0)
+        {
+            result = ReadHeaderValue(reader, &header->height);
+        }
+        else if (strcmp(keyword, "DEPTH") == 0)
+        {
+            result = ReadHeaderValue(reader, &header->samplesPerPixel);
+        }
+        else if (strcmp(keyword, "MAXVAL") == 0)
+        {
+            result = ReadHeaderValue(reader, &header->maxValue);
+        }
+        else if (strcmp(keyword, "TUPLTYPE") == 0)
+        {
+            char name[32];
+            result = StreamReaderReadToken(reader, name, sizeof(name));
+            if (result == S_OK)
+            {
+                header->tupleType = GetTupleType(name);
+            }
+        }
+        else
+        {
+            return WINCODEC_ERR_BADHEADER;
+        }
+
+        if (FAILED(result))
+            return result;
+
+        if (result == S_FALSE)
+            return WINCODEC_ERR_BADHEADER;
+    }
+
+    if (header->samplesPerPixel == 0)
+        return WINCODEC_ERR_BADHEADER;
+
+    // TUPLTYPE is optional: derive the layout of known depths from the number of samples.
+    if (header->tupleType == PamTupleTypeUnknown)
+    {
+        static const PamTupleType defaultTupleTypes[] = {PamTupleTypeGrayscale, PamTupleTypeGrayscaleAlpha,
+                                                         PamTupleTypeRgb, PamTupleTypeRgbAlpha};
+        if (header->samplesPerPixel <= ARRAYSIZE(defaultTupleTypes))
+        {
+            header->tupleType = defaultTupleTypes[header->samplesPerPixel - 1];
+        }
+
+        return S_OK;
+    }
+
+    if (GetTupleTypeDepth(header->tupleType) != header->samplesPerPixel)
+        return WINCODEC_ERR_BADHEADER;
+
+    if ((header->tupleType == PamTupleTypeBlackAndWhite || header->tupleType == PamTupleTypeBlackAndWhiteAlpha) &&
+        header->maxValue != 1)
+        return WINCODEC_ERR_BADHEADER;
+
+    return S_OK;
+}
+
+static HRESULT ReadPnmHeaderFromStream(_In_ IStream *stream, _Out_ PnmHeader *header,
+                                       _Inout_opt_ CommentRanges *comments)
+{
+    const LARGE_INTEGER move = {};
+    ULARGE_INTEGER startPosition;
+    const HRESULT result = stream->lpVtbl->Seek(stream, move, STREAM_SEEK_CUR, &startPosition);
+    if (FAILED(result))
+        return result;
+
+    StreamReader reader;
+    StreamReaderInitialize(&reader, stream, startPosition.QuadPart);
+    reader.comments = comments;
+    return ReadPnmHeaderFromReader(&reader, header);
+}
+
+_Use_decl_annotations_ HRESULT ReadPnmHeader(IStream *stream, PnmHeader *header)
+{
+    return ReadPnmHeaderFromStream(stream, header, NULL);
+}
+
+_Use_decl_annotations_ HRESULT ReadPnmHeaderAndComments(IStream *stream, PnmHeader *header, CommentRanges *comments)
+{
+    comments->count = 0;
+    comments->textSize = 0;
+    return ReadPnmHeaderFromStream(stream, header, comments);
+}
+
+_Use_decl_annotations_ HRESULT ReadPnmHeaderFromReader(StreamReader *reader, PnmHeader *header)
+{
+    memset(header, 0, sizeof(*header));
+
+    HRESULT result;
+    BYTE magic[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        result = StreamReaderReadByte(reader, &magic[i]);
+        if (FAILED(result))
+            return result;
+
+        if (result == S_FALSE)
+            return WINCODEC_ERR_UNKNOWNIMAGEFORMAT;
+    }
+
+    if (magic[0] != 'P')
+        return WINCODEC_ERR_UNKNOWNIMAGEFORMAT;
+
+    if (magic[1] == 'f' || magic[1] == 'F')
+    {
+        header->format = magic[1] == 'f' ? PnmFormatFloatGraymap : PnmFormatFloatPixmap;
+        result = ReadPfmHeaderValues(reader, header);
+    }
+    else
+    {
+        if (magic[1] < '1' || magic[1] > '7')
+            return WINCODEC_ERR_UNKNOWNIMAGEFORMAT;
+
+        header->format = (PnmFormat)(magic[1] - '0');
+        result = header->format == PnmFormatArbitraryMap ? ReadPamHeaderValues(reader, header)
+                                                         : ReadPnmHeaderValues(reader, header);
+    }
+
+    if (FAILED(result))
+        return result;
+
+    if (header->width == 0 || header->height == 0)
+        return WINCODEC_ERR_BADHEADER;
+
+    if (!IsFloatPnmFormat(header->format) && (header->maxValue == 0 || header->maxValue > USHRT_MAX))
+        return WINCODEC_ERR_BADHEADER;
+
+    // The last header value is followed by exactly 1 whitespace character.
+    BYTE separator;
+    result = StreamReaderReadByte(reader, &separator);
+    if (FAILED(result))
+        return result;
+
+    if (result == S_FALSE || !IsPnmWhitespace(separator))
+        return WINCODEC_ERR_BADHEADER;
+
+    // WIC passes strides and buffer sizes as UINT, rows that don't fit cannot be decoded.
+    // A gray-alpha row is expanded to RGBA, which doubles its size.
+    const UINT bitsPerSample = GetPnmBitsPerSample(header);
+    const ULONGLONG bytesPerSample = bitsPerSample < 8 ? 1 : bitsPerSample / 8;
+    const ULONGLONG rowSize = (ULONGLONG)header->width * header->samplesPerPixel * bytesPerSample;
+    if (rowSize * 2 > UINT_MAX)
+        return WINCODEC_ERR_IMAGESIZEOUTOFRANGE;
+
+    header->dataOffset = StreamReaderGetPosition(reader);
+    return S_OK;
+}
+
+bool IsPlainPnmFormat(const PnmFormat format)
+{
+    return format == PnmFormatPlainBitmap || format == PnmFormatPlainGraymap || format == PnmFormatPlainPixmap;
+}
+
+bool IsFloatPnmFormat(const PnmFormat format)
+{
+    return format == PnmFormatFloatGraymap || format == PnmFormatFloatPixmap;
+}
+
+bool IsColorTupleType(const PamTupleType tupleType)
+{
+    return tupleType == PamTupleTypeRgb || tupleType == PamTupleTypeRgbAlpha;
+}
+
+_Use_decl_annotations_ UINT GetPnmBitsPerSample(const PnmHeader *header)
+{
+    if (header->format == PnmFormatPlainBitmap || header->format == PnmFormatBitmap)
+        return 1;
+
+    if (IsFloatPnmFormat(header->format))
+        return 32;
+
+    return header->maxValue < 256 ? 8 : 16;
+}
+
+_Use_decl_annotations_ UINT GetPnmRowSize(const PnmHeader *header)
+{
+    if (header->format == PnmFormatBitmap)
+        return (header->width + 7) / 8;
+
+    return header->width * header->samplesPerPixel * (GetPnmBitsPerSample(header) / 8);
 }
@@ -3,4 +3,68 @@
 
 #pragma once
 
+#include "stream_reader.h"
+
+typedef enum PnmFormat
+{
+    PnmFormatPlainBitmap = 1,  // P1
+    PnmFormatPlainGraymap = 2, // P2
+    PnmFormatPlainPixmap = 3,  // P3
+    PnmFormatBitmap = 4,       // P4
+    PnmFormatGraymap = 5,      // P5
+    PnmFormatPixmap = 6,       // P6
+    PnmFormatArbitraryMap = 7, // P7 (PAM)
+    PnmFormatFloatGraymap = 8, // Pf (PFM)
+    PnmFormatFloatPixmap = 9   // PF (PFM)
+} PnmFormat;
+
+// The layout of the samples of a pixel. P1 to P6 files map to the first 3 tuple types.
+typedef enum PamTupleType
+{
+    PamTupleTypeUnknown,
+    PamTupleTypeBlackAndWhite,
+    PamTupleTypeGrayscale,
+    PamTupleTypeRgb,
+    PamTupleTypeBlackAndWhiteAlpha,
+    PamTupleTypeGrayscaleAlpha,
+    PamTupleTypeRgbAlpha
+} PamTupleType;
+
+typedef struct PnmHeader
+{
+    PnmFormat format;
+    PamTupleType tupleType;
+    UINT width;
+    UINT height;
+    UINT maxValue;        // 1 for bitmaps, 0 for float maps.
+    UINT samplesPerPixel; // 1 (bitmap, graymap), 3 (pixmap) or the DEPTH of a PAM file.
+    ULONGLONG dataOffset; // Stream position of the first sample.
+    float scale;          // Absolute value of the PFM scale factor, informational only.
+    bool littleEndian;    // PFM files with a negative scale factor store little endian samples.
+} PnmHeader;
+
 bool IsPnmFile(_In_ IStream *stream);
+
+// Reads the header from the current stream position.
+// The stream position is undefined after the call, use dataOffset to locate the samples.
+HRESULT ReadPnmHeader(_In_ IStream *stream, _Out_ PnmHeader *header);
+
+// Reads the header like ReadPnmHeader and records the byte ranges of its comments.
+HRESULT ReadPnmHeaderAndComments(_In_ IStream *stream, _Out_ PnmHeader *header, _Out_ CommentRanges *comments);
+
+// Reads the header with a reader, which is positioned at the first sample after the call. Used for non-seekable
+// streams: the samples the reader has buffered cannot be read again from the stream.
+HRESULT ReadPnmHeaderFromReader(_Inout_ StreamReader *reader, _Out_ PnmHeader *header);
+
+bool IsPlainPnmFormat(PnmFormat format);
+
+bool IsColorTupleType(PamTupleType tupleType);
+
+// PFM files store 32-bit float samples with the rows ordered from bottom to top.
+bool IsFloatPnmFormat(PnmFormat format);
+
+// Returns 1 for P1 and P4 bitmaps, 32 for float maps, 8 when maxValue < 256 and 16 otherwise.
+UINT GetPnmBitsPerSample(_In_ const PnmHeader *header);
+
+// Returns the size in bytes of a row of a binary (P4, P5, P6, P7, Pf, PF) file.
+UINT GetPnmRowSize(_In_ const PnmHeader *header);
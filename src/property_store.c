@@ -5,9 +5,16 @@
 
 #include "property_store.h"
 
+#include "allocator.h"
 #include "class_factory.h"
+#include "guids.h"
+#include "header_cache.h"
 #include "macros.h"
 #include "module.h"
+#include "object_pool.h"
+#include "pnm_header.h"
+#include "property_table.h"
+#include "stream_reader.h"
 
 
 inline HRESULT InitPropVariantFromInt32(_In_ LONG lVal, _Out_ PROPVARIANT *ppropvar)
@@ -23,12 +30,36 @@ typedef struct PropertyStore
     IInitializeWithStream initialize_with_stream;
     IPropertyStore property_store;
     IPropertyStoreCapabilities propertyStoreCapabilities;
-    volatile bool initialized;
     LONG refCount;
-    PROPVARIANT values[5]; // Sample data (could be dynamically allocated for flexibility)
-    PROPERTYKEY keys[5];   // Property keys
+    SRWLOCK lock;              // Exclusive for Initialize and the materialization of the values.
+    PnmHeader header;          // The values are materialized from the header on their first request.
+    PropertyTable *properties; // Created by Initialize.
 } PropertyStore;
 
+typedef enum PropertyId
+{
+    PropertyIdHorizontalSize,
+    PropertyIdVerticalSize,
+    PropertyIdBitDepth,
+    PropertyIdDimensions,
+    PropertyIdFormat,
+    PropertyIdMaxValue
+} PropertyId;
+
+static PropertyStore *FromInitializeWithStream(_In_ IInitializeWithStream *initializeWithStream)
+{
+    return (PropertyStore *)((char *)initializeWithStream - offsetof(PropertyStore, initialize_with_stream));
+}
+
+static PropertyStore *FromPropertyStore(_In_ IPropertyStore *propertyStore)
+{
+    return (PropertyStore *)((char *)propertyStore - offsetof(PropertyStore, property_store));
+}
+
+static PropertyStore *FromPropertyStoreCapabilities(_In_ IPropertyStoreCapabilities *propertyStoreCapabilities)
+{
+    return (PropertyStore *)((char *)propertyStoreCapabilities - offsetof(PropertyStore, propertyStoreCapabilities));
+}
 
 static ULONG STDMETHODCALLTYPE AddRef(_In_ PropertyStore *this)
 {
@@ -40,11 +71,8 @@ static ULONG STDMETHODCALLTYPE Release(_In_ PropertyStore *this)
     const ULONG refCount = InterlockedDecrement(&this->refCount);
     if (refCount == 0)
     {
-        for (int i = 0; i < 5; ++i)
-        {
-            VERIFY(SUCCEEDED(PropVariantClear(&this->values[i])));
-        }
-        free(this);
+        FreeMemory(this->properties);
+        FreePooledObject(ObjectPoolPropertyStore, this);
         ModuleRelease();
     }
 
@@ -53,127 +81,265 @@ static ULONG STDMETHODCALLTYPE Release(_In_ PropertyStore *this)
 
 static HRESULT STDMETHODCALLTYPE QueryInterface(_In_ PropertyStore *this, _In_ REFIID riid, _COM_Outptr_ void **ppv)
 {
-    static const QITAB qiTable[] = {QITABENT(PropertyStore, IInitializeWithStream),
-                                    QITABENT(PropertyStore, IPropertyStore),
-                                    QITABENT(PropertyStore, IPropertyStoreCapabilities),
-                                    {NULL, 0}};
+    static const QITAB qiTable[] = {
+        {&IID_IInitializeWithStream, (int)offsetof(PropertyStore, initialize_with_stream)},
+        {&IID_IPropertyStore, (int)offsetof(PropertyStore, property_store)},
+        {&IID_IPropertyStoreCapabilities, (int)offsetof(PropertyStore, propertyStoreCapabilities)},
+        {NULL, 0}};
 
     return QISearch(this, qiTable, riid, ppv);
 }
 
 static ULONG STDMETHODCALLTYPE IInitializeWithStream_AddRef(_In_ IInitializeWithStream *this)
 {
-    return AddRef((PropertyStore *)((char *)this - offsetof(PropertyStore, initialize_with_stream)));
+    return AddRef(FromInitializeWithStream(this));
 }
 
 static ULONG STDMETHODCALLTYPE IInitializeWithStream_Release(_In_ IInitializeWithStream *this)
 {
-    return Release((PropertyStore *)((char *)this - offsetof(PropertyStore, initialize_with_stream)));
+    return Release(FromInitializeWithStream(this));
 }
 
 static HRESULT STDMETHODCALLTYPE IInitializeWithStream_QueryInterface(_In_ IInitializeWithStream *this, _In_ REFIID riid,
-                                                               _COM_Outptr_ void **ppv)
+                                                                      _COM_Outptr_ void **ppv)
+{
+    return QueryInterface(FromInitializeWithStream(this), riid, ppv);
+}
+
+static void AddProperties(_Inout_ PropertyTableBuilder *builder, _In_ const PnmHeader *header)
 {
-    return QueryInterface((PropertyStore *)((char *)this - offsetof(PropertyStore, initialize_with_stream)), riid, ppv);
+    AddProperty(builder, &PKEY_Image_HorizontalSize, PropertyIdHorizontalSize, 0);
+    AddProperty(builder, &PKEY_Image_VerticalSize, PropertyIdVerticalSize, 0);
+    AddProperty(builder, &PKEY_Image_BitDepth, PropertyIdBitDepth, 0);
+    AddProperty(builder, &PKEY_Image_Dimensions, PropertyIdDimensions, ARRAYSIZE(L"4294967295 x 4294967295"));
+    AddProperty(builder, &PKEY_Netpbm_Format, PropertyIdFormat, ARRAYSIZE(L"P7"));
+
+    // PFM files have a scale factor instead of a maximum value.
+    if (!IsFloatPnmFormat(header->format))
+    {
+        AddProperty(builder, &PKEY_Netpbm_MaxValue, PropertyIdMaxValue, 0);
+    }
 }
 
-static HRESULT STDMETHODCALLTYPE IInitializeWithStream_Initialize([[maybe_unused]] _In_ IInitializeWithStream *this,
-                                                           [[maybe_unused]] _In_ IStream *pstream,
-                                                           [[maybe_unused]] _In_ DWORD grfMode)
+static HRESULT MaterializeValue(_In_ const void *context, const UINT id, _Out_writes_opt_(textCapacity) WCHAR *text,
+                                const UINT textCapacity, _Out_ PROPVARIANT *value)
 {
+    const PnmHeader *header = context;
+    PropVariantInit(value);
+    switch ((PropertyId)id)
+    {
+    case PropertyIdHorizontalSize:
+        return InitPropVariantFromUInt32(header->width, value);
+
+    case PropertyIdVerticalSize:
+        return InitPropVariantFromUInt32(header->height, value);
+
+    case PropertyIdBitDepth:
+        return InitPropVariantFromUInt32(header->samplesPerPixel * GetPnmBitsPerSample(header), value);
+
+    case PropertyIdMaxValue:
+        return InitPropVariantFromUInt32(header->maxValue, value);
+
+    case PropertyIdDimensions:
+        // Explorer displays the dimensions as "width x height".
+        swprintf_s(text, textCapacity, L"%u x %u", header->width, header->height);
+        break;
+
+    case PropertyIdFormat: {
+        static const WCHAR formatCharacters[] = L"?1234567fF"; // Indexed by PnmFormat.
+        text[0] = L'P';
+        text[1] = formatCharacters[header->format];
+        text[2] = L'\0';
+        break;
+    }
+    }
+
+    // The string is owned by the property table.
+    value->vt = VT_LPWSTR;
+    value->pwszVal = text;
     return S_OK;
 }
 
+// Reads the header, usually from the bytes of a single read, and adds it to the cache when the stream has a key.
+static HRESULT ReadHeader(_In_ IStream *stream, const ULONGLONG position, _Out_ PnmHeader *header,
+                          _In_opt_ const HeaderCacheKey *key)
+{
+    StreamReader reader;
+    StreamReaderInitialize(&reader, stream, position);
+    CommentRanges comments = {};
+    reader.comments = &comments;
+    HRESULT result = StreamReaderFillOnce(&reader);
+    if (SUCCEEDED(result))
+    {
+        result = ReadPnmHeaderFromReader(&reader, header);
+    }
+
+    if (SUCCEEDED(result) && key)
+    {
+        AddCachedHeader(key, header, &comments);
+    }
+
+    return result;
+}
+
+// Only the header is parsed, usually from the bytes of a single read. The stream is not kept, the values of the
+// properties are created from the header when they are requested.
+static HRESULT STDMETHODCALLTYPE IInitializeWithStream_Initialize(_In_ IInitializeWithStream *this,
+                                                                  _In_ IStream *pstream, _In_ const DWORD grfMode)
+{
+    TRACE("netpbm-wic-codec-c::PropertyStore::Initialize\n");
+
+    if (!pstream)
+        return E_INVALIDARG;
+
+    // The properties of Netpbm files are read-only.
+    if (grfMode & (STGM_WRITE | STGM_READWRITE))
+        return STG_E_ACCESSDENIED;
+
+    PropertyStore *propertyStore = FromInitializeWithStream(this);
+    AcquireSRWLockExclusive(&propertyStore->lock);
+    HRESULT result = S_OK;
+    if (propertyStore->properties)
+    {
+        result = HRESULT_FROM_WIN32(ERROR_ALREADY_INITIALIZED);
+    }
+
+    // The header is read from the current position of the stream, which is part of the key of the cache. The header
+    // of a file that was opened before (for example by the decoder) is taken from the cache. A stream without a
+    // position (a pipe) is not cached.
+    const LARGE_INTEGER move = {};
+    ULARGE_INTEGER position = {};
+    const bool positioned = SUCCEEDED(result) && SUCCEEDED(pstream->lpVtbl->Seek(pstream, move, STREAM_SEEK_CUR, &position));
+    PnmHeader *header = &propertyStore->header;
+    HeaderCacheKey key;
+    const bool cacheable = positioned && GetHeaderCacheKey(pstream, position.QuadPart, &key);
+    if (SUCCEEDED(result) && (!cacheable || !FindCachedHeader(&key, header, NULL)))
+    {
+        result = ReadHeader(pstream, position.QuadPart, header, cacheable ? &key : NULL);
+    }
+
+    if (SUCCEEDED(result))
+    {
+        PropertyTableBuilder builder;
+        InitializePropertyTableBuilder(&builder);
+        AddProperties(&builder, header);
+        result = CreatePropertyTable(&builder, &propertyStore->properties);
+    }
+
+    ReleaseSRWLockExclusive(&propertyStore->lock);
+    return result;
+}
+
 static ULONG STDMETHODCALLTYPE IPropertyStore_AddRef(_In_ IPropertyStore *this)
 {
-    return AddRef((PropertyStore *)((char *)this - offsetof(PropertyStore, property_store)));
+    return AddRef(FromPropertyStore(this));
 }
 
 static ULONG STDMETHODCALLTYPE IPropertyStore_Release(_In_ IPropertyStore *this)
 {
-    return Release((PropertyStore *)((char *)this - offsetof(PropertyStore, property_store)));
+    return Release(FromPropertyStore(this));
 }
 
 static HRESULT STDMETHODCALLTYPE IPropertyStore_QueryInterface(_In_ IPropertyStore *this, _In_ REFIID riid,
-                                                        _COM_Outptr_ void **ppvObject)
+                                                               _COM_Outptr_ void **ppvObject)
 {
-    return QueryInterface((PropertyStore *)((char *)this - offsetof(PropertyStore, initialize_with_stream)), riid,
-                          ppvObject);
+    return QueryInterface(FromPropertyStore(this), riid, ppvObject);
 }
 
-static HRESULT STDMETHODCALLTYPE IPropertyStore_GetCount([[maybe_unused]] IPropertyStore *this, DWORD *cProps)
+static HRESULT STDMETHODCALLTYPE IPropertyStore_GetCount(_In_ IPropertyStore *this, DWORD *cProps)
 {
     if (!cProps)
         return E_POINTER;
 
-    *cProps = 5; // We have 5 properties in this example
+    PropertyStore *propertyStore = FromPropertyStore(this);
+    AcquireSRWLockShared(&propertyStore->lock);
+    *cProps = propertyStore->properties ? propertyStore->properties->count : 0;
+    ReleaseSRWLockShared(&propertyStore->lock);
     return S_OK;
 }
 
-static HRESULT STDMETHODCALLTYPE IPropertyStore_GetAt(IPropertyStore *this, DWORD iProp, PROPERTYKEY *pkey)
+static HRESULT STDMETHODCALLTYPE IPropertyStore_GetAt(_In_ IPropertyStore *this, const DWORD iProp, PROPERTYKEY *pkey)
 {
-    PropertyStore *ps = (PropertyStore *)this;
-    if (iProp >= 5)
-        return E_INVALIDARG; // Invalid index
-    *pkey = ps->keys[iProp];
-    return S_OK;
-}
+    if (!pkey)
+        return E_POINTER;
 
+    PropertyStore *propertyStore = FromPropertyStore(this);
+    AcquireSRWLockShared(&propertyStore->lock);
+    const PropertyTable *properties = propertyStore->properties;
+    const bool valid = properties && iProp < properties->count;
+    if (valid)
+    {
+        *pkey = properties->entries[iProp].key;
+    }
+    ReleaseSRWLockShared(&propertyStore->lock);
 
-#define IsEqualPropertyKey2(a, b) (((a)->pid == (b)->pid) && IsEqualIID(&((a)->fmtid), &((b)->fmtid)))
+    return valid ? S_OK : E_INVALIDARG;
+}
 
 
-static HRESULT STDMETHODCALLTYPE IPropertyStore_GetValue(IPropertyStore *this, REFPROPERTYKEY key, PROPVARIANT *pv)
+// Properties that are not present are returned as VT_EMPTY.
+static HRESULT STDMETHODCALLTYPE IPropertyStore_GetValue(_In_ IPropertyStore *this, REFPROPERTYKEY key,
+                                                         PROPVARIANT *pv)
 {
-    PropertyStore *ps = (PropertyStore *)this;
-    for (int i = 0; i < 5; ++i)
+    if (!key || !pv)
+        return E_POINTER;
+
+    PropVariantInit(pv);
+    PropertyStore *propertyStore = FromPropertyStore(this);
+    AcquireSRWLockShared(&propertyStore->lock);
+    PropertyEntry *entry = propertyStore->properties ? FindPropertyTableEntry(propertyStore->properties, key) : NULL;
+    if (!entry || entry->value.vt != VT_EMPTY)
     {
-        if (IsEqualPropertyKey2(key, &ps->keys[i]))
-        {
-            // return PropVariantCopy(pv, &ps->values[i]);
-        }
+        const HRESULT result = entry ? PropVariantCopy(pv, &entry->value) : S_OK;
+        ReleaseSRWLockShared(&propertyStore->lock);
+        return result;
     }
+    ReleaseSRWLockShared(&propertyStore->lock);
 
-    PropVariantInit(pv);
-    return E_INVALIDARG; // Key not found
+    // The first request of a value materializes it, the properties are not replaced after Initialize.
+    AcquireSRWLockExclusive(&propertyStore->lock);
+    HRESULT result =
+        MaterializePropertyTableEntry(propertyStore->properties, entry, MaterializeValue, &propertyStore->header);
+    if (SUCCEEDED(result))
+    {
+        result = PropVariantCopy(pv, &entry->value);
+    }
+    ReleaseSRWLockExclusive(&propertyStore->lock);
+
+    return result;
 }
 
-static HRESULT STDMETHODCALLTYPE IPropertyStore_SetValue(IPropertyStore *this, REFPROPERTYKEY key, REFPROPVARIANT propvar)
+static HRESULT STDMETHODCALLTYPE IPropertyStore_SetValue([[maybe_unused]] IPropertyStore *this,
+                                                         [[maybe_unused]] REFPROPERTYKEY key,
+                                                         [[maybe_unused]] REFPROPVARIANT propvar)
 {
-    PropertyStore *ps = (PropertyStore *)this;
-    for (int i = 0; i < 5; ++i)
-    {
-        if (IsEqualPropertyKey2(key, &ps->keys[i]))
-        {
-            return PropVariantCopy(&ps->values[i], propvar);
-        }
-    }
-    return E_INVALIDARG; // Key not found
+    return STG_E_ACCESSDENIED;
 }
 
 static HRESULT STDMETHODCALLTYPE IPropertyStore_Commit([[maybe_unused]] IPropertyStore *this)
 {
-    return S_OK;
+    return STG_E_ACCESSDENIED;
 }
 
-static HRESULT STDMETHODCALLTYPE IPropertyStoreCapabilities_QueryInterface(IPropertyStoreCapabilities *this, REFIID riid,
-                                                                    void **ppv)
+static HRESULT STDMETHODCALLTYPE IPropertyStoreCapabilities_QueryInterface(IPropertyStoreCapabilities *this,
+                                                                           REFIID riid, void **ppv)
 {
-    return QueryInterface((PropertyStore *)((char *)this - offsetof(PropertyStore, propertyStoreCapabilities)), riid, ppv);
+    return QueryInterface(FromPropertyStoreCapabilities(this), riid, ppv);
 }
 
 static ULONG STDMETHODCALLTYPE IPropertyStoreCapabilities_AddRef(IPropertyStoreCapabilities *this)
 {
-    return AddRef((PropertyStore *)((char *)this - offsetof(PropertyStore, propertyStoreCapabilities)));
+    return AddRef(FromPropertyStoreCapabilities(this));
 }
 
 static ULONG STDMETHODCALLTYPE IPropertyStoreCapabilities_Release(IPropertyStoreCapabilities *this)
 {
-    return Release((PropertyStore *)((char *)this - offsetof(PropertyStore, propertyStoreCapabilities)));
+    return Release(FromPropertyStoreCapabilities(this));
 }
 
-static HRESULT STDMETHODCALLTYPE IPropertyStoreCapabilities_IsPropertyWritable([[maybe_unused]] IPropertyStoreCapabilities *this,
-                                                                        [[maybe_unused]] REFPROPERTYKEY key)
+static HRESULT STDMETHODCALLTYPE
+IPropertyStoreCapabilities_IsPropertyWritable([[maybe_unused]] IPropertyStoreCapabilities *this,
+                                              [[maybe_unused]] REFPROPERTYKEY key)
 {
     return S_FALSE;
 }
@@ -187,7 +353,7 @@ static HRESULT STDMETHODCALLTYPE IClassFactory_CreateInstance([[maybe_unused]] I
         return CLASS_E_NOAGGREGATION;
     }
 
-    PropertyStore *ps = malloc(sizeof(PropertyStore));
+    PropertyStore *ps = AllocatePooledObject(ObjectPoolPropertyStore, sizeof(PropertyStore));
     if (!ps)
     {
         *ppv = NULL;
@@ -211,8 +377,8 @@ static HRESULT STDMETHODCALLTYPE IClassFactory_CreateInstance([[maybe_unused]] I
     ps->property_store.lpVtbl = &propertyStoreVtbl;
     ps->propertyStoreCapabilities.lpVtbl = &propertyStoreCapabilitiesVtbl;
     ps->refCount = 0;
-    ps->initialized = false;
-    memset(ps->values, 0, sizeof(ps->values));
+    InitializeSRWLock(&ps->lock);
+    ps->properties = NULL;
 
     const HRESULT hr = QueryInterface(ps, vTableGuid, ppv);
     if (SUCCEEDED(hr))
@@ -221,7 +387,7 @@ static HRESULT STDMETHODCALLTYPE IClassFactory_CreateInstance([[maybe_unused]] I
     }
     else
     {
-        free(ps);
+        FreePooledObject(ObjectPoolPropertyStore, ps);
     }
 
     return hr;
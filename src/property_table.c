@@ -0,0 +1,137 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "property_table.h"
+
+#include "allocator.h"
+#include "macros.h"
+
+
+// The slots store the index of an entry plus 1, 0 marks an empty slot.
+typedef BYTE PropertySlot;
+
+static PropertySlot *GetSlots(_In_ const PropertyTable *table)
+{
+    return (PropertySlot *)(table->entries + table->count);
+}
+
+static UINT HashPropertyKey(_In_ const PROPERTYKEY *key)
+{
+    UINT words[4];
+    memcpy(words, &key->fmtid, sizeof(words));
+
+    UINT hash = key->pid;
+    for (UINT i = 0; i < ARRAYSIZE(words); ++i)
+    {
+        hash = (hash ^ words[i]) * 0x9E3779B1;
+    }
+
+    return hash ^ hash >> 16;
+}
+
+static int ComparePropertyKeys(_In_ const PROPERTYKEY *a, _In_ const PROPERTYKEY *b)
+{
+    const int result = memcmp(&a->fmtid, &b->fmtid, sizeof(GUID));
+    if (result != 0)
+        return result;
+
+    return a->pid < b->pid ? -1 : a->pid > b->pid ? 1 : 0;
+}
+
+static int CompareEntries(const void *a, const void *b)
+{
+    return ComparePropertyKeys(&((const PropertyEntry *)a)->key, &((const PropertyEntry *)b)->key);
+}
+
+_Use_decl_annotations_ void InitializePropertyTableBuilder(PropertyTableBuilder *builder)
+{
+    builder->count = 0;
+    builder->textSize = 0;
+}
+
+_Use_decl_annotations_ void AddProperty(PropertyTableBuilder *builder, const PROPERTYKEY *key, const UINT id,
+                                        const UINT textCapacity)
+{
+    ASSERT(builder->count < MaxPropertyTableCount);
+    PropertyEntry *entry = &builder->entries[builder->count++];
+    entry->key = *key;
+    entry->id = id;
+    entry->textOffset = builder->textSize;
+    entry->textCapacity = textCapacity;
+    PropVariantInit(&entry->value);
+    builder->textSize += textCapacity;
+}
+
+_Use_decl_annotations_ HRESULT CreatePropertyTable(const PropertyTableBuilder *builder, PropertyTable **table)
+{
+    // A load factor of at most 1/2 keeps the probe sequences short.
+    UINT slotCount = 4;
+    while (slotCount < builder->count * 2)
+    {
+        slotCount *= 2;
+    }
+
+    const size_t entriesSize = builder->count * sizeof(PropertyEntry);
+    const size_t textOffset = (sizeof(PropertyTable) + entriesSize + slotCount * sizeof(PropertySlot) + 1) & ~(size_t)1;
+    PropertyTable *newTable = AllocateMemory(textOffset + builder->textSize * sizeof(WCHAR));
+    if (!newTable)
+    {
+        *table = NULL;
+        return E_OUTOFMEMORY;
+    }
+
+    newTable->count = builder->count;
+    newTable->slotMask = slotCount - 1;
+    newTable->text = (WCHAR *)((BYTE *)newTable + textOffset);
+    memcpy(newTable->entries, builder->entries, entriesSize);
+    qsort(newTable->entries, newTable->count, sizeof(PropertyEntry), CompareEntries);
+
+    PropertySlot *slots = GetSlots(newTable);
+    memset(slots, 0, slotCount * sizeof(PropertySlot));
+    for (UINT i = 0; i < newTable->count; ++i)
+    {
+        const PropertyEntry *entry = &newTable->entries[i];
+        UINT slot = HashPropertyKey(&entry->key) & newTable->slotMask;
+        while (slots[slot] != 0)
+        {
+            ASSERT(ComparePropertyKeys(&newTable->entries[slots[slot] - 1].key, &entry->key) != 0);
+            slot = (slot + 1) & newTable->slotMask;
+        }
+
+        slots[slot] = (PropertySlot)(i + 1);
+    }
+
+    *table = newTable;
+    return S_OK;
+}
+
+_Use_decl_annotations_ PropertyEntry *FindPropertyTableEntry(PropertyTable *table, const PROPERTYKEY *key)
+{
+    const PropertySlot *slots = GetSlots(table);
+    for (UINT slot = HashPropertyKey(key) & table->slotMask; slots[slot] != 0; slot = (slot + 1) & table->slotMask)
+    {
+        PropertyEntry *entry = &table->entries[slots[slot] - 1];
+        if (entry->key.pid == key->pid && IsEqualGUID(&entry->key.fmtid, &key->fmtid))
+            return entry;
+    }
+
+    return NULL;
+}
+
+_Use_decl_annotations_ HRESULT MaterializePropertyTableEntry(PropertyTable *table, PropertyEntry *entry,
+                                                             const MaterializeProperty materialize, const void *context)
+{
+    if (entry->value.vt != VT_EMPTY)
+        return S_OK;
+
+    WCHAR *text = entry->textCapacity == 0 ? NULL : table->text + entry->textOffset;
+    const HRESULT result = materialize(context, entry->id, text, entry->textCapacity, &entry->value);
+    if (FAILED(result))
+    {
+        PropVariantInit(&entry->value);
+    }
+
+    return result;
+}
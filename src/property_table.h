@@ -0,0 +1,60 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Windows.h>
+#include <propsys.h>
+
+enum
+{
+    MaxPropertyTableCount = 64
+};
+
+typedef struct PropertyEntry
+{
+    PROPERTYKEY key;
+    UINT id;           // Identifies the value for the materialize callback.
+    UINT textOffset;   // Of the reserved text in WCHARs, from the start of the text of the table.
+    UINT textCapacity; // Reserved WCHARs for a string value, including the terminating zero.
+    PROPVARIANT value; // VT_EMPTY until materialized, the string of a VT_LPWSTR value is owned by the table.
+} PropertyEntry;
+
+// Read-only set of properties in a single allocation: the entries sorted by (fmtid, pid), followed by an open
+// addressing hash index and the reserved text of the string values. Freed with FreeMemory().
+typedef struct PropertyTable
+{
+    UINT count;
+    UINT slotMask; // The number of hash slots minus 1.
+    WCHAR *text;
+    PropertyEntry entries[];
+} PropertyTable;
+
+// Collects the keys of the properties before the table is created.
+typedef struct PropertyTableBuilder
+{
+    UINT count;
+    UINT textSize; // In WCHARs.
+    PropertyEntry entries[MaxPropertyTableCount];
+} PropertyTableBuilder;
+
+// Creates the value of a property on its first request. A string value is written to the reserved text, which has
+// room for textCapacity WCHARs. The value must not own memory.
+typedef HRESULT (*MaterializeProperty)(_In_ const void *context, UINT id,
+                                       _Out_writes_opt_(textCapacity) WCHAR *text, UINT textCapacity,
+                                       _Out_ PROPVARIANT *value);
+
+void InitializePropertyTableBuilder(_Out_ PropertyTableBuilder *builder);
+
+// Every key can be added once. textCapacity is 0 for values that are not strings.
+void AddProperty(_Inout_ PropertyTableBuilder *builder, _In_ const PROPERTYKEY *key, UINT id, UINT textCapacity);
+
+HRESULT CreatePropertyTable(_In_ const PropertyTableBuilder *builder, _Outptr_ PropertyTable **table);
+
+// Returns the entry of the key, or NULL when the table doesn't contain the key. The value of the entry may be read
+// concurrently with other lookups once it is materialized.
+PropertyEntry *FindPropertyTableEntry(_In_ PropertyTable *table, _In_ const PROPERTYKEY *key);
+
+// Materializes the value of the entry when it is still VT_EMPTY. Calls must be exclusive of all lookups of the value.
+HRESULT MaterializePropertyTableEntry(_Inout_ PropertyTable *table, _Inout_ PropertyEntry *entry,
+                                      _In_ MaterializeProperty materialize, _In_ const void *context);
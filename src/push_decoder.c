@@ -0,0 +1,551 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "netpbm_push_decoder.h"
+
+#include "allocator.h"
+#include "macros.h"
+#include "row_decoder.h"
+
+#include <Shlwapi.h>
+
+
+typedef enum PushDecoderState
+{
+    PushDecoderStateMagic,
+    PushDecoderStateHeader,
+    PushDecoderStateSamples,
+    PushDecoderStatePlainSamples,
+    PushDecoderStateDone
+} PushDecoderState;
+
+typedef enum HeaderField
+{
+    HeaderFieldNumber,
+    HeaderFieldToken,
+    HeaderFieldKeyword, // PAM only.
+    HeaderFieldSeparator
+} HeaderField;
+
+struct NetpbmPushDecoder
+{
+    NetpbmRowSink sink;
+    void *context;
+    const GUID *pixelFormat; // Requested pixel format, NULL for the pixel format of the samples.
+    GUID pixelFormatValue;
+    UINT bandHeight;
+    PushDecoderState state;
+    HRESULT result; // The first failure, it is returned by all following calls.
+
+    // The header is tokenized in the same way as ReadPnmHeader does, which makes it possible to detect its end.
+    // The complete header (with the text of the comments removed) is then parsed by ReadPnmHeader.
+    HeaderField field;
+    UINT fieldCount;
+    bool inValue;
+    bool inComment;
+    bool digitFound;
+    ULONGLONG number;
+    char token[32];
+    UINT tokenLength;
+    UINT headerSize;
+    BYTE headerText[4096];
+
+    RowConverter converter;
+    bool converterInitialized;
+    BYTE *band;
+    BYTE *scratch;    // The file row, for rows that cannot be converted in place.
+    UINT bandRowCount; // Completed rows in the band.
+    UINT rowsDecoded;
+    UINT rowPosition; // Bytes (binary) or samples (plain) of the current row.
+};
+
+
+static HRESULT AppendHeaderByte(_Inout_ NetpbmPushDecoder *decoder, const BYTE value)
+{
+    if (decoder->headerSize == sizeof(decoder->headerText))
+        return WINCODEC_ERR_BADHEADER;
+
+    decoder->headerText[decoder->headerSize++] = value;
+    return S_OK;
+}
+
+static UINT GetHeaderValueCount(const PnmFormat format)
+{
+    return format == PnmFormatPlainBitmap || format == PnmFormatBitmap ? 2 : 3;
+}
+
+static HRESULT EndHeaderField(_Inout_ NetpbmPushDecoder *decoder)
+{
+    decoder->inValue = false;
+    const PnmFormat format = (PnmFormat)(decoder->headerText[1] - '0');
+    if (decoder->headerText[1] == 'f' || decoder->headerText[1] == 'F')
+    {
+        ++decoder->fieldCount;
+        decoder->field = decoder->fieldCount == 2 ? HeaderFieldToken
+                         : decoder->fieldCount == 3 ? HeaderFieldSeparator
+                                                    : HeaderFieldNumber;
+        return S_OK;
+    }
+
+    if (format != PnmFormatArbitraryMap)
+    {
+        ++decoder->fieldCount;
+        decoder->field = decoder->fieldCount == GetHeaderValueCount(format) ? HeaderFieldSeparator : HeaderFieldNumber;
+        return S_OK;
+    }
+
+    if (decoder->field != HeaderFieldKeyword)
+    {
+        decoder->field = HeaderFieldKeyword;
+        return S_OK;
+    }
+
+    decoder->token[decoder->tokenLength] = 0;
+    if (strcmp(decoder->token, "ENDHDR") == 0)
+    {
+        decoder->field = HeaderFieldSeparator;
+    }
+    else if (strcmp(decoder->token, "TUPLTYPE") == 0)
+    {
+        decoder->field = HeaderFieldToken;
+    }
+    else if (strcmp(decoder->token, "WIDTH") == 0 || strcmp(decoder->token, "HEIGHT") == 0 ||
+             strcmp(decoder->token, "DEPTH") == 0 || strcmp(decoder->token, "MAXVAL") == 0)
+    {
+        decoder->field = HeaderFieldNumber;
+    }
+    else
+    {
+        return WINCODEC_ERR_BADHEADER;
+    }
+
+    return S_OK;
+}
+
+// Processes a header byte, returns S_FALSE when the byte completes the header.
+static HRESULT ProcessHeaderByte(_Inout_ NetpbmPushDecoder *decoder, const BYTE value)
+{
+    if (decoder->inComment)
+    {
+        if (value != '\n' && value != '\r')
+            return S_OK;
+
+        decoder->inComment = false;
+        return AppendHeaderByte(decoder, value);
+    }
+
+    if (decoder->field == HeaderFieldSeparator)
+    {
+        if (!IsPnmWhitespace(value))
+            return WINCODEC_ERR_BADHEADER;
+
+        const HRESULT result = AppendHeaderByte(decoder, value);
+        return FAILED(result) ? result : S_FALSE;
+    }
+
+    if (!decoder->inValue)
+    {
+        if (IsPnmWhitespace(value))
+        {
+            // Runs of whitespace are equivalent to a single whitespace character.
+            return IsPnmWhitespace(decoder->headerText[decoder->headerSize - 1]) ? S_OK
+                                                                                 : AppendHeaderByte(decoder, value);
+        }
+
+        if (value == '#')
+        {
+            decoder->inComment = true;
+            return AppendHeaderByte(decoder, value);
+        }
+
+        decoder->inValue = true;
+        decoder->digitFound = false;
+        decoder->number = 0;
+        decoder->tokenLength = 0;
+    }
+
+    if (decoder->field == HeaderFieldNumber)
+    {
+        if (value >= '0' && value <= '9')
+        {
+            decoder->number = decoder->number * 10 + (value - '0');
+            if (decoder->number > UINT_MAX)
+                return WINCODEC_ERR_BADHEADER;
+
+            decoder->digitFound = true;
+            return AppendHeaderByte(decoder, value);
+        }
+
+        if (!decoder->digitFound)
+            return WINCODEC_ERR_BADHEADER;
+    }
+    else if (!IsPnmWhitespace(value))
+    {
+        // Same limits as the token buffers of ReadPnmHeader.
+        const UINT maxLength = decoder->field == HeaderFieldKeyword ? 15 : sizeof(decoder->token) - 1;
+        if (decoder->tokenLength == maxLength)
+            return WINCODEC_ERR_BADHEADER;
+
+        decoder->token[decoder->tokenLength++] = (char)value;
+        return AppendHeaderByte(decoder, value);
+    }
+
+    // The character that ends a value is processed as part of the next field.
+    const HRESULT result = EndHeaderField(decoder);
+    if (FAILED(result))
+        return result;
+
+    return ProcessHeaderByte(decoder, value);
+}
+
+static HRESULT InitializeSamples(_Inout_ NetpbmPushDecoder *decoder)
+{
+    IStream *stream = SHCreateMemStream(decoder->headerText, decoder->headerSize);
+    if (!stream)
+        return E_OUTOFMEMORY;
+
+    PnmHeader header;
+    HRESULT result = ReadPnmHeader(stream, &header);
+    stream->lpVtbl->Release(stream);
+    if (FAILED(result))
+        return result;
+
+    decoder->converterInitialized = true;
+    result = InitializeRowConverter(&decoder->converter, &header, decoder->pixelFormat, NULL);
+    if (FAILED(result))
+        return result;
+
+    // The rows of PFM files are passed one by one, as they are stored bottom-up.
+    const RowConverter *converter = &decoder->converter;
+    decoder->bandHeight =
+        IsFloatPnmFormat(header.format) ? 1 : GetRowConverterBandHeight(converter, decoder->bandHeight);
+    const size_t bandSize = (size_t)decoder->bandHeight * converter->stride;
+    const size_t scratchOffset = (bandSize + 15) & ~(size_t)15;
+    const bool plain = IsPlainPnmFormat(header.format);
+    decoder->band = AllocatePixelBuffer(plain || converter->inPlace ? bandSize : scratchOffset + converter->fileRowSize);
+    if (!decoder->band)
+        return E_OUTOFMEMORY;
+
+    decoder->scratch = plain || converter->inPlace ? NULL : decoder->band + scratchOffset;
+    decoder->digitFound = false;
+    decoder->number = 0;
+    decoder->state = plain ? PushDecoderStatePlainSamples : PushDecoderStateSamples;
+    return S_OK;
+}
+
+static HRESULT FlushBand(_Inout_ NetpbmPushDecoder *decoder)
+{
+    if (decoder->bandRowCount == 0)
+        return S_OK;
+
+    const RowConverter *converter = &decoder->converter;
+    const PnmHeader *header = &converter->header;
+    const UINT firstRow = IsFloatPnmFormat(header->format) ? header->height - decoder->rowsDecoded
+                                                           : decoder->rowsDecoded - decoder->bandRowCount;
+    const NetpbmRows rows = {header->width, header->height,  *converter->pixelFormat, firstRow,
+                             decoder->bandRowCount, converter->stride, decoder->band};
+    const HRESULT result = decoder->sink(decoder->context, &rows);
+
+    // A partial row is moved to the first row of the band.
+    BYTE *partialRow = decoder->band + (size_t)decoder->bandRowCount * converter->stride;
+    if (decoder->rowPosition != 0 && decoder->state == PushDecoderStatePlainSamples)
+    {
+        memmove(decoder->band, partialRow, converter->stride);
+    }
+    else if (decoder->rowPosition != 0 && !decoder->scratch)
+    {
+        const UINT rowOffset = converter->stride - converter->fileRowSize;
+        memmove(decoder->band + rowOffset, partialRow + rowOffset, decoder->rowPosition);
+    }
+
+    decoder->bandRowCount = 0;
+    return FAILED(result) ? result : S_OK;
+}
+
+static HRESULT CompleteRow(_Inout_ NetpbmPushDecoder *decoder, _Inout_ UINT *rowCount)
+{
+    decoder->rowPosition = 0;
+    ++decoder->bandRowCount;
+    ++decoder->rowsDecoded;
+    ++*rowCount;
+    if (decoder->rowsDecoded == decoder->converter.header.height)
+    {
+        decoder->state = PushDecoderStateDone;
+    }
+
+    return decoder->bandRowCount == decoder->bandHeight ? FlushBand(decoder) : S_OK;
+}
+
+// Copies the binary samples to the current row, complete rows are converted.
+static HRESULT ProcessSamples(_Inout_ NetpbmPushDecoder *decoder, _In_reads_(size) const BYTE *data, UINT size,
+                              _Inout_ UINT *rowCount)
+{
+    const RowConverter *converter = &decoder->converter;
+    const UINT fileRowSize = converter->fileRowSize;
+    while (size != 0 && decoder->state == PushDecoderStateSamples)
+    {
+        BYTE *row = decoder->band + (size_t)decoder->bandRowCount * converter->stride;
+        BYTE *fileRow = decoder->scratch ? decoder->scratch : row + (converter->stride - fileRowSize);
+        const UINT copySize = size < fileRowSize - decoder->rowPosition ? size : fileRowSize - decoder->rowPosition;
+        memcpy(fileRow + decoder->rowPosition, data, copySize);
+        decoder->rowPosition += copySize;
+        data += copySize;
+        size -= copySize;
+        if (decoder->rowPosition != fileRowSize)
+            break;
+
+        if (decoder->scratch)
+        {
+            ConvertRow(converter, fileRow, row);
+        }
+        else
+        {
+            ConvertRowsInPlace(converter, row, 1);
+        }
+
+        const HRESULT result = CompleteRow(decoder, rowCount);
+        if (FAILED(result))
+            return result;
+    }
+
+    return S_OK;
+}
+
+static HRESULT StorePlainSample(_Inout_ NetpbmPushDecoder *decoder, const UINT value, _Inout_ UINT *rowCount)
+{
+    const RowConverter *converter = &decoder->converter;
+    const PnmHeader *header = &converter->header;
+    if (value > header->maxValue)
+        return WINCODEC_ERR_BADIMAGE;
+
+    BYTE *row = decoder->band + (size_t)decoder->bandRowCount * converter->stride;
+    if (decoder->rowPosition == 0)
+    {
+        memset(row, 0, converter->stride);
+    }
+
+    StorePlainPnmSample(header, converter->scaleTable, row, decoder->rowPosition++, value);
+    if (decoder->rowPosition != header->width * header->samplesPerPixel)
+        return S_OK;
+
+    FinishPlainPnmRow(header, row);
+    return CompleteRow(decoder, rowCount);
+}
+
+// Tokenizes plain samples in the same way as DecodePlainPnmRow, a number may be split across chunks.
+static HRESULT ProcessPlainSamples(_Inout_ NetpbmPushDecoder *decoder, _In_reads_(size) const BYTE *data,
+                                   const UINT size, _Inout_ UINT *rowCount)
+{
+    const bool bitmap = decoder->converter.header.format == PnmFormatPlainBitmap;
+    for (UINT i = 0; i < size && decoder->state == PushDecoderStatePlainSamples; ++i)
+    {
+        const BYTE value = data[i];
+        if (decoder->inComment)
+        {
+            decoder->inComment = value != '\n' && value != '\r';
+            continue;
+        }
+
+        const bool digit = bitmap ? value == '0' || value == '1' : value >= '0' && value <= '9';
+        HRESULT result = S_OK;
+        if (digit && bitmap)
+        {
+            result = StorePlainSample(decoder, value - '0', rowCount);
+        }
+        else if (digit)
+        {
+            decoder->number = decoder->number * 10 + (value - '0');
+            decoder->digitFound = true;
+            if (decoder->number > UINT_MAX)
+                return WINCODEC_ERR_BADIMAGE;
+
+            continue;
+        }
+        else if (decoder->digitFound)
+        {
+            decoder->digitFound = false;
+            result = StorePlainSample(decoder, (UINT)decoder->number, rowCount);
+            decoder->number = 0;
+        }
+
+        if (FAILED(result))
+            return result;
+
+        // The character after the last sample is not part of the image.
+        if (digit || decoder->state != PushDecoderStatePlainSamples)
+            continue;
+
+        if (value == '#')
+        {
+            decoder->inComment = true;
+        }
+        else if (!IsPnmWhitespace(value))
+        {
+            return WINCODEC_ERR_BADIMAGE;
+        }
+    }
+
+    return S_OK;
+}
+
+static HRESULT Feed(_Inout_ NetpbmPushDecoder *decoder, _In_reads_(size) const BYTE *data, UINT size,
+                    _Inout_ UINT *rowCount)
+{
+    while (size != 0 && decoder->state == PushDecoderStateMagic)
+    {
+        const BYTE value = *data++;
+        --size;
+        if (decoder->headerSize == 0 ? value != 'P'
+                                     : (value < '1' || value > '7') && value != 'f' && value != 'F')
+            return WINCODEC_ERR_UNKNOWNIMAGEFORMAT;
+
+        decoder->headerText[decoder->headerSize++] = value;
+        if (decoder->headerSize == 2)
+        {
+            decoder->state = PushDecoderStateHeader;
+            decoder->field = value == '7' ? HeaderFieldKeyword : HeaderFieldNumber;
+        }
+    }
+
+    while (size != 0 && decoder->state == PushDecoderStateHeader)
+    {
+        HRESULT result = ProcessHeaderByte(decoder, *data++);
+        --size;
+        if (FAILED(result))
+            return result;
+
+        if (result == S_FALSE)
+        {
+            result = InitializeSamples(decoder);
+            if (FAILED(result))
+                return result;
+        }
+    }
+
+    HRESULT result = S_OK;
+    if (decoder->state == PushDecoderStateSamples)
+    {
+        result = ProcessSamples(decoder, data, size, rowCount);
+    }
+    else if (decoder->state == PushDecoderStatePlainSamples)
+    {
+        result = ProcessPlainSamples(decoder, data, size, rowCount);
+    }
+
+    if (FAILED(result))
+        return result;
+
+    // The completed rows are passed to the sink before the call returns.
+    return decoder->converterInitialized ? FlushBand(decoder) : S_OK;
+}
+
+_Use_decl_annotations_ HRESULT STDMETHODCALLTYPE NetpbmCreatePushDecoder(const WICPixelFormatGUID *pixelFormat,
+                                                                         const UINT bandHeight, const NetpbmRowSink sink,
+                                                                         void *context, NetpbmPushDecoder **decoder)
+{
+    TRACE("netpbm-wic-codec-c::NetpbmCreatePushDecoder\n");
+
+    if (!decoder)
+        return E_POINTER;
+
+    *decoder = NULL;
+    if (!sink)
+        return E_INVALIDARG;
+
+    NetpbmPushDecoder *pushDecoder = AllocateZeroedMemory(1, sizeof(NetpbmPushDecoder));
+    if (!pushDecoder)
+        return E_OUTOFMEMORY;
+
+    pushDecoder->sink = sink;
+    pushDecoder->context = context;
+    if (pixelFormat)
+    {
+        pushDecoder->pixelFormatValue = *pixelFormat;
+        pushDecoder->pixelFormat = &pushDecoder->pixelFormatValue;
+    }
+
+    pushDecoder->bandHeight = bandHeight;
+    pushDecoder->state = PushDecoderStateMagic;
+    pushDecoder->result = S_OK;
+    *decoder = pushDecoder;
+    return S_OK;
+}
+
+_Use_decl_annotations_ HRESULT STDMETHODCALLTYPE NetpbmPushDecoderFeed(NetpbmPushDecoder *decoder, const BYTE *data,
+                                                                       const UINT size, UINT *rowCount)
+{
+    if (!decoder || !rowCount || (!data && size != 0))
+        return E_INVALIDARG;
+
+    *rowCount = 0;
+    if (SUCCEEDED(decoder->result))
+    {
+        decoder->result = Feed(decoder, data, size, rowCount);
+    }
+
+    return decoder->result;
+}
+
+_Use_decl_annotations_ HRESULT STDMETHODCALLTYPE NetpbmPushDecoderFinish(NetpbmPushDecoder *decoder, UINT *rowCount)
+{
+    if (!decoder || !rowCount)
+        return E_INVALIDARG;
+
+    *rowCount = 0;
+    if (FAILED(decoder->result))
+        return decoder->result;
+
+    switch (decoder->state)
+    {
+    case PushDecoderStateMagic:
+        decoder->result = WINCODEC_ERR_UNKNOWNIMAGEFORMAT;
+        break;
+
+    case PushDecoderStateHeader:
+        decoder->result = WINCODEC_ERR_BADHEADER;
+        break;
+
+    case PushDecoderStatePlainSamples:
+        // A number at the end of the file is completed by the end of the data.
+        if (decoder->digitFound)
+        {
+            decoder->digitFound = false;
+            decoder->result = StorePlainSample(decoder, (UINT)decoder->number, rowCount);
+            if (SUCCEEDED(decoder->result))
+            {
+                decoder->result = FlushBand(decoder);
+            }
+        }
+
+        if (SUCCEEDED(decoder->result) && decoder->state != PushDecoderStateDone)
+        {
+            decoder->result = WINCODEC_ERR_BADIMAGE;
+        }
+        break;
+
+    case PushDecoderStateSamples:
+        decoder->result = WINCODEC_ERR_BADIMAGE;
+        break;
+
+    case PushDecoderStateDone:
+        break;
+    }
+
+    return decoder->result;
+}
+
+_Use_decl_annotations_ void STDMETHODCALLTYPE NetpbmDestroyPushDecoder(NetpbmPushDecoder *decoder)
+{
+    if (!decoder)
+        return;
+
+    if (decoder->converterInitialized)
+    {
+        ReleaseRowConverter(&decoder->converter);
+    }
+
+    FreePixelBuffer(decoder->band);
+    FreeMemory(decoder);
+}
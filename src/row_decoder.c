@@ -0,0 +1,534 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "row_decoder.h"
+
+#include "allocator.h"
+#include "macros.h"
+#include "pixel_converter.h"
+#include "scratch_buffer.h"
+
+
+_Use_decl_annotations_ void SelectPnmPixelFormat(const PnmHeader *header, const GUID **pixelFormat, UINT *bitsPerPixel)
+{
+    const bool samples16 = GetPnmBitsPerSample(header) == 16;
+    if (IsFloatPnmFormat(header->format))
+    {
+        const bool gray = header->format == PnmFormatFloatGraymap;
+        *pixelFormat = gray ? &GUID_WICPixelFormat32bppGrayFloat : &GUID_WICPixelFormat96bppRGBFloat;
+        *bitsPerPixel = gray ? 32 : 96;
+        return;
+    }
+
+    switch (header->tupleType)
+    {
+    case PamTupleTypeBlackAndWhite:
+        if (header->format != PnmFormatArbitraryMap)
+        {
+            *pixelFormat = &GUID_WICPixelFormatBlackWhite;
+            *bitsPerPixel = 1;
+            return;
+        }
+
+        // PAM files store black and white pixels as 1 byte samples, which are scaled to gray.
+        *pixelFormat = &GUID_WICPixelFormat8bppGray;
+        *bitsPerPixel = 8;
+        return;
+
+    case PamTupleTypeRgb:
+        *pixelFormat = samples16 ? &GUID_WICPixelFormat48bppRGB : &GUID_WICPixelFormat24bppRGB;
+        *bitsPerPixel = samples16 ? 48 : 24;
+        return;
+
+    case PamTupleTypeBlackAndWhiteAlpha:
+    case PamTupleTypeGrayscaleAlpha:
+    case PamTupleTypeRgbAlpha:
+        // WIC has no gray-alpha pixel formats, gray-alpha pixels are expanded to RGBA.
+        *pixelFormat = samples16 ? &GUID_WICPixelFormat64bppRGBA : &GUID_WICPixelFormat32bppRGBA;
+        *bitsPerPixel = samples16 ? 64 : 32;
+        return;
+
+    default:
+        *pixelFormat = samples16 ? &GUID_WICPixelFormat16bppGray : &GUID_WICPixelFormat8bppGray;
+        *bitsPerPixel = samples16 ? 16 : 8;
+        return;
+    }
+}
+
+_Use_decl_annotations_ const GUID *GetPnmHalfPixelFormat(const PnmHeader *header)
+{
+    const UINT bitsPerSample = GetPnmBitsPerSample(header);
+    if (IsPlainPnmFormat(header->format) || header->tupleType == PamTupleTypeUnknown ||
+        (bitsPerSample != 16 && bitsPerSample != 32))
+        return NULL;
+
+    return header->samplesPerPixel == 1 ? &GUID_WICPixelFormat16bppGrayHalf : &GUID_WICPixelFormat64bppRGBAHalf;
+}
+
+_Use_decl_annotations_ void ConvertPnmPixels(const PnmHeader *header, const BYTE *scaleTable, BYTE *pixels,
+                                             const size_t pixelCount)
+{
+    if (IsFloatPnmFormat(header->format))
+    {
+        if (!header->littleEndian)
+        {
+            ByteSwapSamples32((UINT *)pixels, pixelCount * header->samplesPerPixel);
+        }
+
+        return;
+    }
+
+    const bool expand = header->samplesPerPixel == 2;
+    if (GetPnmBitsPerSample(header) == 8)
+    {
+        BYTE *samples = expand ? pixels + pixelCount * 2 : pixels;
+        if (header->maxValue != UCHAR_MAX)
+        {
+            ScaleSamples8(samples, pixelCount * header->samplesPerPixel, scaleTable);
+        }
+
+        if (expand)
+        {
+            ExpandGrayAlphaToRgba8(samples, pixels, pixelCount);
+        }
+
+        return;
+    }
+
+    USHORT *samples = (USHORT *)pixels;
+    size_t sampleCount = pixelCount * header->samplesPerPixel;
+    if (expand)
+    {
+        ExpandBigEndianGrayAlphaToRgba16(samples + pixelCount * 2, samples, pixelCount);
+        sampleCount = pixelCount * 4;
+    }
+    else
+    {
+        ByteSwapSamples16(samples, sampleCount);
+    }
+
+    if (header->maxValue != USHRT_MAX)
+    {
+        ScaleSamples16(samples, sampleCount, header->maxValue);
+    }
+}
+
+_Use_decl_annotations_ void StorePlainPnmSample(const PnmHeader *header, const BYTE *scaleTable, BYTE *row,
+                                                const size_t index, const UINT value)
+{
+    if (header->format == PnmFormatPlainBitmap)
+    {
+        // A set bit is black in the Netpbm format and white in WIC.
+        if (!value)
+        {
+            row[index / 8] |= (BYTE)(0x80 >> (index % 8));
+        }
+    }
+    else if (GetPnmBitsPerSample(header) == 16)
+    {
+        ((USHORT *)row)[index] = (USHORT)value;
+    }
+    else
+    {
+        row[index] = scaleTable[value];
+    }
+}
+
+_Use_decl_annotations_ void FinishPlainPnmRow(const PnmHeader *header, BYTE *row)
+{
+    if (GetPnmBitsPerSample(header) == 16 && header->maxValue != USHRT_MAX)
+    {
+        ScaleSamples16((USHORT *)row, (size_t)header->width * header->samplesPerPixel, header->maxValue);
+    }
+}
+
+_Use_decl_annotations_ HRESULT DecodePlainPnmRow(StreamReader *reader, const PnmHeader *header, const BYTE *scaleTable,
+                                                 BYTE *row)
+{
+    const bool bitmap = header->format == PnmFormatPlainBitmap;
+    const size_t sampleCount = (size_t)header->width * header->samplesPerPixel;
+
+    for (size_t i = 0; i < sampleCount; ++i)
+    {
+        UINT value;
+        const HRESULT result = bitmap ? StreamReaderReadBit(reader, &value) : StreamReaderReadUnsigned(reader, &value);
+        if (FAILED(result))
+            return result;
+
+        if (result == S_FALSE || value > header->maxValue)
+            return WINCODEC_ERR_BADIMAGE;
+
+        StorePlainPnmSample(header, scaleTable, row, i, value);
+    }
+
+    FinishPlainPnmRow(header, row);
+    return S_OK;
+}
+
+_Use_decl_annotations_ void ConvertPnmSamplesToFloat(const PnmHeader *header, BYTE *samples, float *destination,
+                                                     const size_t pixelCount)
+{
+    const UINT samplesPerPixel = header->samplesPerPixel;
+    const bool floatSamples = IsFloatPnmFormat(header->format);
+    if (floatSamples && !header->littleEndian)
+    {
+        ByteSwapSamples32((UINT *)samples, pixelCount * samplesPerPixel);
+    }
+    else if (!floatSamples)
+    {
+        ByteSwapSamples16((USHORT *)samples, pixelCount * samplesPerPixel);
+    }
+
+    const float maxValue = (float)header->maxValue;
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        float pixel[4] = {0, 0, 0, 1.0F};
+        for (UINT j = 0; j < samplesPerPixel; ++j)
+        {
+            const size_t index = i * samplesPerPixel + j;
+            pixel[j] = floatSamples ? ((const float *)samples)[index] : (float)((const USHORT *)samples)[index] / maxValue;
+        }
+
+        switch (samplesPerPixel)
+        {
+        case 1:
+            *destination++ = pixel[0];
+            break;
+
+        case 2:
+            // Gray-alpha is expanded to RGBA.
+            pixel[3] = pixel[1];
+            pixel[1] = pixel[0];
+            pixel[2] = pixel[0];
+            [[fallthrough]];
+
+        default:
+            memcpy(destination, pixel, sizeof(pixel));
+            destination += 4;
+            break;
+        }
+    }
+}
+
+
+_Use_decl_annotations_ HRESULT InitializeRowConverter(RowConverter *converter, const PnmHeader *header,
+                                                      const GUID *pixelFormat, StatisticsAccumulator *statistics)
+{
+    UINT bitsPerPixel;
+    SelectPnmPixelFormat(header, &converter->pixelFormat, &bitsPerPixel);
+    if (statistics && statistics->window)
+    {
+        converter->pixelFormat = &GUID_WICPixelFormat8bppGray;
+        bitsPerPixel = 8;
+    }
+
+    converter->header = *header;
+    converter->halfFloat = false;
+    converter->floatSamples = NULL;
+    converter->statistics = statistics;
+    if (pixelFormat && !IsEqualGUID(pixelFormat, &GUID_WICPixelFormatDontCare) &&
+        !IsEqualGUID(pixelFormat, converter->pixelFormat))
+    {
+        const GUID *halfPixelFormat = GetPnmHalfPixelFormat(header);
+        if (!halfPixelFormat || !IsEqualGUID(pixelFormat, halfPixelFormat))
+            return WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT;
+
+        converter->pixelFormat = halfPixelFormat;
+        bitsPerPixel = header->samplesPerPixel == 1 ? 16 : 64;
+        converter->halfFloat = true;
+        converter->floatSamples =
+            AcquireScratchBuffer((size_t)header->width * (header->samplesPerPixel == 1 ? 1 : 4) * sizeof(float));
+        if (!converter->floatSamples)
+            return E_OUTOFMEMORY;
+    }
+
+    converter->stride = (UINT)(((ULONGLONG)header->width * bitsPerPixel + 7) / 8);
+    converter->fileRowSize = GetPnmRowSize(header);
+    converter->inPlace = !converter->halfFloat && header->tupleType != PamTupleTypeUnknown &&
+                         converter->stride >= converter->fileRowSize;
+    if (GetPnmBitsPerSample(header) == 8)
+    {
+        InitializeScaleTable8(converter->scaleTable, header->maxValue);
+    }
+
+    return S_OK;
+}
+
+_Use_decl_annotations_ void ReleaseRowConverter(RowConverter *converter)
+{
+    ReleaseScratchBuffer(converter->floatSamples);
+}
+
+_Use_decl_annotations_ UINT GetRowConverterBandHeight(const RowConverter *converter, UINT bandHeight)
+{
+    // The band is bounded to the maximum size of a single read (but always holds at least 1 row).
+    const UINT stride = converter->stride;
+    const UINT defaultBandSize = 1U << 18;
+    const UINT maxBandSize = 1U << 26;
+    const UINT maxBandHeight = stride < maxBandSize ? maxBandSize / stride : 1;
+    if (bandHeight == 0)
+    {
+        bandHeight = stride < defaultBandSize ? defaultBandSize / stride : 1;
+    }
+
+    bandHeight = bandHeight < maxBandHeight ? bandHeight : maxBandHeight;
+    return bandHeight < converter->header.height ? bandHeight : converter->header.height;
+}
+
+_Use_decl_annotations_ void ConvertRowsInPlace(const RowConverter *converter, BYTE *rows, const UINT rowCount)
+{
+    const PnmHeader *header = &converter->header;
+    if (header->format == PnmFormatBitmap)
+    {
+        InvertBits(rows, (size_t)rowCount * converter->stride);
+        return;
+    }
+
+    if (converter->statistics)
+    {
+        ConvertGraySamplesWithStatistics(converter->statistics, converter->scaleTable, rows, rows,
+                                         (size_t)rowCount * header->width);
+        return;
+    }
+
+    ConvertPnmPixels(header, converter->scaleTable, rows, (size_t)rowCount * header->width);
+}
+
+_Use_decl_annotations_ void ConvertRow(const RowConverter *converter, BYTE *fileRow, BYTE *row)
+{
+    const PnmHeader *header = &converter->header;
+    if (converter->statistics)
+    {
+        // 16-bit samples that are mapped by a window to 8-bit.
+        ConvertGraySamplesWithStatistics(converter->statistics, converter->scaleTable, fileRow, row, header->width);
+        return;
+    }
+
+    if (converter->halfFloat)
+    {
+        ConvertPnmSamplesToFloat(header, fileRow, converter->floatSamples, header->width);
+        ConvertFloatToHalf(converter->floatSamples, (USHORT *)row,
+                           (size_t)header->width * (header->samplesPerPixel == 1 ? 1 : 4));
+        return;
+    }
+
+    // Multispectral PAM files are decoded as the gray image of channel 0, like the frame does.
+    const UINT channel = 0;
+    if (GetPnmBitsPerSample(header) == 8)
+    {
+        GatherChannels8(fileRow, header->samplesPerPixel, &channel, 1, row, header->width);
+        if (header->maxValue != UCHAR_MAX)
+        {
+            ScaleSamples8(row, header->width, converter->scaleTable);
+        }
+    }
+    else
+    {
+        GatherBigEndianChannels16(fileRow, header->samplesPerPixel, &channel, 1, (USHORT *)row, header->width);
+        if (header->maxValue != USHRT_MAX)
+        {
+            ScaleSamples16((USHORT *)row, header->width, header->maxValue);
+        }
+    }
+}
+
+
+typedef struct RowDecoder
+{
+    IStream *stream;
+    RowConverter converter;
+    BYTE *scratch;           // A file row, for rows that cannot be converted in place.
+    StreamReader *reader;    // Plain formats and single pass decoding only.
+    bool singlePass;         // Non-seekable stream, all samples are read in file order with the reader.
+    StreamReader ownReader;
+} RowDecoder;
+
+static HRESULT ReadSamples(_Inout_ RowDecoder *decoder, _Out_writes_bytes_all_(size) BYTE *buffer, const ULONG size)
+{
+    return decoder->singlePass ? StreamReaderReadExactly(decoder->reader, buffer, size)
+                               : ReadExactly(decoder->stream, buffer, size);
+}
+
+// Decodes rowCount rows, starting at firstRow, into the band. Rows are decoded in order, which makes it possible to
+// read the top-down formats sequentially.
+static HRESULT DecodeBand(_Inout_ RowDecoder *decoder, const UINT firstRow, const UINT rowCount, _Out_ BYTE *band)
+{
+    const RowConverter *converter = &decoder->converter;
+    const PnmHeader *header = &converter->header;
+    const UINT stride = converter->stride;
+    if (IsPlainPnmFormat(header->format))
+    {
+        memset(band, 0, (size_t)rowCount * stride);
+        for (UINT row = 0; row < rowCount; ++row)
+        {
+            const HRESULT result =
+                DecodePlainPnmRow(decoder->reader, header, converter->scaleTable, band + (size_t)row * stride);
+            if (FAILED(result))
+                return result;
+        }
+
+        return S_OK;
+    }
+
+    const UINT fileRowSize = converter->fileRowSize;
+    const bool bottomUp = IsFloatPnmFormat(header->format);
+    if (!converter->inPlace || bottomUp)
+    {
+        for (UINT row = 0; row < rowCount; ++row)
+        {
+            HRESULT result;
+            if (bottomUp && !decoder->singlePass)
+            {
+                result = SeekTo(decoder->stream,
+                                header->dataOffset + (ULONGLONG)(header->height - 1 - (firstRow + row)) * fileRowSize);
+                if (FAILED(result))
+                    return result;
+            }
+
+            BYTE *destination = band + (size_t)row * stride;
+            result = ReadSamples(decoder, converter->inPlace ? destination : decoder->scratch, fileRowSize);
+            if (FAILED(result))
+                return result;
+
+            if (converter->inPlace)
+            {
+                ConvertRowsInPlace(converter, destination, 1);
+            }
+            else
+            {
+                ConvertRow(converter, decoder->scratch, destination);
+            }
+        }
+
+        return S_OK;
+    }
+
+    // All rows of the band are read with a single call, gray-alpha samples are read into the back of the band and
+    // expanded in place to RGBA.
+    const HRESULT result =
+        ReadSamples(decoder, band + (size_t)rowCount * (stride - fileRowSize), rowCount * fileRowSize);
+    if (FAILED(result))
+        return result;
+
+    ConvertRowsInPlace(converter, band, rowCount);
+    return S_OK;
+}
+
+_Use_decl_annotations_ HRESULT DecodePnmRows(IStream *stream, StreamReader *reader, const PnmHeader *header,
+                                             const GUID *pixelFormat, StatisticsAccumulator *statistics,
+                                             UINT bandHeight, const NetpbmRowSink sink, void *context)
+{
+    RowDecoder *decoder = AcquireScratchBuffer(sizeof(RowDecoder));
+    if (!decoder)
+        return E_OUTOFMEMORY;
+
+    HRESULT result = InitializeRowConverter(&decoder->converter, header, pixelFormat, statistics);
+    if (FAILED(result))
+    {
+        ReleaseRowConverter(&decoder->converter);
+        ReleaseScratchBuffer(decoder);
+        return result;
+    }
+
+    // Without seeking, the bottom-up rows of PFM files can only be passed one by one in file order.
+    const RowConverter *converter = &decoder->converter;
+    const bool fileOrder = reader && IsFloatPnmFormat(header->format);
+    bandHeight = fileOrder ? 1 : GetRowConverterBandHeight(converter, bandHeight);
+    const size_t bandSize = (size_t)bandHeight * converter->stride;
+    const size_t scratchOffset = (bandSize + 15) & ~(size_t)15;
+    BYTE *band = AcquireScratchBuffer(converter->inPlace ? bandSize : scratchOffset + converter->fileRowSize);
+    if (!band)
+    {
+        ReleaseRowConverter(&decoder->converter);
+        ReleaseScratchBuffer(decoder);
+        return E_OUTOFMEMORY;
+    }
+
+    decoder->stream = stream;
+    decoder->scratch = converter->inPlace ? NULL : band + scratchOffset;
+    decoder->reader = reader;
+    decoder->singlePass = reader != NULL;
+    if (!reader)
+    {
+        result = SeekTo(stream, header->dataOffset);
+        if (SUCCEEDED(result) && IsPlainPnmFormat(header->format))
+        {
+            decoder->reader = &decoder->ownReader;
+            StreamReaderInitialize(decoder->reader, stream, header->dataOffset);
+        }
+    }
+
+    NetpbmRows rows = {header->width, header->height, *converter->pixelFormat, 0, 0, converter->stride, band};
+    for (UINT row = 0; row < header->height && SUCCEEDED(result); row += bandHeight)
+    {
+        const UINT rowCount = header->height - row < bandHeight ? header->height - row : bandHeight;
+        result = DecodeBand(decoder, row, rowCount, band);
+        if (FAILED(result))
+            break;
+
+        rows.firstRow = fileOrder ? header->height - 1 - row : row;
+        rows.rowCount = rowCount;
+        result = sink(context, &rows);
+    }
+
+    ReleaseScratchBuffer(band);
+    ReleaseRowConverter(&decoder->converter);
+    ReleaseScratchBuffer(decoder);
+    return FAILED(result) ? result : S_OK;
+}
+
+_Use_decl_annotations_ HRESULT DecodeStreamRows(IStream *stream, const GUID *pixelFormat, const UINT binCount,
+                                                const NetpbmWindowLevel *windowLevel, NetpbmStatistics *statistics,
+                                                const UINT bandHeight, const NetpbmRowSink sink, void *context)
+{
+    // Non-seekable streams (pipes) are decoded in a single pass, the reader keeps the samples it has buffered.
+    const bool seekable = IsSeekableStream(stream);
+    StreamReader *reader = NULL;
+    if (!seekable)
+    {
+        reader = AllocateMemory(sizeof(StreamReader));
+        if (!reader)
+            return E_OUTOFMEMORY;
+
+        StreamReaderInitialize(reader, stream, 0);
+    }
+
+    PnmHeader header;
+    HRESULT result = seekable ? ReadPnmHeader(stream, &header) : ReadPnmHeaderFromReader(reader, &header);
+    if (SUCCEEDED(result))
+    {
+        if (statistics)
+        {
+            StatisticsAccumulator accumulator;
+            result = InitializeStatisticsAccumulator(&accumulator, &header, binCount, windowLevel);
+            if (SUCCEEDED(result))
+            {
+                result = DecodePnmRows(stream, reader, &header, pixelFormat, &accumulator, bandHeight, sink, context);
+                GetAccumulatedStatistics(&accumulator, statistics);
+            }
+
+            ReleaseStatisticsAccumulator(&accumulator);
+        }
+        else
+        {
+            result = DecodePnmRows(stream, reader, &header, pixelFormat, NULL, bandHeight, sink, context);
+        }
+    }
+
+    FreeMemory(reader);
+    return result;
+}
+
+_Use_decl_annotations_ HRESULT STDMETHODCALLTYPE NetpbmDecodeRows(IStream *stream, const WICPixelFormatGUID *pixelFormat,
+                                                                  const UINT bandHeight, const NetpbmRowSink sink,
+                                                                  void *context)
+{
+    TRACE("netpbm-wic-codec-c::NetpbmDecodeRows\n");
+
+    if (!stream || !sink)
+        return E_INVALIDARG;
+
+    return DecodeStreamRows(stream, pixelFormat, 0, NULL, NULL, bandHeight, sink, context);
+}
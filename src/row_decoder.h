@@ -0,0 +1,81 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "netpbm_row_decoder.h"
+#include "pnm_header.h"
+#include "statistics.h"
+#include "stream_reader.h"
+
+// Row conversion functions that are shared by the frame decoder and the row sink API.
+
+// Selects the WIC pixel format that matches the samples of the file.
+// Layouts without a matching pixel format (multispectral PAM files) use the gray format of a single channel.
+void SelectPnmPixelFormat(_In_ const PnmHeader *header, _Out_ const GUID **pixelFormat, _Out_ UINT *bitsPerPixel);
+
+// Returns the half float pixel format that can be decoded directly from the samples, or NULL when there is none.
+const GUID *GetPnmHalfPixelFormat(_In_ const PnmHeader *header);
+
+// Converts the samples of pixelCount binary pixels to the layout of the WIC pixel format.
+// Gray-alpha pixels are expected in the second half of the buffer, they are expanded to RGBA.
+void ConvertPnmPixels(_In_ const PnmHeader *header, _In_reads_(256) const BYTE *scaleTable, _Inout_ BYTE *pixels,
+                      size_t pixelCount);
+
+// Stores sample index of a row of plain (ASCII) samples. Bitmap rows are expected to be zero initialized.
+void StorePlainPnmSample(_In_ const PnmHeader *header, _In_reads_(256) const BYTE *scaleTable, _Inout_ BYTE *row,
+                         size_t index, UINT value);
+
+// Completes a row after all plain samples have been stored (16-bit samples are scaled).
+void FinishPlainPnmRow(_In_ const PnmHeader *header, _Inout_ BYTE *row);
+
+// Decodes a row of plain (ASCII) samples. Bitmap rows are expected to be zero initialized.
+HRESULT DecodePlainPnmRow(_Inout_ StreamReader *reader, _In_ const PnmHeader *header,
+                          _In_reads_(256) const BYTE *scaleTable, _Out_ BYTE *row);
+
+// Converts a row of binary 16-bit or float samples to float samples in the layout of the half float pixel format.
+void ConvertPnmSamplesToFloat(_In_ const PnmHeader *header, _Inout_ BYTE *samples, _Out_ float *destination,
+                              size_t pixelCount);
+
+// Converts rows of binary file samples to rows of the output pixel format.
+typedef struct RowConverter
+{
+    PnmHeader header;
+    const GUID *pixelFormat; // Of the converted rows.
+    UINT stride;             // Size of a converted row.
+    UINT fileRowSize;
+    bool inPlace;            // File rows are converted in place, otherwise they are converted from a separate buffer.
+    bool halfFloat;
+    float *floatSamples;     // A row of float samples, used for the conversion to half float.
+    StatisticsAccumulator *statistics; // Graymaps only, the output is 8bppGray when it has a window.
+    BYTE scaleTable[256];
+} RowConverter;
+
+// pixelFormat is NULL (or GUID_WICPixelFormatDontCare) for the pixel format of the samples, or a half float format.
+// The statistics (optional) are accumulated while the rows are converted.
+// ReleaseRowConverter must also be called when the initialization fails.
+HRESULT InitializeRowConverter(_Out_ RowConverter *converter, _In_ const PnmHeader *header,
+                               _In_opt_ const GUID *pixelFormat, _Inout_opt_ StatisticsAccumulator *statistics);
+void ReleaseRowConverter(_Inout_ RowConverter *converter);
+
+// Returns the number of rows of a band, 0 selects the default band size.
+UINT GetRowConverterBandHeight(_In_ const RowConverter *converter, UINT bandHeight);
+
+// Converts rows of which the file samples have been stored at the back of the buffer.
+void ConvertRowsInPlace(_In_ const RowConverter *converter, _Inout_ BYTE *rows, UINT rowCount);
+
+// Converts a file row (that is modified) to a row of the output pixel format.
+void ConvertRow(_In_ const RowConverter *converter, _Inout_ BYTE *fileRow, _Out_ BYTE *row);
+
+// Decodes the samples that start at header->dataOffset and passes bands of rows to the sink.
+// Non-seekable streams pass the reader that has read the header: the samples are then read in a single pass, without
+// seeking, and the bottom-up rows of PFM files are passed one by one in file order.
+HRESULT DecodePnmRows(_In_ IStream *stream, _Inout_opt_ StreamReader *reader, _In_ const PnmHeader *header,
+                      _In_opt_ const GUID *pixelFormat, _Inout_opt_ StatisticsAccumulator *statistics,
+                      UINT bandHeight, _In_ NetpbmRowSink sink, _In_opt_ void *context);
+
+// Reads the header at the current position of the stream (seekable or not) and decodes the rows with DecodePnmRows.
+// The statistics accumulator is created with binCount bins and the window when statistics is not NULL.
+HRESULT DecodeStreamRows(_In_ IStream *stream, _In_opt_ const GUID *pixelFormat, UINT binCount,
+                         _In_opt_ const NetpbmWindowLevel *windowLevel, _Out_opt_ NetpbmStatistics *statistics,
+                         UINT bandHeight, _In_ NetpbmRowSink sink, _In_opt_ void *context);
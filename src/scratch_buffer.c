@@ -0,0 +1,183 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "scratch_buffer.h"
+
+#include "allocator.h"
+
+
+// The released buffers of a thread are kept in the fiber local storage, which calls ReleaseThreadBuffers when the
+// thread exits (DllMain doesn't receive DLL_THREAD_DETACH, it disables the thread library calls). Every buffer starts
+// with a header of one alignment that stores its capacity.
+enum
+{
+    ThreadBufferCount = 4,
+    ScratchHeaderSize = PixelBufferAlignment,
+    MinimumScratchCapacity = 4096,
+    MaximumKeptCapacity = 4 * 1024 * 1024
+};
+
+typedef struct ThreadBuffers
+{
+    BYTE *buffers[ThreadBufferCount]; // The start of the allocations, NULL for a free slot.
+} ThreadBuffers;
+
+static INIT_ONCE g_initOnce = INIT_ONCE_STATIC_INIT;
+static DWORD g_threadBuffersIndex = FLS_OUT_OF_INDEXES;
+
+
+static size_t GetCapacity(_In_ const BYTE *allocation)
+{
+    return *(const size_t *)allocation;
+}
+
+static void NTAPI ReleaseThreadBuffers(void *data)
+{
+    ThreadBuffers *threadBuffers = data;
+    if (!threadBuffers)
+        return;
+
+    for (size_t i = 0; i < ThreadBufferCount; ++i)
+    {
+        FreePixelBuffer(threadBuffers->buffers[i]);
+    }
+
+    FreeMemory(threadBuffers);
+}
+
+static BOOL CALLBACK InitializeScratchBuffers([[maybe_unused]] INIT_ONCE *initOnce, [[maybe_unused]] void *parameter,
+                                              [[maybe_unused]] void **context)
+{
+    // Without an index every buffer is allocated and freed.
+    g_threadBuffersIndex = FlsAlloc(ReleaseThreadBuffers);
+    return TRUE;
+}
+
+static ThreadBuffers *GetThreadBuffers(const bool create)
+{
+    if (g_threadBuffersIndex == FLS_OUT_OF_INDEXES)
+        return NULL;
+
+    ThreadBuffers *threadBuffers = FlsGetValue(g_threadBuffersIndex);
+    if (!threadBuffers && create)
+    {
+        threadBuffers = AllocateZeroedMemory(1, sizeof(ThreadBuffers));
+        if (threadBuffers && !FlsSetValue(g_threadBuffersIndex, threadBuffers))
+        {
+            FreeMemory(threadBuffers);
+            threadBuffers = NULL;
+        }
+    }
+
+    return threadBuffers;
+}
+
+_Use_decl_annotations_ void *AcquireScratchBuffer(const size_t size)
+{
+    InitOnceExecuteOnce(&g_initOnce, InitializeScratchBuffers, NULL, NULL);
+
+    // The smallest kept buffer that is large enough is taken, otherwise the largest buffer is replaced.
+    ThreadBuffers *threadBuffers = GetThreadBuffers(false);
+    size_t slot = ThreadBufferCount;
+    for (size_t i = 0; threadBuffers && i < ThreadBufferCount; ++i)
+    {
+        if (!threadBuffers->buffers[i])
+            continue;
+
+        if (slot == ThreadBufferCount)
+        {
+            slot = i;
+            continue;
+        }
+
+        const size_t capacity = GetCapacity(threadBuffers->buffers[i]);
+        const size_t slotCapacity = GetCapacity(threadBuffers->buffers[slot]);
+        if (capacity >= size ? slotCapacity < size || capacity < slotCapacity : capacity > slotCapacity)
+        {
+            slot = i;
+        }
+    }
+
+    size_t capacity = size < MinimumScratchCapacity ? MinimumScratchCapacity : size;
+    if (slot != ThreadBufferCount)
+    {
+        BYTE *allocation = threadBuffers->buffers[slot];
+        threadBuffers->buffers[slot] = NULL;
+        if (GetCapacity(allocation) >= size)
+            return allocation + ScratchHeaderSize;
+
+        // A replaced buffer grows at least by doubling, which limits the reallocations of growing sizes.
+        const size_t doubled = 2 * GetCapacity(allocation);
+        capacity = capacity > doubled ? capacity : doubled;
+        FreePixelBuffer(allocation);
+    }
+
+    if (capacity > SIZE_MAX - ScratchHeaderSize)
+        return NULL;
+
+    BYTE *allocation = AllocatePixelBuffer(ScratchHeaderSize + capacity);
+    if (!allocation)
+        return NULL;
+
+    *(size_t *)allocation = capacity;
+    return allocation + ScratchHeaderSize;
+}
+
+_Use_decl_annotations_ void ReleaseScratchBuffer(void *buffer)
+{
+    if (!buffer)
+        return;
+
+    BYTE *allocation = (BYTE *)buffer - ScratchHeaderSize;
+    ThreadBuffers *threadBuffers = GetCapacity(allocation) <= MaximumKeptCapacity ? GetThreadBuffers(true) : NULL;
+    if (threadBuffers)
+    {
+        // A free slot keeps the buffer, otherwise it replaces a smaller buffer.
+        size_t slot = 0;
+        for (size_t i = 0; i < ThreadBufferCount; ++i)
+        {
+            if (!threadBuffers->buffers[i])
+            {
+                slot = i;
+                break;
+            }
+
+            if (GetCapacity(threadBuffers->buffers[i]) < GetCapacity(threadBuffers->buffers[slot]))
+            {
+                slot = i;
+            }
+        }
+
+        BYTE *replaced = threadBuffers->buffers[slot];
+        if (!replaced || GetCapacity(replaced) < GetCapacity(allocation))
+        {
+            threadBuffers->buffers[slot] = allocation;
+            allocation = replaced;
+        }
+    }
+
+    FreePixelBuffer(allocation);
+}
+
+// Freeing the index calls ReleaseThreadBuffers for the buffers of all threads.
+static void FreeKeptBuffers(const bool keepIndex)
+{
+    if (g_threadBuffersIndex != FLS_OUT_OF_INDEXES)
+    {
+        FlsFree(g_threadBuffersIndex);
+        g_threadBuffersIndex = keepIndex ? FlsAlloc(ReleaseThreadBuffers) : FLS_OUT_OF_INDEXES;
+    }
+}
+
+void EmptyScratchBuffers(void)
+{
+    InitOnceExecuteOnce(&g_initOnce, InitializeScratchBuffers, NULL, NULL);
+    FreeKeptBuffers(true);
+}
+
+void ReleaseScratchBuffers(void)
+{
+    FreeKeptBuffers(false);
+}
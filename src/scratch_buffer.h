@@ -0,0 +1,18 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+// Returns a temporary buffer of at least the size, aligned to PixelBufferAlignment, or NULL when out of memory.
+// The buffers are kept per thread and reused by the following calls of the thread, a buffer in use is not shared:
+// nested and re-entrant callers get their own buffer.
+void *AcquireScratchBuffer(size_t size);
+
+// Returns the buffer to the buffers of the thread, or frees it.
+void ReleaseScratchBuffer(_In_opt_ void *buffer);
+
+// Frees the kept buffers of all threads. Must not be called concurrently with the other functions.
+void EmptyScratchBuffers(void);
+
+// Frees the kept buffers, called when the DLL is unloaded.
+void ReleaseScratchBuffers(void);
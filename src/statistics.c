@@ -0,0 +1,186 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "statistics.h"
+
+#include "allocator.h"
+#include "macros.h"
+#include "row_decoder.h"
+
+
+_Use_decl_annotations_ bool IsStatisticsSupported(const PnmHeader *header)
+{
+    const UINT bitsPerSample = GetPnmBitsPerSample(header);
+    return !IsPlainPnmFormat(header->format) && header->samplesPerPixel == 1 &&
+           (bitsPerSample == 8 || bitsPerSample == 16);
+}
+
+_Use_decl_annotations_ HRESULT InitializeStatisticsAccumulator(StatisticsAccumulator *accumulator,
+                                                               const PnmHeader *header, const UINT binCount,
+                                                               const NetpbmWindowLevel *windowLevel)
+{
+    accumulator->bins = NULL;
+    accumulator->window = NULL;
+    accumulator->scale16 = NULL;
+    if (!IsStatisticsSupported(header))
+        return WINCODEC_ERR_UNSUPPORTEDOPERATION;
+
+    if ((binCount != 256 && binCount != 4096) || (windowLevel && windowLevel->width == 0))
+        return E_INVALIDARG;
+
+    // Lookup tables map every possible sample value, invalid samples above maxValue are counted in the last bin.
+    accumulator->samples16 = GetPnmBitsPerSample(header) == 16;
+    const UINT valueCount = accumulator->samples16 ? USHRT_MAX + 1 : UCHAR_MAX + 1;
+    const UINT maxValue = header->maxValue;
+    accumulator->bins = AllocateMemory(valueCount * sizeof(USHORT));
+    if (!accumulator->bins)
+        return E_OUTOFMEMORY;
+
+    for (UINT value = 0; value < valueCount; ++value)
+    {
+        accumulator->bins[value] =
+            value > maxValue ? (USHORT)(binCount - 1) : (USHORT)((ULONGLONG)value * binCount / (maxValue + 1ULL));
+    }
+
+    if (windowLevel)
+    {
+        accumulator->window = AllocateMemory(valueCount);
+        if (!accumulator->window)
+            return E_OUTOFMEMORY;
+
+        const double low = (double)windowLevel->center - (double)windowLevel->width / 2.0;
+        for (UINT value = 0; value < valueCount; ++value)
+        {
+            const double mapped = ((double)value - low) * 255.0 / (double)windowLevel->width;
+            accumulator->window[value] = mapped <= 0.0 ? 0 : mapped >= 255.0 ? 255 : (BYTE)(mapped + 0.5);
+        }
+    }
+    else if (accumulator->samples16)
+    {
+        // A lookup is faster than the division of ScaleSamples16 for every sample.
+        accumulator->scale16 = AllocateMemory(valueCount * sizeof(USHORT));
+        if (!accumulator->scale16)
+            return E_OUTOFMEMORY;
+
+        for (UINT value = 0; value < valueCount; ++value)
+        {
+            accumulator->scale16[value] =
+                value >= maxValue ? USHRT_MAX : (USHORT)((value * USHRT_MAX + maxValue / 2) / maxValue);
+        }
+    }
+
+    accumulator->statistics.maxValue = maxValue;
+    accumulator->statistics.binCount = binCount;
+    ResetStatisticsAccumulator(accumulator);
+    return S_OK;
+}
+
+_Use_decl_annotations_ void ReleaseStatisticsAccumulator(StatisticsAccumulator *accumulator)
+{
+    FreeMemory(accumulator->bins);
+    FreeMemory(accumulator->window);
+    FreeMemory(accumulator->scale16);
+}
+
+_Use_decl_annotations_ void ResetStatisticsAccumulator(StatisticsAccumulator *accumulator)
+{
+    accumulator->statistics.minimum = UINT_MAX;
+    accumulator->statistics.maximum = 0;
+    accumulator->statistics.mean = 0;
+    memset(accumulator->statistics.histogram, 0, sizeof(accumulator->statistics.histogram));
+    accumulator->sum = 0;
+    accumulator->sampleCount = 0;
+}
+
+static void AccumulateSamples(_Inout_ StatisticsAccumulator *accumulator, _In_ const BYTE *source, const size_t count)
+{
+    const USHORT *bins = accumulator->bins;
+    ULONGLONG *histogram = accumulator->statistics.histogram;
+    UINT minimum = accumulator->statistics.minimum;
+    UINT maximum = accumulator->statistics.maximum;
+    ULONGLONG sum = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const UINT value = accumulator->samples16 ? (UINT)source[i * 2] << 8 | source[i * 2 + 1] : source[i];
+        ++histogram[bins[value]];
+        minimum = value < minimum ? value : minimum;
+        maximum = value > maximum ? value : maximum;
+        sum += value;
+    }
+
+    accumulator->statistics.minimum = minimum;
+    accumulator->statistics.maximum = maximum;
+    accumulator->sum += sum;
+    accumulator->sampleCount += count;
+}
+
+_Use_decl_annotations_ void ConvertGraySamplesWithStatistics(StatisticsAccumulator *accumulator, const BYTE *scaleTable,
+                                                             const BYTE *source, BYTE *destination, const size_t count)
+{
+    // The samples are processed in blocks that stay in the L1 cache: the statistics are accumulated and then the
+    // block is converted. Stores into the block in the loop that updates the histogram make that loop several
+    // times slower, the loads of the histogram are then delayed by the stores.
+    enum { BlockSize = 2048 };
+    const size_t sampleSize = accumulator->samples16 ? 2 : 1;
+    const BYTE *window = accumulator->window;
+    for (size_t block = 0; block < count; block += BlockSize)
+    {
+        const size_t blockCount = count - block < BlockSize ? count - block : BlockSize;
+        const BYTE *blockSource = source + block * sampleSize;
+        AccumulateSamples(accumulator, blockSource, blockCount);
+
+        // 16-bit samples are read as bytes: the destination may overlap the source (also for 8-bit window output).
+        if (!accumulator->samples16)
+        {
+            const BYTE *outputTable = window ? window : scaleTable;
+            for (size_t i = 0; i < blockCount; ++i)
+            {
+                destination[block + i] = outputTable[blockSource[i]];
+            }
+        }
+        else if (window)
+        {
+            for (size_t i = 0; i < blockCount; ++i)
+            {
+                destination[block + i] = window[(UINT)blockSource[i * 2] << 8 | blockSource[i * 2 + 1]];
+            }
+        }
+        else
+        {
+            const USHORT *scale16 = accumulator->scale16;
+            for (size_t i = 0; i < blockCount; ++i)
+            {
+                ((USHORT *)destination)[block + i] = scale16[(UINT)blockSource[i * 2] << 8 | blockSource[i * 2 + 1]];
+            }
+        }
+    }
+}
+
+_Use_decl_annotations_ void GetAccumulatedStatistics(const StatisticsAccumulator *accumulator,
+                                                     NetpbmStatistics *statistics)
+{
+    *statistics = accumulator->statistics;
+    if (accumulator->sampleCount == 0)
+    {
+        statistics->minimum = 0;
+        return;
+    }
+
+    statistics->mean = (double)accumulator->sum / (double)accumulator->sampleCount;
+}
+
+_Use_decl_annotations_ HRESULT STDMETHODCALLTYPE NetpbmDecodeRowsWithStatistics(IStream *stream, const UINT binCount,
+                                                                                const NetpbmWindowLevel *windowLevel,
+                                                                                const UINT bandHeight,
+                                                                                const NetpbmRowSink sink, void *context,
+                                                                                NetpbmStatistics *statistics)
+{
+    TRACE("netpbm-wic-codec-c::NetpbmDecodeRowsWithStatistics\n");
+
+    if (!stream || !sink || !statistics)
+        return E_INVALIDARG;
+
+    return DecodeStreamRows(stream, NULL, binCount, windowLevel, statistics, bandHeight, sink, context);
+}
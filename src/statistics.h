@@ -0,0 +1,37 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "netpbm_statistics.h"
+#include "pnm_header.h"
+
+// Accumulates the statistics of graymap samples while they are converted to the output pixel format.
+typedef struct StatisticsAccumulator
+{
+    NetpbmStatistics statistics; // The mean is computed by GetAccumulatedStatistics.
+    ULONGLONG sum;
+    ULONGLONG sampleCount;
+    bool samples16;
+    USHORT *bins;                // Histogram bin of every sample value (256 or 65536 entries).
+    BYTE *window;                // 8-bit window/level value of every sample value, NULL to keep the sample format.
+    USHORT *scale16;             // Scaled 16-bit value of every sample value, when there is no window.
+} StatisticsAccumulator;
+
+// Returns true for binary graymaps with 8 or 16-bit samples.
+bool IsStatisticsSupported(_In_ const PnmHeader *header);
+
+// ReleaseStatisticsAccumulator must also be called when the initialization fails.
+HRESULT InitializeStatisticsAccumulator(_Out_ StatisticsAccumulator *accumulator, _In_ const PnmHeader *header,
+                                        UINT binCount, _In_opt_ const NetpbmWindowLevel *windowLevel);
+void ReleaseStatisticsAccumulator(_Inout_ StatisticsAccumulator *accumulator);
+
+// Restarts the accumulation, for example after a failed decode.
+void ResetStatisticsAccumulator(_Inout_ StatisticsAccumulator *accumulator);
+
+// Converts count file samples (big endian when 16-bit) to the output format, scaled as by ConvertPnmPixels or mapped
+// to 8-bit by the window, and accumulates their statistics in the same pass. Source and destination may be the same.
+void ConvertGraySamplesWithStatistics(_Inout_ StatisticsAccumulator *accumulator, _In_reads_(256) const BYTE *scaleTable,
+                                      _In_ const BYTE *source, _Out_ BYTE *destination, size_t count);
+
+void GetAccumulatedStatistics(_In_ const StatisticsAccumulator *accumulator, _Out_ NetpbmStatistics *statistics);
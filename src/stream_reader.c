@@ -0,0 +1,365 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "stream_reader.h"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#include <immintrin.h>
+#define USE_SSE2
+#endif
+
+
+static HRESULT Fill(_Inout_ StreamReader *reader)
+{
+    if (reader->endOfStream)
+        return S_FALSE;
+
+    reader->bufferPosition += reader->size;
+    reader->position = 0;
+    reader->size = 0;
+
+    ULONG bytesRead;
+    const HRESULT result = reader->stream->lpVtbl->Read(reader->stream, reader->buffer, sizeof(reader->buffer), &bytesRead);
+    if (FAILED(result))
+        return result;
+
+    reader->size = bytesRead;
+    if (bytesRead == 0)
+    {
+        reader->endOfStream = true;
+        return S_FALSE;
+    }
+
+    return S_OK;
+}
+
+_Use_decl_annotations_ void StreamReaderInitialize(StreamReader *reader, IStream *stream, const ULONGLONG streamPosition)
+{
+    reader->stream = stream;
+    reader->bufferPosition = streamPosition;
+    reader->position = 0;
+    reader->size = 0;
+    reader->endOfStream = false;
+    reader->comments = NULL;
+}
+
+_Use_decl_annotations_ ULONGLONG StreamReaderGetPosition(const StreamReader *reader)
+{
+    return reader->bufferPosition + reader->position;
+}
+
+_Use_decl_annotations_ HRESULT StreamReaderFillOnce(StreamReader *reader)
+{
+    const HRESULT result = Fill(reader);
+    if (reader->size < sizeof(reader->buffer))
+    {
+        reader->endOfStream = true;
+    }
+
+    return FAILED(result) ? result : S_OK;
+}
+
+_Use_decl_annotations_ HRESULT StreamReaderPeekByte(StreamReader *reader, BYTE *value)
+{
+    if (reader->position == reader->size)
+    {
+        const HRESULT result = Fill(reader);
+        if (result != S_OK)
+        {
+            *value = 0;
+            return result;
+        }
+    }
+
+    *value = reader->buffer[reader->position];
+    return S_OK;
+}
+
+_Use_decl_annotations_ HRESULT StreamReaderReadByte(StreamReader *reader, BYTE *value)
+{
+    const HRESULT result = StreamReaderPeekByte(reader, value);
+    if (result == S_OK)
+    {
+        ++reader->position;
+    }
+
+    return result;
+}
+
+_Use_decl_annotations_ HRESULT StreamReaderRead(StreamReader *reader, void *buffer, const ULONG size, ULONG *bytesRead)
+{
+    BYTE *destination = buffer;
+    const ULONG bufferedSize = reader->size - reader->position < size ? reader->size - reader->position : size;
+    memcpy(destination, reader->buffer + reader->position, bufferedSize);
+    reader->position += bufferedSize;
+    *bytesRead = bufferedSize;
+
+    // The remaining bytes are read directly into the destination. Pipes may return less than requested before the
+    // end of the stream is reached.
+    if (bufferedSize < size)
+    {
+        reader->bufferPosition += reader->size;
+        reader->position = 0;
+        reader->size = 0;
+    }
+
+    while (*bytesRead < size && !reader->endOfStream)
+    {
+        ULONG chunkSize;
+        const HRESULT result =
+            reader->stream->lpVtbl->Read(reader->stream, destination + *bytesRead, size - *bytesRead, &chunkSize);
+        if (FAILED(result))
+            return result;
+
+        reader->endOfStream = chunkSize == 0;
+        reader->bufferPosition += chunkSize;
+        *bytesRead += chunkSize;
+    }
+
+    return S_OK;
+}
+
+_Use_decl_annotations_ HRESULT StreamReaderReadExactly(StreamReader *reader, void *buffer, const ULONG size)
+{
+    ULONG bytesRead;
+    const HRESULT result = StreamReaderRead(reader, buffer, size, &bytesRead);
+    if (FAILED(result))
+        return result;
+
+    return bytesRead == size ? S_OK : WINCODEC_ERR_BADIMAGE;
+}
+
+bool IsPnmWhitespace(const BYTE value)
+{
+    return value == ' ' || value == '\t' || value == '\n' || value == '\r' || value == '\v' || value == '\f';
+}
+
+static void AddCommentRange(_Inout_ CommentRanges *comments, const ULONGLONG position, const ULONGLONG size)
+{
+    const ULONG remainingSize = MaxCommentTextSize - comments->textSize;
+    if (comments->count == MaxCommentCount || remainingSize == 0)
+        return;
+
+    CommentRange *range = &comments->ranges[comments->count++];
+    range->position = position;
+    range->size = size < remainingSize ? (ULONG)size : remainingSize;
+    comments->textSize += range->size;
+}
+
+// Returns the offset of the first byte that is not whitespace, or size when all bytes are whitespace.
+static ULONG FindNonWhitespace(_In_reads_(size) const BYTE *buffer, const ULONG size)
+{
+    ULONG i = 0;
+
+#ifdef USE_SSE2
+    // Whitespace is ' ' or in the range ['\t', '\r'].
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i controlRange = _mm_set1_epi8('\r' - '\t');
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m128i value = _mm_loadu_si128((const __m128i *)(buffer + i));
+        const __m128i offset = _mm_sub_epi8(value, tab);
+        const __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(offset, controlRange), offset);
+        const int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(value, space), control)) ^ 0xFFFF;
+        if (mask != 0)
+        {
+            unsigned long index;
+            _BitScanForward(&index, (unsigned long)mask);
+            return i + index;
+        }
+    }
+#endif
+
+    for (; i < size && IsPnmWhitespace(buffer[i]); ++i)
+    {
+    }
+
+    return i;
+}
+
+// Returns the offset of the first '\n' or '\r', or size when the bytes contain no line end.
+static ULONG FindLineEnd(_In_reads_(size) const BYTE *buffer, const ULONG size)
+{
+    ULONG i = 0;
+
+#ifdef USE_SSE2
+    const __m128i lineFeed = _mm_set1_epi8('\n');
+    const __m128i carriageReturn = _mm_set1_epi8('\r');
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m128i value = _mm_loadu_si128((const __m128i *)(buffer + i));
+        const int mask =
+            _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(value, lineFeed), _mm_cmpeq_epi8(value, carriageReturn)));
+        if (mask != 0)
+        {
+            unsigned long index;
+            _BitScanForward(&index, (unsigned long)mask);
+            return i + index;
+        }
+    }
+#endif
+
+    for (; i < size && buffer[i] != '\n' && buffer[i] != '\r'; ++i)
+    {
+    }
+
+    return i;
+}
+
+// Whitespace and comments are skipped by searching the buffered bytes, 16 bytes at a time when SSE2 is available:
+// large comment blocks are skipped at the speed at which the stream can be read.
+_Use_decl_annotations_ HRESULT StreamReaderSkipWhitespaceAndComments(StreamReader *reader)
+{
+    for (;;)
+    {
+        if (reader->position == reader->size)
+        {
+            const HRESULT result = Fill(reader);
+            if (result != S_OK)
+                return result;
+        }
+
+        reader->position += FindNonWhitespace(reader->buffer + reader->position, reader->size - reader->position);
+        if (reader->position == reader->size)
+            continue;
+
+        if (reader->buffer[reader->position] != '#')
+            return S_OK;
+
+        ++reader->position;
+        const ULONGLONG textPosition = StreamReaderGetPosition(reader);
+        for (;;)
+        {
+            if (reader->position == reader->size)
+            {
+                const HRESULT result = Fill(reader);
+                if (result != S_OK)
+                    return result;
+            }
+
+            reader->position += FindLineEnd(reader->buffer + reader->position, reader->size - reader->position);
+            if (reader->position != reader->size)
+                break;
+        }
+
+        if (reader->comments)
+        {
+            AddCommentRange(reader->comments, textPosition, StreamReaderGetPosition(reader) - textPosition);
+        }
+
+        ++reader->position; // The line end.
+    }
+}
+
+_Use_decl_annotations_ HRESULT StreamReaderReadUnsigned(StreamReader *reader, UINT *value)
+{
+    *value = 0;
+
+    HRESULT result = StreamReaderSkipWhitespaceAndComments(reader);
+    if (result != S_OK)
+        return result;
+
+    ULONGLONG number = 0;
+    bool digitFound = false;
+    for (;;)
+    {
+        BYTE digit;
+        result = StreamReaderPeekByte(reader, &digit);
+        if (FAILED(result))
+            return result;
+
+        if (result == S_FALSE || digit < '0' || digit > '9')
+            break;
+
+        number = number * 10 + (digit - '0');
+        if (number > UINT_MAX)
+            return S_FALSE;
+
+        digitFound = true;
+        ++reader->position;
+    }
+
+    if (!digitFound)
+        return S_FALSE;
+
+    *value = (UINT)number;
+    return S_OK;
+}
+
+_Use_decl_annotations_ HRESULT StreamReaderReadBit(StreamReader *reader, UINT *value)
+{
+    *value = 0;
+
+    HRESULT result = StreamReaderSkipWhitespaceAndComments(reader);
+    if (result != S_OK)
+        return result;
+
+    BYTE digit;
+    result = StreamReaderReadByte(reader, &digit);
+    if (result != S_OK)
+        return result;
+
+    if (digit != '0' && digit != '1')
+        return S_FALSE;
+
+    *value = digit - '0';
+    return S_OK;
+}
+
+_Use_decl_annotations_ HRESULT StreamReaderReadToken(StreamReader *reader, char *token, const size_t size)
+{
+    token[0] = 0;
+
+    HRESULT result = StreamReaderSkipWhitespaceAndComments(reader);
+    if (result != S_OK)
+        return result;
+
+    size_t length = 0;
+    for (;;)
+    {
+        BYTE value;
+        result = StreamReaderPeekByte(reader, &value);
+        if (FAILED(result))
+            return result;
+
+        if (result == S_FALSE || IsPnmWhitespace(value))
+            break;
+
+        if (length + 1 == size)
+            return S_FALSE;
+
+        token[length++] = (char)value;
+        ++reader->position;
+    }
+
+    token[length] = 0;
+    return length == 0 ? S_FALSE : S_OK;
+}
+
+_Use_decl_annotations_ HRESULT ReadExactly(IStream *stream, void *buffer, const ULONG size)
+{
+    ULONG bytesRead;
+    const HRESULT result = stream->lpVtbl->Read(stream, buffer, size, &bytesRead);
+    if (FAILED(result))
+        return result;
+
+    return bytesRead == size ? S_OK : WINCODEC_ERR_BADIMAGE;
+}
+
+_Use_decl_annotations_ HRESULT SeekTo(IStream *stream, const ULONGLONG position)
+{
+    LARGE_INTEGER move;
+    move.QuadPart = (LONGLONG)position;
+    return stream->lpVtbl->Seek(stream, move, STREAM_SEEK_SET, NULL);
+}
+
+_Use_decl_annotations_ bool IsSeekableStream(IStream *stream)
+{
+    const LARGE_INTEGER move = {};
+    ULARGE_INTEGER position;
+    return SUCCEEDED(stream->lpVtbl->Seek(stream, move, STREAM_SEEK_CUR, &position));
+}
@@ -0,0 +1,88 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+// Byte range of the text of a '#' comment: the bytes after the '#' up to the end of the line.
+typedef struct CommentRange
+{
+    ULONGLONG position;
+    ULONG size;
+} CommentRange;
+
+enum
+{
+    MaxCommentCount = 16,
+    MaxCommentTextSize = 64 * 1024
+};
+
+// The comments of a header, recorded while they are skipped. Only the ranges are stored, the text can be read later.
+// The comments after the first MaxCommentCount are not recorded and the total size is limited to MaxCommentTextSize
+// (the last recorded comment may be truncated): the memory needed for the text is bounded.
+typedef struct CommentRanges
+{
+    UINT count;
+    ULONG textSize;
+    CommentRange ranges[MaxCommentCount];
+} CommentRanges;
+
+// Small buffered reader on top of an IStream.
+// Used to tokenize the text parts (header, plain format samples) of Netpbm files without
+// calling IStream::Read for every byte.
+typedef struct StreamReader
+{
+    IStream *stream;
+    ULONGLONG bufferPosition; // Stream position of buffer[0].
+    ULONG position;
+    ULONG size;
+    bool endOfStream;
+    CommentRanges *comments; // Optional, receives the ranges of the skipped comments.
+    BYTE buffer[4096];
+} StreamReader;
+
+// The stream must be positioned at streamPosition.
+void StreamReaderInitialize(_Out_ StreamReader *reader, _In_ IStream *stream, ULONGLONG streamPosition);
+
+ULONGLONG StreamReaderGetPosition(_In_ const StreamReader *reader);
+
+// Fills the buffer with a single read. A read that doesn't fill the buffer is taken as the end of the stream, reading
+// beyond a full buffer continues with the following reads. Used to parse a header at the cost of one small read,
+// without failing for the rare headers that don't fit (comment blocks of any size).
+HRESULT StreamReaderFillOnce(_Inout_ StreamReader *reader);
+
+// Returns S_FALSE when the end of the stream has been reached.
+HRESULT StreamReaderPeekByte(_Inout_ StreamReader *reader, _Out_ BYTE *value);
+HRESULT StreamReaderReadByte(_Inout_ StreamReader *reader, _Out_ BYTE *value);
+
+// Skips whitespace and '#' comments (which run until the end of the line).
+HRESULT StreamReaderSkipWhitespaceAndComments(_Inout_ StreamReader *reader);
+
+// Skips whitespace and comments and reads a decimal number.
+// Returns S_FALSE when no (valid) number is present at the current position.
+HRESULT StreamReaderReadUnsigned(_Inout_ StreamReader *reader, _Out_ UINT *value);
+
+// Skips whitespace and comments and reads a single '0' or '1' digit (plain bitmaps don't need separators).
+// Returns S_FALSE when no bit is present at the current position.
+HRESULT StreamReaderReadBit(_Inout_ StreamReader *reader, _Out_ UINT *value);
+
+// Skips whitespace and comments and reads a token of non-whitespace characters as a zero terminated string.
+// Returns S_FALSE when no token is present or when it doesn't fit in the buffer.
+HRESULT StreamReaderReadToken(_Inout_ StreamReader *reader, _Out_writes_z_(size) char *token, size_t size);
+
+// Reads up to size bytes, the buffered bytes are used first. bytesRead is less than size at the end of the stream.
+HRESULT StreamReaderRead(_Inout_ StreamReader *reader, _Out_writes_bytes_to_(size, *bytesRead) void *buffer, ULONG size,
+                         _Out_ ULONG *bytesRead);
+
+// Reads exactly size bytes, the buffered bytes are used first (used to read binary samples after the header of a
+// non-seekable stream). A partial read is reported as WINCODEC_ERR_BADIMAGE.
+HRESULT StreamReaderReadExactly(_Inout_ StreamReader *reader, _Out_writes_bytes_all_(size) void *buffer, ULONG size);
+
+bool IsPnmWhitespace(BYTE value);
+
+// Reads exactly size bytes, a partial read is reported as WINCODEC_ERR_BADIMAGE (truncated file).
+HRESULT ReadExactly(_In_ IStream *stream, _Out_writes_bytes_all_(size) void *buffer, ULONG size);
+
+HRESULT SeekTo(_In_ IStream *stream, ULONGLONG position);
+
+// Returns false for streams that cannot seek (pipes), these can only be decoded in a single pass.
+bool IsSeekableStream(_In_ IStream *stream);
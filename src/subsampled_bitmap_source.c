@@ -0,0 +1,336 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "subsampled_bitmap_source.h"
+
+#include "allocator.h"
+#include "macros.h"
+#include "module.h"
+#include "scratch_buffer.h"
+#include "stream_reader.h"
+
+
+typedef struct SubsampledBitmapSource
+{
+    IWICBitmapSource wicBitmapSource;
+    LONG refCount;
+    UINT width;
+    UINT height;
+    UINT samplesPerPixel;
+    BYTE *pixels; // Allocated together with the object.
+} SubsampledBitmapSource;
+
+
+static ULONG __stdcall AddRef(_In_ IWICBitmapSource *this)
+{
+    SubsampledBitmapSource *bitmapSource = (SubsampledBitmapSource *)this;
+    return InterlockedIncrement(&bitmapSource->refCount);
+}
+
+static ULONG __stdcall Release(_In_ IWICBitmapSource *this)
+{
+    SubsampledBitmapSource *bitmapSource = (SubsampledBitmapSource *)this;
+    const ULONG refCount = InterlockedDecrement(&bitmapSource->refCount);
+    if (refCount == 0)
+    {
+        FreeMemory(bitmapSource);
+        ModuleRelease();
+    }
+
+    return refCount;
+}
+
+static HRESULT __stdcall QueryInterface(_In_ IWICBitmapSource *this, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+{
+    static const QITAB qiTable[] = {QITABENT(SubsampledBitmapSource, IWICBitmapSource), {NULL, 0}};
+
+    return QISearch(this, qiTable, riid, ppv);
+}
+
+static HRESULT __stdcall GetSize(_In_ IWICBitmapSource *this, UINT *puiWidth, UINT *puiHeight)
+{
+    if (!puiWidth || !puiHeight)
+        return E_POINTER;
+
+    const SubsampledBitmapSource *bitmapSource = (SubsampledBitmapSource *)this;
+    *puiWidth = bitmapSource->width;
+    *puiHeight = bitmapSource->height;
+    return S_OK;
+}
+
+static HRESULT __stdcall GetPixelFormat(_In_ IWICBitmapSource *this, WICPixelFormatGUID *pPixelFormat)
+{
+    if (!pPixelFormat)
+        return E_POINTER;
+
+    const SubsampledBitmapSource *bitmapSource = (SubsampledBitmapSource *)this;
+    memcpy(pPixelFormat,
+           bitmapSource->samplesPerPixel == 1 ? &GUID_WICPixelFormat8bppGray : &GUID_WICPixelFormat24bppRGB,
+           sizeof(GUID));
+    return S_OK;
+}
+
+static HRESULT __stdcall GetResolution([[maybe_unused]] IWICBitmapSource *this, double *pDpiX, double *pDpiY)
+{
+    if (!pDpiX || !pDpiY)
+        return E_POINTER;
+
+    // The Netpbm format has no resolution information, use the default of 96 DPI.
+    *pDpiX = 96.0;
+    *pDpiY = 96.0;
+    return S_OK;
+}
+
+static HRESULT __stdcall CopyPalette([[maybe_unused]] IWICBitmapSource *this, [[maybe_unused]] IWICPalette *pIPalette)
+{
+    return WINCODEC_ERR_PALETTEUNAVAILABLE;
+}
+
+static HRESULT __stdcall CopyPixels(_In_ IWICBitmapSource *this, const WICRect *prc, const UINT cbStride,
+                                    const UINT cbBufferSize, BYTE *pbBuffer)
+{
+    if (!pbBuffer)
+        return E_INVALIDARG;
+
+    const SubsampledBitmapSource *bitmapSource = (SubsampledBitmapSource *)this;
+    WICRect rect = {0, 0, (INT)bitmapSource->width, (INT)bitmapSource->height};
+    if (prc)
+    {
+        if (prc->X < 0 || prc->Y < 0 || prc->Width < 0 || prc->Height < 0 ||
+            (UINT)prc->X + (UINT)prc->Width > bitmapSource->width ||
+            (UINT)prc->Y + (UINT)prc->Height > bitmapSource->height)
+            return E_INVALIDARG;
+
+        rect = *prc;
+    }
+
+    const UINT sourceStride = bitmapSource->width * bitmapSource->samplesPerPixel;
+    const UINT rowSize = (UINT)rect.Width * bitmapSource->samplesPerPixel;
+    if (cbStride < rowSize)
+        return E_INVALIDARG;
+
+    if (rect.Height == 0)
+        return S_OK;
+
+    if (cbBufferSize < (ULONGLONG)cbStride * (rect.Height - 1) + rowSize)
+        return WINCODEC_ERR_INSUFFICIENTBUFFER;
+
+    const BYTE *source =
+        bitmapSource->pixels + (size_t)rect.Y * sourceStride + (size_t)rect.X * bitmapSource->samplesPerPixel;
+    for (INT row = 0; row < rect.Height; ++row)
+    {
+        memcpy(pbBuffer, source, rowSize);
+        source += sourceStride;
+        pbBuffer += cbStride;
+    }
+
+    return S_OK;
+}
+
+// Returns the source index that is at the center of the area that the target index covers.
+static UINT GetSourceIndex(const UINT targetIndex, const UINT sourceSize, const UINT targetSize)
+{
+    return (UINT)(((2ULL * targetIndex + 1) * sourceSize) / (2ULL * targetSize));
+}
+
+static BYTE ScaleTo8Bit(const UINT value, const UINT maxValue)
+{
+    if (value >= maxValue)
+        return 255;
+
+    return (BYTE)((value * 255 + maxValue / 2) / maxValue);
+}
+
+static BYTE FloatTo8Bit(_In_reads_(4) const BYTE *sample, const bool littleEndian)
+{
+    const UINT bits = littleEndian ? (UINT)sample[0] | (UINT)sample[1] << 8 | (UINT)sample[2] << 16 | (UINT)sample[3] << 24
+                                   : (UINT)sample[0] << 24 | (UINT)sample[1] << 16 | (UINT)sample[2] << 8 | sample[3];
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+
+    // Float samples are not limited to [0, 1], clamp the out of range values (and NaN) for the 8-bit preview.
+    if (!(value > 0.0F))
+        return 0;
+
+    if (value >= 1.0F)
+        return 255;
+
+    return (BYTE)(value * 255.0F + 0.5F);
+}
+
+static HRESULT SampleBinaryPixels(_In_ IStream *stream, _In_ const PnmHeader *header,
+                                  _Inout_ SubsampledBitmapSource *bitmapSource)
+{
+    const bool bitmap = header->format == PnmFormatBitmap;
+    const bool floatSamples = IsFloatPnmFormat(header->format);
+    const UINT bytesPerSample = GetPnmBitsPerSample(header) / 8;
+    const UINT bytesPerPixel = header->samplesPerPixel * bytesPerSample;
+    const UINT outputSamples = bitmapSource->samplesPerPixel;
+
+    // Only the span between the first and the last sampled column is read from a sampled row.
+    const UINT firstColumn = GetSourceIndex(0, header->width, bitmapSource->width);
+    const UINT lastColumn = GetSourceIndex(bitmapSource->width - 1, header->width, bitmapSource->width);
+    const UINT spanStart = bitmap ? firstColumn / 8 : firstColumn * bytesPerPixel;
+    const UINT spanEnd = bitmap ? lastColumn / 8 + 1 : (lastColumn + 1) * bytesPerPixel;
+
+    BYTE *span = AcquireScratchBuffer(spanEnd - spanStart);
+    if (!span)
+        return E_OUTOFMEMORY;
+
+    const UINT rowSize = GetPnmRowSize(header);
+    BYTE *destination = bitmapSource->pixels;
+    HRESULT result = S_OK;
+    for (UINT y = 0; y < bitmapSource->height; ++y)
+    {
+        // The rows of PFM files are stored from bottom to top.
+        UINT sourceRow = GetSourceIndex(y, header->height, bitmapSource->height);
+        sourceRow = floatSamples ? header->height - 1 - sourceRow : sourceRow;
+        result = SeekTo(stream, header->dataOffset + (ULONGLONG)sourceRow * rowSize + spanStart);
+        if (FAILED(result))
+            break;
+
+        result = ReadExactly(stream, span, spanEnd - spanStart);
+        if (FAILED(result))
+            break;
+
+        for (UINT x = 0; x < bitmapSource->width; ++x)
+        {
+            const UINT sourceColumn = GetSourceIndex(x, header->width, bitmapSource->width);
+            if (bitmap)
+            {
+                // A set bit is black in the Netpbm format.
+                const BYTE bits = span[sourceColumn / 8 - spanStart];
+                *destination++ = (BYTE)((bits >> (7 - sourceColumn % 8)) & 1 ? 0 : 255);
+                continue;
+            }
+
+            // The first samples hold the gray or RGB values, alpha and extra PAM channels are skipped.
+            const BYTE *sample = span + (sourceColumn * bytesPerPixel - spanStart);
+            for (UINT i = 0; i < outputSamples; ++i)
+            {
+                if (floatSamples)
+                {
+                    *destination++ = FloatTo8Bit(sample + 4 * i, header->littleEndian);
+                    continue;
+                }
+
+                // 16-bit samples are stored big endian.
+                const UINT value = bytesPerSample == 1 ? sample[i] : ((UINT)sample[2 * i] << 8) | sample[2 * i + 1];
+                *destination++ = ScaleTo8Bit(value, header->maxValue);
+            }
+        }
+    }
+
+    ReleaseScratchBuffer(span);
+    return result;
+}
+
+static HRESULT SamplePlainPixels(_In_ IStream *stream, _In_ const PnmHeader *header,
+                                 _Inout_ SubsampledBitmapSource *bitmapSource)
+{
+    // Plain (ASCII) samples have no fixed size, all rows up to the last sampled row need to be scanned.
+    HRESULT result = SeekTo(stream, header->dataOffset);
+    if (FAILED(result))
+        return result;
+
+    StreamReader reader;
+    StreamReaderInitialize(&reader, stream, header->dataOffset);
+
+    const bool bitmap = header->format == PnmFormatPlainBitmap;
+    BYTE *destination = bitmapSource->pixels;
+    UINT y = 0;
+    for (UINT sourceRow = 0; y < bitmapSource->height; ++sourceRow)
+    {
+        const bool sampledRow = sourceRow == GetSourceIndex(y, header->height, bitmapSource->height);
+        UINT x = 0;
+        for (UINT column = 0; column < header->width; ++column)
+        {
+            const bool sampled = sampledRow && x < bitmapSource->width &&
+                                 column == GetSourceIndex(x, header->width, bitmapSource->width);
+            for (UINT i = 0; i < header->samplesPerPixel; ++i)
+            {
+                UINT value;
+                result = bitmap ? StreamReaderReadBit(&reader, &value) : StreamReaderReadUnsigned(&reader, &value);
+                if (FAILED(result))
+                    return result;
+
+                if (result == S_FALSE || value > header->maxValue)
+                    return WINCODEC_ERR_BADIMAGE;
+
+                if (sampled && i < bitmapSource->samplesPerPixel)
+                {
+                    *destination++ = bitmap ? (BYTE)(value ? 0 : 255) : ScaleTo8Bit(value, header->maxValue);
+                }
+            }
+
+            if (sampled)
+            {
+                ++x;
+            }
+        }
+
+        if (sampledRow)
+        {
+            ++y;
+        }
+    }
+
+    return S_OK;
+}
+
+_Use_decl_annotations_ HRESULT CreateSubsampledBitmapSource(IStream *stream, const PnmHeader *header, const UINT maxSize,
+                                                            IWICBitmapSource **bitmapSource)
+{
+    *bitmapSource = NULL;
+
+    // Keep the aspect ratio, images that are already small enough are not scaled.
+    UINT width = header->width;
+    UINT height = header->height;
+    if (width > maxSize || height > maxSize)
+    {
+        if (width >= height)
+        {
+            height = (UINT)(((ULONGLONG)height * maxSize + width / 2) / width);
+            width = maxSize;
+        }
+        else
+        {
+            width = (UINT)(((ULONGLONG)width * maxSize + height / 2) / height);
+            height = maxSize;
+        }
+
+        width = width == 0 ? 1 : width;
+        height = height == 0 ? 1 : height;
+    }
+
+    const UINT samplesPerPixel = IsColorTupleType(header->tupleType) ? 3 : 1;
+    const size_t pixelsSize = (size_t)width * height * samplesPerPixel;
+    SubsampledBitmapSource *subsampledBitmapSource = AllocateMemory(sizeof(SubsampledBitmapSource) + pixelsSize);
+    if (!subsampledBitmapSource)
+        return E_OUTOFMEMORY;
+
+    static const IWICBitmapSourceVtbl wicBitmapSourceVtbl = {QueryInterface, AddRef,        Release,   GetSize,
+                                                             GetPixelFormat, GetResolution, CopyPalette, CopyPixels};
+
+    subsampledBitmapSource->wicBitmapSource.lpVtbl = &wicBitmapSourceVtbl;
+    subsampledBitmapSource->refCount = 1;
+    subsampledBitmapSource->width = width;
+    subsampledBitmapSource->height = height;
+    subsampledBitmapSource->samplesPerPixel = samplesPerPixel;
+    subsampledBitmapSource->pixels = (BYTE *)(subsampledBitmapSource + 1);
+
+    const HRESULT result = IsPlainPnmFormat(header->format)
+                               ? SamplePlainPixels(stream, header, subsampledBitmapSource)
+                               : SampleBinaryPixels(stream, header, subsampledBitmapSource);
+    if (FAILED(result))
+    {
+        FreeMemory(subsampledBitmapSource);
+        return result;
+    }
+
+    ModuleAddRef();
+    *bitmapSource = &subsampledBitmapSource->wicBitmapSource;
+    return S_OK;
+}
@@ -0,0 +1,18 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "pnm_header.h"
+
+// Longest edge of the images returned by GetThumbnail and GetPreview.
+enum
+{
+    ThumbnailMaxSize = 256,
+    PreviewMaxSize = 1024
+};
+
+// Creates an in-memory bitmap source (8bppGray or 24bppRGB) with a longest edge of at most maxSize pixels.
+// Only the sampled rows of binary files are read from the stream, which makes it a cheap thumbnail or preview.
+HRESULT CreateSubsampledBitmapSource(_In_ IStream *stream, _In_ const PnmHeader *header, UINT maxSize,
+                                     _COM_Outptr_ IWICBitmapSource **bitmapSource);
@@ -0,0 +1,114 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "pch.h"
+
+#include "netpbm_validation.h"
+
+#include "allocator.h"
+#include "macros.h"
+#include "pixel_converter.h"
+#include "pnm_header.h"
+#include "stream_reader.h"
+
+
+// Binary samples are checked in chunks, which bounds the memory use independent of the size of the image.
+// The chunk size is a multiple of the sample size: samples never straddle 2 chunks.
+enum
+{
+    ValidationChunkSize = 1 << 16
+};
+
+static HRESULT ValidatePlainSamples(_Inout_ StreamReader *reader, _In_ const PnmHeader *header,
+                                    _Out_ ULONGLONG *badOffset)
+{
+    const bool bitmap = header->format == PnmFormatPlainBitmap;
+    const ULONGLONG sampleCount = (ULONGLONG)header->width * header->height * header->samplesPerPixel;
+    for (ULONGLONG i = 0; i < sampleCount; ++i)
+    {
+        HRESULT result = StreamReaderSkipWhitespaceAndComments(reader);
+        *badOffset = StreamReaderGetPosition(reader);
+        if (FAILED(result))
+            return result;
+
+        UINT value;
+        result = bitmap ? StreamReaderReadBit(reader, &value) : StreamReaderReadUnsigned(reader, &value);
+        if (FAILED(result))
+            return result;
+
+        if (result == S_FALSE || value > header->maxValue)
+            return WINCODEC_ERR_BADIMAGE;
+    }
+
+    *badOffset = StreamReaderGetPosition(reader);
+    return S_OK;
+}
+
+static HRESULT ValidateBinarySamples(_Inout_ StreamReader *reader, _In_ const PnmHeader *header,
+                                     _Out_ ULONGLONG *badOffset)
+{
+    // Bitmap and float samples have no invalid values, only their size is checked.
+    const UINT bitsPerSample = GetPnmBitsPerSample(header);
+    const bool checkSamples8 = bitsPerSample == 8 && header->maxValue != UCHAR_MAX;
+    const bool checkSamples16 = bitsPerSample == 16 && header->maxValue != USHRT_MAX;
+    *badOffset = header->dataOffset;
+    BYTE *chunk = AllocateMemory(ValidationChunkSize);
+    if (!chunk)
+        return E_OUTOFMEMORY;
+
+    const ULONGLONG end = header->dataOffset + (ULONGLONG)GetPnmRowSize(header) * header->height;
+    HRESULT result = S_OK;
+    while (*badOffset < end)
+    {
+        const ULONG size = end - *badOffset < ValidationChunkSize ? (ULONG)(end - *badOffset) : ValidationChunkSize;
+        ULONG bytesRead;
+        result = StreamReaderRead(reader, chunk, size, &bytesRead);
+        if (FAILED(result))
+            break;
+
+        size_t validSize = bytesRead;
+        if (checkSamples8)
+        {
+            validSize = FindSampleAboveMax8(chunk, bytesRead, (BYTE)header->maxValue);
+        }
+        else if (checkSamples16)
+        {
+            const size_t sampleCount = bytesRead / 2;
+            const size_t index = FindBigEndianSampleAboveMax16(chunk, sampleCount, (USHORT)header->maxValue);
+            validSize = index < sampleCount ? index * 2 : bytesRead;
+        }
+
+        *badOffset += validSize;
+        if (validSize < size)
+        {
+            result = WINCODEC_ERR_BADIMAGE;
+            break;
+        }
+    }
+
+    FreeMemory(chunk);
+    return result;
+}
+
+_Use_decl_annotations_ HRESULT STDMETHODCALLTYPE NetpbmValidate(IStream *stream, ULONGLONG *badOffset)
+{
+    TRACE("netpbm-wic-codec-c::NetpbmValidate\n");
+
+    if (!stream || !badOffset)
+        return E_INVALIDARG;
+
+    // The stream is never repositioned: the positions of the reader are relative to the start of the file.
+    StreamReader reader;
+    StreamReaderInitialize(&reader, stream, 0);
+
+    PnmHeader header;
+    const HRESULT result = ReadPnmHeaderFromReader(&reader, &header);
+    if (FAILED(result))
+    {
+        *badOffset = StreamReaderGetPosition(&reader);
+        return result;
+    }
+
+    return IsPlainPnmFormat(header.format) ? ValidatePlainSamples(&reader, &header, badOffset)
+                                           : ValidateBinarySamples(&reader, &header, badOffset);
+}
@@ -0,0 +1,299 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "com_factory.h"
+#include "test_stream.h"
+#include <unknwn.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/guids.h"
+#include "../src/netpbm_allocator.h"
+
+#define CLOVE_SUITE_NAME allocator_test_suite
+#include <wincodec.h>
+#include <clove-unit/clove-unit.h>
+
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmSetAllocatorPtr)(const NetpbmAllocator *allocator);
+
+// Every allocation starts with a header that stores its size, the header of an aligned allocation fills an alignment
+// and also stores the alignment.
+typedef struct CountingAllocator
+{
+    LONG allocationCount;
+    LONG alignedAllocationCount;
+    size_t alignment;
+    LONG64 allocatedSize;
+    LONG64 peakAllocatedSize;
+} CountingAllocator;
+
+enum
+{
+    HeaderSize = 16
+};
+
+static void AddAllocatedSize(CountingAllocator *allocator, const LONG64 size)
+{
+    allocator->allocatedSize += size;
+    if (allocator->allocatedSize > allocator->peakAllocatedSize)
+    {
+        allocator->peakAllocatedSize = allocator->allocatedSize;
+    }
+}
+
+static void *STDMETHODCALLTYPE CountingAllocateMemory(void *context, const size_t size)
+{
+    BYTE *memory = malloc(HeaderSize + size);
+    if (!memory)
+        return NULL;
+
+    CountingAllocator *allocator = context;
+    ++allocator->allocationCount;
+    AddAllocatedSize(allocator, (LONG64)size);
+    *(size_t *)memory = size;
+    return memory + HeaderSize;
+}
+
+static void STDMETHODCALLTYPE CountingFreeMemory(void *context, void *memory)
+{
+    BYTE *allocation = (BYTE *)memory - HeaderSize;
+    AddAllocatedSize(context, -(LONG64) * (size_t *)allocation);
+    free(allocation);
+}
+
+static void *STDMETHODCALLTYPE CountingAllocateAlignedMemory(void *context, const size_t size, const size_t alignment)
+{
+    BYTE *memory = _aligned_malloc(alignment + size, alignment);
+    if (!memory)
+        return NULL;
+
+    CountingAllocator *allocator = context;
+    ++allocator->alignedAllocationCount;
+    allocator->alignment = alignment;
+    AddAllocatedSize(allocator, (LONG64)size);
+    size_t *header = (size_t *)(memory + alignment) - 2;
+    header[0] = alignment;
+    header[1] = size;
+    return memory + alignment;
+}
+
+static void STDMETHODCALLTYPE CountingFreeAlignedMemory(void *context, void *memory)
+{
+    const size_t *header = (size_t *)memory - 2;
+    AddAllocatedSize(context, -(LONG64)header[1]);
+    _aligned_free((BYTE *)memory - header[0]);
+}
+
+static HRESULT SetAllocator(const NetpbmAllocator *allocator)
+{
+    const NetpbmSetAllocatorPtr setAllocator = (NetpbmSetAllocatorPtr)GetCodecFunction("NetpbmSetAllocator");
+    return setAllocator ? setAllocator(allocator) : E_FAIL;
+}
+
+static HRESULT SetCountingAllocator(CountingAllocator *countingAllocator)
+{
+    const CountingAllocator initial = {};
+    *countingAllocator = initial;
+    const NetpbmAllocator allocator = {countingAllocator, CountingAllocateMemory, CountingFreeMemory,
+                                       CountingAllocateAlignedMemory, CountingFreeAlignedMemory};
+    return SetAllocator(&allocator);
+}
+
+CLOVE_SUITE_SETUP_ONCE()
+{
+    ConstructComFactory();
+}
+
+CLOVE_SUITE_TEARDOWN_ONCE()
+{
+    SetAllocator(NULL);
+    DestructComFactory();
+}
+
+CLOVE_TEST(DecodeAllocatesWithAllocator)
+{
+    CountingAllocator countingAllocator;
+    CLOVE_UINT_EQ(S_OK, SetCountingAllocator(&countingAllocator));
+
+    // The decoder is aligned for the list of released objects, the samples of a plain graymap are decoded once into a
+    // pixel buffer.
+    IStream *stream = CreateStreamFromHeaderAndData("P2 2 2 255\n", "1 2\n3 4\n", 8);
+    IWICBitmapDecoder *decoder = CreateDecoder();
+    CLOVE_UINT_EQ(S_OK, decoder->lpVtbl->Initialize(decoder, stream, WICDecodeMetadataCacheOnDemand));
+    IWICBitmapFrameDecode *frame;
+    CLOVE_UINT_EQ(S_OK, decoder->lpVtbl->GetFrame(decoder, 0, &frame));
+    BYTE pixels[4];
+    CLOVE_UINT_EQ(S_OK, frame->lpVtbl->CopyPixels(frame, NULL, 2, sizeof(pixels), pixels));
+    CLOVE_UINT_EQ(4, pixels[3]);
+    frame->lpVtbl->Release(frame);
+    decoder->lpVtbl->Release(decoder);
+    stream->lpVtbl->Release(stream);
+
+    CLOVE_INT_LT(0, countingAllocator.allocationCount);
+    CLOVE_INT_EQ(2, countingAllocator.alignedAllocationCount);
+    CLOVE_ULLONG_EQ(64, countingAllocator.alignment);
+    CLOVE_LLONG_LT(0, countingAllocator.peakAllocatedSize);
+
+    // The released decoder is kept for reuse until the allocator is replaced.
+    CLOVE_UINT_EQ(S_OK, SetAllocator(NULL));
+    CLOVE_LLONG_EQ(0, countingAllocator.allocatedSize);
+}
+
+CLOVE_TEST(SetAllocatorWhileObjectsExist)
+{
+    CountingAllocator countingAllocator;
+    CLOVE_UINT_EQ(S_OK, SetCountingAllocator(&countingAllocator));
+    IWICBitmapDecoder *decoder = CreateDecoder();
+    CLOVE_NOT_NULL(decoder);
+    IWICBitmapDecoder *releasedDecoder = CreateDecoder();
+    CLOVE_NOT_NULL(releasedDecoder);
+    releasedDecoder->lpVtbl->Release(releasedDecoder);
+
+    // The failed call keeps the released decoder for reuse.
+    const LONG64 allocatedSize = countingAllocator.allocatedSize;
+    CLOVE_UINT_EQ(WINCODEC_ERR_WRONGSTATE, SetAllocator(NULL));
+    CLOVE_LLONG_EQ(allocatedSize, countingAllocator.allocatedSize);
+    decoder->lpVtbl->Release(decoder);
+    CLOVE_UINT_EQ(S_OK, SetAllocator(NULL));
+    CLOVE_LLONG_EQ(0, countingAllocator.allocatedSize);
+}
+
+CLOVE_TEST(SetAllocatorRequiresAllFunctions)
+{
+    const NetpbmAllocator allocator = {NULL, CountingAllocateMemory, CountingFreeMemory, NULL, NULL};
+
+    CLOVE_UINT_EQ(E_INVALIDARG, SetAllocator(&allocator));
+}
+
+// Creates a decoder, copies the pixels of its frame and releases them.
+static HRESULT Decode(IStream *stream, const UINT stride, const UINT bufferSize, BYTE *buffer)
+{
+    IWICBitmapDecoder *decoder = CreateDecoder();
+    HRESULT hr = decoder->lpVtbl->Initialize(decoder, stream, WICDecodeMetadataCacheOnDemand);
+    IWICBitmapFrameDecode *frame = NULL;
+    if (SUCCEEDED(hr))
+    {
+        hr = decoder->lpVtbl->GetFrame(decoder, 0, &frame);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = frame->lpVtbl->CopyPixels(frame, NULL, stride, bufferSize, buffer);
+        frame->lpVtbl->Release(frame);
+    }
+
+    decoder->lpVtbl->Release(decoder);
+    return hr;
+}
+
+CLOVE_TEST(DecodeMakesFewAllocations)
+{
+    const BYTE samples[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    BYTE pixels[sizeof(samples)];
+    IStream *stream = CreateStreamFromHeaderAndData("P6 2 2 255\n", samples, sizeof(samples));
+    CountingAllocator countingAllocator;
+    CLOVE_UINT_EQ(S_OK, SetCountingAllocator(&countingAllocator));
+
+    // The frame is allocated from the first arena chunk in the decoder. The first decode allocates the decoder and
+    // the cache of released objects of the thread, the following decodes reuse the decoder.
+    CLOVE_UINT_EQ(S_OK, Decode(stream, 6, sizeof(pixels), pixels));
+    CLOVE_INT_EQ(1, countingAllocator.allocationCount);
+    CLOVE_INT_EQ(1, countingAllocator.alignedAllocationCount);
+    CLOVE_ULLONG_EQ(MEMORY_ALLOCATION_ALIGNMENT, countingAllocator.alignment);
+    const LARGE_INTEGER start = {};
+    stream->lpVtbl->Seek(stream, start, STREAM_SEEK_SET, NULL);
+    CLOVE_UINT_EQ(S_OK, Decode(stream, 6, sizeof(pixels), pixels));
+    CLOVE_INT_EQ(1, countingAllocator.allocationCount);
+    CLOVE_INT_EQ(1, countingAllocator.alignedAllocationCount);
+
+    // The reader of a non-seekable stream grows the arena with a chunk, the pixels are decoded into a pixel buffer.
+    // The first decode also allocates the scratch buffers of the row decoder and keeps them for the thread.
+    for (LONG i = 0; i < 2; ++i)
+    {
+        stream->lpVtbl->Seek(stream, start, STREAM_SEEK_SET, NULL);
+        IStream *nonSeekableStream = CreateNonSeekableStream(stream);
+        const LONG allocationCount = countingAllocator.allocationCount;
+        const LONG alignedAllocationCount = countingAllocator.alignedAllocationCount;
+        CLOVE_UINT_EQ(S_OK, Decode(nonSeekableStream, 6, sizeof(pixels), pixels));
+        CLOVE_INT_EQ(i == 0 ? 2 : 1, countingAllocator.allocationCount - allocationCount);
+        CLOVE_INT_EQ(i == 0 ? 3 : 1, countingAllocator.alignedAllocationCount - alignedAllocationCount);
+        CLOVE_IS_TRUE(memcmp(samples, pixels, sizeof(samples)) == 0);
+        nonSeekableStream->lpVtbl->Release(nonSeekableStream);
+    }
+
+    CLOVE_UINT_EQ(S_OK, SetAllocator(NULL));
+    CLOVE_LLONG_EQ(0, countingAllocator.allocatedSize);
+    stream->lpVtbl->Release(stream);
+}
+
+// Rectangles of a bitmap that don't start at a byte boundary are shifted in a scratch buffer.
+static DWORD WINAPI CopyShiftedRectangle(void *parameter)
+{
+    IWICBitmapFrameDecode *frame = parameter;
+    const WICRect rect = {1, 0, 3, 2};
+    BYTE pixels[2];
+    return (DWORD)frame->lpVtbl->CopyPixels(frame, &rect, 1, sizeof(pixels), pixels);
+}
+
+CLOVE_TEST(ScratchBuffersAreReleasedOnThreadExit)
+{
+    const BYTE samples[] = {0x5A, 0xC3};
+    IStream *stream = CreateStreamFromHeaderAndData("P4 8 2\n", samples, sizeof(samples));
+    CountingAllocator countingAllocator;
+    CLOVE_UINT_EQ(S_OK, SetCountingAllocator(&countingAllocator));
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    const LONG64 allocatedSize = countingAllocator.allocatedSize;
+    const LONG alignedAllocationCount = countingAllocator.alignedAllocationCount;
+
+    // The scratch buffer is kept by the thread and reused by its following copies.
+    HANDLE thread = CreateThread(NULL, 0, CopyShiftedRectangle, frame, 0, NULL);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    CLOVE_INT_EQ(alignedAllocationCount + 1, countingAllocator.alignedAllocationCount);
+    CLOVE_LLONG_EQ(allocatedSize, countingAllocator.allocatedSize);
+
+    CLOVE_UINT_EQ(S_OK, CopyShiftedRectangle(frame));
+    CLOVE_UINT_EQ(S_OK, CopyShiftedRectangle(frame));
+    CLOVE_INT_EQ(alignedAllocationCount + 2, countingAllocator.alignedAllocationCount);
+
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+    CLOVE_UINT_EQ(S_OK, SetAllocator(NULL));
+    CLOVE_LLONG_EQ(0, countingAllocator.allocatedSize);
+}
+
+CLOVE_TEST(TinyCopyPixelsBenchmark)
+{
+    enum { copyCount = 1000000 };
+    const BYTE samples[] = {0x5A, 0xC3};
+    IStream *stream = CreateStreamFromHeaderAndData("P4 8 2\n", samples, sizeof(samples));
+    CountingAllocator countingAllocator;
+    CLOVE_UINT_EQ(S_OK, SetCountingAllocator(&countingAllocator));
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    CLOVE_UINT_EQ(S_OK, CopyShiftedRectangle(frame)); // Warm up.
+    const LONG allocationCount = countingAllocator.allocationCount + countingAllocator.alignedAllocationCount;
+
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER begin;
+    LARGE_INTEGER end;
+    HRESULT result = S_OK;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+    for (UINT i = 0; i < copyCount && SUCCEEDED(result); ++i)
+    {
+        result = CopyShiftedRectangle(frame);
+    }
+    QueryPerformanceCounter(&end);
+    const double nanoseconds = (double)(end.QuadPart - begin.QuadPart) * 1e9 / (double)frequency.QuadPart;
+    printf("CopyPixels of a 3x2 rectangle: %.0f ns per call\n", nanoseconds / copyCount);
+
+    CLOVE_UINT_EQ(S_OK, result);
+    CLOVE_INT_EQ(allocationCount, countingAllocator.allocationCount + countingAllocator.alignedAllocationCount);
+
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+    CLOVE_UINT_EQ(S_OK, SetAllocator(NULL));
+    CLOVE_LLONG_EQ(0, countingAllocator.allocatedSize);
+}
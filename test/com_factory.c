@@ -3,6 +3,8 @@
 
 #include "com_factory.h"
 
+#include "../src/guids.h"
+
 static HMODULE codec_library = NULL;
 
 void ConstructComFactory(void)
@@ -35,6 +37,11 @@ void *GetClassObject(const CLSID *rclsid, const IID *riid)
     return NULL;
 }
 
+void *GetCodecFunction(const char *name)
+{
+    return (void *)GetProcAddress(codec_library, name);
+}
+
 typedef HRESULT(WINAPI *DllCanUnloadNowPtr)(void);
 HRESULT CallDllCanUnloadNow(void)
 {
@@ -44,3 +51,33 @@ HRESULT CallDllCanUnloadNow(void)
 
     return pDllCanUnloadNow();
 }
+
+IWICBitmapDecoder *CreateDecoder(void)
+{
+    IClassFactory *classFactory = GetClassObject(&CLSID_WICBitmapDecoder, &IID_IClassFactory);
+    if (!classFactory)
+        return NULL;
+
+    IWICBitmapDecoder *decoder = NULL;
+    const HRESULT hr =
+        classFactory->lpVtbl->CreateInstance(classFactory, NULL, &IID_IWICBitmapDecoder, (void **)&decoder);
+    classFactory->lpVtbl->Release(classFactory);
+    return SUCCEEDED(hr) ? decoder : NULL;
+}
+
+IWICBitmapFrameDecode *CreateFrame(IStream *stream)
+{
+    IWICBitmapDecoder *decoder = CreateDecoder();
+    if (!decoder)
+        return NULL;
+
+    IWICBitmapFrameDecode *frame = NULL;
+    HRESULT hr = decoder->lpVtbl->Initialize(decoder, stream, WICDecodeMetadataCacheOnDemand);
+    if (SUCCEEDED(hr))
+    {
+        hr = decoder->lpVtbl->GetFrame(decoder, 0, &frame);
+    }
+
+    decoder->lpVtbl->Release(decoder);
+    return SUCCEEDED(hr) ? frame : NULL;
+}
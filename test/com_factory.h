@@ -4,8 +4,17 @@
 #pragma once
 
 #include <Windows.h>
+#include <wincodec.h>
 
 void ConstructComFactory(void);
 void DestructComFactory(void);
 void *GetClassObject(const CLSID *rclsid, const IID *riid);
+void *GetCodecFunction(const char *name);
 HRESULT CallDllCanUnloadNow(void);
+
+// Creates a decoder of the codec, returns NULL when it can't be created.
+IWICBitmapDecoder *CreateDecoder(void);
+
+// Returns the frame of a decoder that is initialized with the stream, NULL when the stream can't be decoded. The frame
+// keeps the decoder alive.
+IWICBitmapFrameDecode *CreateFrame(IStream *stream);
@@ -0,0 +1,192 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "com_factory.h"
+#include "test_stream.h"
+#include <unknwn.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/netpbm_content_hash.h"
+
+#define CLOVE_SUITE_NAME content_hash_test_suite
+#include <wincodec.h>
+#include <clove-unit/clove-unit.h>
+
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmDecodeRowsWithHashPtr)(IStream *stream, const WICPixelFormatGUID *pixelFormat,
+                                                                NetpbmHashAlgorithm algorithm, UINT bandHeight,
+                                                                NetpbmRowSink sink, void *context, ULONGLONG *hash);
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmDecodeRowsPtr)(IStream *stream, const WICPixelFormatGUID *pixelFormat,
+                                                        UINT bandHeight, NetpbmRowSink sink, void *context);
+
+static HRESULT HashStream(IStream *stream, const NetpbmHashAlgorithm algorithm, const UINT bandHeight,
+                          ULONGLONG *hash)
+{
+    const NetpbmDecodeRowsWithHashPtr decodeRows =
+        (NetpbmDecodeRowsWithHashPtr)GetCodecFunction("NetpbmDecodeRowsWithHash");
+    if (!decodeRows)
+        return E_FAIL;
+
+    return decodeRows(stream, NULL, algorithm, bandHeight, NULL, NULL, hash);
+}
+
+static ULONGLONG Hash(const char *header, const void *data, const size_t size, const NetpbmHashAlgorithm algorithm)
+{
+    IStream *stream = CreateStreamFromHeaderAndData(header, data, size);
+    ULONGLONG hash;
+    const HRESULT hr = HashStream(stream, algorithm, 0, &hash);
+    stream->lpVtbl->Release(stream);
+    return SUCCEEDED(hr) ? hash : 0;
+}
+
+static HRESULT STDMETHODCALLTYPE CountRows(void *context, const NetpbmRows *rows)
+{
+    *(UINT *)context += rows->rowCount;
+    return S_OK;
+}
+
+CLOVE_SUITE_SETUP_ONCE()
+{
+    ConstructComFactory();
+}
+
+CLOVE_SUITE_TEARDOWN_ONCE()
+{
+    DestructComFactory();
+}
+
+CLOVE_TEST(HashIsIndependentOfFileVariant)
+{
+    const BYTE samples[] = {1, 2, 3, 40, 50, 60, 255, 0, 7, 8, 9, 10};
+    const char plain[] = "1 2 3 40 50 60\n255 0 7 8 9 10\n";
+    const char *pam = "P7\nWIDTH 2\nHEIGHT 2\nDEPTH 3\nMAXVAL 255\nTUPLTYPE RGB\nENDHDR\n";
+
+    for (NetpbmHashAlgorithm algorithm = NetpbmHashAlgorithmXxHash64; algorithm <= NetpbmHashAlgorithmCrc32c;
+         ++algorithm)
+    {
+        const ULONGLONG hash = Hash("P6 2 2 255\n", samples, sizeof(samples), algorithm);
+
+        CLOVE_ULLONG_NE(0, hash);
+        CLOVE_ULLONG_EQ(hash, Hash("P3 2 2 255\n", plain, sizeof(plain) - 1, algorithm));
+        CLOVE_ULLONG_EQ(hash, Hash(pam, samples, sizeof(samples), algorithm));
+
+        // The band height doesn't change the hash.
+        IStream *stream = CreateStreamFromHeaderAndData("P6 2 2 255\n", samples, sizeof(samples));
+        ULONGLONG bandHash;
+        CLOVE_UINT_EQ(S_OK, HashStream(stream, algorithm, 1, &bandHash));
+        CLOVE_ULLONG_EQ(hash, bandHash);
+        stream->lpVtbl->Release(stream);
+    }
+}
+
+CLOVE_TEST(HashDependsOnPixelsAndLayout)
+{
+    BYTE samples[] = {1, 2, 3, 4};
+    const ULONGLONG hash = Hash("P5 2 2 255\n", samples, sizeof(samples), NetpbmHashAlgorithmXxHash64);
+
+    CLOVE_ULLONG_NE(hash, Hash("P5 4 1 255\n", samples, sizeof(samples), NetpbmHashAlgorithmXxHash64));
+    CLOVE_ULLONG_NE(hash, Hash("P5 2 2 255\n", samples, sizeof(samples), NetpbmHashAlgorithmCrc32c));
+
+    samples[3] = 5;
+    CLOVE_ULLONG_NE(hash, Hash("P5 2 2 255\n", samples, sizeof(samples), NetpbmHashAlgorithmXxHash64));
+}
+
+CLOVE_TEST(HashIgnoresBitmapPadding)
+{
+    // The padding bits of the binary rows are set, they are not part of the image.
+    const BYTE samples[] = {0xA3, 0x5F};
+    const char plain[] = "101\n010\n";
+
+    const ULONGLONG hash = Hash("P4 3 2\n", samples, sizeof(samples), NetpbmHashAlgorithmCrc32c);
+
+    CLOVE_ULLONG_EQ(hash, Hash("P1 3 2\n", plain, sizeof(plain) - 1, NetpbmHashAlgorithmCrc32c));
+}
+
+CLOVE_TEST(HashNonSeekableStream)
+{
+    const BYTE samples[24] = {0, 0, 128, 63};
+    IStream *memoryStream = CreateStreamFromHeaderAndData("P6 2 4 255\n", samples, sizeof(samples));
+    IStream *stream = CreateNonSeekableStream(memoryStream);
+    ULONGLONG hash;
+    UINT rowCount = 0;
+    const NetpbmDecodeRowsWithHashPtr decodeRows =
+        (NetpbmDecodeRowsWithHashPtr)GetCodecFunction("NetpbmDecodeRowsWithHash");
+
+    CLOVE_UINT_EQ(S_OK, decodeRows(stream, NULL, NetpbmHashAlgorithmXxHash64, 0, CountRows, &rowCount, &hash));
+    CLOVE_UINT_EQ(4, rowCount);
+    CLOVE_ULLONG_EQ(Hash("P6 2 4 255\n", samples, sizeof(samples), NetpbmHashAlgorithmXxHash64), hash);
+    stream->lpVtbl->Release(stream);
+    memoryStream->lpVtbl->Release(memoryStream);
+
+    // The rows of a PFM file in a pipe are passed bottom-up, they cannot be hashed in top-down order.
+    memoryStream = CreateStreamFromHeaderAndData("Pf 2 3 -1.0\n", samples, sizeof(samples));
+    stream = CreateNonSeekableStream(memoryStream);
+    CLOVE_UINT_EQ(WINCODEC_ERR_UNSUPPORTEDOPERATION, HashStream(stream, NetpbmHashAlgorithmXxHash64, 0, &hash));
+    CLOVE_ULLONG_NE(0, Hash("Pf 2 3 -1.0\n", samples, sizeof(samples), NetpbmHashAlgorithmXxHash64));
+    stream->lpVtbl->Release(stream);
+    memoryStream->lpVtbl->Release(memoryStream);
+}
+
+CLOVE_TEST(HashInvalidArguments)
+{
+    const BYTE samples[] = {1, 2};
+    IStream *stream = CreateStreamFromHeaderAndData("P5 2 1 255\n", samples, sizeof(samples));
+    ULONGLONG hash;
+
+    CLOVE_UINT_EQ(E_INVALIDARG, HashStream(stream, (NetpbmHashAlgorithm)0, 0, &hash));
+    CLOVE_UINT_EQ(E_INVALIDARG, HashStream(stream, NetpbmHashAlgorithmCrc32c, 0, NULL));
+    stream->lpVtbl->Release(stream);
+}
+
+static double DecodeMilliseconds(IStream *stream, const NetpbmHashAlgorithm algorithm, UINT *rowCount)
+{
+    const LARGE_INTEGER start = {};
+    stream->lpVtbl->Seek(stream, start, STREAM_SEEK_SET, NULL);
+
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER begin;
+    LARGE_INTEGER end;
+    *rowCount = 0;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+    if (algorithm == 0)
+    {
+        const NetpbmDecodeRowsPtr decodeRows = (NetpbmDecodeRowsPtr)GetCodecFunction("NetpbmDecodeRows");
+        decodeRows(stream, NULL, 0, CountRows, rowCount);
+    }
+    else
+    {
+        const NetpbmDecodeRowsWithHashPtr decodeRows =
+            (NetpbmDecodeRowsWithHashPtr)GetCodecFunction("NetpbmDecodeRowsWithHash");
+        ULONGLONG hash;
+        decodeRows(stream, NULL, algorithm, 0, CountRows, rowCount, &hash);
+    }
+    QueryPerformanceCounter(&end);
+
+    return (double)(end.QuadPart - begin.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+}
+
+CLOVE_TEST(HashBenchmark)
+{
+    enum { width = 4096, height = 2048 };
+    const size_t size = (size_t)width * height * 3;
+    BYTE *samples = malloc(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        samples[i] = (BYTE)(i * 7 >> 3);
+    }
+
+    IStream *stream = CreateStreamFromHeaderAndData("P6 4096 2048 200\n", samples, size);
+    UINT rowCount;
+    DecodeMilliseconds(stream, 0, &rowCount); // Warm up.
+    const double decodeMilliseconds = DecodeMilliseconds(stream, 0, &rowCount);
+    const double xxHashMilliseconds = DecodeMilliseconds(stream, NetpbmHashAlgorithmXxHash64, &rowCount);
+    CLOVE_UINT_EQ(height, rowCount);
+    const double crcMilliseconds = DecodeMilliseconds(stream, NetpbmHashAlgorithmCrc32c, &rowCount);
+    CLOVE_UINT_EQ(height, rowCount);
+    printf("Decode %ux%u P6: %.2f ms, with XXH64: %.2f ms, with CRC-32C: %.2f ms\n", width, height,
+           decodeMilliseconds, xxHashMilliseconds, crcMilliseconds);
+
+    stream->lpVtbl->Release(stream);
+    free(samples);
+}
@@ -0,0 +1,273 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "com_factory.h"
+#include "test_stream.h"
+#include <unknwn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/guids.h"
+#include "../src/netpbm_frame_cache.h"
+
+#define CLOVE_SUITE_NAME frame_cache_test_suite
+#include <wincodec.h>
+#include <clove-unit/clove-unit.h>
+
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmSetFrameCacheBudgetPtr)(ULONGLONG byteBudget);
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmGetFrameCacheCountersPtr)(ULONGLONG *hits, ULONGLONG *misses);
+
+enum
+{
+    width = 512,
+    height = 512
+};
+
+static BYTE *samples;
+static IStream *memoryStream;
+
+static HRESULT SetBudget(const ULONGLONG byteBudget)
+{
+    const NetpbmSetFrameCacheBudgetPtr setBudget =
+        (NetpbmSetFrameCacheBudgetPtr)GetCodecFunction("NetpbmSetFrameCacheBudget");
+    return setBudget ? setBudget(byteBudget) : E_FAIL;
+}
+
+static void GetCounters(ULONGLONG *hits, ULONGLONG *misses)
+{
+    const NetpbmGetFrameCacheCountersPtr getCounters =
+        (NetpbmGetFrameCacheCountersPtr)GetCodecFunction("NetpbmGetFrameCacheCounters");
+    *hits = 0;
+    *misses = 0;
+    if (getCounters)
+    {
+        getCounters(hits, misses);
+    }
+}
+
+// Opens the graymap as a file with the name and copies all pixels.
+static HRESULT DecodeFile(const WCHAR *name, BYTE *pixels)
+{
+    // The streams share the position of the memory stream, the decoder is initialized at the start of the file.
+    IStream *stream = CreateNamedStream(memoryStream, name, 1000);
+    const LARGE_INTEGER start = {};
+    stream->lpVtbl->Seek(stream, start, STREAM_SEEK_SET, NULL);
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    HRESULT hr = E_FAIL;
+    if (frame)
+    {
+        hr = frame->lpVtbl->CopyPixels(frame, NULL, width, width * height, pixels);
+        frame->lpVtbl->Release(frame);
+    }
+
+    stream->lpVtbl->Release(stream);
+    return hr;
+}
+
+CLOVE_SUITE_SETUP_ONCE()
+{
+    ConstructComFactory();
+    samples = malloc(width * height);
+    for (size_t i = 0; i < width * height; ++i)
+    {
+        samples[i] = (BYTE)(i * 7 >> 3);
+    }
+    memoryStream = CreateStreamFromHeaderAndData("P5 512 512 255\n", samples, width * height);
+}
+
+CLOVE_SUITE_TEARDOWN_ONCE()
+{
+    SetBudget(0);
+    memoryStream->lpVtbl->Release(memoryStream);
+    free(samples);
+    DestructComFactory();
+}
+
+CLOVE_TEST(CacheIsDisabledByDefault)
+{
+    ULONGLONG hits;
+    ULONGLONG misses;
+    GetCounters(&hits, &misses);
+    BYTE *pixels = malloc(width * height);
+
+    CLOVE_UINT_EQ(S_OK, DecodeFile(L"C:\\images\\disabled.pgm", pixels));
+    CLOVE_UINT_EQ(S_OK, DecodeFile(L"C:\\images\\disabled.pgm", pixels));
+    CLOVE_IS_TRUE(memcmp(samples, pixels, width * height) == 0);
+
+    ULONGLONG disabledHits;
+    ULONGLONG disabledMisses;
+    GetCounters(&disabledHits, &disabledMisses);
+    CLOVE_ULLONG_EQ(hits, disabledHits);
+    CLOVE_ULLONG_EQ(misses, disabledMisses);
+    free(pixels);
+}
+
+CLOVE_TEST(LeastRecentlyUsedPixelsAreRemoved)
+{
+    // The budget holds one image: decoding a second file removes the first.
+    CLOVE_UINT_EQ(S_OK, SetBudget(width * height));
+    ULONGLONG hits;
+    ULONGLONG misses;
+    GetCounters(&hits, &misses);
+    BYTE *pixels = malloc(width * height);
+
+    CLOVE_UINT_EQ(S_OK, DecodeFile(L"C:\\images\\first.pgm", pixels));
+    CLOVE_UINT_EQ(S_OK, DecodeFile(L"C:\\images\\first.pgm", pixels));
+    CLOVE_UINT_EQ(S_OK, DecodeFile(L"C:\\images\\second.pgm", pixels));
+    CLOVE_UINT_EQ(S_OK, DecodeFile(L"C:\\images\\first.pgm", pixels));
+    CLOVE_IS_TRUE(memcmp(samples, pixels, width * height) == 0);
+
+    ULONGLONG cacheHits;
+    ULONGLONG cacheMisses;
+    GetCounters(&cacheHits, &cacheMisses);
+    CLOVE_ULLONG_EQ(hits + 1, cacheHits);
+    CLOVE_ULLONG_EQ(misses + 3, cacheMisses);
+
+    // Images larger than the budget are not cached.
+    CLOVE_UINT_EQ(S_OK, SetBudget(width * height - 1));
+    CLOVE_UINT_EQ(S_OK, DecodeFile(L"C:\\images\\first.pgm", pixels));
+    CLOVE_IS_TRUE(memcmp(samples, pixels, width * height) == 0);
+    GetCounters(&hits, &misses);
+    CLOVE_ULLONG_EQ(cacheHits, hits);
+    CLOVE_ULLONG_EQ(cacheMisses, misses);
+
+    CLOVE_UINT_EQ(S_OK, SetBudget(0));
+    free(pixels);
+}
+
+CLOVE_TEST(RecentlyUsedPixelsAreKept)
+{
+    // The budget holds two images: the first file is used after the second was added, the second is removed.
+    CLOVE_UINT_EQ(S_OK, SetBudget(2 * width * height));
+    BYTE *pixels = malloc(width * height);
+    CLOVE_UINT_EQ(S_OK, DecodeFile(L"C:\\images\\recent1.pgm", pixels));
+    CLOVE_UINT_EQ(S_OK, DecodeFile(L"C:\\images\\recent2.pgm", pixels));
+    CLOVE_UINT_EQ(S_OK, DecodeFile(L"C:\\images\\recent1.pgm", pixels));
+    CLOVE_UINT_EQ(S_OK, DecodeFile(L"C:\\images\\recent3.pgm", pixels));
+    ULONGLONG hits;
+    ULONGLONG misses;
+    GetCounters(&hits, &misses);
+
+    CLOVE_UINT_EQ(S_OK, DecodeFile(L"C:\\images\\recent1.pgm", pixels));
+    CLOVE_UINT_EQ(S_OK, DecodeFile(L"C:\\images\\recent2.pgm", pixels));
+    ULONGLONG cacheHits;
+    ULONGLONG cacheMisses;
+    GetCounters(&cacheHits, &cacheMisses);
+    CLOVE_ULLONG_EQ(hits + 1, cacheHits);
+    CLOVE_ULLONG_EQ(misses + 1, cacheMisses);
+
+    CLOVE_UINT_EQ(S_OK, SetBudget(0));
+    free(pixels);
+}
+
+CLOVE_TEST(FrameKeepsPixelsAfterRemoval)
+{
+    CLOVE_UINT_EQ(S_OK, SetBudget(width * height));
+    IStream *stream = CreateNamedStream(memoryStream, L"C:\\images\\kept.pgm", 1000);
+    const LARGE_INTEGER start = {};
+    stream->lpVtbl->Seek(stream, start, STREAM_SEEK_SET, NULL);
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    BYTE row[width];
+    const WICRect rect = {0, 7, width, 1};
+    CLOVE_UINT_EQ(S_OK, frame->lpVtbl->CopyPixels(frame, &rect, width, sizeof(row), row));
+
+    // Disabling the cache releases its reference, the frame still uses the shared pixels.
+    CLOVE_UINT_EQ(S_OK, SetBudget(0));
+    const WICRect nextRect = {1, 8, width - 1, 1};
+    CLOVE_UINT_EQ(S_OK, frame->lpVtbl->CopyPixels(frame, &nextRect, width, sizeof(row), row));
+    CLOVE_IS_TRUE(memcmp(samples + 8 * width + 1, row, width - 1) == 0);
+
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+typedef struct DecodeThreadContext
+{
+    LONG decodeCount;
+    LONG failureCount;
+} DecodeThreadContext;
+
+// Every thread opens its own decoders on its own stream of the same file, the pixels are copied from the cache.
+static DWORD WINAPI DecodeThread(void *parameter)
+{
+    DecodeThreadContext *context = parameter;
+    BYTE *pixels = malloc(width * height);
+    IStream *fileStream = CreateStreamFromHeaderAndData("P5 512 512 255\n", samples, width * height);
+    IStream *stream = CreateNamedStream(fileStream, L"C:\\images\\concurrent.pgm", 1000);
+    fileStream->lpVtbl->Release(fileStream);
+    for (LONG i = 0; i < context->decodeCount; ++i)
+    {
+        const LARGE_INTEGER start = {};
+        stream->lpVtbl->Seek(stream, start, STREAM_SEEK_SET, NULL);
+        IWICBitmapFrameDecode *frame = CreateFrame(stream);
+        HRESULT hr = E_FAIL;
+        if (frame)
+        {
+            hr = frame->lpVtbl->CopyPixels(frame, NULL, width, width * height, pixels);
+            frame->lpVtbl->Release(frame);
+        }
+
+        if (FAILED(hr) || memcmp(samples, pixels, width * height) != 0)
+        {
+            InterlockedIncrement(&context->failureCount);
+        }
+    }
+
+    stream->lpVtbl->Release(stream);
+    free(pixels);
+    return 0;
+}
+
+static double DecodeConcurrently(const UINT threadCount, DecodeThreadContext *context)
+{
+    HANDLE threads[16];
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER begin;
+    LARGE_INTEGER end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+    for (UINT i = 0; i < threadCount; ++i)
+    {
+        threads[i] = CreateThread(NULL, 0, DecodeThread, context, 0, NULL);
+    }
+    WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+    QueryPerformanceCounter(&end);
+    for (UINT i = 0; i < threadCount; ++i)
+    {
+        CloseHandle(threads[i]);
+    }
+
+    return (double)(end.QuadPart - begin.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+}
+
+CLOVE_TEST(ConcurrentDecodesShareCachedPixels)
+{
+    enum { threadCount = 8, decodeCount = 50 };
+    CLOVE_UINT_EQ(S_OK, SetBudget(16 * 1024 * 1024));
+
+    // The first decode reads the header and the pixels, the other decodes only copy the cached pixels: the threads
+    // only share a reader lock of the cache, which lets them copy the pixels in parallel.
+    BYTE *pixels = malloc(width * height);
+    CLOVE_UINT_EQ(S_OK, DecodeFile(L"C:\\images\\concurrent.pgm", pixels));
+    free(pixels);
+
+    ULONGLONG hits;
+    ULONGLONG misses;
+    GetCounters(&hits, &misses);
+    DecodeThreadContext context = {decodeCount, 0};
+    const double singleThreadMilliseconds = DecodeConcurrently(1, &context);
+    const double multiThreadMilliseconds = DecodeConcurrently(threadCount, &context);
+    CLOVE_INT_EQ(0, context.failureCount);
+
+    ULONGLONG concurrentHits;
+    ULONGLONG concurrentMisses;
+    GetCounters(&concurrentHits, &concurrentMisses);
+    CLOVE_ULLONG_EQ(hits + (1 + threadCount) * decodeCount, concurrentHits);
+    CLOVE_ULLONG_EQ(misses, concurrentMisses);
+    printf("Cached decodes of a 512x512 P5: 1 thread: %.2f ms for %d, %d threads: %.2f ms for %d\n",
+           singleThreadMilliseconds, decodeCount, threadCount, multiThreadMilliseconds, threadCount * decodeCount);
+
+    CLOVE_UINT_EQ(S_OK, SetBudget(0));
+}
@@ -0,0 +1,221 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "com_factory.h"
+#include "test_stream.h"
+#include <unknwn.h>
+#include <propsys.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/guids.h"
+#include "../src/netpbm_header_cache.h"
+
+#define CLOVE_SUITE_NAME header_cache_test_suite
+#include <wincodec.h>
+#include <clove-unit/clove-unit.h>
+
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmGetHeaderCacheCountersPtr)(ULONGLONG *hits, ULONGLONG *misses);
+
+static const char header[] = "P5\n# camera 3\n2 2\n255\n";
+static const BYTE samples[4] = {1, 2, 3, 4};
+
+static void GetCounters(ULONGLONG *hits, ULONGLONG *misses)
+{
+    const NetpbmGetHeaderCacheCountersPtr getCounters =
+        (NetpbmGetHeaderCacheCountersPtr)GetCodecFunction("NetpbmGetHeaderCacheCounters");
+    *hits = 0;
+    *misses = 0;
+    if (getCounters)
+    {
+        getCounters(hits, misses);
+    }
+}
+
+static IStream *CreateFileStream(const WCHAR *name, const ULONGLONG lastWriteTime, const size_t sampleCount)
+{
+    IStream *memoryStream = CreateStreamFromHeaderAndData(header, samples, sampleCount);
+    IStream *stream = CreateNamedStream(memoryStream, name, lastWriteTime);
+    memoryStream->lpVtbl->Release(memoryStream);
+    return stream;
+}
+
+static HRESULT InitializePropertyStore(IStream *stream)
+{
+    IClassFactory *classFactory = GetClassObject(&CLSID_PropertyStore, &IID_IClassFactory);
+    IInitializeWithStream *initializeWithStream;
+    HRESULT hr = classFactory->lpVtbl->CreateInstance(classFactory, NULL, &IID_IInitializeWithStream,
+                                                      (void **)&initializeWithStream);
+    classFactory->lpVtbl->Release(classFactory);
+    if (FAILED(hr))
+        return hr;
+
+    hr = initializeWithStream->lpVtbl->Initialize(initializeWithStream, stream, STGM_READ);
+    initializeWithStream->lpVtbl->Release(initializeWithStream);
+    return hr;
+}
+
+static HRESULT OpenFile(const WCHAR *name, const ULONGLONG lastWriteTime)
+{
+    IStream *stream = CreateFileStream(name, lastWriteTime, sizeof(samples));
+    const HRESULT hr = InitializePropertyStore(stream);
+    stream->lpVtbl->Release(stream);
+    return hr;
+}
+
+CLOVE_SUITE_SETUP_ONCE()
+{
+    ConstructComFactory();
+}
+
+CLOVE_SUITE_TEARDOWN_ONCE()
+{
+    DestructComFactory();
+}
+
+CLOVE_TEST(DecoderUsesHeaderReadByPropertyStore)
+{
+    ULONGLONG hits;
+    ULONGLONG misses;
+    GetCounters(&hits, &misses);
+
+    IStream *stream = CreateFileStream(L"C:\\images\\shared.pgm", 1000, sizeof(samples));
+    CLOVE_UINT_EQ(S_OK, InitializePropertyStore(stream));
+    stream->lpVtbl->Release(stream);
+    ULONGLONG storeHits;
+    ULONGLONG storeMisses;
+    GetCounters(&storeHits, &storeMisses);
+    CLOVE_ULLONG_EQ(hits, storeHits);
+    CLOVE_ULLONG_EQ(misses + 1, storeMisses);
+
+    // The decoder opens the same file: the header (with the ranges of its comments) isn't read again.
+    stream = CreateFileStream(L"C:\\images\\shared.pgm", 1000, sizeof(samples));
+    IWICBitmapDecoder *decoder = CreateDecoder();
+    CLOVE_UINT_EQ(S_OK, decoder->lpVtbl->Initialize(decoder, stream, WICDecodeMetadataCacheOnDemand));
+    CLOVE_UINT_EQ(0, GetCountingStreamReadCalls(stream));
+    GetCounters(&hits, &misses);
+    CLOVE_ULLONG_EQ(storeHits + 1, hits);
+    CLOVE_ULLONG_EQ(storeMisses, misses);
+
+    IWICBitmapFrameDecode *frame;
+    CLOVE_UINT_EQ(S_OK, decoder->lpVtbl->GetFrame(decoder, 0, &frame));
+    BYTE pixels[4];
+    CLOVE_UINT_EQ(S_OK, frame->lpVtbl->CopyPixels(frame, NULL, 2, sizeof(pixels), pixels));
+    CLOVE_IS_TRUE(memcmp(samples, pixels, sizeof(pixels)) == 0);
+
+    IWICMetadataQueryReader *queryReader;
+    CLOVE_UINT_EQ(S_OK, decoder->lpVtbl->GetMetadataQueryReader(decoder, &queryReader));
+    PROPVARIANT value;
+    CLOVE_UINT_EQ(S_OK, queryReader->lpVtbl->GetMetadataByName(queryReader, L"/comments/0", &value));
+    CLOVE_UINT_EQ(VT_LPSTR, value.vt);
+    CLOVE_STRING_EQ(" camera 3", value.pszVal);
+    PropVariantClear(&value);
+
+    queryReader->lpVtbl->Release(queryReader);
+    frame->lpVtbl->Release(frame);
+    decoder->lpVtbl->Release(decoder);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(HeaderIsCachedAtItsPosition)
+{
+    // The file holds 2 images, the property store reads the second one.
+    const char images[] = "\x07P5 2 2 255\n\x01\x02\x03\x04";
+    IStream *memoryStream = CreateStreamFromHeaderAndData("P5 1 1 255\n", images, sizeof(images) - 1);
+    IStream *stream = CreateNamedStream(memoryStream, L"C:\\images\\two.pgm", 1000);
+    memoryStream->lpVtbl->Release(memoryStream);
+    const LARGE_INTEGER second = {.QuadPart = 12};
+    stream->lpVtbl->Seek(stream, second, STREAM_SEEK_SET, NULL);
+    CLOVE_UINT_EQ(S_OK, InitializePropertyStore(stream));
+
+    // The decoder reads the first image, its header isn't the header of the second image.
+    const LARGE_INTEGER start = {};
+    stream->lpVtbl->Seek(stream, start, STREAM_SEEK_SET, NULL);
+    IWICBitmapDecoder *decoder = CreateDecoder();
+    CLOVE_UINT_EQ(S_OK, decoder->lpVtbl->Initialize(decoder, stream, WICDecodeMetadataCacheOnDemand));
+    IWICBitmapFrameDecode *frame;
+    CLOVE_UINT_EQ(S_OK, decoder->lpVtbl->GetFrame(decoder, 0, &frame));
+    UINT width;
+    UINT height;
+    CLOVE_UINT_EQ(S_OK, frame->lpVtbl->GetSize(frame, &width, &height));
+    CLOVE_UINT_EQ(1, width);
+    CLOVE_UINT_EQ(1, height);
+    BYTE pixel;
+    CLOVE_UINT_EQ(S_OK, frame->lpVtbl->CopyPixels(frame, NULL, 1, 1, &pixel));
+    CLOVE_UINT_EQ(7, pixel);
+
+    frame->lpVtbl->Release(frame);
+    decoder->lpVtbl->Release(decoder);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(ChangedFileIsReadAgain)
+{
+    CLOVE_UINT_EQ(S_OK, OpenFile(L"C:\\images\\changed.pgm", 1000));
+
+    ULONGLONG hits;
+    ULONGLONG misses;
+    GetCounters(&hits, &misses);
+    CLOVE_UINT_EQ(S_OK, OpenFile(L"C:\\images\\changed.pgm", 2000));
+
+    // A different size also identifies a different file.
+    IStream *stream = CreateFileStream(L"C:\\images\\changed.pgm", 2000, sizeof(samples) - 1);
+    CLOVE_UINT_EQ(S_OK, InitializePropertyStore(stream));
+    CLOVE_UINT_EQ(1, GetCountingStreamReadCalls(stream));
+    stream->lpVtbl->Release(stream);
+
+    ULONGLONG changedHits;
+    ULONGLONG changedMisses;
+    GetCounters(&changedHits, &changedMisses);
+    CLOVE_ULLONG_EQ(hits, changedHits);
+    CLOVE_ULLONG_EQ(misses + 2, changedMisses);
+}
+
+CLOVE_TEST(StreamWithoutNameIsNotCached)
+{
+    ULONGLONG hits;
+    ULONGLONG misses;
+    GetCounters(&hits, &misses);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        IStream *stream = CreateStreamFromHeaderAndData(header, samples, sizeof(samples));
+        CLOVE_UINT_EQ(S_OK, InitializePropertyStore(stream));
+        stream->lpVtbl->Release(stream);
+    }
+
+    ULONGLONG memoryHits;
+    ULONGLONG memoryMisses;
+    GetCounters(&memoryHits, &memoryMisses);
+    CLOVE_ULLONG_EQ(hits, memoryHits);
+    CLOVE_ULLONG_EQ(misses, memoryMisses);
+}
+
+CLOVE_TEST(LeastRecentlyUsedHeaderIsReplaced)
+{
+    static WCHAR names[NetpbmHeaderCacheCapacity + 1][32];
+    for (UINT i = 0; i < ARRAYSIZE(names); ++i)
+    {
+        swprintf_s(names[i], ARRAYSIZE(names[i]), L"C:\\images\\lru%u.pgm", i);
+    }
+
+    // Fill the cache and use the first file again: the second file is then the least recently used.
+    for (UINT i = 0; i < NetpbmHeaderCacheCapacity; ++i)
+    {
+        CLOVE_UINT_EQ(S_OK, OpenFile(names[i], 1000));
+    }
+    ULONGLONG hits;
+    ULONGLONG misses;
+    GetCounters(&hits, &misses);
+    CLOVE_UINT_EQ(S_OK, OpenFile(names[0], 1000));
+    CLOVE_UINT_EQ(S_OK, OpenFile(names[NetpbmHeaderCacheCapacity], 1000));
+    CLOVE_UINT_EQ(S_OK, OpenFile(names[0], 1000));
+    CLOVE_UINT_EQ(S_OK, OpenFile(names[2], 1000));
+    CLOVE_UINT_EQ(S_OK, OpenFile(names[1], 1000));
+
+    ULONGLONG lruHits;
+    ULONGLONG lruMisses;
+    GetCounters(&lruHits, &lruMisses);
+    CLOVE_ULLONG_EQ(hits + 3, lruHits);
+    CLOVE_ULLONG_EQ(misses + 2, lruMisses);
+}
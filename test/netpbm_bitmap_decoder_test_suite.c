@@ -2,29 +2,20 @@
 // SPDX-License-Identifier: MIT
 
 #include "com_factory.h"
+#include "test_stream.h"
 #include <unknwn.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #include "../src/guids.h"
+#include "../src/netpbm_channel_selection.h"
+#include "../src/netpbm_planar_output.h"
 
 #define CLOVE_SUITE_NAME netpbm_bitmap_decoder_test_suite
 #include <wincodec.h>
 #include <clove-unit/clove-unit.h>
 
-IWICBitmapDecoder *CreateDecoder()
-{
-    IClassFactory *classFactory = GetClassObject(&CLSID_WICBitmapDecoder, &IID_IClassFactory);
-
-    IWICBitmapDecoder *wicBitmapDecoder = NULL;
-    const HRESULT hr = classFactory->lpVtbl->CreateInstance(classFactory, NULL, &IID_IWICBitmapDecoder, (void **)&wicBitmapDecoder);
-    classFactory->lpVtbl->Release(classFactory);
-    if (FAILED(hr))
-    {
-        return NULL;
-    }
-
-    return wicBitmapDecoder;
-}
-
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmSetFrameCacheBudgetPtr)(ULONGLONG byteBudget);
 
 CLOVE_SUITE_SETUP_ONCE()
 {
@@ -84,4 +75,1504 @@ CLOVE_TEST(GetContainerFormat)
 
     CLOVE_UINT_EQ(S_OK, hr);
     CLOVE_IS_TRUE(IsEqualGUID(&CLSID_ContainerFormatNetpbm, &containerFormat));
+    wicBitmapDecoder->lpVtbl->Release(wicBitmapDecoder);
+}
+
+CLOVE_TEST(QueryCapabilityCanDecodeThumbnail)
+{
+    IWICBitmapDecoder *wicBitmapDecoder = CreateDecoder();
+    const BYTE pixels[4] = {};
+    IStream *stream = CreateStreamFromHeaderAndData("P5 2 2 255\n", pixels, sizeof(pixels));
+
+    DWORD capability;
+    const HRESULT hr = wicBitmapDecoder->lpVtbl->QueryCapability(wicBitmapDecoder, stream, &capability);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(WICBitmapDecoderCapabilityCanDecodeAllImages | WICBitmapDecoderCapabilityCanDecodeThumbnail,
+                  capability);
+    stream->lpVtbl->Release(stream);
+    wicBitmapDecoder->lpVtbl->Release(wicBitmapDecoder);
+}
+
+CLOVE_TEST(GetThumbnailNotInitialized)
+{
+    IWICBitmapDecoder *wicBitmapDecoder = CreateDecoder();
+
+    IWICBitmapSource *thumbnail;
+    const HRESULT hr = wicBitmapDecoder->lpVtbl->GetThumbnail(wicBitmapDecoder, &thumbnail);
+
+    CLOVE_UINT_EQ(WINCODEC_ERR_NOTINITIALIZED, hr);
+    CLOVE_NULL(thumbnail);
+    wicBitmapDecoder->lpVtbl->Release(wicBitmapDecoder);
+}
+
+CLOVE_TEST(GetThumbnailReturnsSubsampledImage)
+{
+    enum { width = 1024, height = 512 };
+    BYTE *pixels = malloc(width * height);
+    CLOVE_NOT_NULL(pixels);
+    for (UINT y = 0; y < height; ++y)
+    {
+        for (UINT x = 0; x < width; ++x)
+        {
+            pixels[y * width + x] = (BYTE)(x + y);
+        }
+    }
+
+    IStream *stream = CreateStreamFromHeaderAndData("P5\n# comment\n1024 512\n255\n", pixels, width * height);
+    free(pixels);
+    IWICBitmapDecoder *wicBitmapDecoder = CreateDecoder();
+    HRESULT hr = wicBitmapDecoder->lpVtbl->Initialize(wicBitmapDecoder, stream, WICDecodeMetadataCacheOnDemand);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    IWICBitmapSource *thumbnail;
+    hr = wicBitmapDecoder->lpVtbl->GetThumbnail(wicBitmapDecoder, &thumbnail);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    UINT thumbnailWidth;
+    UINT thumbnailHeight;
+    hr = thumbnail->lpVtbl->GetSize(thumbnail, &thumbnailWidth, &thumbnailHeight);
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(256, thumbnailWidth);
+    CLOVE_UINT_EQ(128, thumbnailHeight);
+
+    GUID pixelFormat;
+    hr = thumbnail->lpVtbl->GetPixelFormat(thumbnail, &pixelFormat);
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_IS_TRUE(IsEqualGUID(&GUID_WICPixelFormat8bppGray, &pixelFormat));
+
+    BYTE thumbnailPixels[256 * 128];
+    hr = thumbnail->lpVtbl->CopyPixels(thumbnail, NULL, 256, sizeof(thumbnailPixels), thumbnailPixels);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    // Every thumbnail pixel is the center pixel of a 4x4 block.
+    for (UINT y = 0; y < 128; ++y)
+    {
+        for (UINT x = 0; x < 256; ++x)
+        {
+            CLOVE_UINT_EQ((BYTE)(x * 4 + 2 + y * 4 + 2), thumbnailPixels[y * 256 + x]);
+        }
+    }
+
+    thumbnail->lpVtbl->Release(thumbnail);
+    wicBitmapDecoder->lpVtbl->Release(wicBitmapDecoder);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(GetPreviewOfSmallPlainImageIsFullSize)
+{
+    IStream *stream = CreateStreamFromHeaderAndData("P2\n4 2\n# comment\n10\n0 1 2 3\n4 5 6 10\n", NULL, 0);
+    IWICBitmapDecoder *wicBitmapDecoder = CreateDecoder();
+    HRESULT hr = wicBitmapDecoder->lpVtbl->Initialize(wicBitmapDecoder, stream, WICDecodeMetadataCacheOnDemand);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    IWICBitmapSource *preview;
+    hr = wicBitmapDecoder->lpVtbl->GetPreview(wicBitmapDecoder, &preview);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    UINT width;
+    UINT height;
+    hr = preview->lpVtbl->GetSize(preview, &width, &height);
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(4, width);
+    CLOVE_UINT_EQ(2, height);
+
+    BYTE pixels[8];
+    hr = preview->lpVtbl->CopyPixels(preview, NULL, 4, sizeof(pixels), pixels);
+    CLOVE_UINT_EQ(S_OK, hr);
+    const BYTE expected[8] = {0, 26, 51, 77, 102, 128, 153, 255};
+    CLOVE_IS_TRUE(memcmp(expected, pixels, sizeof(pixels)) == 0);
+
+    preview->lpVtbl->Release(preview);
+    wicBitmapDecoder->lpVtbl->Release(wicBitmapDecoder);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(GetThumbnailReadsOnlySampledRows)
+{
+    // Benchmark the I/O of the thumbnail path: a 4096 x 4096 graymap should only need its 256 sampled rows.
+    enum { size = 4096 };
+    BYTE *pixels = calloc(size, size);
+    CLOVE_NOT_NULL(pixels);
+    IStream *memoryStream = CreateStreamFromHeaderAndData("P5 4096 4096 255\n", pixels, (size_t)size * size);
+    free(pixels);
+    IStream *stream = CreateCountingStream(memoryStream);
+    memoryStream->lpVtbl->Release(memoryStream);
+
+    IWICBitmapDecoder *wicBitmapDecoder = CreateDecoder();
+    HRESULT hr = wicBitmapDecoder->lpVtbl->Initialize(wicBitmapDecoder, stream, WICDecodeMetadataCacheOnDemand);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    IWICBitmapSource *thumbnail;
+    hr = wicBitmapDecoder->lpVtbl->GetThumbnail(wicBitmapDecoder, &thumbnail);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    const ULONGLONG bytesRead = GetCountingStreamBytesRead(stream);
+    printf("GetThumbnail 4096x4096 P5: %llu of %llu bytes read in %lu read calls\n", bytesRead,
+           (ULONGLONG)size * size, GetCountingStreamReadCalls(stream));
+    CLOVE_ULLONG_GTE(256ULL * size + 4096, bytesRead);
+
+    thumbnail->lpVtbl->Release(thumbnail);
+    wicBitmapDecoder->lpVtbl->Release(wicBitmapDecoder);
+    stream->lpVtbl->Release(stream);
+}
+
+static bool HasPixelFormat(IWICBitmapFrameDecode *frame, const GUID *expected)
+{
+    GUID pixelFormat;
+    return SUCCEEDED(frame->lpVtbl->GetPixelFormat(frame, &pixelFormat)) && IsEqualGUID(expected, &pixelFormat);
+}
+
+CLOVE_TEST(QueryCapabilityDetectsPam)
+{
+    IWICBitmapDecoder *wicBitmapDecoder = CreateDecoder();
+    const BYTE pixels[4] = {};
+    IStream *stream = CreateStreamFromHeaderAndData("P7\nWIDTH 2\nHEIGHT 2\nDEPTH 1\nMAXVAL 255\nENDHDR\n", pixels,
+                                                    sizeof(pixels));
+
+    DWORD capability;
+    const HRESULT hr = wicBitmapDecoder->lpVtbl->QueryCapability(wicBitmapDecoder, stream, &capability);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(WICBitmapDecoderCapabilityCanDecodeAllImages | WICBitmapDecoderCapabilityCanDecodeThumbnail,
+                  capability);
+    stream->lpVtbl->Release(stream);
+    wicBitmapDecoder->lpVtbl->Release(wicBitmapDecoder);
+}
+
+CLOVE_TEST(GetFrameWithInvalidIndex)
+{
+    const BYTE pixels[4] = {};
+    IStream *stream = CreateStreamFromHeaderAndData("P5 2 2 255\n", pixels, sizeof(pixels));
+    IWICBitmapDecoder *wicBitmapDecoder = CreateDecoder();
+    HRESULT hr = wicBitmapDecoder->lpVtbl->Initialize(wicBitmapDecoder, stream, WICDecodeMetadataCacheOnDemand);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    IWICBitmapFrameDecode *frame;
+    hr = wicBitmapDecoder->lpVtbl->GetFrame(wicBitmapDecoder, 1, &frame);
+
+    CLOVE_UINT_EQ(WINCODEC_ERR_FRAMEMISSING, hr);
+    CLOVE_NULL(frame);
+    wicBitmapDecoder->lpVtbl->Release(wicBitmapDecoder);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(CopyPixelsPamRgbAlpha)
+{
+    const BYTE pixels[3 * 2 * 4] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 255};
+    IStream *stream = CreateStreamFromHeaderAndData(
+        "P7\nWIDTH 3\nHEIGHT 2\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", pixels, sizeof(pixels));
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    CLOVE_IS_TRUE(HasPixelFormat(frame, &GUID_WICPixelFormat32bppRGBA));
+
+    // The samples already have the layout of the WIC pixel format and are read directly into the buffer.
+    BYTE buffer[sizeof(pixels)];
+    const HRESULT hr = frame->lpVtbl->CopyPixels(frame, NULL, 3 * 4, sizeof(buffer), buffer);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_IS_TRUE(memcmp(pixels, buffer, sizeof(pixels)) == 0);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(CopyPixelsPamGrayscaleAlphaIsExpandedToRgba)
+{
+    enum { width = 19 };
+    BYTE pixels[width * 2];
+    for (UINT i = 0; i < width; ++i)
+    {
+        pixels[i * 2] = (BYTE)(i * 13);
+        pixels[i * 2 + 1] = (BYTE)(255 - i);
+    }
+
+    IStream *stream = CreateStreamFromHeaderAndData(
+        "P7\nWIDTH 19\nHEIGHT 1\nDEPTH 2\nMAXVAL 255\nTUPLTYPE GRAYSCALE_ALPHA\nENDHDR\n", pixels, sizeof(pixels));
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    CLOVE_IS_TRUE(HasPixelFormat(frame, &GUID_WICPixelFormat32bppRGBA));
+
+    BYTE buffer[width * 4];
+    const HRESULT hr = frame->lpVtbl->CopyPixels(frame, NULL, width * 4, sizeof(buffer), buffer);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    for (UINT i = 0; i < width; ++i)
+    {
+        CLOVE_UINT_EQ(pixels[i * 2], buffer[i * 4]);
+        CLOVE_UINT_EQ(pixels[i * 2], buffer[i * 4 + 1]);
+        CLOVE_UINT_EQ(pixels[i * 2], buffer[i * 4 + 2]);
+        CLOVE_UINT_EQ(pixels[i * 2 + 1], buffer[i * 4 + 3]);
+    }
+
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(CopyPixelsPamGrayscaleAlpha16IsExpandedToRgba)
+{
+    enum { width = 7 };
+    BYTE pixels[width * 4];
+    for (UINT i = 0; i < width; ++i)
+    {
+        pixels[i * 4] = (BYTE)i;
+        pixels[i * 4 + 1] = 0x10;
+        pixels[i * 4 + 2] = 0xFF;
+        pixels[i * 4 + 3] = (BYTE)(0xF0 + i);
+    }
+
+    IStream *stream = CreateStreamFromHeaderAndData("P7\nWIDTH 7\nHEIGHT 1\nDEPTH 2\nMAXVAL 65535\nENDHDR\n", pixels,
+                                                    sizeof(pixels));
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    CLOVE_IS_TRUE(HasPixelFormat(frame, &GUID_WICPixelFormat64bppRGBA));
+
+    USHORT buffer[width * 4];
+    const HRESULT hr = frame->lpVtbl->CopyPixels(frame, NULL, width * 8, sizeof(buffer), (BYTE *)buffer);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    for (UINT i = 0; i < width; ++i)
+    {
+        CLOVE_UINT_EQ(i << 8 | 0x10, buffer[i * 4]);
+        CLOVE_UINT_EQ(i << 8 | 0x10, buffer[i * 4 + 1]);
+        CLOVE_UINT_EQ(i << 8 | 0x10, buffer[i * 4 + 2]);
+        CLOVE_UINT_EQ(0xFF00 | (0xF0 + i), buffer[i * 4 + 3]);
+    }
+
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(CopyPixelsPixmap16IsByteSwapped)
+{
+    const BYTE pixels[2 * 3 * 2] = {0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC, 0xDE, 0xF0, 0x00, 0x01, 0xFF, 0xFF};
+    IStream *stream = CreateStreamFromHeaderAndData("P6 2 1 65535\n", pixels, sizeof(pixels));
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    CLOVE_IS_TRUE(HasPixelFormat(frame, &GUID_WICPixelFormat48bppRGB));
+
+    USHORT buffer[6];
+    const HRESULT hr = frame->lpVtbl->CopyPixels(frame, NULL, sizeof(buffer), sizeof(buffer), (BYTE *)buffer);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    const USHORT expected[6] = {0x1234, 0x5678, 0x9ABC, 0xDEF0, 0x0001, 0xFFFF};
+    CLOVE_IS_TRUE(memcmp(expected, buffer, sizeof(buffer)) == 0);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(CopyPixelsBitmapRectangleNotAtByteBoundary)
+{
+    // 12 x 2 bitmap, a set bit is black in the Netpbm format and a cleared bit is black in WIC.
+    const BYTE pixels[4] = {0b10110011, 0b10100000, 0b00001111, 0b00000000};
+    IStream *stream = CreateStreamFromHeaderAndData("P4 12 2\n", pixels, sizeof(pixels));
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    CLOVE_IS_TRUE(HasPixelFormat(frame, &GUID_WICPixelFormatBlackWhite));
+
+    const WICRect rect = {3, 0, 9, 2};
+    BYTE buffer[2 * 2];
+    const HRESULT hr = frame->lpVtbl->CopyPixels(frame, &rect, 2, sizeof(buffer), buffer);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(0b01100010, buffer[0]);
+    CLOVE_UINT_EQ(0b10000000, buffer[1] & 0x80);
+    CLOVE_UINT_EQ(0b10000111, buffer[2]);
+    CLOVE_UINT_EQ(0b10000000, buffer[3] & 0x80);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(CopyPixelsPlainGraymap)
+{
+    IStream *stream = CreateStreamFromHeaderAndData("P2\n4 2\n# comment\n10\n0 1 2 3\n4 5 6 10\n", NULL, 0);
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    CLOVE_IS_TRUE(HasPixelFormat(frame, &GUID_WICPixelFormat8bppGray));
+
+    const WICRect rect = {1, 1, 3, 1};
+    BYTE buffer[3];
+    const HRESULT hr = frame->lpVtbl->CopyPixels(frame, &rect, 3, sizeof(buffer), buffer);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    const BYTE expected[3] = {128, 153, 255};
+    CLOVE_IS_TRUE(memcmp(expected, buffer, sizeof(buffer)) == 0);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+static IStream *CreateMultispectralStream(const UINT width, const UINT height)
+{
+    enum { depth = 16 };
+    BYTE *pixels = malloc((size_t)width * height * depth);
+    if (!pixels)
+        return NULL;
+
+    for (size_t i = 0; i < (size_t)width * height; ++i)
+    {
+        for (UINT channel = 0; channel < depth; ++channel)
+        {
+            pixels[i * depth + channel] = (BYTE)(i * 7 + channel * 16);
+        }
+    }
+
+    char header[128];
+    snprintf(header, sizeof(header), "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 16\nMAXVAL 255\nTUPLTYPE MULTISPECTRAL\nENDHDR\n",
+             width, height);
+    IStream *stream = CreateStreamFromHeaderAndData(header, pixels, (size_t)width * height * depth);
+    free(pixels);
+    return stream;
+}
+
+CLOVE_TEST(CopyPixelsMultispectralPamDefaultsToFirstChannel)
+{
+    IStream *stream = CreateMultispectralStream(5, 2);
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    CLOVE_IS_TRUE(HasPixelFormat(frame, &GUID_WICPixelFormat8bppGray));
+
+    BYTE buffer[5 * 2];
+    const HRESULT hr = frame->lpVtbl->CopyPixels(frame, NULL, 5, sizeof(buffer), buffer);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    for (UINT i = 0; i < 10; ++i)
+    {
+        CLOVE_UINT_EQ((BYTE)(i * 7), buffer[i]);
+    }
+
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(CopyPixelsSelectedChannels)
+{
+    IStream *stream = CreateMultispectralStream(5, 2);
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+
+    INetpbmChannelSelection *channelSelection;
+    HRESULT hr = frame->lpVtbl->QueryInterface(frame, &IID_INetpbmChannelSelection, (void **)&channelSelection);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    UINT channelCount;
+    hr = channelSelection->lpVtbl->GetChannelCount(channelSelection, &channelCount);
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(16, channelCount);
+
+    const UINT invalidChannels[3] = {2, 7, 16};
+    hr = channelSelection->lpVtbl->SelectChannels(channelSelection, 3, invalidChannels);
+    CLOVE_UINT_EQ(E_INVALIDARG, hr);
+
+    const UINT channels[3] = {11, 2, 7};
+    hr = channelSelection->lpVtbl->SelectChannels(channelSelection, 3, channels);
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_IS_TRUE(HasPixelFormat(frame, &GUID_WICPixelFormat24bppRGB));
+
+    const WICRect rect = {1, 1, 3, 1};
+    BYTE buffer[3 * 3];
+    hr = frame->lpVtbl->CopyPixels(frame, &rect, sizeof(buffer), sizeof(buffer), buffer);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    for (UINT x = 0; x < 3; ++x)
+    {
+        const UINT i = 5 + 1 + x;
+        CLOVE_UINT_EQ((BYTE)(i * 7 + 11 * 16), buffer[x * 3]);
+        CLOVE_UINT_EQ((BYTE)(i * 7 + 2 * 16), buffer[x * 3 + 1]);
+        CLOVE_UINT_EQ((BYTE)(i * 7 + 7 * 16), buffer[x * 3 + 2]);
+    }
+
+    channelSelection->lpVtbl->Release(channelSelection);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(CopyPixelsSelectedChannelsBenchmark)
+{
+    // Benchmark the strided gather: extract 3 bands of a 16 channel 2048 x 2048 PAM file (64 MB).
+    enum { size = 2048 };
+    IStream *memoryStream = CreateMultispectralStream(size, size);
+    CLOVE_NOT_NULL(memoryStream);
+    IStream *stream = CreateCountingStream(memoryStream);
+    memoryStream->lpVtbl->Release(memoryStream);
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+
+    INetpbmChannelSelection *channelSelection;
+    HRESULT hr = frame->lpVtbl->QueryInterface(frame, &IID_INetpbmChannelSelection, (void **)&channelSelection);
+    CLOVE_UINT_EQ(S_OK, hr);
+    const UINT channels[3] = {4, 5, 6};
+    hr = channelSelection->lpVtbl->SelectChannels(channelSelection, 3, channels);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    BYTE *buffer = malloc((size_t)size * size * 3);
+    CLOVE_NOT_NULL(buffer);
+    const ULONGLONG bytesReadBefore = GetCountingStreamBytesRead(stream);
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+    hr = frame->lpVtbl->CopyPixels(frame, NULL, size * 3, size * size * 3, buffer);
+    QueryPerformanceCounter(&end);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    const double milliseconds = (double)(end.QuadPart - start.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+    const ULONGLONG bytesRead = GetCountingStreamBytesRead(stream) - bytesReadBefore;
+    printf("CopyPixels 3 of 16 channels %ux%u: %.2f ms, %llu of %llu bytes read\n", size, size, milliseconds,
+           bytesRead, (ULONGLONG)size * size * 16);
+    CLOVE_UINT_EQ((BYTE)(size * 7 + 4 * 16), buffer[size * 3]);
+
+    // Only the span of the 3 adjacent channels is read from every row.
+    CLOVE_ULLONG_GTE((ULONGLONG)size * ((size - 1) * 16 + 3), bytesRead);
+
+    free(buffer);
+    channelSelection->lpVtbl->Release(channelSelection);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+static void StoreFloat(BYTE *destination, const float value, const bool littleEndian)
+{
+    UINT bits;
+    memcpy(&bits, &value, sizeof(bits));
+    for (UINT i = 0; i < 4; ++i)
+    {
+        destination[littleEndian ? i : 3 - i] = (BYTE)(bits >> (8 * i));
+    }
+}
+
+CLOVE_TEST(QueryCapabilityDetectsPfm)
+{
+    IWICBitmapDecoder *wicBitmapDecoder = CreateDecoder();
+    const BYTE pixels[4] = {};
+    IStream *stream = CreateStreamFromHeaderAndData("Pf\n1 1\n-1.0\n", pixels, sizeof(pixels));
+
+    DWORD capability;
+    const HRESULT hr = wicBitmapDecoder->lpVtbl->QueryCapability(wicBitmapDecoder, stream, &capability);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(WICBitmapDecoderCapabilityCanDecodeAllImages | WICBitmapDecoderCapabilityCanDecodeThumbnail,
+                  capability);
+    stream->lpVtbl->Release(stream);
+    wicBitmapDecoder->lpVtbl->Release(wicBitmapDecoder);
+}
+
+CLOVE_TEST(CopyPixelsBigEndianFloatGraymapIsBottomUp)
+{
+    // A positive scale factor indicates big endian samples, the first row in the file is the bottom row.
+    enum { width = 5, height = 3 };
+    BYTE pixels[width * height * 4];
+    for (UINT i = 0; i < width * height; ++i)
+    {
+        StoreFloat(pixels + i * 4, (float)i * 0.25F, false);
+    }
+
+    IStream *stream = CreateStreamFromHeaderAndData("Pf\n5 3\n1.0\n", pixels, sizeof(pixels));
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    CLOVE_IS_TRUE(HasPixelFormat(frame, &GUID_WICPixelFormat32bppGrayFloat));
+
+    float buffer[width * height];
+    const HRESULT hr = frame->lpVtbl->CopyPixels(frame, NULL, width * 4, sizeof(buffer), (BYTE *)buffer);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    for (UINT y = 0; y < height; ++y)
+    {
+        for (UINT x = 0; x < width; ++x)
+        {
+            CLOVE_FLOAT_EQ((float)((height - 1 - y) * width + x) * 0.25F, buffer[y * width + x]);
+        }
+    }
+
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(CopyPixelsLittleEndianFloatPixmapRectangle)
+{
+    enum { width = 3, height = 2 };
+    BYTE pixels[width * height * 3 * 4];
+    for (UINT i = 0; i < width * height * 3; ++i)
+    {
+        StoreFloat(pixels + i * 4, (float)i - 2.5F, true);
+    }
+
+    IStream *stream = CreateStreamFromHeaderAndData("PF\n3 2\n-4.0\n", pixels, sizeof(pixels));
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    CLOVE_IS_TRUE(HasPixelFormat(frame, &GUID_WICPixelFormat96bppRGBFloat));
+
+    // The top row of the image is the last row in the file.
+    const WICRect rect = {1, 0, 2, 1};
+    float buffer[2 * 3];
+    const HRESULT hr = frame->lpVtbl->CopyPixels(frame, &rect, sizeof(buffer), sizeof(buffer), (BYTE *)buffer);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    for (UINT i = 0; i < 6; ++i)
+    {
+        CLOVE_FLOAT_EQ((float)(width * 3 + 3 + i) - 2.5F, buffer[i]);
+    }
+
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+static IWICBitmapSourceTransform *GetBitmapSourceTransform(IWICBitmapFrameDecode *frame)
+{
+    IWICBitmapSourceTransform *bitmapSourceTransform;
+    const HRESULT hr =
+        frame->lpVtbl->QueryInterface(frame, &IID_IWICBitmapSourceTransform, (void **)&bitmapSourceTransform);
+    return SUCCEEDED(hr) ? bitmapSourceTransform : NULL;
+}
+
+CLOVE_TEST(GetClosestPixelFormatOffersHalfFloatFor16BitSamples)
+{
+    const BYTE pixels[6] = {};
+    IStream *stream = CreateStreamFromHeaderAndData("P6 1 1 65535\n", pixels, sizeof(pixels));
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    IWICBitmapSourceTransform *bitmapSourceTransform = GetBitmapSourceTransform(frame);
+    CLOVE_NOT_NULL(bitmapSourceTransform);
+
+    GUID pixelFormat = GUID_WICPixelFormat64bppRGBAHalf;
+    HRESULT hr = bitmapSourceTransform->lpVtbl->GetClosestPixelFormat(bitmapSourceTransform, &pixelFormat);
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_IS_TRUE(IsEqualGUID(&GUID_WICPixelFormat64bppRGBAHalf, &pixelFormat));
+
+    pixelFormat = GUID_WICPixelFormat128bppRGBAFloat;
+    hr = bitmapSourceTransform->lpVtbl->GetClosestPixelFormat(bitmapSourceTransform, &pixelFormat);
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_IS_TRUE(IsEqualGUID(&GUID_WICPixelFormat48bppRGB, &pixelFormat));
+
+    bitmapSourceTransform->lpVtbl->Release(bitmapSourceTransform);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(CopyPixelsPamGrayscaleAlpha16AsHalfFloat)
+{
+    const BYTE pixels[2 * 4] = {0xFF, 0xFF, 0x80, 0x00, 0x00, 0x00, 0x00, 0x01};
+    IStream *stream =
+        CreateStreamFromHeaderAndData("P7\nWIDTH 2\nHEIGHT 1\nDEPTH 2\nMAXVAL 65535\nENDHDR\n", pixels, sizeof(pixels));
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    IWICBitmapSourceTransform *bitmapSourceTransform = GetBitmapSourceTransform(frame);
+    CLOVE_NOT_NULL(bitmapSourceTransform);
+
+    GUID pixelFormat = GUID_WICPixelFormat64bppRGBAHalf;
+    USHORT buffer[2 * 4];
+    const HRESULT hr = bitmapSourceTransform->lpVtbl->CopyPixels(
+        bitmapSourceTransform, NULL, 2, 1, &pixelFormat, WICBitmapTransformRotate0, sizeof(buffer), sizeof(buffer),
+        (BYTE *)buffer);
+
+    // 32768 / 65535 rounds to 0.5 and 1 / 65535 rounds to the denormal half float 256 * 2^-24.
+    CLOVE_UINT_EQ(S_OK, hr);
+    const USHORT expected[2 * 4] = {0x3C00, 0x3C00, 0x3C00, 0x3800, 0x0000, 0x0000, 0x0000, 0x0100};
+    CLOVE_IS_TRUE(memcmp(expected, buffer, sizeof(buffer)) == 0);
+
+    bitmapSourceTransform->lpVtbl->Release(bitmapSourceTransform);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(CopyPixelsFloatGraymapAsHalfFloatIsBitExact)
+{
+    // Reference conversions (round to nearest even) of the special cases: signed zero, overflow to Inf, Inf, NaN,
+    // float denormals and results that are half float denormals.
+    static const struct
+    {
+        UINT floatBits;
+        USHORT halfBits;
+    } conversions[] = {{0x3F800000, 0x3C00}, // 1.0
+                       {0xC0000000, 0xC000}, // -2.0
+                       {0x80000000, 0x8000}, // -0.0
+                       {0x3DCCCCCD, 0x2E66}, // 0.1
+                       {0x477FE000, 0x7BFF}, // 65504, largest half float
+                       {0x477FF000, 0x7C00}, // 65520, rounds to Inf
+                       {0x7F800000, 0x7C00}, // Inf
+                       {0xFF800000, 0xFC00}, // -Inf
+                       {0x7FC00000, 0x7E00}, // quiet NaN
+                       {0xFF800001, 0xFE00}, // signaling NaN is made quiet
+                       {0x38800000, 0x0400}, // 2^-14, smallest normal half float
+                       {0x33800000, 0x0001}, // 2^-24, smallest denormal half float
+                       {0x33000000, 0x0000}, // 2^-25, halfway rounds to even (0)
+                       {0x33C00000, 0x0002}, // 1.5 * 2^-24, halfway rounds to even (2)
+                       {0x387FC000, 0x03FF}, // largest denormal half float
+                       {0x00000001, 0x0000}, // smallest float denormal
+                       {0x807FFFFF, 0x8000}}; // largest negative float denormal
+    enum { width = ARRAYSIZE(conversions) };
+
+    BYTE pixels[width * 4];
+    for (UINT i = 0; i < width; ++i)
+    {
+        memcpy(pixels + i * 4, &conversions[i].floatBits, 4);
+    }
+
+    IStream *stream = CreateStreamFromHeaderAndData("Pf\n17 1\n-1.0\n", pixels, sizeof(pixels));
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    IWICBitmapSourceTransform *bitmapSourceTransform = GetBitmapSourceTransform(frame);
+    CLOVE_NOT_NULL(bitmapSourceTransform);
+
+    GUID pixelFormat = GUID_WICPixelFormat16bppGrayHalf;
+    HRESULT hr = bitmapSourceTransform->lpVtbl->GetClosestPixelFormat(bitmapSourceTransform, &pixelFormat);
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_IS_TRUE(IsEqualGUID(&GUID_WICPixelFormat16bppGrayHalf, &pixelFormat));
+
+    // A full row uses the vectorized conversion, single pixels the scalar conversion.
+    USHORT buffer[width];
+    hr = bitmapSourceTransform->lpVtbl->CopyPixels(bitmapSourceTransform, NULL, width, 1, &pixelFormat,
+                                                   WICBitmapTransformRotate0, sizeof(buffer), sizeof(buffer),
+                                                   (BYTE *)buffer);
+    CLOVE_UINT_EQ(S_OK, hr);
+    for (UINT i = 0; i < width; ++i)
+    {
+        CLOVE_UINT_EQ(conversions[i].halfBits, buffer[i]);
+
+        USHORT half;
+        const WICRect rect = {(INT)i, 0, 1, 1};
+        hr = bitmapSourceTransform->lpVtbl->CopyPixels(bitmapSourceTransform, &rect, 1, 1, &pixelFormat,
+                                                       WICBitmapTransformRotate0, sizeof(half), sizeof(half),
+                                                       (BYTE *)&half);
+        CLOVE_UINT_EQ(S_OK, hr);
+        CLOVE_UINT_EQ(conversions[i].halfBits, half);
+    }
+
+    bitmapSourceTransform->lpVtbl->Release(bitmapSourceTransform);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+// Palette that only stores the colors of InitializeCustom.
+typedef struct TestPalette
+{
+    IWICPalette palette;
+    WICColor colors[256];
+    UINT colorCount;
+} TestPalette;
+
+static HRESULT STDMETHODCALLTYPE TestPaletteQueryInterface([[maybe_unused]] IWICPalette *this,
+                                                           [[maybe_unused]] REFIID riid, void **ppv)
+{
+    *ppv = NULL;
+    return E_NOINTERFACE;
+}
+
+static ULONG STDMETHODCALLTYPE TestPaletteAddRef([[maybe_unused]] IWICPalette *this)
+{
+    return 1;
+}
+
+static ULONG STDMETHODCALLTYPE TestPaletteRelease([[maybe_unused]] IWICPalette *this)
+{
+    return 1;
+}
+
+static HRESULT STDMETHODCALLTYPE TestPaletteInitializePredefined([[maybe_unused]] IWICPalette *this,
+                                                                 [[maybe_unused]] WICBitmapPaletteType paletteType,
+                                                                 [[maybe_unused]] BOOL addTransparentColor)
+{
+    return E_NOTIMPL;
+}
+
+static HRESULT STDMETHODCALLTYPE TestPaletteInitializeCustom(IWICPalette *this, WICColor *colors, const UINT colorCount)
+{
+    TestPalette *testPalette = (TestPalette *)this;
+    if (colorCount > ARRAYSIZE(testPalette->colors))
+        return E_INVALIDARG;
+
+    memcpy(testPalette->colors, colors, colorCount * sizeof(WICColor));
+    testPalette->colorCount = colorCount;
+    return S_OK;
+}
+
+static HRESULT STDMETHODCALLTYPE TestPaletteInitializeFromBitmap([[maybe_unused]] IWICPalette *this,
+                                                                 [[maybe_unused]] IWICBitmapSource *surface,
+                                                                 [[maybe_unused]] UINT colorCount,
+                                                                 [[maybe_unused]] BOOL addTransparentColor)
+{
+    return E_NOTIMPL;
+}
+
+static HRESULT STDMETHODCALLTYPE TestPaletteInitializeFromPalette([[maybe_unused]] IWICPalette *this,
+                                                                  [[maybe_unused]] IWICPalette *palette)
+{
+    return E_NOTIMPL;
+}
+
+static HRESULT STDMETHODCALLTYPE TestPaletteGetType([[maybe_unused]] IWICPalette *this,
+                                                    [[maybe_unused]] WICBitmapPaletteType *paletteType)
+{
+    return E_NOTIMPL;
+}
+
+static HRESULT STDMETHODCALLTYPE TestPaletteGetColorCount([[maybe_unused]] IWICPalette *this,
+                                                          [[maybe_unused]] UINT *colorCount)
+{
+    return E_NOTIMPL;
+}
+
+static HRESULT STDMETHODCALLTYPE TestPaletteGetColors([[maybe_unused]] IWICPalette *this,
+                                                      [[maybe_unused]] UINT colorCount,
+                                                      [[maybe_unused]] WICColor *colors,
+                                                      [[maybe_unused]] UINT *actualColorCount)
+{
+    return E_NOTIMPL;
+}
+
+static HRESULT STDMETHODCALLTYPE TestPaletteGetBool([[maybe_unused]] IWICPalette *this, [[maybe_unused]] BOOL *value)
+{
+    return E_NOTIMPL;
+}
+
+static const IWICPaletteVtbl testPaletteVtbl = {
+    TestPaletteQueryInterface,        TestPaletteAddRef,  TestPaletteRelease,       TestPaletteInitializePredefined,
+    TestPaletteInitializeCustom,      TestPaletteInitializeFromBitmap,              TestPaletteInitializeFromPalette,
+    TestPaletteGetType,               TestPaletteGetColorCount,                     TestPaletteGetColors,
+    TestPaletteGetBool,               TestPaletteGetBool, TestPaletteGetBool};
+
+static HRESULT CopyIndexedPixels(IWICBitmapFrameDecode *frame, const GUID *indexedPixelFormat, const UINT width,
+                                 BYTE *buffer, const UINT bufferSize)
+{
+    IWICBitmapSourceTransform *bitmapSourceTransform = GetBitmapSourceTransform(frame);
+    GUID pixelFormat = *indexedPixelFormat;
+    HRESULT hr = bitmapSourceTransform->lpVtbl->GetClosestPixelFormat(bitmapSourceTransform, &pixelFormat);
+    if (SUCCEEDED(hr) && !IsEqualGUID(&pixelFormat, indexedPixelFormat))
+    {
+        hr = WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = bitmapSourceTransform->lpVtbl->CopyPixels(bitmapSourceTransform, NULL, width, 1, &pixelFormat,
+                                                       WICBitmapTransformRotate0, bufferSize, bufferSize, buffer);
+    }
+
+    bitmapSourceTransform->lpVtbl->Release(bitmapSourceTransform);
+    return hr;
+}
+
+CLOVE_TEST(CopyPaletteGraymapMapsSamplesToGray)
+{
+    // The binary samples are copied as is, the plain samples are converted: both map to the same gray levels.
+    const BYTE pixels[4] = {0, 3, 15, 20};
+    const char *plainPixels = "0 3 15 15\n"; // Plain samples larger than maxValue are invalid.
+    const WICColor expected[4] = {0xFF000000, 0xFF333333, 0xFFFFFFFF, 0xFFFFFFFF};
+
+    for (int plain = 0; plain < 2; ++plain)
+    {
+        IStream *stream = plain ? CreateStreamFromHeaderAndData("P2 4 1 15\n", plainPixels, strlen(plainPixels))
+                                : CreateStreamFromHeaderAndData("P5 4 1 15\n", pixels, sizeof(pixels));
+        IWICBitmapFrameDecode *frame = CreateFrame(stream);
+        CLOVE_NOT_NULL(frame);
+        CLOVE_IS_TRUE(HasPixelFormat(frame, &GUID_WICPixelFormat8bppGray));
+
+        TestPalette palette = {{&testPaletteVtbl}};
+        CLOVE_UINT_EQ(S_OK, frame->lpVtbl->CopyPalette(frame, &palette.palette));
+        CLOVE_UINT_EQ(256, palette.colorCount);
+
+        BYTE buffer[4];
+        CLOVE_UINT_EQ(S_OK, CopyIndexedPixels(frame, &GUID_WICPixelFormat8bppIndexed, 4, buffer, sizeof(buffer)));
+        for (UINT i = 0; i < 4; ++i)
+        {
+            if (!plain)
+            {
+                CLOVE_UINT_EQ(pixels[i], buffer[i]);
+            }
+
+            CLOVE_UINT_EQ(expected[i], palette.colors[buffer[i]]);
+        }
+
+        frame->lpVtbl->Release(frame);
+        stream->lpVtbl->Release(stream);
+    }
+}
+
+CLOVE_TEST(CopyPaletteBitmapMapsSamplesToBlackAndWhite)
+{
+    const BYTE pixels[2] = {0xA3, 0x40};
+    IStream *stream = CreateStreamFromHeaderAndData("P4 3 2\n", pixels, sizeof(pixels));
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+
+    TestPalette palette = {{&testPaletteVtbl}};
+    CLOVE_UINT_EQ(S_OK, frame->lpVtbl->CopyPalette(frame, &palette.palette));
+    CLOVE_UINT_EQ(2, palette.colorCount);
+    CLOVE_UINT_EQ(0xFFFFFFFF, palette.colors[0]);
+    CLOVE_UINT_EQ(0xFF000000, palette.colors[1]);
+
+    // The bits of the file are not inverted: a set bit is black.
+    BYTE buffer[2];
+    IWICBitmapSourceTransform *bitmapSourceTransform = GetBitmapSourceTransform(frame);
+    GUID pixelFormat = GUID_WICPixelFormat1bppIndexed;
+    CLOVE_UINT_EQ(S_OK, bitmapSourceTransform->lpVtbl->CopyPixels(bitmapSourceTransform, NULL, 3, 2, &pixelFormat,
+                                                                  WICBitmapTransformRotate0, 1, sizeof(buffer),
+                                                                  buffer));
+    CLOVE_UINT_EQ(0xA0, buffer[0] & 0xE0);
+    CLOVE_UINT_EQ(0x40, buffer[1] & 0xE0);
+
+    CLOVE_UINT_EQ(S_OK, frame->lpVtbl->CopyPixels(frame, NULL, 1, sizeof(buffer), buffer));
+    CLOVE_UINT_EQ(0x40, buffer[0] & 0xE0);
+
+    bitmapSourceTransform->lpVtbl->Release(bitmapSourceTransform);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(CopyPaletteNotAvailableForPixmapAnd16BitGraymap)
+{
+    const BYTE pixels[6] = {};
+    const char *headers[] = {"P6 1 1 255\n", "P5 1 1 65535\n"};
+    for (UINT i = 0; i < ARRAYSIZE(headers); ++i)
+    {
+        IStream *stream = CreateStreamFromHeaderAndData(headers[i], pixels, sizeof(pixels));
+        IWICBitmapFrameDecode *frame = CreateFrame(stream);
+        CLOVE_NOT_NULL(frame);
+
+        TestPalette palette = {{&testPaletteVtbl}};
+        CLOVE_UINT_EQ(WINCODEC_ERR_PALETTEUNAVAILABLE, frame->lpVtbl->CopyPalette(frame, &palette.palette));
+
+        BYTE buffer[6];
+        CLOVE_UINT_EQ(WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT,
+                      CopyIndexedPixels(frame, &GUID_WICPixelFormat8bppIndexed, 1, buffer, sizeof(buffer)));
+
+        frame->lpVtbl->Release(frame);
+        stream->lpVtbl->Release(stream);
+    }
+}
+
+static INetpbmPlanarOutput *GetPlanarOutput(IWICBitmapFrameDecode *frame)
+{
+    INetpbmPlanarOutput *planarOutput;
+    const HRESULT hr = frame->lpVtbl->QueryInterface(frame, &IID_INetpbmPlanarOutput, (void **)&planarOutput);
+    return SUCCEEDED(hr) ? planarOutput : NULL;
+}
+
+static IStream *CreatePixmapStream(const UINT width, const UINT height, const UINT maxValue)
+{
+    const size_t size = (size_t)width * height * 3;
+    BYTE *pixels = malloc(size);
+    if (!pixels)
+        return NULL;
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        pixels[i] = (BYTE)((i * 31 + i / 3) % (maxValue + 1));
+    }
+
+    char header[64];
+    snprintf(header, sizeof(header), "P6 %u %u %u\n", width, height, maxValue);
+    IStream *stream = CreateStreamFromHeaderAndData(header, pixels, size);
+    free(pixels);
+    return stream;
+}
+
+CLOVE_TEST(CopyPlanesPixmap)
+{
+    // 37 pixels: 2 blocks for the vectorized de-interleave and a remainder for the scalar code.
+    enum { width = 37, height = 2 };
+    IStream *stream = CreatePixmapStream(width, height, 200);
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    INetpbmPlanarOutput *planarOutput = GetPlanarOutput(frame);
+    CLOVE_NOT_NULL(planarOutput);
+
+    BYTE interleaved[width * height * 3];
+    HRESULT hr = frame->lpVtbl->CopyPixels(frame, NULL, width * 3, sizeof(interleaved), interleaved);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    BYTE planeBuffers[3][width * height];
+    float floatPlaneBuffers[3][width * height];
+    WICBitmapPlane planes[3];
+    WICBitmapPlane floatPlanes[3];
+    for (UINT i = 0; i < 3; ++i)
+    {
+        planes[i] = (WICBitmapPlane){GUID_WICPixelFormat8bppGray, planeBuffers[i], width, width * height};
+        floatPlanes[i] = (WICBitmapPlane){GUID_WICPixelFormat32bppGrayFloat, (BYTE *)floatPlaneBuffers[i], width * 4,
+                                          width * height * 4};
+    }
+
+    hr = planarOutput->lpVtbl->CopyPlanes(planarOutput, NULL, planes, 3);
+    CLOVE_UINT_EQ(S_OK, hr);
+    hr = planarOutput->lpVtbl->CopyPlanes(planarOutput, NULL, floatPlanes, 3);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    BYTE samples[width * height * 3];
+    hr = frame->lpVtbl->CopyPixels(frame, NULL, width * 3, sizeof(samples), samples);
+    CLOVE_UINT_EQ(S_OK, hr);
+    for (UINT i = 0; i < width * height; ++i)
+    {
+        for (UINT channel = 0; channel < 3; ++channel)
+        {
+            CLOVE_UINT_EQ(interleaved[i * 3 + channel], planeBuffers[channel][i]);
+            const BYTE sample = (BYTE)(((size_t)(i * 3 + channel) * 31 + i) % 201);
+            CLOVE_FLOAT_EQ((float)sample / 200.0F, floatPlaneBuffers[channel][i]);
+        }
+    }
+
+    planarOutput->lpVtbl->Release(planarOutput);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(CopyPlanesRequiresPlanePerChannel)
+{
+    IStream *stream = CreatePixmapStream(4, 4, 255);
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    INetpbmPlanarOutput *planarOutput = GetPlanarOutput(frame);
+    CLOVE_NOT_NULL(planarOutput);
+
+    BYTE buffer[16];
+    const WICBitmapPlane plane = {GUID_WICPixelFormat8bppGray, buffer, 4, sizeof(buffer)};
+    HRESULT hr = planarOutput->lpVtbl->CopyPlanes(planarOutput, NULL, &plane, 1);
+    CLOVE_UINT_EQ(E_INVALIDARG, hr);
+
+    const WICBitmapPlane planes[3] = {plane, plane, {GUID_WICPixelFormat16bppGray, buffer, 8, sizeof(buffer)}};
+    hr = planarOutput->lpVtbl->CopyPlanes(planarOutput, NULL, planes, 3);
+    CLOVE_UINT_EQ(WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT, hr);
+
+    planarOutput->lpVtbl->Release(planarOutput);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(CopyPlanesBenchmark)
+{
+    // Benchmark planar float output against an interleaved decode followed by a separate split pass.
+    enum { size = 2048 };
+    const size_t pixelCount = (size_t)size * size;
+    IStream *stream = CreatePixmapStream(size, size, 255);
+    CLOVE_NOT_NULL(stream);
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    INetpbmPlanarOutput *planarOutput = GetPlanarOutput(frame);
+    CLOVE_NOT_NULL(planarOutput);
+
+    float *planeBuffer = malloc(pixelCount * 3 * sizeof(float));
+    BYTE *interleaved = malloc(pixelCount * 3);
+    CLOVE_NOT_NULL(planeBuffer);
+    CLOVE_NOT_NULL(interleaved);
+
+    // Touch the buffers upfront to keep page faults out of the measurements.
+    memset(planeBuffer, 0, pixelCount * 3 * sizeof(float));
+    memset(interleaved, 0, pixelCount * 3);
+    WICBitmapPlane planes[3];
+    for (UINT i = 0; i < 3; ++i)
+    {
+        planes[i] = (WICBitmapPlane){GUID_WICPixelFormat32bppGrayFloat, (BYTE *)(planeBuffer + i * pixelCount),
+                                     size * 4, (UINT)(pixelCount * 4)};
+    }
+
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+    LARGE_INTEGER planarEnd;
+    LARGE_INTEGER splitEnd;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+    HRESULT hr = planarOutput->lpVtbl->CopyPlanes(planarOutput, NULL, planes, 3);
+    QueryPerformanceCounter(&planarEnd);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    hr = frame->lpVtbl->CopyPixels(frame, NULL, size * 3, (UINT)(pixelCount * 3), interleaved);
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        for (UINT channel = 0; channel < 3; ++channel)
+        {
+            planeBuffer[channel * pixelCount + i] = (float)interleaved[i * 3 + channel] / 255.0F;
+        }
+    }
+    QueryPerformanceCounter(&splitEnd);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    const double planarMilliseconds =
+        (double)(planarEnd.QuadPart - start.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+    const double splitMilliseconds =
+        (double)(splitEnd.QuadPart - planarEnd.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+    printf("CopyPlanes %ux%u RGB to float planes: %.2f ms, CopyPixels and split: %.2f ms\n", size, size,
+           planarMilliseconds, splitMilliseconds);
+
+    free(interleaved);
+    free(planeBuffer);
+    planarOutput->lpVtbl->Release(planarOutput);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(QueryCapabilityNonSeekableStreamReadsNothing)
+{
+    IWICBitmapDecoder *wicBitmapDecoder = CreateDecoder();
+    const BYTE pixels[4] = {};
+    IStream *memoryStream = CreateStreamFromHeaderAndData("P5 2 2 255\n", pixels, sizeof(pixels));
+    IStream *stream = CreateNonSeekableStream(memoryStream);
+
+    DWORD capability;
+    const HRESULT hr = wicBitmapDecoder->lpVtbl->QueryCapability(wicBitmapDecoder, stream, &capability);
+
+    CLOVE_IS_TRUE(FAILED(hr));
+    CLOVE_UINT_EQ(0, GetCountingStreamBytesRead(stream));
+    stream->lpVtbl->Release(stream);
+    memoryStream->lpVtbl->Release(memoryStream);
+    wicBitmapDecoder->lpVtbl->Release(wicBitmapDecoder);
+}
+
+CLOVE_TEST(CopyPixelsNonSeekableStreamReadsFileOnce)
+{
+    // The image is larger than the buffer of the header reader: the samples are read partly from that buffer.
+    enum { width = 67, height = 41, stride = width * 3 };
+    BYTE *samples = malloc(stride * height);
+    for (size_t i = 0; i < stride * height; ++i)
+    {
+        samples[i] = (BYTE)((i * 7 + i / 5) % 201);
+    }
+
+    IStream *memoryStream = CreateStreamFromHeaderAndData("P6\n# pipe\n67 41\n200\n", samples, stride * height);
+    BYTE *expected = malloc(stride * height);
+    IWICBitmapFrameDecode *frame = CreateFrame(memoryStream);
+    CLOVE_NOT_NULL(frame);
+    CLOVE_UINT_EQ(S_OK, frame->lpVtbl->CopyPixels(frame, NULL, stride, stride * height, expected));
+    frame->lpVtbl->Release(frame);
+
+    const LARGE_INTEGER start = {};
+    memoryStream->lpVtbl->Seek(memoryStream, start, STREAM_SEEK_SET, NULL);
+    IStream *stream = CreateNonSeekableStream(memoryStream);
+    frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+
+    // Rectangles are copied from the image that is decoded by the first call.
+    const WICRect rect = {3, 20, 11, 21};
+    HRESULT hr = frame->lpVtbl->CopyPixels(frame, &rect, stride, stride * height, samples);
+    CLOVE_UINT_EQ(S_OK, hr);
+    for (INT y = 0; y < rect.Height; ++y)
+    {
+        CLOVE_IS_TRUE(memcmp(expected + (size_t)(rect.Y + y) * stride + (size_t)rect.X * 3, samples + (size_t)y * stride,
+                             (size_t)rect.Width * 3) == 0);
+    }
+
+    hr = frame->lpVtbl->CopyPixels(frame, NULL, stride, stride * height, samples);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_IS_TRUE(memcmp(expected, samples, stride * height) == 0);
+    STATSTG stat;
+    memoryStream->lpVtbl->Stat(memoryStream, &stat, STATFLAG_NONAME);
+    CLOVE_ULLONG_EQ(stat.cbSize.QuadPart, GetCountingStreamBytesRead(stream));
+
+    IWICBitmapSource *thumbnail;
+    CLOVE_UINT_EQ(WINCODEC_ERR_UNSUPPORTEDOPERATION, frame->lpVtbl->GetThumbnail(frame, &thumbnail));
+
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+    memoryStream->lpVtbl->Release(memoryStream);
+    free(expected);
+    free(samples);
+}
+
+CLOVE_TEST(CopyPixelsNonSeekableFloatGraymapIsBottomUp)
+{
+    enum { width = 2, height = 3 };
+    BYTE pixels[width * height * 4];
+    for (UINT i = 0; i < width * height; ++i)
+    {
+        StoreFloat(pixels + i * 4, (float)i, true);
+    }
+
+    IStream *memoryStream = CreateStreamFromHeaderAndData("Pf\n2 3\n-1.0\n", pixels, sizeof(pixels));
+    IStream *stream = CreateNonSeekableStream(memoryStream);
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+
+    float buffer[width * height];
+    const HRESULT hr = frame->lpVtbl->CopyPixels(frame, NULL, width * 4, sizeof(buffer), (BYTE *)buffer);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    for (UINT y = 0; y < height; ++y)
+    {
+        for (UINT x = 0; x < width; ++x)
+        {
+            CLOVE_FLOAT_EQ((float)((height - 1 - y) * width + x), buffer[y * width + x]);
+        }
+    }
+
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+    memoryStream->lpVtbl->Release(memoryStream);
+}
+
+CLOVE_TEST(CopyPixelsNonSeekablePlainGraymap)
+{
+    const char samples[] = "0 5 10\n# comment\n 15 20 25\n";
+    IStream *memoryStream = CreateStreamFromHeaderAndData("P2 3 2 25\n", samples, sizeof(samples) - 1);
+    IStream *stream = CreateNonSeekableStream(memoryStream);
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+
+    BYTE buffer[3 * 2];
+    const HRESULT hr = frame->lpVtbl->CopyPixels(frame, NULL, 3, sizeof(buffer), buffer);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    const BYTE expected[] = {0, 51, 102, 153, 204, 255};
+    CLOVE_IS_TRUE(memcmp(expected, buffer, sizeof(buffer)) == 0);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+    memoryStream->lpVtbl->Release(memoryStream);
+}
+
+static bool HasCommentValue(IWICMetadataQueryReader *queryReader, const WCHAR *name, const char *expected)
+{
+    PROPVARIANT value;
+    if (FAILED(queryReader->lpVtbl->GetMetadataByName(queryReader, name, &value)))
+        return false;
+
+    const bool equal = value.vt == VT_LPSTR && strcmp(value.pszVal, expected) == 0;
+    PropVariantClear(&value);
+    return equal;
+}
+
+CLOVE_TEST(GetMetadataQueryReaderReturnsComments)
+{
+    const BYTE pixels[6] = {};
+    IStream *memoryStream =
+        CreateStreamFromHeaderAndData("P5\n# exposure 12 ms\n3 2\n#gain 2\n#\n255\n", pixels, sizeof(pixels));
+    IStream *stream = CreateCountingStream(memoryStream);
+    memoryStream->lpVtbl->Release(memoryStream);
+    IWICBitmapDecoder *wicBitmapDecoder = CreateDecoder();
+
+    IWICMetadataQueryReader *queryReader;
+    CLOVE_UINT_EQ(WINCODEC_ERR_NOTINITIALIZED,
+                  wicBitmapDecoder->lpVtbl->GetMetadataQueryReader(wicBitmapDecoder, &queryReader));
+    HRESULT hr = wicBitmapDecoder->lpVtbl->Initialize(wicBitmapDecoder, stream, WICDecodeMetadataCacheOnDemand);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    // Creating the reader doesn't read the text of the comments.
+    const ULONG readCalls = GetCountingStreamReadCalls(stream);
+    hr = wicBitmapDecoder->lpVtbl->GetMetadataQueryReader(wicBitmapDecoder, &queryReader);
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(readCalls, GetCountingStreamReadCalls(stream));
+
+    CLOVE_IS_TRUE(HasCommentValue(queryReader, L"/comments/0", " exposure 12 ms"));
+    CLOVE_IS_TRUE(HasCommentValue(queryReader, L"/comments/1", "gain 2"));
+    CLOVE_IS_TRUE(HasCommentValue(queryReader, L"/comments/2", ""));
+    CLOVE_UINT_EQ(WINCODEC_ERR_PROPERTYNOTFOUND, queryReader->lpVtbl->GetMetadataByName(queryReader, L"/comments/3", NULL));
+
+    // The text is cached by the reader after the first query.
+    const ULONG queryReadCalls = GetCountingStreamReadCalls(stream);
+    CLOVE_IS_TRUE(HasCommentValue(queryReader, L"/comments/1", "gain 2"));
+    CLOVE_UINT_EQ(queryReadCalls, GetCountingStreamReadCalls(stream));
+
+    queryReader->lpVtbl->Release(queryReader);
+    wicBitmapDecoder->lpVtbl->Release(wicBitmapDecoder);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(GetMetadataQueryReaderLimitsCommentMemory)
+{
+    // 64 comments of 4 KiB: only the first comments are kept, their total size is limited to 64 KiB.
+    enum { commentCount = 64, commentSize = 4096 };
+    const size_t headerSize = 3 + (size_t)commentCount * (commentSize + 2) + sizeof("2 1\n255\n");
+    char *header = malloc(headerSize);
+    CLOVE_NOT_NULL(header);
+    char *position = header;
+    memcpy(position, "P5\n", 3);
+    position += 3;
+    for (UINT i = 0; i < commentCount; ++i)
+    {
+        *position++ = '#';
+        memset(position, 'a' + i % 26, commentSize);
+        position += commentSize;
+        *position++ = '\n';
+    }
+    memcpy(position, "2 1\n255\n", sizeof("2 1\n255\n"));
+
+    const BYTE samples[2] = {7, 9};
+    IStream *stream = CreateStreamFromHeaderAndData(header, samples, sizeof(samples));
+    free(header);
+    IWICBitmapDecoder *wicBitmapDecoder = CreateDecoder();
+    HRESULT hr = wicBitmapDecoder->lpVtbl->Initialize(wicBitmapDecoder, stream, WICDecodeMetadataCacheOnDemand);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    IWICMetadataQueryReader *queryReader;
+    hr = wicBitmapDecoder->lpVtbl->GetMetadataQueryReader(wicBitmapDecoder, &queryReader);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    IEnumString *enumString;
+    CLOVE_UINT_EQ(S_OK, queryReader->lpVtbl->GetEnumerator(queryReader, &enumString));
+    size_t totalSize = 0;
+    UINT itemCount = 0;
+    LPOLESTR name;
+    while (enumString->lpVtbl->Next(enumString, 1, &name, NULL) == S_OK)
+    {
+        PROPVARIANT value;
+        CLOVE_UINT_EQ(S_OK, queryReader->lpVtbl->GetMetadataByName(queryReader, name, &value));
+        CLOVE_UINT_EQ(VT_LPSTR, value.vt);
+        CLOVE_INT_EQ('a' + itemCount % 26, value.pszVal[0]);
+        totalSize += strlen(value.pszVal);
+        PropVariantClear(&value);
+        CoTaskMemFree(name);
+        ++itemCount;
+    }
+    enumString->lpVtbl->Release(enumString);
+    CLOVE_UINT_EQ(16, itemCount);
+    CLOVE_ULLONG_EQ(64 * 1024, totalSize);
+
+    // The comments don't affect the decoding of the pixels.
+    IWICBitmapFrameDecode *frame;
+    CLOVE_UINT_EQ(S_OK, wicBitmapDecoder->lpVtbl->GetFrame(wicBitmapDecoder, 0, &frame));
+    BYTE pixels[2];
+    CLOVE_UINT_EQ(S_OK, frame->lpVtbl->CopyPixels(frame, NULL, 2, sizeof(pixels), pixels));
+    CLOVE_UINT_EQ(7, pixels[0]);
+    CLOVE_UINT_EQ(9, pixels[1]);
+
+    frame->lpVtbl->Release(frame);
+    queryReader->lpVtbl->Release(queryReader);
+    wicBitmapDecoder->lpVtbl->Release(wicBitmapDecoder);
+    stream->lpVtbl->Release(stream);
+}
+
+// Creates a 2 x 1 graymap of which the header has a comment block of size bytes, in lines of 1 KiB.
+static IStream *CreateStreamWithCommentBlock(const size_t size)
+{
+    const char end[] = "2 1\n255\n";
+    char *header = malloc(3 + size + sizeof(end));
+    if (!header)
+        return NULL;
+
+    memcpy(header, "P5\n", 3);
+    for (size_t i = 0; i < size; ++i)
+    {
+        header[3 + i] = i % 1024 == 0 ? '#' : i % 1024 == 1023 ? '\n' : (char)('a' + i % 26);
+    }
+    memcpy(header + 3 + size, end, sizeof(end));
+
+    const BYTE samples[2] = {7, 9};
+    IStream *stream = CreateStreamFromHeaderAndData(header, samples, sizeof(samples));
+    free(header);
+    return stream;
+}
+
+CLOVE_TEST(InitializeWithCommentBlockBenchmark)
+{
+    const size_t sizes[] = {1024, 1024 * 1024, 100 * 1024 * 1024};
+    for (size_t i = 0; i < ARRAYSIZE(sizes); ++i)
+    {
+        IStream *stream = CreateStreamWithCommentBlock(sizes[i]);
+        CLOVE_NOT_NULL(stream);
+        IWICBitmapDecoder *wicBitmapDecoder = CreateDecoder();
+
+        LARGE_INTEGER frequency;
+        LARGE_INTEGER begin;
+        LARGE_INTEGER end;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&begin);
+        const HRESULT hr =
+            wicBitmapDecoder->lpVtbl->Initialize(wicBitmapDecoder, stream, WICDecodeMetadataCacheOnDemand);
+        QueryPerformanceCounter(&end);
+        CLOVE_UINT_EQ(S_OK, hr);
+
+        IWICBitmapFrameDecode *frame;
+        CLOVE_UINT_EQ(S_OK, wicBitmapDecoder->lpVtbl->GetFrame(wicBitmapDecoder, 0, &frame));
+        BYTE pixels[2];
+        CLOVE_UINT_EQ(S_OK, frame->lpVtbl->CopyPixels(frame, NULL, 2, sizeof(pixels), pixels));
+        CLOVE_UINT_EQ(9, pixels[1]);
+
+        const double seconds = (double)(end.QuadPart - begin.QuadPart) / (double)frequency.QuadPart;
+        printf("Initialize with %zu KiB of comments: %.3f ms (%.2f GB/s)\n", sizes[i] / 1024, seconds * 1000.0,
+               (double)sizes[i] / seconds / 1e9);
+
+        frame->lpVtbl->Release(frame);
+        wicBitmapDecoder->lpVtbl->Release(wicBitmapDecoder);
+        stream->lpVtbl->Release(stream);
+    }
+}
+
+typedef struct CopyRectangleContext
+{
+    IWICBitmapFrameDecode *frame;
+    WICRect rect;
+    UINT stride;
+    UINT bufferSize;
+    BYTE *buffer; // The position of the rectangle in the pixels of the complete frame.
+    HRESULT result;
+} CopyRectangleContext;
+
+static DWORD WINAPI CopyRectangleThread(void *parameter)
+{
+    CopyRectangleContext *context = parameter;
+    context->result = S_OK;
+    for (int i = 0; i < 20 && SUCCEEDED(context->result); ++i)
+    {
+        context->result = context->frame->lpVtbl->CopyPixels(context->frame, &context->rect, context->stride,
+                                                             context->bufferSize, context->buffer);
+    }
+
+    return 0;
+}
+
+// Every thread copies its own rectangle of a new frame repeatedly, the first copies also race to read or decode the
+// samples. The threads only share the frame, which makes the test a stress test for race detectors.
+static bool CopyRectanglesConcurrently(IStream *stream, const UINT width, const UINT height, const UINT bytesPerPixel,
+                                       const BYTE *expected)
+{
+    enum { threadCount = 8 };
+    const LARGE_INTEGER start = {};
+    stream->lpVtbl->Seek(stream, start, STREAM_SEEK_SET, NULL);
+    IWICBitmapDecoder *wicBitmapDecoder = CreateDecoder();
+    IWICBitmapFrameDecode *frame = NULL;
+    HRESULT hr = wicBitmapDecoder->lpVtbl->Initialize(wicBitmapDecoder, stream, WICDecodeMetadataCacheOnDemand);
+    if (SUCCEEDED(hr))
+    {
+        hr = wicBitmapDecoder->lpVtbl->GetFrame(wicBitmapDecoder, 0, &frame);
+    }
+    wicBitmapDecoder->lpVtbl->Release(wicBitmapDecoder);
+    if (FAILED(hr))
+        return false;
+
+    const UINT stride = width * bytesPerPixel;
+    BYTE *pixels = calloc(height, stride);
+    CopyRectangleContext contexts[threadCount];
+    HANDLE threads[threadCount];
+    for (UINT i = 0; i < threadCount; ++i)
+    {
+        // Two columns of four bands: the rectangles are disjoint and don't span complete rows.
+        const WICRect rect = {(INT)(i % 2 * width / 2), (INT)(i / 2 * height / 4), (INT)(width / 2), (INT)(height / 4)};
+        contexts[i].frame = frame;
+        contexts[i].rect = rect;
+        contexts[i].stride = stride;
+        contexts[i].bufferSize = stride * (UINT)(rect.Height - 1) + (UINT)rect.Width * bytesPerPixel;
+        contexts[i].buffer = pixels + (size_t)rect.Y * stride + (size_t)rect.X * bytesPerPixel;
+        threads[i] = CreateThread(NULL, 0, CopyRectangleThread, &contexts[i], 0, NULL);
+    }
+    WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+
+    bool succeeded = true;
+    for (UINT i = 0; i < threadCount; ++i)
+    {
+        CloseHandle(threads[i]);
+        succeeded = succeeded && SUCCEEDED(contexts[i].result);
+    }
+
+    succeeded = succeeded && memcmp(expected, pixels, (size_t)height * stride) == 0;
+    free(pixels);
+    frame->lpVtbl->Release(frame);
+    return succeeded;
+}
+
+CLOVE_TEST(CopyPixelsConcurrentlyOnDisjointRectangles)
+{
+    enum { width = 256, height = 128 };
+    BYTE *samples = malloc(width * height * 3);
+    for (size_t i = 0; i < width * height * 3; ++i)
+    {
+        samples[i] = (BYTE)(i * 7 >> 3);
+    }
+
+    // The samples of the binary pixmap are read by every copy, the plain graymap is decoded once.
+    IStream *stream = CreateStreamFromHeaderAndData("P6 256 128 255\n", samples, width * height * 3);
+    for (int round = 0; round < 10; ++round)
+    {
+        CLOVE_IS_TRUE(CopyRectanglesConcurrently(stream, width, height, 3, samples));
+    }
+
+    // With the frame cache enabled, the frames of a stream without a name still copy concurrently.
+    const NetpbmSetFrameCacheBudgetPtr setBudget =
+        (NetpbmSetFrameCacheBudgetPtr)GetCodecFunction("NetpbmSetFrameCacheBudget");
+    CLOVE_UINT_EQ(S_OK, setBudget(16 * 1024 * 1024));
+    for (int round = 0; round < 10; ++round)
+    {
+        CLOVE_IS_TRUE(CopyRectanglesConcurrently(stream, width, height, 3, samples));
+    }
+    CLOVE_UINT_EQ(S_OK, setBudget(0));
+    stream->lpVtbl->Release(stream);
+
+    char *plain = malloc(width * height * 4);
+    size_t size = 0;
+    for (size_t i = 0; i < width * height; ++i)
+    {
+        const BYTE sample = samples[i];
+        if (sample >= 100)
+        {
+            plain[size++] = (char)('0' + sample / 100);
+        }
+        if (sample >= 10)
+        {
+            plain[size++] = (char)('0' + sample / 10 % 10);
+        }
+        plain[size++] = (char)('0' + sample % 10);
+        plain[size++] = ' ';
+    }
+
+    stream = CreateStreamFromHeaderAndData("P2 256 128 255\n", plain, size);
+    for (int round = 0; round < 10; ++round)
+    {
+        CLOVE_IS_TRUE(CopyRectanglesConcurrently(stream, width, height, 1, samples));
+    }
+    stream->lpVtbl->Release(stream);
+
+    free(plain);
+    free(samples);
+}
+
+typedef struct SelectChannelsContext
+{
+    IWICBitmapFrameDecode *frame;
+    UINT stride;
+    UINT bufferSize;
+    BYTE *buffer;
+    volatile LONG unexpectedCount;
+} SelectChannelsContext;
+
+// The buffer fits the rows of 1 selected channel with the stride of 3 channels, copies of 3 channels must be rejected.
+static DWORD WINAPI CopyWhileSelectingThread(void *parameter)
+{
+    SelectChannelsContext *context = parameter;
+    for (int i = 0; i < 200; ++i)
+    {
+        const HRESULT result =
+            context->frame->lpVtbl->CopyPixels(context->frame, NULL, context->stride, context->bufferSize,
+                                               context->buffer);
+        if (result != S_OK && result != WINCODEC_ERR_INSUFFICIENTBUFFER)
+        {
+            InterlockedIncrement(&context->unexpectedCount);
+        }
+    }
+
+    return 0;
+}
+
+CLOVE_TEST(CopyPixelsWhileSelectingChannels)
+{
+    enum { width = 64, height = 2, threadCount = 4 };
+    IStream *stream = CreateMultispectralStream(width, height);
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    CLOVE_NOT_NULL(frame);
+    INetpbmChannelSelection *channelSelection;
+    frame->lpVtbl->QueryInterface(frame, &IID_INetpbmChannelSelection, (void **)&channelSelection);
+
+    SelectChannelsContext contexts[threadCount];
+    HANDLE threads[threadCount];
+    for (UINT i = 0; i < threadCount; ++i)
+    {
+        contexts[i].frame = frame;
+        contexts[i].stride = width * 3;
+        contexts[i].bufferSize = width * 3 * (height - 1) + width;
+        contexts[i].buffer = malloc(contexts[i].bufferSize);
+        contexts[i].unexpectedCount = 0;
+        threads[i] = CreateThread(NULL, 0, CopyWhileSelectingThread, &contexts[i], 0, NULL);
+    }
+
+    const UINT channels[3] = {3, 1, 2};
+    for (int i = 0; i < 200; ++i)
+    {
+        CLOVE_UINT_EQ(S_OK, channelSelection->lpVtbl->SelectChannels(channelSelection, i % 2 == 0 ? 3 : 1, channels));
+    }
+    WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+
+    for (UINT i = 0; i < threadCount; ++i)
+    {
+        CloseHandle(threads[i]);
+        CLOVE_INT_EQ(0, contexts[i].unexpectedCount);
+        free(contexts[i].buffer);
+    }
+
+    channelSelection->lpVtbl->Release(channelSelection);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
 }
@@ -0,0 +1,163 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "com_factory.h"
+#include <unknwn.h>
+#include <propsys.h>
+#include <stdio.h>
+
+#include "../src/guids.h"
+#include "../src/netpbm_object_pool.h"
+
+#define CLOVE_SUITE_NAME object_pool_test_suite
+#include <wincodec.h>
+#include <clove-unit/clove-unit.h>
+
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmSetObjectPoolCapacityPtr)(UINT capacity);
+
+static HRESULT SetCapacity(const UINT capacity)
+{
+    const NetpbmSetObjectPoolCapacityPtr setCapacity =
+        (NetpbmSetObjectPoolCapacityPtr)GetCodecFunction("NetpbmSetObjectPoolCapacity");
+    return setCapacity ? setCapacity(capacity) : E_FAIL;
+}
+
+static IUnknown *CreateObject(IClassFactory *classFactory, const IID *iid)
+{
+    IUnknown *object = NULL;
+    classFactory->lpVtbl->CreateInstance(classFactory, NULL, iid, (void **)&object);
+    return object;
+}
+
+static IUnknown *CreateClassObject(const CLSID *classId, const IID *iid)
+{
+    IClassFactory *classFactory = GetClassObject(classId, &IID_IClassFactory);
+    IUnknown *object = CreateObject(classFactory, iid);
+    classFactory->lpVtbl->Release(classFactory);
+    return object;
+}
+
+CLOVE_SUITE_SETUP_ONCE()
+{
+    ConstructComFactory();
+}
+
+CLOVE_SUITE_TEARDOWN_ONCE()
+{
+    SetCapacity(NetpbmDefaultObjectPoolCapacity);
+    DestructComFactory();
+}
+
+CLOVE_TEST(ReleasedObjectsAreReused)
+{
+    CLOVE_UINT_EQ(S_OK, SetCapacity(NetpbmDefaultObjectPoolCapacity));
+    const CLSID *classIds[] = {&CLSID_WICBitmapDecoder, &CLSID_PropertyStore};
+    const IID *iids[] = {&IID_IWICBitmapDecoder, &IID_IInitializeWithStream};
+    for (size_t i = 0; i < ARRAYSIZE(classIds); ++i)
+    {
+        IUnknown *object = CreateClassObject(classIds[i], iids[i]);
+        CLOVE_NOT_NULL(object);
+        object->lpVtbl->Release(object);
+
+        // The kept objects don't keep the module loaded, a reused object is a new instance with a reference count of 1.
+        CLOVE_UINT_EQ(S_OK, CallDllCanUnloadNow());
+        IUnknown *reused = CreateClassObject(classIds[i], iids[i]);
+        CLOVE_PTR_EQ(object, reused);
+        CLOVE_UINT_EQ(S_FALSE, CallDllCanUnloadNow());
+        CLOVE_UINT_EQ(2, reused->lpVtbl->AddRef(reused));
+        CLOVE_UINT_EQ(1, reused->lpVtbl->Release(reused));
+        CLOVE_UINT_EQ(0, reused->lpVtbl->Release(reused));
+        CLOVE_UINT_EQ(S_OK, CallDllCanUnloadNow());
+    }
+}
+
+CLOVE_TEST(SetObjectPoolCapacity)
+{
+    CLOVE_UINT_EQ(E_INVALIDARG, SetCapacity(UINT_MAX));
+    CLOVE_UINT_EQ(S_OK, SetCapacity(0));
+
+    // The objects are freed by their last release and allocated by CreateInstance.
+    IUnknown *object = CreateClassObject(&CLSID_WICBitmapDecoder, &IID_IWICBitmapDecoder);
+    CLOVE_NOT_NULL(object);
+    CLOVE_UINT_EQ(0, object->lpVtbl->Release(object));
+
+    CLOVE_UINT_EQ(S_OK, SetCapacity(NetpbmDefaultObjectPoolCapacity));
+}
+
+typedef struct CreateThreadContext
+{
+    LONG iterationCount;
+    LONG failureCount;
+} CreateThreadContext;
+
+// Creates and releases a decoder and a property store, as a thumbnail request does.
+static DWORD WINAPI CreateReleaseThread(void *parameter)
+{
+    CreateThreadContext *context = parameter;
+    IClassFactory *decoderFactory = GetClassObject(&CLSID_WICBitmapDecoder, &IID_IClassFactory);
+    IClassFactory *propertyStoreFactory = GetClassObject(&CLSID_PropertyStore, &IID_IClassFactory);
+    for (LONG i = 0; i < context->iterationCount; ++i)
+    {
+        IUnknown *decoder = CreateObject(decoderFactory, &IID_IWICBitmapDecoder);
+        IUnknown *propertyStore = CreateObject(propertyStoreFactory, &IID_IInitializeWithStream);
+        if (!decoder || !propertyStore)
+        {
+            InterlockedIncrement(&context->failureCount);
+        }
+
+        if (decoder)
+        {
+            decoder->lpVtbl->Release(decoder);
+        }
+
+        if (propertyStore)
+        {
+            propertyStore->lpVtbl->Release(propertyStore);
+        }
+    }
+
+    decoderFactory->lpVtbl->Release(decoderFactory);
+    propertyStoreFactory->lpVtbl->Release(propertyStoreFactory);
+    return 0;
+}
+
+// Returns the number of created pairs per second.
+static double CreateConcurrently(const UINT threadCount, CreateThreadContext *context)
+{
+    HANDLE threads[64];
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER begin;
+    LARGE_INTEGER end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+    for (UINT i = 0; i < threadCount; ++i)
+    {
+        threads[i] = CreateThread(NULL, 0, CreateReleaseThread, context, 0, NULL);
+    }
+    WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+    QueryPerformanceCounter(&end);
+    for (UINT i = 0; i < threadCount; ++i)
+    {
+        CloseHandle(threads[i]);
+    }
+
+    const double seconds = (double)(end.QuadPart - begin.QuadPart) / (double)frequency.QuadPart;
+    return (double)threadCount * context->iterationCount / seconds;
+}
+
+CLOVE_TEST(CreateReleaseBenchmark)
+{
+    CreateThreadContext context = {20000, 0};
+    for (UINT threadCount = 1; threadCount <= 64; threadCount *= 2)
+    {
+        CLOVE_UINT_EQ(S_OK, SetCapacity(0));
+        const double unpooled = CreateConcurrently(threadCount, &context);
+        CLOVE_UINT_EQ(S_OK, SetCapacity(NetpbmDefaultObjectPoolCapacity));
+        const double pooled = CreateConcurrently(threadCount, &context);
+        printf("Create and release a decoder and a property store, %u threads: %.2f M/s, pooled: %.2f M/s\n",
+               threadCount, unpooled / 1e6, pooled / 1e6);
+    }
+
+    CLOVE_INT_EQ(0, context.failureCount);
+    CLOVE_UINT_EQ(S_OK, CallDllCanUnloadNow());
+}
@@ -7,6 +7,15 @@
 #include <Windows.h>
 #include <unknwn.h>
 #include <propsys.h>
+#include <propkey.h>
+#include <propvarutil.h>
+
+#include "test_stream.h"
+#include "../src/guids.h"
+
+#ifdef _DEBUG
+#include <crtdbg.h>
+#endif
 
 typedef HRESULT(WINAPI* DllGetClassObjectPtr)(
     const CLSID* rclsid,
@@ -124,3 +133,288 @@ CLOVE_TEST(CreatePropertyStoreGetIPropertyStore) {
 
 
 
+
+static IPropertyStore *CreateInitializedPropertyStore(IStream *stream, HRESULT *result)
+{
+    IClassFactory *classFactory = GetClassObject(&IID_IClassFactory);
+    IInitializeWithStream *initializeWithStream = NULL;
+    classFactory->lpVtbl->CreateInstance(classFactory, NULL, &IID_IInitializeWithStream, (void **)&initializeWithStream);
+    classFactory->lpVtbl->Release(classFactory);
+
+    *result = initializeWithStream->lpVtbl->Initialize(initializeWithStream, stream, STGM_READ);
+    IPropertyStore *propertyStore = NULL;
+    initializeWithStream->lpVtbl->QueryInterface(initializeWithStream, &IID_IPropertyStore, (void **)&propertyStore);
+    initializeWithStream->lpVtbl->Release(initializeWithStream);
+    return propertyStore;
+}
+
+static UINT GetUInt32Value(IPropertyStore *propertyStore, const PROPERTYKEY *key)
+{
+    PROPVARIANT value;
+    if (FAILED(propertyStore->lpVtbl->GetValue(propertyStore, key, &value)) || value.vt != VT_UI4)
+        return 0;
+
+    return value.ulVal;
+}
+
+static bool HasStringValue(IPropertyStore *propertyStore, const PROPERTYKEY *key, const WCHAR *expected)
+{
+    PROPVARIANT value;
+    if (FAILED(propertyStore->lpVtbl->GetValue(propertyStore, key, &value)))
+        return false;
+
+    const bool equal = value.vt == VT_LPWSTR && wcscmp(value.pwszVal, expected) == 0;
+    PropVariantClear(&value);
+    return equal;
+}
+
+CLOVE_TEST(InitializeReadsHeaderWithSingleRead)
+{
+    const BYTE pixels[640 * 3] = {};
+    IStream *memoryStream = CreateStreamFromHeaderAndData("P6\n# comment\n640 1\n1023\n", pixels, sizeof(pixels));
+    IStream *stream = CreateCountingStream(memoryStream);
+    HRESULT result;
+    IPropertyStore *propertyStore = CreateInitializedPropertyStore(stream, &result);
+
+    CLOVE_UINT_EQ(S_OK, result);
+    CLOVE_UINT_EQ(1, GetCountingStreamReadCalls(stream));
+
+    // The property store doesn't keep a reference to the stream.
+    CLOVE_UINT_EQ(2, stream->lpVtbl->AddRef(stream));
+    stream->lpVtbl->Release(stream);
+
+    DWORD count;
+    CLOVE_UINT_EQ(S_OK, propertyStore->lpVtbl->GetCount(propertyStore, &count));
+    CLOVE_UINT_EQ(6, count);
+    CLOVE_UINT_EQ(640, GetUInt32Value(propertyStore, &PKEY_Image_HorizontalSize));
+    CLOVE_UINT_EQ(1, GetUInt32Value(propertyStore, &PKEY_Image_VerticalSize));
+    CLOVE_UINT_EQ(48, GetUInt32Value(propertyStore, &PKEY_Image_BitDepth));
+    CLOVE_UINT_EQ(1023, GetUInt32Value(propertyStore, &PKEY_Netpbm_MaxValue));
+    CLOVE_IS_TRUE(HasStringValue(propertyStore, &PKEY_Image_Dimensions, L"640 x 1"));
+    CLOVE_IS_TRUE(HasStringValue(propertyStore, &PKEY_Netpbm_Format, L"P6"));
+
+    for (DWORD i = 0; i < count; ++i)
+    {
+        PROPERTYKEY key;
+        CLOVE_UINT_EQ(S_OK, propertyStore->lpVtbl->GetAt(propertyStore, i, &key));
+        PROPVARIANT value;
+        CLOVE_UINT_EQ(S_OK, propertyStore->lpVtbl->GetValue(propertyStore, &key, &value));
+        CLOVE_UINT_NE(VT_EMPTY, value.vt);
+        PropVariantClear(&value);
+    }
+
+    PROPERTYKEY key;
+    CLOVE_UINT_EQ(E_INVALIDARG, propertyStore->lpVtbl->GetAt(propertyStore, count, &key));
+
+    propertyStore->lpVtbl->Release(propertyStore);
+    stream->lpVtbl->Release(stream);
+    memoryStream->lpVtbl->Release(memoryStream);
+    CLOVE_UINT_EQ(S_OK, CallDllCanUnloadNow());
+}
+
+CLOVE_TEST(InitializeReadsHeaderLargerThanSingleRead)
+{
+    // A header with a comment block of 3 lines of 3000 bytes continues after the first read.
+    char header[3 + 3 * 3002 + 9] = "P5\n";
+    for (size_t i = 0; i < 3; ++i)
+    {
+        char *line = header + 3 + i * 3002;
+        line[0] = '#';
+        memset(line + 1, 'c', 3000);
+        line[3001] = '\n';
+    }
+    memcpy(header + 3 + 3 * 3002, "2 2 255\n", 9);
+    const BYTE pixels[4] = {};
+    IStream *memoryStream = CreateStreamFromHeaderAndData(header, pixels, sizeof(pixels));
+    IStream *stream = CreateCountingStream(memoryStream);
+    HRESULT result;
+    IPropertyStore *propertyStore = CreateInitializedPropertyStore(stream, &result);
+
+    CLOVE_UINT_EQ(S_OK, result);
+    CLOVE_UINT_EQ(3, GetCountingStreamReadCalls(stream));
+    CLOVE_IS_TRUE(HasStringValue(propertyStore, &PKEY_Image_Dimensions, L"2 x 2"));
+
+    propertyStore->lpVtbl->Release(propertyStore);
+    stream->lpVtbl->Release(stream);
+    memoryStream->lpVtbl->Release(memoryStream);
+}
+
+CLOVE_TEST(InitializeFloatMapHasNoMaxValue)
+{
+    const BYTE pixels[3 * 2 * 4] = {};
+    IStream *stream = CreateStreamFromHeaderAndData("Pf 3 2 -1.0\n", pixels, sizeof(pixels));
+    HRESULT result;
+    IPropertyStore *propertyStore = CreateInitializedPropertyStore(stream, &result);
+
+    CLOVE_UINT_EQ(S_OK, result);
+    CLOVE_UINT_EQ(32, GetUInt32Value(propertyStore, &PKEY_Image_BitDepth));
+    CLOVE_IS_TRUE(HasStringValue(propertyStore, &PKEY_Netpbm_Format, L"Pf"));
+
+    // Absent properties are VT_EMPTY.
+    PROPVARIANT value;
+    CLOVE_UINT_EQ(S_OK, propertyStore->lpVtbl->GetValue(propertyStore, &PKEY_Netpbm_MaxValue, &value));
+    CLOVE_UINT_EQ(VT_EMPTY, value.vt);
+
+    propertyStore->lpVtbl->Release(propertyStore);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(InitializeFailsForBadHeaderAndSecondCall)
+{
+    const BYTE pixels[4] = {};
+    IStream *stream = CreateStreamFromHeaderAndData("P5 2 2\n", pixels, sizeof(pixels));
+    HRESULT result;
+    IPropertyStore *propertyStore = CreateInitializedPropertyStore(stream, &result);
+    CLOVE_UINT_EQ(WINCODEC_ERR_BADHEADER, result);
+
+    DWORD count;
+    CLOVE_UINT_EQ(S_OK, propertyStore->lpVtbl->GetCount(propertyStore, &count));
+    CLOVE_UINT_EQ(0, count);
+    propertyStore->lpVtbl->Release(propertyStore);
+    stream->lpVtbl->Release(stream);
+
+    stream = CreateStreamFromHeaderAndData("P5 2 2 255\n", pixels, sizeof(pixels));
+    propertyStore = CreateInitializedPropertyStore(stream, &result);
+    CLOVE_UINT_EQ(S_OK, result);
+
+    IInitializeWithStream *initializeWithStream;
+    propertyStore->lpVtbl->QueryInterface(propertyStore, &IID_IInitializeWithStream, (void **)&initializeWithStream);
+    CLOVE_UINT_EQ(HRESULT_FROM_WIN32(ERROR_ALREADY_INITIALIZED),
+                  initializeWithStream->lpVtbl->Initialize(initializeWithStream, stream, STGM_READ));
+    initializeWithStream->lpVtbl->Release(initializeWithStream);
+    propertyStore->lpVtbl->Release(propertyStore);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(PropertyStoreIsReadOnly)
+{
+    const BYTE pixels[1] = {};
+    IStream *stream = CreateStreamFromHeaderAndData("P4 1 1\n", pixels, sizeof(pixels));
+    HRESULT result;
+    IPropertyStore *propertyStore = CreateInitializedPropertyStore(stream, &result);
+    CLOVE_UINT_EQ(S_OK, result);
+
+    PROPVARIANT value;
+    InitPropVariantFromUInt32(2, &value);
+    CLOVE_UINT_EQ(STG_E_ACCESSDENIED, propertyStore->lpVtbl->SetValue(propertyStore, &PKEY_Image_HorizontalSize, &value));
+    CLOVE_UINT_EQ(1, GetUInt32Value(propertyStore, &PKEY_Image_HorizontalSize));
+
+    IPropertyStoreCapabilities *capabilities;
+    CLOVE_UINT_EQ(S_OK, propertyStore->lpVtbl->QueryInterface(propertyStore, &IID_IPropertyStoreCapabilities,
+                                                              (void **)&capabilities));
+    CLOVE_UINT_EQ(S_FALSE, capabilities->lpVtbl->IsPropertyWritable(capabilities, &PKEY_Image_HorizontalSize));
+    capabilities->lpVtbl->Release(capabilities);
+
+    propertyStore->lpVtbl->Release(propertyStore);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(GetAtEnumeratesKeysInSortedOrder)
+{
+    const BYTE pixels[4] = {};
+    IStream *stream = CreateStreamFromHeaderAndData("P7\nWIDTH 1\nHEIGHT 1\nDEPTH 4\nMAXVAL 255\nENDHDR\n", pixels,
+                                                    sizeof(pixels));
+    HRESULT result;
+    IPropertyStore *propertyStore = CreateInitializedPropertyStore(stream, &result);
+    CLOVE_UINT_EQ(S_OK, result);
+    CLOVE_IS_TRUE(HasStringValue(propertyStore, &PKEY_Netpbm_Format, L"P7"));
+    CLOVE_UINT_EQ(32, GetUInt32Value(propertyStore, &PKEY_Image_BitDepth));
+
+    DWORD count;
+    propertyStore->lpVtbl->GetCount(propertyStore, &count);
+    PROPERTYKEY previous = {};
+    for (DWORD i = 0; i < count; ++i)
+    {
+        PROPERTYKEY key;
+        CLOVE_UINT_EQ(S_OK, propertyStore->lpVtbl->GetAt(propertyStore, i, &key));
+        const int order = memcmp(&previous.fmtid, &key.fmtid, sizeof(GUID));
+        CLOVE_IS_TRUE(order < 0 || (order == 0 && previous.pid < key.pid));
+        previous = key;
+    }
+
+    propertyStore->lpVtbl->Release(propertyStore);
+    stream->lpVtbl->Release(stream);
+}
+
+#ifdef _DEBUG
+static volatile LONG allocationCount;
+
+// The codec and the tests share the debug CRT, the hook also sees the allocations of the codec.
+static int AllocationHook(const int allocationType, [[maybe_unused]] void *userData, [[maybe_unused]] size_t size,
+                          const int blockType, [[maybe_unused]] long requestNumber,
+                          [[maybe_unused]] const unsigned char *fileName, [[maybe_unused]] int lineNumber)
+{
+    if (allocationType != _HOOK_FREE && blockType != _CRT_BLOCK)
+    {
+        InterlockedIncrement(&allocationCount);
+    }
+
+    return TRUE;
+}
+#endif
+
+static void StartCountingAllocations(void)
+{
+#ifdef _DEBUG
+    allocationCount = 0;
+    _CrtSetAllocHook(AllocationHook);
+#endif
+}
+
+// Returns -1 when allocations cannot be counted (release builds).
+static int StopCountingAllocations(void)
+{
+#ifdef _DEBUG
+    _CrtSetAllocHook(NULL);
+    return (int)allocationCount;
+#else
+    return -1;
+#endif
+}
+
+CLOVE_TEST(ValuesAreMaterializedOnFirstRequest)
+{
+    const BYTE pixels[6] = {};
+    IStream *stream = CreateStreamFromHeaderAndData("P5 3 2 255\n", pixels, sizeof(pixels));
+    IClassFactory *classFactory = GetClassObject(&IID_IClassFactory);
+    IInitializeWithStream *initializeWithStream = NULL;
+    classFactory->lpVtbl->CreateInstance(classFactory, NULL, &IID_IInitializeWithStream, (void **)&initializeWithStream);
+    classFactory->lpVtbl->Release(classFactory);
+    IPropertyStore *propertyStore = NULL;
+    initializeWithStream->lpVtbl->QueryInterface(initializeWithStream, &IID_IPropertyStore, (void **)&propertyStore);
+
+    StartCountingAllocations();
+    const HRESULT result = initializeWithStream->lpVtbl->Initialize(initializeWithStream, stream, STGM_READ);
+    const int initializeAllocations = StopCountingAllocations();
+    CLOVE_UINT_EQ(S_OK, result);
+
+    // The numeric values are created in the property table, the strings in the text reserved by the table: only the
+    // copy of a string that is returned to the caller is allocated (with CoTaskMemAlloc).
+    StartCountingAllocations();
+    UINT width = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+        width += GetUInt32Value(propertyStore, &PKEY_Image_HorizontalSize);
+    }
+    const UINT height = GetUInt32Value(propertyStore, &PKEY_Image_VerticalSize);
+    const int numericAllocations = StopCountingAllocations();
+
+    StartCountingAllocations();
+    const bool dimensions = HasStringValue(propertyStore, &PKEY_Image_Dimensions, L"3 x 2") &&
+                            HasStringValue(propertyStore, &PKEY_Image_Dimensions, L"3 x 2");
+    const int stringAllocations = StopCountingAllocations();
+
+    CLOVE_UINT_EQ(9, width);
+    CLOVE_UINT_EQ(2, height);
+    CLOVE_IS_TRUE(dimensions);
+    if (initializeAllocations != -1)
+    {
+        CLOVE_INT_EQ(1, initializeAllocations);
+        CLOVE_INT_EQ(0, numericAllocations);
+        CLOVE_INT_EQ(0, stringAllocations);
+    }
+
+    propertyStore->lpVtbl->Release(propertyStore);
+    initializeWithStream->lpVtbl->Release(initializeWithStream);
+    stream->lpVtbl->Release(stream);
+}
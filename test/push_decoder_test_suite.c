@@ -0,0 +1,225 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "com_factory.h"
+#include "row_collector.h"
+#include "test_stream.h"
+#include <stdlib.h>
+
+#include "../src/netpbm_push_decoder.h"
+
+#define CLOVE_SUITE_NAME push_decoder_test_suite
+#include <clove-unit/clove-unit.h>
+
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmDecodeRowsPtr)(IStream *stream, const WICPixelFormatGUID *pixelFormat,
+                                                        UINT bandHeight, NetpbmRowSink sink, void *context);
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmCreatePushDecoderPtr)(const WICPixelFormatGUID *pixelFormat, UINT bandHeight,
+                                                               NetpbmRowSink sink, void *context,
+                                                               NetpbmPushDecoder **decoder);
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmPushDecoderFeedPtr)(NetpbmPushDecoder *decoder, const BYTE *data, UINT size,
+                                                             UINT *rowCount);
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmPushDecoderFinishPtr)(NetpbmPushDecoder *decoder, UINT *rowCount);
+typedef void(STDMETHODCALLTYPE *NetpbmDestroyPushDecoderPtr)(NetpbmPushDecoder *decoder);
+
+enum
+{
+    ImageSize = 1024
+};
+
+// Feeds the data in chunks that end at the offsets in splits (the last chunk ends at size) and finishes the decoding.
+static HRESULT PushDecode(const BYTE *data, const size_t size, const size_t *splits, const size_t splitCount,
+                          const UINT bandHeight, RowCollector *collector)
+{
+    const NetpbmCreatePushDecoderPtr createPushDecoder =
+        (NetpbmCreatePushDecoderPtr)GetCodecFunction("NetpbmCreatePushDecoder");
+    const NetpbmPushDecoderFeedPtr feed = (NetpbmPushDecoderFeedPtr)GetCodecFunction("NetpbmPushDecoderFeed");
+    const NetpbmPushDecoderFinishPtr finish = (NetpbmPushDecoderFinishPtr)GetCodecFunction("NetpbmPushDecoderFinish");
+    const NetpbmDestroyPushDecoderPtr destroyPushDecoder =
+        (NetpbmDestroyPushDecoderPtr)GetCodecFunction("NetpbmDestroyPushDecoder");
+    if (!createPushDecoder || !feed || !finish || !destroyPushDecoder)
+        return E_FAIL;
+
+    NetpbmPushDecoder *decoder;
+    HRESULT hr = createPushDecoder(NULL, bandHeight, CollectRows, collector, &decoder);
+    if (FAILED(hr))
+        return hr;
+
+    // The rows that are reported as completed must have been passed to the sink.
+    UINT completedRows = 0;
+    size_t position = 0;
+    for (size_t i = 0; i <= splitCount && SUCCEEDED(hr); ++i)
+    {
+        const size_t end = i < splitCount ? splits[i] : size;
+        UINT rowCount;
+        hr = feed(decoder, data + position, (UINT)(end - position), &rowCount);
+        completedRows += rowCount;
+        position = end;
+        if (SUCCEEDED(hr) && completedRows != collector->rowCount)
+        {
+            hr = E_UNEXPECTED;
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        UINT rowCount;
+        hr = finish(decoder, &rowCount);
+        completedRows += rowCount;
+        if (SUCCEEDED(hr) && completedRows != collector->rowCount)
+        {
+            hr = E_UNEXPECTED;
+        }
+    }
+
+    destroyPushDecoder(decoder);
+    return hr;
+}
+
+// Decodes the file with NetpbmDecodeRows and compares the result with the push decoder, for every position at which
+// the file can be split in 2 chunks and for chunks of 1 byte.
+static bool DecodesIdenticallyAtEverySplit(const char *header, const void *samples, const size_t sampleSize)
+{
+    const size_t headerSize = strlen(header);
+    const size_t size = headerSize + sampleSize;
+    BYTE *data = malloc(size);
+    size_t *splits = malloc(size * sizeof(size_t));
+    BYTE *expectedPixels = calloc(1, ImageSize);
+    BYTE *pixels = malloc(ImageSize);
+    memcpy(data, header, headerSize);
+    memcpy(data + headerSize, samples, sampleSize);
+
+    IStream *stream = CreateStreamFromHeaderAndData(header, samples, sampleSize);
+    const NetpbmDecodeRowsPtr decodeRows = (NetpbmDecodeRowsPtr)GetCodecFunction("NetpbmDecodeRows");
+    RowCollector expected = {expectedPixels, ImageSize};
+    bool identical = decodeRows && SUCCEEDED(decodeRows(stream, NULL, 0, CollectRows, &expected));
+    stream->lpVtbl->Release(stream);
+
+    for (size_t split = 0; split <= size && identical; ++split)
+    {
+        memset(pixels, 0, ImageSize);
+        RowCollector collector = {pixels, ImageSize};
+        identical = SUCCEEDED(PushDecode(data, size, &split, 1, 1, &collector)) &&
+                    collector.rowCount == expected.rowCount && memcmp(pixels, expectedPixels, ImageSize) == 0;
+    }
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        splits[i] = i;
+    }
+
+    memset(pixels, 0, ImageSize);
+    RowCollector collector = {pixels, ImageSize};
+    identical = identical && SUCCEEDED(PushDecode(data, size, splits, size, 0, &collector)) &&
+                memcmp(pixels, expectedPixels, ImageSize) == 0;
+
+    free(pixels);
+    free(expectedPixels);
+    free(splits);
+    free(data);
+    return identical;
+}
+
+CLOVE_SUITE_SETUP_ONCE()
+{
+    ConstructComFactory();
+}
+
+CLOVE_SUITE_TEARDOWN_ONCE()
+{
+    DestructComFactory();
+}
+
+CLOVE_TEST(PushDecodePlainFormatsAtEverySplit)
+{
+    // The last sample is not followed by whitespace, it is completed by NetpbmPushDecoderFinish.
+    const char pixmap[] = "10 200 3#c 4\n 4 5 6 7 8 9\n100 110 120 130 140 150 255 0 1";
+    CLOVE_IS_TRUE(DecodesIdenticallyAtEverySplit("P3\n# comment 1 2\n3 2 # trailing\n# x\n255\n", pixmap,
+                                                 sizeof(pixmap) - 1));
+
+    const char graymap[] = "0 1000 999\n#\n65 7\r\n300\n";
+    CLOVE_IS_TRUE(DecodesIdenticallyAtEverySplit("P2 3 2 1000\n", graymap, sizeof(graymap) - 1));
+
+    const char bitmap[] = "10110\n0#c\n1001\n";
+    CLOVE_IS_TRUE(DecodesIdenticallyAtEverySplit("P1 # size\n5 2\n", bitmap, sizeof(bitmap) - 1));
+}
+
+CLOVE_TEST(PushDecodeBinaryFormatsAtEverySplit)
+{
+    BYTE samples[4 * 3 * 2 * 3];
+    for (size_t i = 0; i < sizeof(samples); ++i)
+    {
+        samples[i] = (BYTE)(i * 37 % 251);
+    }
+
+    CLOVE_IS_TRUE(DecodesIdenticallyAtEverySplit("P6\n#c\n4 3\n250\n", samples, 4 * 3 * 3));
+    CLOVE_IS_TRUE(DecodesIdenticallyAtEverySplit("P5 4 3 65535\n", samples, 4 * 3 * 2));
+    CLOVE_IS_TRUE(DecodesIdenticallyAtEverySplit("P4 13 3\n", samples, 2 * 3));
+    CLOVE_IS_TRUE(DecodesIdenticallyAtEverySplit(
+        "P7\nWIDTH 4 # comment\nHEIGHT 3\nDEPTH 2\nMAXVAL 250\nTUPLTYPE GRAYSCALE_ALPHA\nENDHDR\n", samples, 4 * 3 * 2));
+    CLOVE_IS_TRUE(DecodesIdenticallyAtEverySplit("P7\nWIDTH 4\nHEIGHT 3\nDEPTH 5\nMAXVAL 255\nENDHDR\n", samples,
+                                                 4 * 3 * 5));
+
+    const float floatSamples[] = {0.5F, 1.0F, 2.0F, 0.25F, 3.0F, -1.0F, 7.0F, 8.0F, 9.0F, 10.0F, 11.0F, 12.0F};
+    CLOVE_IS_TRUE(DecodesIdenticallyAtEverySplit("PF\n2 2\n-1.0\n", floatSamples, sizeof(floatSamples)));
+}
+
+CLOVE_TEST(PushDecodePassesBandsOfCompletedRows)
+{
+    const BYTE data[] = "P5 4 5 255\n01234567890123456789";
+    const size_t split = 11 + 4 * 3 + 2;
+    BYTE pixels[ImageSize];
+    RowCollector collector = {pixels, sizeof(pixels)};
+
+    const HRESULT hr = PushDecode(data, sizeof(data) - 1, &split, 1, 2, &collector);
+
+    // Bands hold 2 rows, the completed rows of a band are also passed at the end of a call: 2 + 1, 2.
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(5, collector.rowCount);
+    CLOVE_UINT_EQ(3, collector.bandCount);
+}
+
+CLOVE_TEST(PushDecodeTruncatedImage)
+{
+    const BYTE data[] = "P5 4 5 255\n0123456789";
+    BYTE pixels[ImageSize];
+    RowCollector collector = {pixels, sizeof(pixels)};
+
+    const HRESULT hr = PushDecode(data, sizeof(data) - 1, NULL, 0, 0, &collector);
+
+    CLOVE_UINT_EQ(WINCODEC_ERR_BADIMAGE, hr);
+    CLOVE_UINT_EQ(2, collector.rowCount);
+}
+
+CLOVE_TEST(PushDecodeUnknownFormat)
+{
+    const BYTE data[] = "P8 4 5 255\n";
+    BYTE pixels[ImageSize];
+    RowCollector collector = {pixels, sizeof(pixels)};
+
+    const HRESULT hr = PushDecode(data, sizeof(data) - 1, NULL, 0, 0, &collector);
+
+    CLOVE_UINT_EQ(WINCODEC_ERR_UNKNOWNIMAGEFORMAT, hr);
+}
+
+CLOVE_TEST(PushDecodeBadPlainSample)
+{
+    const BYTE data[] = "P2 2 1 255\n1 x";
+    BYTE pixels[ImageSize];
+    RowCollector collector = {pixels, sizeof(pixels)};
+
+    const HRESULT hr = PushDecode(data, sizeof(data) - 1, NULL, 0, 0, &collector);
+
+    CLOVE_UINT_EQ(WINCODEC_ERR_BADIMAGE, hr);
+}
+
+CLOVE_TEST(PushDecodeStopsWhenSinkFails)
+{
+    const BYTE data[] = "P5 2 2 255\n0123";
+    BYTE pixels[ImageSize];
+    RowCollector collector = {pixels, sizeof(pixels)};
+    collector.failingBand = 1;
+
+    const HRESULT hr = PushDecode(data, sizeof(data) - 1, NULL, 0, 0, &collector);
+
+    CLOVE_UINT_EQ(E_ABORT, hr);
+}
@@ -0,0 +1,33 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "row_collector.h"
+
+#include <string.h>
+
+
+HRESULT STDMETHODCALLTYPE CollectRows(void *context, const NetpbmRows *rows)
+{
+    RowCollector *collector = context;
+    // Rows are passed top-down, or bottom-up in the order of the file for the float formats.
+    if (rows->firstRow != collector->rowCount && rows->firstRow + rows->rowCount != rows->height - collector->rowCount)
+        return E_UNEXPECTED;
+
+    const size_t offset = (size_t)rows->firstRow * rows->stride;
+    const size_t size = (size_t)rows->rowCount * rows->stride;
+    if (collector->bandCount + 1 == collector->failingBand || (collector->size != 0 && offset + size > collector->size))
+        return E_ABORT;
+
+    memcpy(collector->pixels + offset, rows->pixels, size);
+    collector->pixelFormat = rows->pixelFormat;
+    collector->stride = rows->stride;
+    collector->rowCount += rows->rowCount;
+    collector->maxRowCount = rows->rowCount > collector->maxRowCount ? rows->rowCount : collector->maxRowCount;
+    ++collector->bandCount;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE IgnoreRows([[maybe_unused]] void *context, [[maybe_unused]] const NetpbmRows *rows)
+{
+    return S_OK;
+}
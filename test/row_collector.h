@@ -0,0 +1,27 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Windows.h>
+
+#include "../src/netpbm_row_decoder.h"
+
+// Context of CollectRows: the rows are copied to the complete image, the bands must be contiguous.
+typedef struct RowCollector
+{
+    BYTE *pixels; // Complete image, to compare the rows with the result of CopyPixels.
+    size_t size;  // Size of the image, 0 when unchecked. The sink fails with E_ABORT for rows beyond the size.
+    WICPixelFormatGUID pixelFormat;
+    UINT stride;
+    UINT rowCount; // Total of the rows passed to the sink.
+    UINT bandCount;
+    UINT maxRowCount;
+    UINT failingBand; // Number of the band (starting at 1) for which the sink fails with E_ABORT, 0 to accept all.
+} RowCollector;
+
+// Row sink that copies the rows to the image of the RowCollector context.
+HRESULT STDMETHODCALLTYPE CollectRows(void *context, const NetpbmRows *rows);
+
+// Row sink that accepts all rows, the context is not used.
+HRESULT STDMETHODCALLTYPE IgnoreRows(void *context, const NetpbmRows *rows);
@@ -0,0 +1,206 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "com_factory.h"
+#include "row_collector.h"
+#include "test_stream.h"
+#include <unknwn.h>
+#include <stdlib.h>
+
+#include "../src/guids.h"
+#include "../src/netpbm_row_decoder.h"
+
+#define CLOVE_SUITE_NAME row_decoder_test_suite
+#include <wincodec.h>
+#include <clove-unit/clove-unit.h>
+
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmDecodeRowsPtr)(IStream *stream, const WICPixelFormatGUID *pixelFormat,
+                                                        UINT bandHeight, NetpbmRowSink sink, void *context);
+
+static HRESULT DecodeRows(IStream *stream, const WICPixelFormatGUID *pixelFormat, const UINT bandHeight,
+                          RowCollector *collector)
+{
+    const NetpbmDecodeRowsPtr decodeRows = (NetpbmDecodeRowsPtr)GetCodecFunction("NetpbmDecodeRows");
+    if (!decodeRows)
+        return E_FAIL;
+
+    return decodeRows(stream, pixelFormat, bandHeight, CollectRows, collector);
+}
+
+static HRESULT CopyFramePixels(IStream *stream, const UINT stride, const UINT bufferSize, BYTE *buffer)
+{
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    if (!frame)
+        return E_FAIL;
+
+    const HRESULT hr = frame->lpVtbl->CopyPixels(frame, NULL, stride, bufferSize, buffer);
+    frame->lpVtbl->Release(frame);
+    return hr;
+}
+
+CLOVE_SUITE_SETUP_ONCE()
+{
+    ConstructComFactory();
+}
+
+CLOVE_SUITE_TEARDOWN_ONCE()
+{
+    DestructComFactory();
+}
+
+CLOVE_TEST(DecodeRowsPixmapMatchesCopyPixels)
+{
+    enum { width = 37, height = 23, stride = width * 3 };
+    BYTE *samples = malloc(stride * height);
+    for (size_t i = 0; i < stride * height; ++i)
+    {
+        samples[i] = (BYTE)((i * 31 + i / 3) % 101);
+    }
+
+    IStream *stream = CreateStreamFromHeaderAndData("P6 37 23 100\n", samples, stride * height);
+    BYTE *pixels = malloc(stride * height);
+    RowCollector collector = {pixels};
+
+    HRESULT hr = DecodeRows(stream, NULL, 5, &collector);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(height, collector.rowCount);
+    CLOVE_UINT_EQ(5, collector.bandCount);
+    CLOVE_UINT_EQ(5, collector.maxRowCount);
+    CLOVE_IS_TRUE(IsEqualGUID(&GUID_WICPixelFormat24bppRGB, &collector.pixelFormat));
+
+    stream->lpVtbl->Release(stream);
+    stream = CreateStreamFromHeaderAndData("P6 37 23 100\n", samples, stride * height);
+    hr = CopyFramePixels(stream, stride, stride * height, samples);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_IS_TRUE(memcmp(samples, pixels, stride * height) == 0);
+    stream->lpVtbl->Release(stream);
+    free(pixels);
+    free(samples);
+}
+
+CLOVE_TEST(DecodeRowsGrayscaleAlpha16BandIsExpandedToRgba)
+{
+    const USHORT samples[3 * 4 * 2] = {0x0102, 0x0304, 0x0506, 0x0708, 0x090A, 0x0B0C, 0x0D0E, 0x0F10,
+                                       0x1112, 0x1314, 0x1516, 0x1718, 0x191A, 0x1B1C, 0x1D1E, 0x1F20,
+                                       0x2122, 0x2324, 0x2526, 0x2728, 0x292A, 0x2B2C, 0x2D2E, 0xFFFF};
+    const char *header = "P7\nWIDTH 3\nHEIGHT 4\nDEPTH 2\nMAXVAL 65535\nTUPLTYPE GRAYSCALE_ALPHA\nENDHDR\n";
+    IStream *stream = CreateStreamFromHeaderAndData(header, samples, sizeof(samples));
+    USHORT pixels[3 * 4 * 4];
+    RowCollector collector = {(BYTE *)pixels};
+
+    HRESULT hr = DecodeRows(stream, NULL, 3, &collector);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(2, collector.bandCount);
+    CLOVE_IS_TRUE(IsEqualGUID(&GUID_WICPixelFormat64bppRGBA, &collector.pixelFormat));
+
+    stream->lpVtbl->Release(stream);
+    stream = CreateStreamFromHeaderAndData(header, samples, sizeof(samples));
+    USHORT expected[3 * 4 * 4];
+    hr = CopyFramePixels(stream, 3 * 8, sizeof(expected), (BYTE *)expected);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_IS_TRUE(memcmp(expected, pixels, sizeof(pixels)) == 0);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(DecodeRowsPlainPixmap)
+{
+    const char samples[] = "1 2 3 4 5 6\n7 8 9 10 11 12\n";
+    IStream *stream = CreateStreamFromHeaderAndData("P3 2 2 255\n", samples, sizeof(samples) - 1);
+    BYTE pixels[2 * 2 * 3];
+    RowCollector collector = {pixels};
+
+    const HRESULT hr = DecodeRows(stream, NULL, 1, &collector);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(2, collector.bandCount);
+    const BYTE expected[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    CLOVE_IS_TRUE(memcmp(expected, pixels, sizeof(pixels)) == 0);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(DecodeRowsFloatGraymapAsHalfFloatIsTopDown)
+{
+    // PFM rows are stored bottom-up.
+    const float samples[] = {0.25F, 0.5F, 1.0F, 2.0F};
+    IStream *stream = CreateStreamFromHeaderAndData("Pf\n2 2\n-1.0\n", samples, sizeof(samples));
+    USHORT pixels[2 * 2];
+    RowCollector collector = {(BYTE *)pixels};
+
+    const HRESULT hr = DecodeRows(stream, &GUID_WICPixelFormat16bppGrayHalf, 0, &collector);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(1, collector.bandCount);
+    CLOVE_IS_TRUE(IsEqualGUID(&GUID_WICPixelFormat16bppGrayHalf, &collector.pixelFormat));
+    CLOVE_UINT_EQ(0x3C00, pixels[0]);
+    CLOVE_UINT_EQ(0x4000, pixels[1]);
+    CLOVE_UINT_EQ(0x3400, pixels[2]);
+    CLOVE_UINT_EQ(0x3800, pixels[3]);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(DecodeRowsStopsWhenSinkFails)
+{
+    const BYTE samples[4 * 4] = {};
+    IStream *stream = CreateStreamFromHeaderAndData("P5 4 4 255\n", samples, sizeof(samples));
+    BYTE pixels[sizeof(samples)];
+    RowCollector collector = {pixels};
+    collector.failingBand = 2;
+
+    const HRESULT hr = DecodeRows(stream, NULL, 2, &collector);
+
+    CLOVE_UINT_EQ(E_ABORT, hr);
+    CLOVE_UINT_EQ(1, collector.bandCount);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(DecodeRowsUnsupportedPixelFormat)
+{
+    const BYTE samples[2 * 3] = {};
+    IStream *stream = CreateStreamFromHeaderAndData("P6 2 1 255\n", samples, sizeof(samples));
+    BYTE pixels[sizeof(samples)];
+    RowCollector collector = {pixels};
+
+    const HRESULT hr = DecodeRows(stream, &GUID_WICPixelFormat64bppRGBAHalf, 0, &collector);
+
+    CLOVE_UINT_EQ(WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT, hr);
+    CLOVE_UINT_EQ(0, collector.bandCount);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(DecodeRowsNonSeekableStream)
+{
+    enum { width = 300, height = 40 };
+    BYTE *samples = malloc(width * height);
+    for (size_t i = 0; i < width * height; ++i)
+    {
+        samples[i] = (BYTE)(i % 251);
+    }
+
+    IStream *memoryStream = CreateStreamFromHeaderAndData("P5 300 40 250\n", samples, width * height);
+    BYTE *expected = malloc(width * height);
+    RowCollector expectedCollector = {expected};
+    CLOVE_UINT_EQ(S_OK, DecodeRows(memoryStream, NULL, 7, &expectedCollector));
+
+    const LARGE_INTEGER start = {};
+    memoryStream->lpVtbl->Seek(memoryStream, start, STREAM_SEEK_SET, NULL);
+    IStream *stream = CreateNonSeekableStream(memoryStream);
+    BYTE *pixels = malloc(width * height);
+    RowCollector collector = {pixels};
+
+    const HRESULT hr = DecodeRows(stream, NULL, 7, &collector);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(height, collector.rowCount);
+    CLOVE_UINT_EQ(6, collector.bandCount);
+    CLOVE_IS_TRUE(memcmp(expected, pixels, width * height) == 0);
+    CLOVE_ULLONG_EQ(14 + width * height, GetCountingStreamBytesRead(stream));
+    stream->lpVtbl->Release(stream);
+    memoryStream->lpVtbl->Release(memoryStream);
+    free(pixels);
+    free(expected);
+    free(samples);
+}
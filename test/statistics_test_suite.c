@@ -0,0 +1,368 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "com_factory.h"
+#include "row_collector.h"
+#include "test_stream.h"
+#include <unknwn.h>
+#include <propvarutil.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/guids.h"
+#include "../src/netpbm_channel_selection.h"
+#include "../src/netpbm_statistics.h"
+
+#define CLOVE_SUITE_NAME statistics_test_suite
+#include <wincodec.h>
+#include <clove-unit/clove-unit.h>
+
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmDecodeRowsWithStatisticsPtr)(IStream *stream, UINT binCount,
+                                                                      const NetpbmWindowLevel *windowLevel,
+                                                                      UINT bandHeight, NetpbmRowSink sink,
+                                                                      void *context, NetpbmStatistics *statistics);
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmDecodeRowsPtr)(IStream *stream, const WICPixelFormatGUID *pixelFormat,
+                                                        UINT bandHeight, NetpbmRowSink sink, void *context);
+
+static HRESULT DecodeWithStatistics(const char *header, const void *samples, const size_t size, const UINT binCount,
+                                    const NetpbmWindowLevel *windowLevel, BYTE *pixels, NetpbmStatistics *statistics)
+{
+    const NetpbmDecodeRowsWithStatisticsPtr decodeRows =
+        (NetpbmDecodeRowsWithStatisticsPtr)GetCodecFunction("NetpbmDecodeRowsWithStatistics");
+    if (!decodeRows)
+        return E_FAIL;
+
+    IStream *stream = CreateStreamFromHeaderAndData(header, samples, size);
+    RowCollector collector = {.pixels = pixels};
+    const HRESULT hr = decodeRows(stream, binCount, windowLevel, 0, CollectRows, &collector, statistics);
+    stream->lpVtbl->Release(stream);
+    return hr;
+}
+
+CLOVE_SUITE_SETUP_ONCE()
+{
+    ConstructComFactory();
+}
+
+CLOVE_SUITE_TEARDOWN_ONCE()
+{
+    DestructComFactory();
+}
+
+CLOVE_TEST(StatisticsOf16BitGraymap)
+{
+    const BYTE samples[] = {0x00, 0x10, 0x0F, 0xFF, 0x01, 0x00, 0x08, 0x00};
+    USHORT pixels[4];
+    NetpbmStatistics *statistics = malloc(sizeof(NetpbmStatistics));
+
+    const HRESULT hr =
+        DecodeWithStatistics("P5 2 2 4095\n", samples, sizeof(samples), 4096, NULL, (BYTE *)pixels, statistics);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(0x10, statistics->minimum);
+    CLOVE_UINT_EQ(0xFFF, statistics->maximum);
+    CLOVE_FLOAT_EQ((0x10 + 0xFFF + 0x100 + 0x800) / 4.0F, (float)statistics->mean);
+    CLOVE_UINT_EQ(4095, statistics->maxValue);
+    CLOVE_UINT_EQ(4096, statistics->binCount);
+    CLOVE_ULLONG_EQ(1, statistics->histogram[0x10]);
+    CLOVE_ULLONG_EQ(1, statistics->histogram[0xFFF]);
+    CLOVE_ULLONG_EQ(1, statistics->histogram[0x100]);
+    CLOVE_ULLONG_EQ(1, statistics->histogram[0x800]);
+    CLOVE_ULLONG_EQ(0, statistics->histogram[0]);
+
+    // The pixels are scaled like the pixels of CopyPixels.
+    CLOVE_UINT_EQ((0x10 * 65535 + 2047) / 4095, pixels[0]);
+    CLOVE_UINT_EQ(65535, pixels[1]);
+    free(statistics);
+}
+
+CLOVE_TEST(StatisticsOf8BitGraymap)
+{
+    const BYTE samples[] = {0, 50, 100, 100, 3, 99};
+    BYTE pixels[6];
+    NetpbmStatistics *statistics = malloc(sizeof(NetpbmStatistics));
+
+    const HRESULT hr = DecodeWithStatistics("P5 3 2 100\n", samples, sizeof(samples), 256, NULL, pixels, statistics);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_UINT_EQ(0, statistics->minimum);
+    CLOVE_UINT_EQ(100, statistics->maximum);
+    CLOVE_FLOAT_EQ(352.0F / 6.0F, (float)statistics->mean);
+    CLOVE_ULLONG_EQ(1, statistics->histogram[0]);
+    CLOVE_ULLONG_EQ(1, statistics->histogram[50 * 256 / 101]);
+    CLOVE_ULLONG_EQ(2, statistics->histogram[100 * 256 / 101]);
+    CLOVE_UINT_EQ(0, pixels[0]);
+    CLOVE_UINT_EQ(255, pixels[2]);
+    free(statistics);
+}
+
+CLOVE_TEST(WindowLevelMapsToGray8)
+{
+    const BYTE samples[] = {0x00, 0x00, 0x03, 0xE8, 0x07, 0xD0, 0x0F, 0xA0};
+    BYTE pixels[4];
+    NetpbmStatistics *statistics = malloc(sizeof(NetpbmStatistics));
+    const NetpbmWindowLevel windowLevel = {.center = 2000, .width = 2000};
+    const NetpbmDecodeRowsWithStatisticsPtr decodeRows =
+        (NetpbmDecodeRowsWithStatisticsPtr)GetCodecFunction("NetpbmDecodeRowsWithStatistics");
+    IStream *stream = CreateStreamFromHeaderAndData("P5 4 1 65535\n", samples, sizeof(samples));
+    RowCollector collector = {.pixels = pixels};
+
+    const HRESULT hr = decodeRows(stream, 256, &windowLevel, 0, CollectRows, &collector, statistics);
+
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_IS_TRUE(IsEqualGUID(&GUID_WICPixelFormat8bppGray, &collector.pixelFormat));
+    CLOVE_UINT_EQ(0, pixels[0]);
+    CLOVE_UINT_EQ(0, pixels[1]);
+    CLOVE_UINT_EQ(128, pixels[2]);
+    CLOVE_UINT_EQ(255, pixels[3]);
+    CLOVE_UINT_EQ(0, statistics->minimum);
+    CLOVE_UINT_EQ(4000, statistics->maximum);
+    stream->lpVtbl->Release(stream);
+    free(statistics);
+}
+
+CLOVE_TEST(StatisticsNotSupported)
+{
+    const BYTE samples[6] = {};
+    BYTE pixels[6];
+    NetpbmStatistics *statistics = malloc(sizeof(NetpbmStatistics));
+    const NetpbmWindowLevel windowLevel = {.center = 100, .width = 0};
+
+    CLOVE_UINT_EQ(WINCODEC_ERR_UNSUPPORTEDOPERATION,
+                  DecodeWithStatistics("P6 1 2 255\n", samples, sizeof(samples), 256, NULL, pixels, statistics));
+    CLOVE_UINT_EQ(WINCODEC_ERR_UNSUPPORTEDOPERATION,
+                  DecodeWithStatistics("P2 1 2 255\n", "1 2", 3, 256, NULL, pixels, statistics));
+    CLOVE_UINT_EQ(E_INVALIDARG,
+                  DecodeWithStatistics("P5 1 2 255\n", samples, 2, 100, NULL, pixels, statistics));
+    CLOVE_UINT_EQ(E_INVALIDARG,
+                  DecodeWithStatistics("P5 1 2 255\n", samples, 2, 256, &windowLevel, pixels, statistics));
+    free(statistics);
+}
+
+CLOVE_TEST(FrameStatisticsAccumulatedByStrips)
+{
+    enum { width = 16, height = 8 };
+    BYTE samples[width * height];
+    for (size_t i = 0; i < sizeof(samples); ++i)
+    {
+        samples[i] = (BYTE)(i + 10);
+    }
+
+    IStream *stream = CreateStreamFromHeaderAndData("P5 16 8 255\n", samples, sizeof(samples));
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    INetpbmStatistics *frameStatistics;
+    HRESULT hr = frame->lpVtbl->QueryInterface(frame, &IID_INetpbmStatistics, (void **)&frameStatistics);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    IWICMetadataQueryReader *queryReader;
+    CLOVE_UINT_EQ(WINCODEC_ERR_UNSUPPORTEDOPERATION, frame->lpVtbl->GetMetadataQueryReader(frame, &queryReader));
+    CLOVE_UINT_EQ(E_INVALIDARG, frameStatistics->lpVtbl->EnableStatistics(frameStatistics, 10));
+    CLOVE_UINT_EQ(S_OK, frameStatistics->lpVtbl->EnableStatistics(frameStatistics, 256));
+
+    NetpbmStatistics *statistics = malloc(sizeof(NetpbmStatistics));
+    BYTE pixels[width * height];
+    for (INT y = 0; y < height; y += 3)
+    {
+        const WICRect rect = {0, y, width, y + 3 <= height ? 3 : height - y};
+        CLOVE_UINT_EQ(WINCODEC_ERR_WRONGSTATE, frameStatistics->lpVtbl->GetStatistics(frameStatistics, statistics));
+        hr = frame->lpVtbl->CopyPixels(frame, &rect, width, width * rect.Height, pixels + y * width);
+        CLOVE_UINT_EQ(S_OK, hr);
+    }
+
+    CLOVE_INT_EQ(0, memcmp(samples, pixels, sizeof(pixels)));
+    CLOVE_UINT_EQ(S_OK, frameStatistics->lpVtbl->GetStatistics(frameStatistics, statistics));
+    CLOVE_UINT_EQ(10, statistics->minimum);
+    CLOVE_UINT_EQ(137, statistics->maximum);
+    CLOVE_FLOAT_EQ(73.5F, (float)statistics->mean);
+    CLOVE_ULLONG_EQ(1, statistics->histogram[10]);
+    CLOVE_ULLONG_EQ(0, statistics->histogram[9]);
+
+    hr = frame->lpVtbl->GetMetadataQueryReader(frame, &queryReader);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    PROPVARIANT value;
+    PropVariantInit(&value);
+    CLOVE_UINT_EQ(S_OK, queryReader->lpVtbl->GetMetadataByName(queryReader, L"/statistics/maximum", &value));
+    CLOVE_UINT_EQ(VT_UI4, value.vt);
+    CLOVE_UINT_EQ(137, value.ulVal);
+    CLOVE_UINT_EQ(S_OK, queryReader->lpVtbl->GetMetadataByName(queryReader, L"/statistics/mean", &value));
+    CLOVE_UINT_EQ(VT_R8, value.vt);
+    CLOVE_UINT_EQ(S_OK, queryReader->lpVtbl->GetMetadataByName(queryReader, L"/statistics/histogram", &value));
+    CLOVE_UINT_EQ(VT_VECTOR | VT_UI8, value.vt);
+    CLOVE_UINT_EQ(256, value.cauh.cElems);
+    CLOVE_ULLONG_EQ(1, value.cauh.pElems[137].QuadPart);
+    PropVariantClear(&value);
+    CLOVE_UINT_EQ(WINCODEC_ERR_PROPERTYNOTFOUND,
+                  queryReader->lpVtbl->GetMetadataByName(queryReader, L"/statistics/median", &value));
+
+    IEnumString *names;
+    CLOVE_UINT_EQ(S_OK, queryReader->lpVtbl->GetEnumerator(queryReader, &names));
+    LPOLESTR name[5];
+    ULONG fetched;
+    CLOVE_UINT_EQ(S_FALSE, names->lpVtbl->Next(names, 5, name, &fetched));
+    CLOVE_UINT_EQ(4, fetched);
+    for (ULONG i = 0; i < fetched; ++i)
+    {
+        CoTaskMemFree(name[i]);
+    }
+
+    names->lpVtbl->Release(names);
+    queryReader->lpVtbl->Release(queryReader);
+
+    // A rectangle that doesn't continue the accumulated rows is copied without changing the statistics.
+    const WICRect partial = {2, 0, 4, 1};
+    CLOVE_UINT_EQ(S_OK, frame->lpVtbl->CopyPixels(frame, &partial, 4, 4, pixels));
+    CLOVE_UINT_EQ(S_OK, frameStatistics->lpVtbl->GetStatistics(frameStatistics, statistics));
+    CLOVE_UINT_EQ(10, statistics->minimum);
+
+    free(statistics);
+    frameStatistics->lpVtbl->Release(frameStatistics);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(FrameStatisticsOfNonSeekableStream)
+{
+    const BYTE samples[] = {0x00, 0x05, 0x03, 0xE8, 0x00, 0x01};
+    IStream *memoryStream = CreateStreamFromHeaderAndData("P5 3 1 1000\n", samples, sizeof(samples));
+    IStream *stream = CreateNonSeekableStream(memoryStream);
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    INetpbmStatistics *frameStatistics;
+    frame->lpVtbl->QueryInterface(frame, &IID_INetpbmStatistics, (void **)&frameStatistics);
+    CLOVE_UINT_EQ(S_OK, frameStatistics->lpVtbl->EnableStatistics(frameStatistics, 4096));
+
+    USHORT pixels[3];
+    CLOVE_UINT_EQ(S_OK, frame->lpVtbl->CopyPixels(frame, NULL, sizeof(pixels), sizeof(pixels), (BYTE *)pixels));
+    NetpbmStatistics *statistics = malloc(sizeof(NetpbmStatistics));
+    CLOVE_UINT_EQ(S_OK, frameStatistics->lpVtbl->GetStatistics(frameStatistics, statistics));
+    CLOVE_UINT_EQ(1, statistics->minimum);
+    CLOVE_UINT_EQ(1000, statistics->maximum);
+    CLOVE_ULLONG_EQ(1, statistics->histogram[1000 * 4096 / 1001]);
+    CLOVE_UINT_EQ(65535, pixels[1]);
+
+    free(statistics);
+    frameStatistics->lpVtbl->Release(frameStatistics);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+    memoryStream->lpVtbl->Release(memoryStream);
+}
+
+CLOVE_TEST(FrameStatisticsExcludeChannelSelection)
+{
+    const BYTE samples[] = {1, 2, 3, 4};
+    IStream *stream = CreateStreamFromHeaderAndData("P5 2 2 255\n", samples, sizeof(samples));
+    IWICBitmapFrameDecode *frame = CreateFrame(stream);
+    INetpbmStatistics *frameStatistics;
+    frame->lpVtbl->QueryInterface(frame, &IID_INetpbmStatistics, (void **)&frameStatistics);
+    INetpbmChannelSelection *channelSelection;
+    frame->lpVtbl->QueryInterface(frame, &IID_INetpbmChannelSelection, (void **)&channelSelection);
+    const UINT channels[1] = {0};
+
+    // Selected channels are copied without accumulating the statistics, the two cannot be combined.
+    CLOVE_UINT_EQ(S_OK, frameStatistics->lpVtbl->EnableStatistics(frameStatistics, 256));
+    CLOVE_UINT_EQ(WINCODEC_ERR_UNSUPPORTEDOPERATION,
+                  channelSelection->lpVtbl->SelectChannels(channelSelection, 1, channels));
+
+    BYTE pixels[4];
+    CLOVE_UINT_EQ(S_OK, frame->lpVtbl->CopyPixels(frame, NULL, 2, sizeof(pixels), pixels));
+    NetpbmStatistics *statistics = malloc(sizeof(NetpbmStatistics));
+    CLOVE_UINT_EQ(S_OK, frameStatistics->lpVtbl->GetStatistics(frameStatistics, statistics));
+    CLOVE_UINT_EQ(4, statistics->maximum);
+    free(statistics);
+    channelSelection->lpVtbl->Release(channelSelection);
+    frameStatistics->lpVtbl->Release(frameStatistics);
+    frame->lpVtbl->Release(frame);
+
+    const LARGE_INTEGER start = {};
+    stream->lpVtbl->Seek(stream, start, STREAM_SEEK_SET, NULL);
+    frame = CreateFrame(stream);
+    frame->lpVtbl->QueryInterface(frame, &IID_INetpbmStatistics, (void **)&frameStatistics);
+    frame->lpVtbl->QueryInterface(frame, &IID_INetpbmChannelSelection, (void **)&channelSelection);
+    CLOVE_UINT_EQ(S_OK, channelSelection->lpVtbl->SelectChannels(channelSelection, 1, channels));
+    CLOVE_UINT_EQ(WINCODEC_ERR_UNSUPPORTEDOPERATION, frameStatistics->lpVtbl->EnableStatistics(frameStatistics, 256));
+
+    channelSelection->lpVtbl->Release(channelSelection);
+    frameStatistics->lpVtbl->Release(frameStatistics);
+    frame->lpVtbl->Release(frame);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(StatisticsBenchmark)
+{
+    enum { size = 2048 };
+    const size_t sampleSize = (size_t)size * size * 2;
+    BYTE *samples = malloc(sampleSize);
+    for (size_t i = 0; i < sampleSize; i += 2)
+    {
+        samples[i] = (BYTE)(i >> 4 & 0x0F);
+        samples[i + 1] = (BYTE)(i >> 1);
+    }
+
+    BYTE *pixels = malloc(sampleSize);
+    NetpbmStatistics *statistics = malloc(sizeof(NetpbmStatistics));
+    IStream *stream = CreateStreamFromHeaderAndData("P5 2048 2048 4095\n", samples, sampleSize);
+    const NetpbmDecodeRowsWithStatisticsPtr decodeRowsWithStatistics =
+        (NetpbmDecodeRowsWithStatisticsPtr)GetCodecFunction("NetpbmDecodeRowsWithStatistics");
+    const NetpbmDecodeRowsPtr decodeRows = (NetpbmDecodeRowsPtr)GetCodecFunction("NetpbmDecodeRows");
+    const LARGE_INTEGER start = {};
+
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER fusedBegin;
+    LARGE_INTEGER fusedEnd;
+    LARGE_INTEGER separateBegin;
+    LARGE_INTEGER separateEnd;
+    RowCollector collector = {.pixels = pixels};
+    HRESULT hr = decodeRows(stream, NULL, 0, CollectRows, &collector); // Warm up the buffers.
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    stream->lpVtbl->Seek(stream, start, STREAM_SEEK_SET, NULL);
+    collector.rowCount = 0;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&fusedBegin);
+    hr = decodeRowsWithStatistics(stream, 4096, NULL, 0, CollectRows, &collector, statistics);
+    QueryPerformanceCounter(&fusedEnd);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    // The same result with a second pass over the decoded pixels.
+    stream->lpVtbl->Seek(stream, start, STREAM_SEEK_SET, NULL);
+    collector.rowCount = 0;
+    QueryPerformanceCounter(&separateBegin);
+    hr = decodeRows(stream, NULL, 0, CollectRows, &collector);
+    ULONGLONG *histogram = calloc(4096, sizeof(ULONGLONG));
+    const USHORT *scaledPixels = (const USHORT *)pixels;
+    ULONGLONG sum = 0;
+    for (size_t i = 0; i < (size_t)size * size; ++i)
+    {
+        const UINT value = (scaledPixels[i] * 4095U + 32767) / 65535;
+        ++histogram[value];
+        sum += value;
+    }
+    QueryPerformanceCounter(&separateEnd);
+    CLOVE_UINT_EQ(S_OK, hr);
+    CLOVE_ULLONG_EQ(histogram[1234], statistics->histogram[1234]);
+    CLOVE_FLOAT_EQ((float)((double)sum / ((double)size * size)), (float)statistics->mean);
+
+    const double fusedMilliseconds =
+        (double)(fusedEnd.QuadPart - fusedBegin.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+    const double separateMilliseconds =
+        (double)(separateEnd.QuadPart - separateBegin.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+    printf("Statistics %ux%u 16-bit graymap: fused %.2f ms, decode and separate pass: %.2f ms\n", size, size,
+           fusedMilliseconds, separateMilliseconds);
+
+    free(histogram);
+    stream->lpVtbl->Release(stream);
+    free(statistics);
+    free(pixels);
+    free(samples);
+}
+
+CLOVE_TEST(DecodeRowsWithStatisticsRequiresStatistics)
+{
+    const BYTE samples[] = {1, 2};
+    const NetpbmDecodeRowsWithStatisticsPtr decodeRows =
+        (NetpbmDecodeRowsWithStatisticsPtr)GetCodecFunction("NetpbmDecodeRowsWithStatistics");
+    IStream *stream = CreateStreamFromHeaderAndData("P5 2 1 255\n", samples, sizeof(samples));
+
+    CLOVE_UINT_EQ(E_INVALIDARG, decodeRows(stream, 256, NULL, 0, IgnoreRows, NULL, NULL));
+    stream->lpVtbl->Release(stream);
+}
@@ -0,0 +1,220 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "test_stream.h"
+
+#include <Shlwapi.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct CountingStream
+{
+    IStream stream;
+    LONG refCount;
+    IStream *inner;
+    ULONGLONG bytesRead;
+    ULONG readCalls;
+    bool seekable;
+    const WCHAR *name; // Returned by Stat when not NULL, with lastWriteTime.
+    FILETIME lastWriteTime;
+} CountingStream;
+
+
+static HRESULT STDMETHODCALLTYPE QueryInterface(IStream *this, REFIID riid, void **ppv)
+{
+    if (!IsEqualIID(riid, &IID_IUnknown) && !IsEqualIID(riid, &IID_IStream) &&
+        !IsEqualIID(riid, &IID_ISequentialStream))
+    {
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+
+    *ppv = this;
+    this->lpVtbl->AddRef(this);
+    return S_OK;
+}
+
+static ULONG STDMETHODCALLTYPE AddRef(IStream *this)
+{
+    return InterlockedIncrement(&((CountingStream *)this)->refCount);
+}
+
+static ULONG STDMETHODCALLTYPE Release(IStream *this)
+{
+    CountingStream *countingStream = (CountingStream *)this;
+    const ULONG refCount = InterlockedDecrement(&countingStream->refCount);
+    if (refCount == 0)
+    {
+        countingStream->inner->lpVtbl->Release(countingStream->inner);
+        free(countingStream);
+    }
+
+    return refCount;
+}
+
+static HRESULT STDMETHODCALLTYPE Read(IStream *this, void *pv, ULONG cb, ULONG *pcbRead)
+{
+    CountingStream *countingStream = (CountingStream *)this;
+    ULONG bytesRead = 0;
+    const HRESULT hr = countingStream->inner->lpVtbl->Read(countingStream->inner, pv, cb, &bytesRead);
+    countingStream->bytesRead += bytesRead;
+    ++countingStream->readCalls;
+    if (pcbRead)
+    {
+        *pcbRead = bytesRead;
+    }
+
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE Write(IStream *this, const void *pv, ULONG cb, ULONG *pcbWritten)
+{
+    const CountingStream *countingStream = (CountingStream *)this;
+    return countingStream->inner->lpVtbl->Write(countingStream->inner, pv, cb, pcbWritten);
+}
+
+static HRESULT STDMETHODCALLTYPE Seek(IStream *this, LARGE_INTEGER dlibMove, DWORD dwOrigin,
+                                      ULARGE_INTEGER *plibNewPosition)
+{
+    const CountingStream *countingStream = (CountingStream *)this;
+    if (!countingStream->seekable)
+        return STG_E_INVALIDFUNCTION; // Same result as a stream on a pipe.
+
+    return countingStream->inner->lpVtbl->Seek(countingStream->inner, dlibMove, dwOrigin, plibNewPosition);
+}
+
+static HRESULT STDMETHODCALLTYPE SetSize(IStream *this, ULARGE_INTEGER libNewSize)
+{
+    const CountingStream *countingStream = (CountingStream *)this;
+    return countingStream->inner->lpVtbl->SetSize(countingStream->inner, libNewSize);
+}
+
+static HRESULT STDMETHODCALLTYPE CopyTo([[maybe_unused]] IStream *this, [[maybe_unused]] IStream *pstm,
+                                        [[maybe_unused]] ULARGE_INTEGER cb, [[maybe_unused]] ULARGE_INTEGER *pcbRead,
+                                        [[maybe_unused]] ULARGE_INTEGER *pcbWritten)
+{
+    return E_NOTIMPL;
+}
+
+static HRESULT STDMETHODCALLTYPE Commit(IStream *this, DWORD grfCommitFlags)
+{
+    const CountingStream *countingStream = (CountingStream *)this;
+    return countingStream->inner->lpVtbl->Commit(countingStream->inner, grfCommitFlags);
+}
+
+static HRESULT STDMETHODCALLTYPE Revert(IStream *this)
+{
+    const CountingStream *countingStream = (CountingStream *)this;
+    return countingStream->inner->lpVtbl->Revert(countingStream->inner);
+}
+
+static HRESULT STDMETHODCALLTYPE LockRegion([[maybe_unused]] IStream *this, [[maybe_unused]] ULARGE_INTEGER libOffset,
+                                            [[maybe_unused]] ULARGE_INTEGER cb, [[maybe_unused]] DWORD dwLockType)
+{
+    return STG_E_INVALIDFUNCTION;
+}
+
+static HRESULT STDMETHODCALLTYPE UnlockRegion([[maybe_unused]] IStream *this, [[maybe_unused]] ULARGE_INTEGER libOffset,
+                                              [[maybe_unused]] ULARGE_INTEGER cb, [[maybe_unused]] DWORD dwLockType)
+{
+    return STG_E_INVALIDFUNCTION;
+}
+
+static HRESULT STDMETHODCALLTYPE Stat(IStream *this, STATSTG *pstatstg, DWORD grfStatFlag)
+{
+    const CountingStream *countingStream = (CountingStream *)this;
+    const HRESULT hr = countingStream->inner->lpVtbl->Stat(countingStream->inner, pstatstg, grfStatFlag);
+    if (FAILED(hr) || !countingStream->name)
+        return hr;
+
+    pstatstg->mtime = countingStream->lastWriteTime;
+    if (grfStatFlag & STATFLAG_NONAME)
+        return hr;
+
+    const size_t size = (wcslen(countingStream->name) + 1) * sizeof(WCHAR);
+    pstatstg->pwcsName = CoTaskMemAlloc(size);
+    if (!pstatstg->pwcsName)
+        return E_OUTOFMEMORY;
+
+    memcpy(pstatstg->pwcsName, countingStream->name, size);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE Clone([[maybe_unused]] IStream *this, IStream **ppstm)
+{
+    *ppstm = NULL;
+    return E_NOTIMPL;
+}
+
+static IStream *CreateWrappingStream(IStream *stream, const bool seekable)
+{
+    static const IStreamVtbl streamVtbl = {QueryInterface, AddRef, Release, Read,         Write, Seek,  SetSize,
+                                           CopyTo,         Commit, Revert,  LockRegion, UnlockRegion, Stat, Clone};
+
+    CountingStream *countingStream = malloc(sizeof(CountingStream));
+    if (!countingStream)
+        return NULL;
+
+    countingStream->stream.lpVtbl = &streamVtbl;
+    countingStream->refCount = 1;
+    countingStream->inner = stream;
+    countingStream->bytesRead = 0;
+    countingStream->readCalls = 0;
+    countingStream->seekable = seekable;
+    countingStream->name = NULL;
+    stream->lpVtbl->AddRef(stream);
+
+    return &countingStream->stream;
+}
+
+IStream *CreateCountingStream(IStream *stream)
+{
+    return CreateWrappingStream(stream, true);
+}
+
+IStream *CreateNonSeekableStream(IStream *stream)
+{
+    return CreateWrappingStream(stream, false);
+}
+
+IStream *CreateNamedStream(IStream *stream, const WCHAR *name, const ULONGLONG lastWriteTime)
+{
+    IStream *namedStream = CreateWrappingStream(stream, true);
+    if (namedStream)
+    {
+        CountingStream *countingStream = (CountingStream *)namedStream;
+        countingStream->name = name;
+        countingStream->lastWriteTime.dwLowDateTime = (DWORD)lastWriteTime;
+        countingStream->lastWriteTime.dwHighDateTime = (DWORD)(lastWriteTime >> 32);
+    }
+
+    return namedStream;
+}
+
+ULONGLONG GetCountingStreamBytesRead(IStream *countingStream)
+{
+    return ((CountingStream *)countingStream)->bytesRead;
+}
+
+ULONG GetCountingStreamReadCalls(IStream *countingStream)
+{
+    return ((CountingStream *)countingStream)->readCalls;
+}
+
+IStream *CreateStreamFromHeaderAndData(const char *header, const void *data, const size_t size)
+{
+    const size_t headerSize = strlen(header);
+    BYTE *buffer = malloc(headerSize + size);
+    if (!buffer)
+        return NULL;
+
+    memcpy(buffer, header, headerSize);
+    if (size != 0)
+    {
+        memcpy(buffer + headerSize, data, size);
+    }
+
+    IStream *stream = SHCreateMemStream(buffer, (UINT)(headerSize + size));
+    free(buffer);
+    return stream;
+}
@@ -0,0 +1,22 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Windows.h>
+#include <objidl.h>
+
+// Wraps a stream and counts the bytes that are read from it (used to measure I/O of the decoder).
+IStream *CreateCountingStream(IStream *stream);
+ULONGLONG GetCountingStreamBytesRead(IStream *countingStream);
+ULONG GetCountingStreamReadCalls(IStream *countingStream);
+
+// Wraps a stream like a file: Stat returns the name (which must stay valid) and the last write time, the bytes that are
+// read are counted.
+IStream *CreateNamedStream(IStream *stream, const WCHAR *name, ULONGLONG lastWriteTime);
+
+// Wraps a stream like a pipe: Seek always fails, the bytes that are read are counted.
+IStream *CreateNonSeekableStream(IStream *stream);
+
+// Creates a memory stream with the header text followed by size bytes of sample data.
+IStream *CreateStreamFromHeaderAndData(const char *header, const void *data, size_t size);
@@ -0,0 +1,213 @@
+// Copyright (c) Victor Derks.
+// SPDX-License-Identifier: MIT
+
+#include "com_factory.h"
+#include "row_collector.h"
+#include "test_stream.h"
+#include <unknwn.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/guids.h"
+#include "../src/netpbm_row_decoder.h"
+#include "../src/netpbm_validation.h"
+
+#define CLOVE_SUITE_NAME validator_test_suite
+#include <wincodec.h>
+#include <clove-unit/clove-unit.h>
+
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmValidatePtr)(IStream *stream, ULONGLONG *badOffset);
+typedef HRESULT(STDMETHODCALLTYPE *NetpbmDecodeRowsPtr)(IStream *stream, const WICPixelFormatGUID *pixelFormat,
+                                                        UINT bandHeight, NetpbmRowSink sink, void *context);
+
+static HRESULT Validate(const char *header, const void *samples, const size_t size, ULONGLONG *badOffset)
+{
+    const NetpbmValidatePtr validate = (NetpbmValidatePtr)GetCodecFunction("NetpbmValidate");
+    if (!validate)
+        return E_FAIL;
+
+    IStream *stream = CreateStreamFromHeaderAndData(header, samples, size);
+    const HRESULT hr = validate(stream, badOffset);
+    stream->lpVtbl->Release(stream);
+    return hr;
+}
+
+CLOVE_SUITE_SETUP_ONCE()
+{
+    ConstructComFactory();
+}
+
+CLOVE_SUITE_TEARDOWN_ONCE()
+{
+    DestructComFactory();
+}
+
+CLOVE_TEST(ValidateValidFiles)
+{
+    // The pixmap is larger than a chunk of the validator.
+    enum { width = 200, height = 150, size = width * height * 3 };
+    BYTE *samples = malloc(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        samples[i] = (BYTE)(i % 201);
+    }
+
+    ULONGLONG badOffset;
+    CLOVE_UINT_EQ(S_OK, Validate("P6 200 150 200\n", samples, size, &badOffset));
+    CLOVE_ULLONG_EQ(15 + size, badOffset);
+
+    const BYTE samples16[] = {0x03, 0xE8, 0x00, 0x00, 0x01, 0x02, 0x03, 0xE7};
+    CLOVE_UINT_EQ(S_OK, Validate("P5 2 2 1000\n", samples16, sizeof(samples16), &badOffset));
+    CLOVE_UINT_EQ(S_OK, Validate("P4 9 2\n", samples16, 4, &badOffset));
+    CLOVE_UINT_EQ(S_OK, Validate("Pf 2 1 -1.0\n", samples16, sizeof(samples16), &badOffset));
+
+    const char plain[] = "1 2 3\n# comment 999\n4 5 6\n";
+    CLOVE_UINT_EQ(S_OK, Validate("P2 3 2 6\n", plain, sizeof(plain) - 1, &badOffset));
+    CLOVE_ULLONG_EQ(9 + sizeof(plain) - 2, badOffset);
+
+    // Non-seekable streams are validated without seeking.
+    IStream *memoryStream = CreateStreamFromHeaderAndData("P6 200 150 200\n", samples, size);
+    IStream *stream = CreateNonSeekableStream(memoryStream);
+    const NetpbmValidatePtr validate = (NetpbmValidatePtr)GetCodecFunction("NetpbmValidate");
+    CLOVE_UINT_EQ(S_OK, validate(stream, &badOffset));
+    CLOVE_ULLONG_EQ(15 + size, GetCountingStreamBytesRead(stream));
+    stream->lpVtbl->Release(stream);
+    memoryStream->lpVtbl->Release(memoryStream);
+    free(samples);
+}
+
+CLOVE_TEST(ValidateReportsFirstSampleAboveMaxValue)
+{
+    // The invalid samples are located in a second chunk and in the tail that is checked without SIMD.
+    enum { size = 100000 };
+    BYTE *samples = calloc(size, 1);
+    samples[70001] = 101;
+    samples[99999] = 255;
+
+    ULONGLONG badOffset;
+    HRESULT hr = Validate("P5 1000 100 100\n", samples, size, &badOffset);
+
+    CLOVE_UINT_EQ(WINCODEC_ERR_BADIMAGE, hr);
+    CLOVE_ULLONG_EQ(16 + 70001, badOffset);
+
+    samples[70001] = 100;
+    hr = Validate("P5 1000 100 100\n", samples, size, &badOffset);
+
+    CLOVE_UINT_EQ(WINCODEC_ERR_BADIMAGE, hr);
+    CLOVE_ULLONG_EQ(16 + 99999, badOffset);
+
+    // 16-bit samples are compared as big endian values.
+    memset(samples, 0, size);
+    samples[2 * 45] = 0x04;
+    samples[2 * 45 + 1] = 0x00;
+    samples[2 * 37 + 1] = 0xFF;
+    hr = Validate("P5 10 10 1023\n", samples, 2 * 100, &badOffset);
+
+    CLOVE_UINT_EQ(WINCODEC_ERR_BADIMAGE, hr);
+    CLOVE_ULLONG_EQ(14 + 2 * 45, badOffset);
+    free(samples);
+}
+
+CLOVE_TEST(ValidateTruncatedFile)
+{
+    const BYTE samples[10] = {};
+    ULONGLONG badOffset;
+
+    const HRESULT hr = Validate("P5 4 4 255\n", samples, sizeof(samples), &badOffset);
+
+    CLOVE_UINT_EQ(WINCODEC_ERR_BADIMAGE, hr);
+    CLOVE_ULLONG_EQ(11 + sizeof(samples), badOffset);
+}
+
+CLOVE_TEST(ValidatePlainSampleAboveMaxValue)
+{
+    const char samples[] = "1 2\n#c\n 70 4";
+    ULONGLONG badOffset;
+
+    HRESULT hr = Validate("P2 2 2 69\n", samples, sizeof(samples) - 1, &badOffset);
+
+    CLOVE_UINT_EQ(WINCODEC_ERR_BADIMAGE, hr);
+    CLOVE_ULLONG_EQ(10 + 8, badOffset);
+
+    hr = Validate("P2 2 3 70\n", samples, sizeof(samples) - 1, &badOffset);
+
+    CLOVE_UINT_EQ(WINCODEC_ERR_BADIMAGE, hr);
+    CLOVE_ULLONG_EQ(10 + sizeof(samples) - 1, badOffset);
+}
+
+CLOVE_TEST(ValidateBadHeader)
+{
+    ULONGLONG badOffset;
+
+    CLOVE_UINT_EQ(WINCODEC_ERR_BADHEADER, Validate("P5 4 0 255\n", NULL, 0, &badOffset));
+    CLOVE_UINT_EQ(WINCODEC_ERR_UNKNOWNIMAGEFORMAT, Validate("BM 4 4 255\n", NULL, 0, &badOffset));
+}
+
+CLOVE_TEST(ValidateThroughDecoderInterface)
+{
+    IClassFactory *classFactory = GetClassObject(&CLSID_WICBitmapDecoder, &IID_IClassFactory);
+    INetpbmValidation *validation;
+    HRESULT hr = classFactory->lpVtbl->CreateInstance(classFactory, NULL, &IID_INetpbmValidation, (void **)&validation);
+    classFactory->lpVtbl->Release(classFactory);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    const BYTE samples[] = {1, 2, 3, 4, 5, 6};
+    IStream *stream = CreateStreamFromHeaderAndData("P6 1 2 5\n", samples, sizeof(samples));
+    ULONGLONG badOffset;
+    hr = validation->lpVtbl->Validate(validation, stream, &badOffset);
+
+    CLOVE_UINT_EQ(WINCODEC_ERR_BADIMAGE, hr);
+    CLOVE_ULLONG_EQ(9 + 5, badOffset);
+
+    IWICBitmapDecoder *wicBitmapDecoder;
+    hr = validation->lpVtbl->QueryInterface(validation, &IID_IWICBitmapDecoder, (void **)&wicBitmapDecoder);
+    CLOVE_UINT_EQ(S_OK, hr);
+    wicBitmapDecoder->lpVtbl->Release(wicBitmapDecoder);
+    validation->lpVtbl->Release(validation);
+    stream->lpVtbl->Release(stream);
+}
+
+CLOVE_TEST(ValidateBenchmark)
+{
+    enum { size = 2048 };
+    const size_t sampleSize = (size_t)size * size * 2;
+    BYTE *samples = malloc(sampleSize);
+    for (size_t i = 0; i < sampleSize; i += 2)
+    {
+        samples[i] = (BYTE)(i >> 4 & 0x0F);
+        samples[i + 1] = (BYTE)(i >> 1);
+    }
+
+    IStream *stream = CreateStreamFromHeaderAndData("P5 2048 2048 4095\n", samples, sampleSize);
+    const NetpbmValidatePtr validate = (NetpbmValidatePtr)GetCodecFunction("NetpbmValidate");
+    const NetpbmDecodeRowsPtr decodeRows = (NetpbmDecodeRowsPtr)GetCodecFunction("NetpbmDecodeRows");
+    const LARGE_INTEGER start = {};
+
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER begin;
+    LARGE_INTEGER validateEnd;
+    LARGE_INTEGER decodeBegin;
+    LARGE_INTEGER decodeEnd;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+    ULONGLONG badOffset;
+    HRESULT hr = validate(stream, &badOffset);
+    QueryPerformanceCounter(&validateEnd);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    stream->lpVtbl->Seek(stream, start, STREAM_SEEK_SET, NULL);
+    QueryPerformanceCounter(&decodeBegin);
+    hr = decodeRows(stream, NULL, 0, IgnoreRows, NULL);
+    QueryPerformanceCounter(&decodeEnd);
+    CLOVE_UINT_EQ(S_OK, hr);
+
+    const double validateMilliseconds =
+        (double)(validateEnd.QuadPart - begin.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+    const double decodeMilliseconds =
+        (double)(decodeEnd.QuadPart - decodeBegin.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+    printf("Validate %ux%u 16-bit graymap: %.2f ms, NetpbmDecodeRows: %.2f ms\n", size, size, validateMilliseconds,
+           decodeMilliseconds);
+
+    stream->lpVtbl->Release(stream);
+    free(samples);
+}